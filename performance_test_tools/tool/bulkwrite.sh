@@ -0,0 +1,19 @@
+source ./conf.sh
+
+# SADD/ZADD of 1k members into random keys, for the bulk write paths
+clientnum=50
+reqnum=100000
+members=1000
+
+saddargs=""
+zaddargs=""
+for((i=0;i<$members;i++))
+do
+    saddargs="$saddargs m$i"
+    zaddargs="$zaddargs $i m$i"
+done
+
+./redis-benchmark -h $benchip -p $benchport -c $clientnum -n $reqnum -r 1000000 -q $bench_pw \
+    sadd bulkset:__rand_int__ $saddargs
+./redis-benchmark -h $benchip -p $benchport -c $clientnum -n $reqnum -r 1000000 -q $bench_pw \
+    zadd bulkzset:__rand_int__ $zaddargs
@@ -0,0 +1,32 @@
+source ./conf.sh
+
+# binlogs/s applied by the slave $ip:$port with repl-apply-batch of 1 and
+# 64, while redis-benchmark writes to its master $benchip:$benchport.
+# The rates compare only while the slave lags behind the master.
+clientnum=50
+reqnum=2000000
+apply_sec=30
+
+applied() {
+    ${bin_dir}/redis-cli -h $ip -p $port $cli_pw info replication |grep slave_apply_$1 |awk -F ":" '{print $2}' |tr -d '\r'
+}
+
+for batch in 1 64
+do
+    ${bin_dir}/redis-cli -h $ip -p $port $cli_pw config set repl-apply-batch $batch
+    nohup ./redis-benchmark -h $benchip -p $benchport -c $clientnum -n $reqnum -r 1000000 -d 128 -t set $bench_pw > /dev/null &
+    pid=$!
+    sleep 5
+
+    start=`applied binlogs`
+    starttxns=`applied txns`
+    sleep $apply_sec
+    end=`applied binlogs`
+    endtxns=`applied txns`
+    let rate=($end-$start)/$apply_sec
+    let txns=($endtxns-$starttxns)/$apply_sec
+    echo "repl-apply-batch:$batch binlogs/s:$rate txns/s:$txns"
+
+    kill -9 $pid
+    sleep 10
+done
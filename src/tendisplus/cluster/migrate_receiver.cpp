@@ -145,10 +145,11 @@ Status ChunkMigrateReceiver::supplySetKV(const string& key,
   // NOTE(takenliu) TTLIndex's chunkid is different from key's chunkid,
   // so need to recover TTLIndex.
   // only RT_*_META need recover, it's saved as RT_DATA_META in RecordKey
-  // if RecordValue's type is RT_KV need ignore recovering.
+  // if RecordValue's type is RT_KV need ignore recovering, except the
+  // big RT_KV stored in pieces.
   if (expRk.value().getRecordType() == RecordType::RT_DATA_META) {
     if (!Command::noExpire() && expRv.value().getTtl() > 0 &&
-        expRv.value().getRecordType() != RecordType::RT_KV) {
+        rcd_util::needTTLIndex(expRv.value())) {
       // add new index entry
       TTLIndex n_ictx(expRk.value().getPrimaryKey(),
                       expRv.value().getRecordType(),
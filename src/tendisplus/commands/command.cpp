@@ -17,12 +17,15 @@
 #include "tendisplus/utils/scopeguard.h"
 #include "tendisplus/lock/lock.h"
 #include "tendisplus/storage/record.h"
+#include "tendisplus/storage/pieced_kv.h"
+#include "tendisplus/server/lazyfree_manager.h"
 #include "tendisplus/utils/sync_point.h"
 
 namespace tendisplus {
 
 std::mutex Command::_mutex;
 bool Command::_noexpire = false;
+bool Command::_mergeWrite = false;
 mgl::LockMode Command::_expRdLk = mgl::LockMode::LOCK_X;
 
 std::map<std::string, uint64_t> Command::_unSeenCmds = {};
@@ -89,6 +92,14 @@ void Command::setNoExpire(bool cfg) {
   }
 }
 
+bool Command::mergeWrite() {
+  return _mergeWrite;
+}
+
+void Command::setMergeWrite(bool cfg) {
+  _mergeWrite = cfg;
+}
+
 void Command::changeCommand(const string& changeCmdList, string mode) {
   LOG(INFO) << "changeCommand begin,mode:" << mode << " list:" << changeCmdList;
   std::stringstream ssAll(changeCmdList);
@@ -277,6 +288,23 @@ Expected<std::string> Command::runSessionCmd(Session* sess) {
     sess->getServerEntry()->slowlogPushEntryIfNeeded(
       now / 1000, duration / 1000, sess);
   });
+
+  auto pCtx = sess->getCtx();
+  if (pCtx->isInMulti() && commandName != "exec" &&
+      commandName != "discard" && commandName != "multi") {
+    // NOTE(tendis): EXEC locks the keys of the commands queued, so the
+    // commands write without keys, or run in background, can't be queued.
+    if (it->second->isBgCmd() ||
+        (it->second->isWriteable() &&
+         it->second->getKeysFromCommand(args).empty())) {
+      pCtx->setMultiDirty();
+      return {ErrorCodes::ERR_PARSEPKT,
+              "Command not allowed inside a transaction"};
+    }
+    pCtx->queueMultiCmd(args);
+    return Command::fmtStatus("QUEUED");
+  }
+
   auto v = it->second->run(sess);
   if (v.ok()) {
     if (sess->getCtx()->isEp()) {
@@ -318,7 +346,8 @@ Status Command::delKeyPessimisticInLock(Session* sess,
                                         uint32_t storeId,
                                         const RecordKey& mk,
                                         RecordType valueType,
-                                        const TTLIndex* ictx) {
+                                        const TTLIndex* ictx,
+                                        bool pieced) {
   std::string keyEnc = mk.encode();
   auto server = sess->getServerEntry();
 
@@ -339,8 +368,15 @@ Status Command::delKeyPessimisticInLock(Session* sess,
       return ptxn.status();
     }
     std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-    Expected<uint32_t> deleteCount = partialDelSubKeys(
-      sess, storeId, batchSize, mk, valueType, false, txn.get());
+    Expected<uint32_t> deleteCount = partialDelSubKeys(sess,
+                                                       storeId,
+                                                       batchSize,
+                                                       mk,
+                                                       valueType,
+                                                       false,
+                                                       txn.get(),
+                                                       nullptr,
+                                                       pieced);
     if (!deleteCount.ok()) {
       return deleteCount.status();
     }
@@ -359,7 +395,7 @@ Status Command::delKeyPessimisticInLock(Session* sess,
       return s;
     }
 
-    if (ictx && ictx->getType() != RecordType::RT_KV) {
+    if (ictx && (ictx->getType() != RecordType::RT_KV || pieced)) {
       Status s = txn->delKV(ictx->encode());
       if (!s.ok()) {
         return s;
@@ -422,7 +458,8 @@ Status Command::delKeyOptimismInLock(Session* sess,
                                      const RecordKey& rk,
                                      RecordType valueType,
                                      Transaction* txn,
-                                     const TTLIndex* ictx) {
+                                     const TTLIndex* ictx,
+                                     bool pieced) {
   auto s = Command::partialDelSubKeys(sess,
                                       storeId,
                                       std::numeric_limits<uint32_t>::max(),
@@ -430,47 +467,23 @@ Status Command::delKeyOptimismInLock(Session* sess,
                                       valueType,
                                       true,
                                       txn,
-                                      ictx);
+                                      ictx,
+                                      pieced);
   return s.status();
 }
 
-Expected<uint32_t> Command::partialDelSubKeys(Session* sess,
-                                              uint32_t storeId,
-                                              uint32_t subCount,
-                                              const RecordKey& mk,
-                                              RecordType valueType,
-                                              bool deleteMeta,
-                                              Transaction* txn,
-                                              const TTLIndex* ictx) {
-  Status s(ErrorCodes::ERR_OK, "");
-  auto guard = MakeGuard([&s] {
-    if (!s.ok()) {
-      INVARIANT_D(0);
-    }
-  });
-  if (deleteMeta && subCount != std::numeric_limits<uint32_t>::max()) {
-    s = Status{ErrorCodes::ERR_PARSEOPT, "delmeta with limited subcount"};
-    return s;
-  }
-  auto server = sess->getServerEntry();
-  INVARIANT(server != nullptr);
-  auto expdb =
-    server->getSegmentMgr()->getDb(nullptr, storeId, mgl::LockMode::LOCK_NONE);
-  RET_IF_ERR_EXPECTED(expdb);
-
-  PStore kvstore = expdb.value().store;
-  INVARIANT_D(mk.getRecordType() == RecordType::RT_DATA_META);
-  if (valueType == RecordType::RT_KV) {
-    s = kvstore->delKV(mk, txn);
-    RET_IF_ERR(s);
-
-    auto commitStatus = txn->commit();
-    RET_IF_ERR_EXPECTED(commitStatus);
-
-    return 1;
-  }
+// the prefixes of the subkeys of mk, mk is a RT_DATA_META key
+static std::vector<std::string> subKeyPrefixes(const RecordKey& mk,
+                                               RecordType valueType) {
   std::vector<std::string> prefixes;
-  if (valueType == RecordType::RT_HASH_META) {
+  if (valueType == RecordType::RT_KV) {
+    RecordKey fakeEle(mk.getChunkId(),
+                      mk.getDbId(),
+                      RecordType::RT_KV_PIECE,
+                      mk.getPrimaryKey(),
+                      "");
+    prefixes.push_back(fakeEle.prefixPk());
+  } else if (valueType == RecordType::RT_HASH_META) {
     RecordKey fakeEle(mk.getChunkId(),
                       mk.getDbId(),
                       RecordType::RT_HASH_ELE,
@@ -507,6 +520,46 @@ Expected<uint32_t> Command::partialDelSubKeys(Session* sess,
   } else {
     INVARIANT_D(0);
   }
+  return prefixes;
+}
+
+Expected<uint32_t> Command::partialDelSubKeys(Session* sess,
+                                              uint32_t storeId,
+                                              uint32_t subCount,
+                                              const RecordKey& mk,
+                                              RecordType valueType,
+                                              bool deleteMeta,
+                                              Transaction* txn,
+                                              const TTLIndex* ictx,
+                                              bool pieced) {
+  Status s(ErrorCodes::ERR_OK, "");
+  auto guard = MakeGuard([&s] {
+    if (!s.ok()) {
+      INVARIANT_D(0);
+    }
+  });
+  if (deleteMeta && subCount != std::numeric_limits<uint32_t>::max()) {
+    s = Status{ErrorCodes::ERR_PARSEOPT, "delmeta with limited subcount"};
+    return s;
+  }
+  auto server = sess->getServerEntry();
+  INVARIANT(server != nullptr);
+  auto expdb =
+    server->getSegmentMgr()->getDb(nullptr, storeId, mgl::LockMode::LOCK_NONE);
+  RET_IF_ERR_EXPECTED(expdb);
+
+  PStore kvstore = expdb.value().store;
+  INVARIANT_D(mk.getRecordType() == RecordType::RT_DATA_META);
+  if (valueType == RecordType::RT_KV && !pieced) {
+    s = kvstore->delKV(mk, txn);
+    RET_IF_ERR(s);
+
+    auto commitStatus = txn->commit();
+    RET_IF_ERR_EXPECTED(commitStatus);
+
+    return 1;
+  }
+  std::vector<std::string> prefixes = subKeyPrefixes(mk, valueType);
 
   std::list<RecordKey> pendingDelete;
   for (const auto& prefix : prefixes) {
@@ -540,7 +593,7 @@ Expected<uint32_t> Command::partialDelSubKeys(Session* sess,
     RET_IF_ERR(s);
   }
 
-  if (ictx && ictx->getType() != RecordType::RT_KV) {
+  if (ictx && (ictx->getType() != RecordType::RT_KV || pieced)) {
     s = txn->delKV(ictx->encode());
     RET_IF_ERR(s);
   }
@@ -553,7 +606,8 @@ Expected<uint32_t> Command::partialDelSubKeys(Session* sess,
 
 Expected<bool> Command::delKeyChkExpire(Session* sess,
                                         const std::string& key,
-                                        RecordType tp) {
+                                        RecordType tp,
+                                        uint64_t lazyMinSubKeys) {
   Expected<RecordValue> rv = Command::expireKeyIfNeeded(sess, key, tp);
   if (rv.status().code() == ErrorCodes::ERR_EXPIRED) {
     return false;
@@ -564,7 +618,7 @@ Expected<bool> Command::delKeyChkExpire(Session* sess,
   }
 
   // key exists and not expired, now we delete it
-  Status s = Command::delKey(sess, key, tp);
+  Status s = Command::delKey(sess, key, tp, lazyMinSubKeys);
   if (s.code() == ErrorCodes::ERR_NOTFOUND) {
     return false;
   }
@@ -585,7 +639,7 @@ Status Command::delKeyAndTTL(Session* sess,
     return s;
   }
 
-  if (val.getTtl() > 0 && val.getRecordType() != RecordType::RT_KV) {
+  if (val.getTtl() > 0 && rcd_util::needTTLIndex(val)) {
     TTLIndex ictx(mk.getPrimaryKey(),
                   val.getRecordType(),
                   sess->getCtx()->getDbId(),
@@ -598,7 +652,40 @@ Status Command::delKeyAndTTL(Session* sess,
   return s;
 }
 
-Status Command::delKey(Session* sess, const std::string& key, RecordType tp) {
+// the key is expired at once by LAZYFREE_TTL, to be freed by the
+// LazyFreeManager. It is queued by the caller after the txn is
+// committed, so that a txn retried doesn't queue it twice.
+static Status lazyFreeKey(PStore kvstore,
+                          const RecordKey& mk,
+                          const RecordValue& val,
+                          Transaction* txn) {
+  Status s;
+  if (val.getTtl() > 0) {
+    TTLIndex o_ictx(
+      mk.getPrimaryKey(), val.getRecordType(), mk.getDbId(), val.getTtl());
+    s = txn->delKV(o_ictx.encode());
+    RET_IF_ERR(s);
+  }
+  // NOTE(tendis): with a ttl index, the key is deleted by the
+  // IndexManager if the task of the manager is lost
+  TTLIndex n_ictx(mk.getPrimaryKey(),
+                  val.getRecordType(),
+                  mk.getDbId(),
+                  LazyFreeManager::LAZYFREE_TTL);
+  s = txn->setKV(n_ictx.encode(),
+                 RecordValue(RecordType::RT_TTL_INDEX).encode());
+  RET_IF_ERR(s);
+  RecordValue rv = val;
+  rv.setTtl(LazyFreeManager::LAZYFREE_TTL);
+  s = kvstore->setKV(mk, rv, txn);
+  RET_IF_ERR(s);
+  return txn->commit().status();
+}
+
+Status Command::delKey(Session* sess,
+                       const std::string& key,
+                       RecordType tp,
+                       uint64_t lazyMinSubKeys) {
   auto server = sess->getServerEntry();
   INVARIANT(server != nullptr);
   SessionCtx* pCtx = sess->getCtx();
@@ -630,6 +717,27 @@ Status Command::delKey(Session* sess, const std::string& key, RecordType tp) {
       return cnt.status();
     }
 
+    bool pieced = rcd_util::isPiecedKV(eValue.value());
+    auto lazyMgr = server->getLazyFreeMgr();
+    if (lazyMinSubKeys > 0 && cnt.value() >= lazyMinSubKeys && !_noexpire &&
+        rcd_util::needTTLIndex(eValue.value()) && lazyMgr) {
+      Status s = lazyFreeKey(kvstore, mk, eValue.value(), txn.get());
+      if (s.code() == ErrorCodes::ERR_COMMIT_RETRY && i != RETRY_CNT - 1) {
+        continue;
+      }
+      if (!s.ok() || lazyMgr->enqueue(storeId, pCtx->getDbId(), key)) {
+        return s;
+      }
+      // the queue is full, free it here. The key is still locked.
+      txn.reset();
+      TTLIndex lazyIctx(key,
+                        valueType,
+                        pCtx->getDbId(),
+                        LazyFreeManager::LAZYFREE_TTL);
+      return Command::delKeyPessimisticInLock(
+        sess, storeId, mk, valueType, &lazyIctx, pieced);
+    }
+
     TTLIndex ictx(
       key, valueType, sess->getCtx()->getDbId(), eValue.value().getTtl());
     if (cnt.value() >= 2048 ||
@@ -638,8 +746,13 @@ Status Command::delKey(Session* sess, const std::string& key, RecordType tp) {
                 << ",rcdType:" << rt2Char(valueType) << ",size:" << cnt.value();
       // reset txn, it is no longer used
       txn.reset();
-      return Command::delKeyPessimisticInLock(
-        sess, storeId, mk, valueType, ictx.getTTL() > 0 ? &ictx : nullptr);
+      return Command::delKeyPessimisticInLock(sess,
+                                              storeId,
+                                              mk,
+                                              valueType,
+                                              ictx.getTTL() > 0 ? &ictx
+                                                                : nullptr,
+                                              pieced);
     } else {
       Status s =
         Command::delKeyOptimismInLock(sess,
@@ -647,7 +760,8 @@ Status Command::delKey(Session* sess, const std::string& key, RecordType tp) {
                                       mk,
                                       valueType,
                                       txn.get(),
-                                      ictx.getTTL() > 0 ? &ictx : nullptr);
+                                      ictx.getTTL() > 0 ? &ictx : nullptr,
+                                      pieced);
       if (s.code() == ErrorCodes::ERR_COMMIT_RETRY && i != RETRY_CNT - 1) {
         continue;
       }
@@ -662,7 +776,8 @@ Status Command::delKey(Session* sess, const std::string& key, RecordType tp) {
 Expected<RecordValue> Command::expireKeyIfNeeded(Session* sess,
                                                  const std::string& key,
                                                  RecordType tp,
-                                                 bool hasVersion) {
+                                                 bool hasVersion,
+                                                 bool loadPieces) {
   auto server = sess->getServerEntry();
   INVARIANT(server != nullptr);
   auto expdb = server->getSegmentMgr()->getDbWithKeyLock(sess, key, RdLock());
@@ -700,6 +815,13 @@ Expected<RecordValue> Command::expireKeyIfNeeded(Session* sess,
         }
       }
       ++sess->getServerEntry()->getServerStat().keyspaceHits;
+      if (loadPieces && tp == RecordType::RT_KV &&
+          rcd_util::isPiecedKV(eValue.value())) {
+        auto s = PiecedKV::load(kvstore, mk, &eValue.value(), txn.get());
+        if (!s.ok()) {
+          return s;
+        }
+      }
       return eValue.value();
     } else if (txn->isReplOnly()) {
       // NOTE(vinchen): if replOnly, it can't delete record, but return
@@ -711,14 +833,41 @@ Expected<RecordValue> Command::expireKeyIfNeeded(Session* sess,
       return cnt.status();
     }
 
+    bool pieced = rcd_util::isPiecedKV(eValue.value());
     TTLIndex ictx(key, valueType, sess->getCtx()->getDbId(), targetTtl);
+    auto lazyMgr = server->getLazyFreeMgr();
+    if ((cnt.value() >= 2048 ||
+         targetTtl == LazyFreeManager::LAZYFREE_TTL) &&
+        lazyMgr && sess->getType() != Session::Type::LOCAL) {
+      // NOTE(tendis): a big key expired, or unlinked, is freed by the
+      // LazyFreeManager, not by the worker thread. The reads see it
+      // expired. A write may create the key again, so the subkeys left
+      // must be deleted before, at most LAZYFREE_INLINE_SUBKEYS of them
+      // here, or the write fails with -TRYAGAIN.
+      txn.reset();
+      lazyMgr->enqueue(storeId, sess->getCtx()->getDbId(), key);
+      auto cmd = Command::getCommand(sess);
+      if (!cmd || !cmd->isWriteable()) {
+        return {ErrorCodes::ERR_EXPIRED, ""};
+      }
+      bool done = false;
+      auto freed = Command::lazyFreeStep(
+        sess, storeId, mk, LAZYFREE_INLINE_SUBKEYS, &done);
+      if (!freed.ok()) {
+        return freed.status();
+      }
+      if (!done) {
+        return {ErrorCodes::ERR_LAZYFREE_BUSY, ""};
+      }
+      return {ErrorCodes::ERR_EXPIRED, ""};
+    }
     if (cnt.value() >= 2048) {
       LOG(INFO) << "bigkey delete:" << hexlify(mk.getPrimaryKey())
                 << ",rcdType:" << rt2Char(valueType) << ",size:" << cnt.value();
       // reset txn, it is no longer used
       txn.reset();
-      Status s =
-        Command::delKeyPessimisticInLock(sess, storeId, mk, valueType, &ictx);
+      Status s = Command::delKeyPessimisticInLock(
+        sess, storeId, mk, valueType, &ictx, pieced);
       if (s.ok()) {
         return {ErrorCodes::ERR_EXPIRED, ""};
       } else {
@@ -726,7 +875,7 @@ Expected<RecordValue> Command::expireKeyIfNeeded(Session* sess,
       }
     } else {
       Status s = Command::delKeyOptimismInLock(
-        sess, storeId, mk, valueType, txn.get(), &ictx);
+        sess, storeId, mk, valueType, txn.get(), &ictx, pieced);
       if (s.code() == ErrorCodes::ERR_COMMIT_RETRY && i != RETRY_CNT - 1) {
         continue;
       }
@@ -742,6 +891,160 @@ Expected<RecordValue> Command::expireKeyIfNeeded(Session* sess,
   return {ErrorCodes::ERR_INTERNAL, "not reachable"};
 }
 
+Expected<uint32_t> Command::lazyFreeStep(Session* sess,
+                                         uint32_t storeId,
+                                         const RecordKey& mk,
+                                         uint32_t batch,
+                                         bool* done) {
+  *done = true;
+  auto server = sess->getServerEntry();
+  INVARIANT(server != nullptr);
+  auto expdb =
+    server->getSegmentMgr()->getDb(sess, storeId, mgl::LockMode::LOCK_NONE);
+  RET_IF_ERR_EXPECTED(expdb);
+  PStore kvstore = expdb.value().store;
+
+  auto ptxn = kvstore->createTransaction(sess);
+  RET_IF_ERR_EXPECTED(ptxn);
+  std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+  if (txn->isReplOnly()) {
+    return 0;
+  }
+  Expected<RecordValue> eValue = kvstore->getKV(mk, txn.get());
+  if (eValue.status().code() == ErrorCodes::ERR_NOTFOUND) {
+    return 0;
+  }
+  RET_IF_ERR_EXPECTED(eValue);
+  uint64_t targetTtl = eValue.value().getTtl();
+  if (_noexpire || targetTtl == 0 || msSinceEpoch() < targetTtl) {
+    // written again after it is expired
+    return 0;
+  }
+  RecordType valueType = eValue.value().getRecordType();
+  bool pieced = rcd_util::isPiecedKV(eValue.value());
+  auto cnt = partialDelSubKeys(
+    sess, storeId, batch, mk, valueType, false, txn.get(), nullptr, pieced);
+  RET_IF_ERR_EXPECTED(cnt);
+  if (cnt.value() == batch) {
+    *done = false;
+    return cnt.value();
+  }
+
+  ptxn = kvstore->createTransaction(sess);
+  RET_IF_ERR_EXPECTED(ptxn);
+  txn = std::move(ptxn.value());
+  auto s = delKeyAndTTL(sess, mk, eValue.value(), txn.get());
+  RET_IF_ERR(s);
+  auto commitStatus = txn->commit();
+  RET_IF_ERR_EXPECTED(commitStatus);
+  return cnt.value();
+}
+
+Expected<uint32_t> Command::delExpiredKeysInLock(
+  Session* sess,
+  uint32_t storeId,
+  const std::vector<std::pair<uint32_t, TTLIndex>>& keys,
+  std::vector<TTLIndex>* left) {
+  // a key with so many subkeys is deleted alone, and the subkeys deleted
+  // by a batch are limited, so that the WriteBatch is bounded.
+  constexpr uint64_t bigKeySubCount = 2048;
+  constexpr uint64_t maxBatchSubCount = 8 * bigKeySubCount;
+
+  auto server = sess->getServerEntry();
+  INVARIANT(server != nullptr);
+  auto expdb =
+    server->getSegmentMgr()->getDb(nullptr, storeId, mgl::LockMode::LOCK_NONE);
+  RET_IF_ERR_EXPECTED(expdb);
+  PStore kvstore = expdb.value().store;
+
+  size_t leftSize = left->size();
+  for (uint32_t i = 0; i < RETRY_CNT; ++i) {
+    left->resize(leftSize);
+    auto ptxn = kvstore->createTransaction(sess);
+    RET_IF_ERR_EXPECTED(ptxn);
+    std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+    if (txn->isReplOnly()) {
+      return 0;
+    }
+
+    uint64_t currentTs = msSinceEpoch();
+    uint64_t subCount = 0;
+    uint32_t deleted = 0;
+    for (const auto& key : keys) {
+      const TTLIndex& index = key.second;
+      RecordKey mk(key.first,
+                   index.getDbId(),
+                   RecordType::RT_DATA_META,
+                   index.getPriKey(),
+                   "");
+      Expected<RecordValue> eValue = kvstore->getKV(mk, txn.get());
+      if (eValue.status().code() == ErrorCodes::ERR_NOTFOUND) {
+        continue;
+      }
+      RET_IF_ERR_EXPECTED(eValue);
+      uint64_t targetTtl = eValue.value().getTtl();
+      if (_noexpire || targetTtl == 0 || currentTs < targetTtl) {
+        continue;
+      }
+      RecordType valueType = eValue.value().getRecordType();
+      auto cnt = rcd_util::getSubKeyCount(mk, eValue.value());
+      RET_IF_ERR_EXPECTED(cnt);
+      if (cnt.value() >= bigKeySubCount ||
+          subCount + cnt.value() > maxBatchSubCount) {
+        left->push_back(index);
+        continue;
+      }
+      subCount += cnt.value();
+
+      if (rcd_util::needTTLIndex(eValue.value())) {
+        for (const auto& prefix : subKeyPrefixes(mk, valueType)) {
+          auto cursor = txn->createDataCursor();
+          cursor->seek(prefix);
+          while (true) {
+            Expected<Record> exptRcd = cursor->next();
+            if (exptRcd.status().code() == ErrorCodes::ERR_EXHAUST) {
+              break;
+            }
+            RET_IF_ERR_EXPECTED(exptRcd);
+            const RecordKey& rcdKey = exptRcd.value().getRecordKey();
+            if (rcdKey.prefixPk() != prefix) {
+              break;
+            }
+            auto s = kvstore->delKV(rcdKey, txn.get());
+            RET_IF_ERR(s);
+          }
+        }
+        TTLIndex ictx(
+          index.getPriKey(), valueType, index.getDbId(), targetTtl);
+        auto s = txn->delKV(ictx.encode());
+        RET_IF_ERR(s);
+        // the scanned one may be a legacy index
+        if (index.encode() != ictx.encode()) {
+          s = txn->delKV(index.encode());
+          RET_IF_ERR(s);
+        }
+      }
+      auto s = kvstore->delKV(mk, txn.get());
+      RET_IF_ERR(s);
+      deleted++;
+    }
+    if (deleted == 0) {
+      return 0;
+    }
+
+    Expected<uint64_t> commitStatus = txn->commit();
+    if (commitStatus.status().code() == ErrorCodes::ERR_COMMIT_RETRY &&
+        i != RETRY_CNT - 1) {
+      continue;
+    }
+    RET_IF_ERR_EXPECTED(commitStatus);
+    return deleted;
+  }
+  // should never reach here
+  INVARIANT_D(0);
+  return {ErrorCodes::ERR_INTERNAL, "not reachable"};
+}
+
 std::string Command::fmtErr(const std::string& s) {
   if (s.size() != 0 && s[0] == '-') {
     return s;
@@ -56,6 +56,8 @@ class Command {
   // should use lock upgrade in the future.
   static mgl::LockMode RdLock();
   static void setNoExpire(bool cfg);
+  static bool mergeWrite();
+  static void setMergeWrite(bool cfg);
   static void changeCommand(const string& renameCmdList, string mode);
   int getFlags() const;
   size_t getFlagsCount() const;
@@ -72,10 +74,24 @@ class Command {
   // return ERR_OK if not expired
   // return ERR_EXPIRED if expired
   // return errors on other unexpected conditions
+  // a pieced RT_KV is returned as a plain RT_KV if loadPieces is true,
+  // otherwise the meta is returned, see PiecedKV
   static Expected<RecordValue> expireKeyIfNeeded(Session* sess,
                                                  const std::string& key,
                                                  RecordType tp,
-                                                 bool hasVersion = true);
+                                                 bool hasVersion = true,
+                                                 bool loadPieces = true);
+
+  // delete the expired keys in one transaction, keys are {chunkId, index}
+  // of the store storeId, and they must be locked by the caller. The keys
+  // not expired any more are skipped. The keys too big for the batch are
+  // appended to left, they should be deleted by expireKeyIfNeeded().
+  // return the number of keys deleted
+  static Expected<uint32_t> delExpiredKeysInLock(
+    Session* sess,
+    uint32_t storeId,
+    const std::vector<std::pair<uint32_t, TTLIndex>>& keys,
+    std::vector<TTLIndex>* left);
 
   static Expected<std::pair<std::string, std::list<Record>>> scan(
     const std::string& pk,
@@ -87,14 +103,29 @@ class Command {
                              const RecordKey& mk,
                              const RecordValue& val,
                              Transaction* txn);
-  static Status delKey(Session* sess, const std::string& key, RecordType tp);
+  // a key of lazyMinSubKeys subkeys or more is expired at once, and
+  // freed by the LazyFreeManager, 0 means never.
+  static Status delKey(Session* sess,
+                       const std::string& key,
+                       RecordType tp,
+                       uint64_t lazyMinSubKeys = 0);
 
   // return true if exists and delete succ
   // return false if not exists
   // return error if has error
   static Expected<bool> delKeyChkExpire(Session* sess,
                                         const std::string& key,
-                                        RecordType tp);
+                                        RecordType tp,
+                                        uint64_t lazyMinSubKeys = 0);
+
+  // delete at most batch subkeys of the expired key mk in a transaction,
+  // and the meta with the last batch, *done is set if nothing is left.
+  // mk should be locked by the caller. return the subkeys deleted.
+  static Expected<uint32_t> lazyFreeStep(Session* sess,
+                                         uint32_t storeId,
+                                         const RecordKey& mk,
+                                         uint32_t batch,
+                                         bool* done);
 
   static std::string fmtErr(const std::string& s);
   static std::string fmtNull();
@@ -116,6 +147,9 @@ class Command {
   static std::stringstream& fmtLongLong(std::stringstream&, int64_t);
 
   static constexpr int32_t RETRY_CNT = 3;
+  // the subkeys of a big key expired deleted by a write at most, the rest
+  // are freed in background, see expireKeyIfNeeded()
+  static constexpr uint32_t LAZYFREE_INLINE_SUBKEYS = 2048;
 
  protected:
   static std::mutex _mutex;
@@ -124,6 +158,7 @@ class Command {
   static std::map<std::string, uint64_t> _unSeenCmds;
 
   static bool _noexpire;
+  static bool _mergeWrite;
   static mgl::LockMode _expRdLk;
 
  private:
@@ -131,14 +166,16 @@ class Command {
                                         uint32_t storeId,
                                         const RecordKey& rk,
                                         RecordType valueType,
-                                        const TTLIndex* ictx = nullptr);
+                                        const TTLIndex* ictx = nullptr,
+                                        bool pieced = false);
 
   static Status delKeyOptimismInLock(Session* sess,
                                      uint32_t storeId,
                                      const RecordKey& rk,
                                      RecordType valueType,
                                      Transaction* txn,
-                                     const TTLIndex* ictx = nullptr);
+                                     const TTLIndex* ictx = nullptr,
+                                     bool pieced = false);
 
   static Expected<uint32_t> partialDelSubKeys(Session* sess,
                                               uint32_t storeId,
@@ -147,7 +184,8 @@ class Command {
                                               RecordType valueType,
                                               bool deleteMeta,
                                               Transaction* txn,
-                                              const TTLIndex* ictx = nullptr);
+                                              const TTLIndex* ictx = nullptr,
+                                              bool pieced = false);
 
   const std::string _name;
   /* Flags as string representation, one char per flag. */
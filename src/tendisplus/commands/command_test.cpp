@@ -9,6 +9,9 @@
 #include <limits>
 #include <algorithm>
 #include <random>
+#include <set>
+#include <mutex>  // NOLINT
+#include <thread>  // NOLINT
 #include "gtest/gtest.h"
 #include "tendisplus/utils/status.h"
 #include "tendisplus/utils/scopeguard.h"
@@ -17,6 +20,7 @@
 #include "tendisplus/utils/sync_point.h"
 #include "tendisplus/utils/test_util.h"
 #include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/storage/pieced_kv.h"
 #include "tendisplus/commands/command.h"
 #include "tendisplus/server/server_params.h"
 #include "tendisplus/server/server_entry.h"
@@ -591,51 +595,109 @@ void testMulti(std::shared_ptr<ServerEntry> svr) {
   expect = Command::runSessionCmd(&sess);
   EXPECT_TRUE(expect.ok());
 
-  // Out multi/exec doesn't behaviour like what redis does.
-  // each command between multi and exec will be executed immediately.
-  sess.setArgs({"hset", "multitest", "multi1", "multi1", "2", "2", "v1"});
+  // the commands between multi and exec are queued, and run in exec
+  for (auto field : {"multi1", "multi2", "multi3"}) {
+    sess.setArgs({"hset", "multitest", field, field, "2", "2", "v1"});
+    s = sess.processExtendProtocol();
+    EXPECT_TRUE(s.ok());
+    expect = Command::runSessionCmd(&sess);
+    EXPECT_TRUE(expect.ok());
+    EXPECT_EQ(expect.value(), Command::fmtStatus("QUEUED"));
+  }
+  sess.setArgs({"hget", "multitest", "multi1", "2", "2", "v1"});
   s = sess.processExtendProtocol();
   EXPECT_TRUE(s.ok());
   expect = Command::runSessionCmd(&sess);
-  EXPECT_TRUE(expect.ok());
+  EXPECT_EQ(expect.value(), Command::fmtStatus("QUEUED"));
 
-  sess.setArgs({"hset", "multitest", "multi2", "multi2", "2", "2", "v1"});
+  sess.setArgs({"exec", "2", "2", "v1"});
   s = sess.processExtendProtocol();
   EXPECT_TRUE(s.ok());
   expect = Command::runSessionCmd(&sess);
   EXPECT_TRUE(expect.ok());
+  std::stringstream ss;
+  Command::fmtMultiBulkLen(ss, 4);
+  for (uint32_t i = 0; i < 3; i++) {
+    Command::fmtLongLong(ss, 1);
+  }
+  Command::fmtBulk(ss, "multi1");
+  EXPECT_EQ(expect.value(), ss.str());
 
-  sess.setArgs({"hset", "multitest", "multi3", "multi3", "2", "2", "v1"});
+  sess.setArgs({"multi", "3", "3", "v1"});
   s = sess.processExtendProtocol();
   EXPECT_TRUE(s.ok());
   expect = Command::runSessionCmd(&sess);
   EXPECT_TRUE(expect.ok());
 
-  // Exec will just return ok, no array reply.
-  sess.setArgs({"exec", "2", "2", "v1"});
+  sess.setArgs({"hset", "multitest", "multi4", "multi4", "3", "3", "v1"});
   s = sess.processExtendProtocol();
   EXPECT_TRUE(s.ok());
   expect = Command::runSessionCmd(&sess);
   EXPECT_TRUE(expect.ok());
 
-  sess.setArgs({"multi", "3", "3", "v1"});
+  // version check: exec with version not same as txn will fail.
+  sess.setArgs({"exec", "4", "4", "v1"});
   s = sess.processExtendProtocol();
   EXPECT_TRUE(s.ok());
   expect = Command::runSessionCmd(&sess);
-  EXPECT_TRUE(expect.ok());
+  EXPECT_TRUE(!expect.ok());
 
-  sess.setArgs({"hset", "multitest", "multi4", "multi4", "3", "3", "v1"});
+  sess.setArgs({"discard", "4", "4", "v1"});
   s = sess.processExtendProtocol();
   EXPECT_TRUE(s.ok());
   expect = Command::runSessionCmd(&sess);
   EXPECT_TRUE(expect.ok());
+  sess.setArgs({"hexists", "multitest", "multi4", "4", "4", "v1"});
+  s = sess.processExtendProtocol();
+  EXPECT_TRUE(s.ok());
+  expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.value(), Command::fmtZero());
 
-  // version check: exec with version not same as txn will fail.
-  sess.setArgs({"exec", "4", "4", "v1"});
+  // a command failed in exec is rolled back, the others are committed,
+  // with one binlog
+  sess.setArgs({"multi", "5", "5", "v1"});
   s = sess.processExtendProtocol();
   EXPECT_TRUE(s.ok());
   expect = Command::runSessionCmd(&sess);
-  EXPECT_TRUE(!expect.ok());
+  EXPECT_TRUE(expect.ok());
+  for (auto& args : std::vector<std::vector<std::string>>{
+         {"hset", "multitest", "multi5", "multi5", "5", "5", "v1"},
+         {"lpush", "multitest", "wrongtype", "5", "5", "v1"},
+         {"hset", "multitest", "multi6", "multi6", "5", "5", "v1"}}) {
+    sess.setArgs(args);
+    s = sess.processExtendProtocol();
+    EXPECT_TRUE(s.ok());
+    expect = Command::runSessionCmd(&sess);
+    EXPECT_EQ(expect.value(), Command::fmtStatus("QUEUED"));
+  }
+  uint32_t commits = 0;
+  auto tid = std::this_thread::get_id();
+  SyncPoint::GetInstance()->SetCallBack(
+    "RocksTxn::commit()::1", [&](void* arg) {
+      if (std::this_thread::get_id() == tid) {
+        commits++;
+      }
+    });
+  SyncPoint::GetInstance()->EnableProcessing();
+  sess.setArgs({"exec", "5", "5", "v1"});
+  s = sess.processExtendProtocol();
+  EXPECT_TRUE(s.ok());
+  expect = Command::runSessionCmd(&sess);
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  EXPECT_TRUE(expect.ok());
+  EXPECT_EQ(commits, 1u);
+  ss.str("");
+  Command::fmtMultiBulkLen(ss, 3);
+  Command::fmtLongLong(ss, 1);
+  ss << Command::fmtErr(Status(ErrorCodes::ERR_WRONG_TYPE, "").toString());
+  Command::fmtLongLong(ss, 1);
+  EXPECT_EQ(expect.value(), ss.str());
+  sess.setArgs({"hlen", "multitest", "6", "6", "v1"});
+  s = sess.processExtendProtocol();
+  EXPECT_TRUE(s.ok());
+  expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.value(), Command::fmtLongLong(6));
 }
 
 void testMaxClients(std::shared_ptr<ServerEntry> svr) {
@@ -1567,6 +1629,79 @@ TEST(Command, RenameCommandDelete) {
 #endif
 }
 
+void testOverwritePiecedKV(std::shared_ptr<ServerEntry> svr) {
+  asio::io_context ioContext;
+  asio::ip::tcp::socket socket(ioContext);
+  NetSession sess(svr, std::move(socket), 1, false, nullptr, nullptr);
+
+  // the records of the key, and the ttl indexes
+  auto countRecords = [&svr](const std::string& key) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < svr->getKVStoreCount(); i++) {
+      auto kvstore = svr->getStores()[i];
+      auto ptxn = kvstore->createTransaction(nullptr);
+      EXPECT_TRUE(ptxn.ok());
+      std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+      auto cursor = txn->createAllDataCursor();
+      while (true) {
+        Expected<Record> exptRcd = cursor->next();
+        if (exptRcd.status().code() == ErrorCodes::ERR_EXHAUST) {
+          break;
+        }
+        EXPECT_TRUE(exptRcd.ok());
+        if (exptRcd.value().getRecordKey().getPrimaryKey() == key) {
+          count++;
+        }
+      }
+      auto ttlCursor = txn->createTTLIndexCursor(UINT64_MAX);
+      while (ttlCursor->next().ok()) {
+        count++;
+      }
+    }
+    return count;
+  };
+
+  std::string value(300, 'a');
+  sess.setArgs({"set", "big", value, "px", "1000000"});
+  auto expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.value(), Command::fmtOK());
+  sess.setArgs({"bitcount", "big"});
+  expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.value(), Command::fmtLongLong(300 * 3));
+  // the meta, the pieces, the bitmap summaries and the ttl index
+  EXPECT_GT(countRecords("big"), 300U / 16 + 2);
+
+  // the pieces are deleted after the threshold is set back to 0
+  PiecedKV::setConfig(0, 0);
+  sess.setArgs({"set", "big", "small"});
+  expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.value(), Command::fmtOK());
+  EXPECT_EQ(countRecords("big"), 1U);
+  sess.setArgs({"get", "big"});
+  expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.value(), Command::fmtBulk("small"));
+}
+
+TEST(Command, OverwritePiecedKV) {
+  const auto guard = MakeGuard([] {
+    destroyEnv();
+    PiecedKV::setConfig(0, 64 * 1024);
+  });
+
+  EXPECT_TRUE(setupEnv());
+  auto cfg = makeServerParam();
+  cfg->kvPieceThreshold = 100;
+  cfg->kvPieceSize = 16;
+  auto server = makeServerEntry(cfg);
+
+  testOverwritePiecedKV(server);
+
+#ifndef _WIN32
+  server->stop();
+  EXPECT_EQ(server.use_count(), 1);
+#endif
+}
+
 /*
 TEST(Command, keys) {
     const auto guard = MakeGuard([] {
@@ -1836,6 +1971,103 @@ TEST(Command, revision) {
 #endif
 }
 
+void testMergeWrite(std::shared_ptr<ServerEntry> svr) {
+  EXPECT_EQ(runCommand(svr, {"set", "counter", "10", "ex", "100"}),
+            Command::fmtOK());
+  EXPECT_EQ(runCommand(svr, {"incrby", "counter", "5"}),
+            Command::fmtLongLong(15));
+  EXPECT_EQ(runCommand(svr, {"incr", "counter"}), Command::fmtLongLong(16));
+  EXPECT_EQ(runCommand(svr, {"decrby", "counter", "6"}),
+            Command::fmtLongLong(10));
+  EXPECT_EQ(runCommand(svr, {"get", "counter"}), Command::fmtBulk("10"));
+  // the ttl is kept
+  EXPECT_EQ(runCommand(svr, {"ttl", "counter"}).substr(0, 1), ":");
+  EXPECT_NE(runCommand(svr, {"ttl", "counter"}), Command::fmtLongLong(-1));
+
+  // concurrent increments of a key are all counted, and each of them
+  // replies a different value
+  std::mutex mutex;
+  std::set<std::string> replies;
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < 4; i++) {
+    threads.emplace_back([svr, &mutex, &replies]() {
+      for (uint32_t j = 0; j < 100; j++) {
+        auto reply = runCommand(svr, {"incr", "counter"});
+        std::lock_guard<std::mutex> lk(mutex);
+        replies.insert(reply);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(replies.size(), 400U);
+  EXPECT_EQ(replies.count(Command::fmtLongLong(11)), 1U);
+  EXPECT_EQ(replies.count(Command::fmtLongLong(410)), 1U);
+  EXPECT_EQ(runCommand(svr, {"get", "counter"}), Command::fmtBulk("410"));
+
+
+  EXPECT_EQ(runCommand(svr, {"set", "str", "x"}), Command::fmtOK());
+  EXPECT_EQ(runCommand(svr, {"append", "str", "ab"}), Command::fmtLongLong(3));
+  EXPECT_EQ(runCommand(svr, {"append", "str", "cd"}), Command::fmtLongLong(5));
+  EXPECT_EQ(runCommand(svr, {"get", "str"}), Command::fmtBulk("xabcd"));
+  asio::io_context ioContext;
+  asio::ip::tcp::socket socket(ioContext);
+  NetSession sess(svr, std::move(socket), 1, false, nullptr, nullptr);
+  sess.setArgs({"incr", "str"});
+  auto expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.status().code(), ErrorCodes::ERR_DECODE);
+  // an overflow is rejected, nothing is merged
+  auto max = std::to_string(LLONG_MAX - 1);
+  EXPECT_EQ(runCommand(svr, {"set", "big", max}), Command::fmtOK());
+  EXPECT_EQ(runCommand(svr, {"incr", "big"}),
+            Command::fmtLongLong(LLONG_MAX));
+  sess.setArgs({"incr", "big"});
+  expect = Command::runSessionCmd(&sess);
+  EXPECT_EQ(expect.status().code(), ErrorCodes::ERR_OVERFLOW);
+  EXPECT_EQ(runCommand(svr, {"get", "big"}),
+            Command::fmtBulk(std::to_string(LLONG_MAX)));
+  // not existing, the common path
+  EXPECT_EQ(runCommand(svr, {"append", "str2", "ab"}),
+            Command::fmtLongLong(2));
+
+  EXPECT_EQ(runCommand(svr, {"hset", "hash", "f", "1"}), Command::fmtOne());
+  EXPECT_EQ(runCommand(svr, {"hincrby", "hash", "f", "10"}),
+            Command::fmtLongLong(11));
+  EXPECT_EQ(runCommand(svr, {"hincrby", "hash", "g", "2"}),
+            Command::fmtLongLong(2));
+  EXPECT_EQ(runCommand(svr, {"hget", "hash", "f"}), Command::fmtBulk("11"));
+  EXPECT_EQ(runCommand(svr, {"hlen", "hash"}), Command::fmtLongLong(2));
+
+  // the operands are merged in compaction
+  for (uint32_t i = 0; i < svr->getKVStoreCount(); i++) {
+    EXPECT_TRUE(svr->getStores()[i]->fullCompact().ok());
+  }
+  EXPECT_EQ(runCommand(svr, {"get", "counter"}), Command::fmtBulk("410"));
+  EXPECT_EQ(runCommand(svr, {"get", "str"}), Command::fmtBulk("xabcd"));
+  EXPECT_EQ(runCommand(svr, {"hget", "hash", "f"}), Command::fmtBulk("11"));
+}
+
+TEST(Command, mergeWrite) {
+  const auto guard = MakeGuard([] {
+    destroyEnv();
+    Command::setMergeWrite(false);
+  });
+
+  EXPECT_TRUE(setupEnv());
+  auto cfg = makeServerParam();
+  cfg->kvMergeWrite = true;
+  auto server = makeServerEntry(cfg);
+  EXPECT_TRUE(Command::mergeWrite());
+
+  testMergeWrite(server);
+
+#ifndef _WIN32
+  server->stop();
+  EXPECT_EQ(server.use_count(), 1);
+#endif
+}
+
 TEST(Command, dexec) {
   const auto guard = MakeGuard([] { destroyEnv(); });
 
@@ -34,6 +34,7 @@
 #include "tendisplus/commands/release.h"
 #include "tendisplus/commands/version.h"
 #include "tendisplus/storage/varint.h"
+#include "tendisplus/storage/pieced_kv.h"
 #include "tendisplus/utils/scopeguard.h"
 
 namespace tendisplus {
@@ -622,6 +623,17 @@ class IterAllCommand : public Command {
         continue;
       }
 
+      if (rcd_util::isPiecedKV(exptRcd.value().getRecordValue())) {
+        // load the whole value of a big string stored in pieces
+        RecordValue rv = exptRcd.value().getRecordValue();
+        auto s = PiecedKV::load(
+          kvstore, exptRcd.value().getRecordKey(), &rv, txn.get());
+        if (!s.ok()) {
+          return s;
+        }
+        result.emplace_back(exptRcd.value().getRecordKey(), rv);
+        continue;
+      }
       result.emplace_back(std::move(exptRcd.value()));
     }
 
@@ -1810,6 +1822,7 @@ class InfoCommand : public Command {
     infoBackup(allsections, defsections, section, sess, result);
     infoDataset(allsections, defsections, section, sess, result);
     infoCompaction(allsections, defsections, section, sess, result);
+    infoWriteStall(allsections, defsections, section, sess, result);
     infoLevelStats(allsections, defsections, section, sess, result);
     infoRocksdbStats(allsections, defsections, section, sess, result);
     infoRocksdbPerfStats(allsections, defsections, section, sess, result);
@@ -2231,6 +2244,28 @@ class InfoCommand : public Command {
     }
   }
 
+  static void infoWriteStall(bool allsections,
+                             bool defsections,
+                             const std::string& section,
+                             Session* sess,
+                             std::stringstream& result) {
+    if (allsections || defsections || section == "writestall") {
+      auto server = sess->getServerEntry();
+
+      result << "# WriteStall\r\n";
+      for (uint64_t i = 0; i < server->getKVStoreCount(); ++i) {
+        auto expdb = server->getSegmentMgr()->getDb(
+          sess, i, mgl::LockMode::LOCK_IS, false, 0);
+        if (!expdb.ok()) {
+          continue;
+        }
+        result << "store_" << i << ":"
+               << expdb.value().store->getWriteStallInfo() << "\r\n";
+      }
+      result << "\r\n";
+    }
+  }
+
   static void infoLevelStats(bool allsections,
                              bool defsections,
                              const std::string& section,
@@ -3307,6 +3342,11 @@ class execCommand : public Command {
     return 0;
   }
 
+  // NOTE(tendis): the keys of all the commands queued are locked first,
+  // then the commands run in one transaction of each kvstore, and they
+  // are committed at the end, with one binlog for each kvstore. A command
+  // failed is rolled back to its savepoint, the others are committed, as
+  // redis.
   Expected<std::string> run(Session* sess) final {
     auto pCtx = sess->getCtx();
     if (!pCtx->isInMulti()) {
@@ -3316,12 +3356,119 @@ class execCommand : public Command {
     if (!pCtx->verifyVersion(pCtx->getVersionEP())) {
       return {ErrorCodes::ERR_WRONG_VERSION_EP, ""};
     }
+    // NOTE(tendis): the commands run in multi, to share the version of
+    // the transaction, see SessionCtx::verifyVersion()
+    const auto multiGuard = MakeGuard([pCtx] { pCtx->resetMulti(); });
+    auto cmds = pCtx->getMultiCmds();
+    if (pCtx->isMultiDirty()) {
+      return {ErrorCodes::ERR_PARSEPKT,
+              "-EXECABORT Transaction discarded because of previous "
+              "errors.\r\n"};
+    }
+
+    std::vector<std::string> keys;
+    std::vector<int> index;
+    for (const auto& args : cmds) {
+      auto cmd = commandMap().at(toLower(args[0]));
+      for (auto i : cmd->getKeysFromCommand(args)) {
+        index.push_back(keys.size());
+        keys.push_back(args[i]);
+      }
+    }
+    auto server = sess->getServerEntry();
+    auto locklist = server->getSegmentMgr()->getAllKeysLocked(
+      sess, keys, index, mgl::LockMode::LOCK_X);
+    RET_IF_ERR_EXPECTED(locklist);
+
+    std::map<uint32_t, std::unique_ptr<Transaction>> txns;
+    for (const auto& lock : locklist.value()) {
+      // the key is locked twice
+      if (!lock || txns.count(lock->getStoreId())) {
+        continue;
+      }
+      auto expdb = server->getSegmentMgr()->getDb(
+        sess, lock->getStoreId(), mgl::LockMode::LOCK_NONE);
+      RET_IF_ERR_EXPECTED(expdb);
+      auto ptxn = expdb.value().store->createTransaction(sess);
+      RET_IF_ERR_EXPECTED(ptxn);
+      txns[lock->getStoreId()] = std::move(ptxn.value());
+    }
+    for (const auto& txn : txns) {
+      pCtx->setExecTxn(txn.second->getKVStoreId(), txn.second.get());
+    }
+    const auto execArgs = sess->getArgs();
+    auto restoreArgs = [sess, &execArgs]() {
+      auto args = execArgs;
+      sess->swapArgs(&args);
+    };
+    const auto guard = MakeGuard([pCtx, &restoreArgs] {
+      pCtx->clearExecTxns();
+      restoreArgs();
+    });
+
+    std::stringstream ss;
+    Command::fmtMultiBulkLen(ss, cmds.size());
+    for (auto& args : cmds) {
+      for (const auto& txn : txns) {
+        txn.second->setSavePoint();
+      }
+      auto cmd = commandMap().at(toLower(args[0]));
+      sess->swapArgs(&args);
+      auto ret = cmd->run(sess);
+      if (ret.ok()) {
+        ss << ret.value();
+        continue;
+      }
+      for (const auto& txn : txns) {
+        auto s = txn.second->rollbackToSavePoint();
+        RET_IF_ERR(s);
+      }
+      ss << Command::fmtErr(ret.status().toString());
+    }
+
+    // the binlog takes the name of EXEC
+    restoreArgs();
+    pCtx->clearExecTxns();
+    for (const auto& txn : txns) {
+      // NOTE(tendis): the keys are in one slot in cluster mode, so there
+      // is only one kvstore. Otherwise, it may lead to partial success if
+      // a kvstore fails to commit, as commitAll().
+      auto eCommit = txn.second->commit();
+      RET_IF_ERR_EXPECTED(eCommit);
+    }
+    return ss.str();
+  }
+} execCmd;
+
+class discardCommand : public Command {
+ public:
+  discardCommand() : Command("discard", "sF") {}
+
+  ssize_t arity() const {
+    return 1;
+  }
+
+  int32_t firstkey() const {
+    return 0;
+  }
+
+  int32_t lastkey() const {
+    return 0;
+  }
+
+  int32_t keystep() const {
+    return 0;
+  }
+
+  Expected<std::string> run(Session* sess) final {
+    auto pCtx = sess->getCtx();
+    if (!pCtx->isInMulti()) {
+      return {ErrorCodes::ERR_PARSEPKT, "DISCARD without MULTI"};
+    }
     pCtx->resetMulti();
-    // TODO(comboqiu): return value should include multiBulkLen and sub
-    // command results
     return Command::fmtOK();
   }
-} execCmd;
+} discardCmd;
 
 class slowlogCommand : public Command {
  public:
@@ -14,6 +14,7 @@
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/time.h"
 #include "tendisplus/commands/command.h"
+#include "tendisplus/server/lazyfree_manager.h"
 
 namespace tendisplus {
 
@@ -63,9 +64,13 @@ class DelCommand : public Command {
       return locklist.status();
     }
 
+    // the big keys are freed in background
+    uint64_t lazyMinSubKeys =
+      sess->getServerEntry()->getParams()->lazyfreeDelMinSubKeys;
     uint64_t total = 0;
     for (size_t i = 1; i < args.size(); ++i) {
-      Expected<bool> done = delGeneric(sess, args[i]);
+      Expected<bool> done = Command::delKeyChkExpire(
+        sess, args[i], RecordType::RT_DATA_META, lazyMinSubKeys);
       if (!done.ok()) {
         return done.status();
       }
@@ -105,35 +110,21 @@ class UnlinkCommand : public Command {
       return locklist.status();
     }
 
-    std::vector<std::string> validKeys;
-    validKeys.reserve(args.size());
+    // NOTE(tendis): the keys are expired at once, and their subkeys are
+    // deleted by the LazyFreeManager. The small keys are deleted here.
+    uint64_t total = 0;
     for (size_t i = 1; i < args.size(); ++i) {
-      const std::string& key = args[i];
-      Expected<RecordValue> rv =
-        Command::expireKeyIfNeeded(sess, key, RecordType::RT_DATA_META);
-      if (rv.status().code() == ErrorCodes::ERR_EXPIRED ||
-          rv.status().code() == ErrorCodes::ERR_NOTFOUND) {
-        continue;
-      } else if (!rv.status().ok()) {
-        return rv.status();
+      Expected<bool> done =
+        Command::delKeyChkExpire(sess,
+                                 args[i],
+                                 RecordType::RT_DATA_META,
+                                 LazyFreeManager::UNLINK_MIN_SUBKEYS);
+      if (!done.ok()) {
+        return done.status();
       }
-      validKeys.emplace_back(std::move(args[i]));
+      total += done.value() ? 1 : 0;
     }
-    uint64_t size = validKeys.size();
-    std::thread unlink(
-      [](Session* sess,
-         std::vector<std::string>&& keys,
-         std::list<std::unique_ptr<KeyLock>>&& locklist) {
-        for (size_t i = 0; i < keys.size(); ++i) {
-          delKey(sess, keys[i], RecordType::RT_DATA_META);
-        }
-      },
-      sess,
-      std::move(validKeys),
-      std::move(locklist.value()));
-    unlink.detach();
-
-    return Command::fmtLongLong(size);
+    return Command::fmtLongLong(total);
   }
 } unlinkCmd;
 
@@ -692,10 +692,21 @@ Expected<std::unique_ptr<Serializer>> getSerializer(Session* sess,
   std::unique_ptr<Serializer> ptr;
   auto type = rv.value().getRecordType();
   switch (type) {
-    case RecordType::RT_KV:
+    case RecordType::RT_KV: {
+      if (rcd_util::isPiecedKV(rv.value())) {
+        // load the whole value of a big string stored in pieces
+        auto kv = Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV);
+        if (!kv.ok()) {
+          return kv.status();
+        }
+        ptr = std::move(std::unique_ptr<Serializer>(
+          new KvSerializer(sess, key, std::move(kv.value()))));
+        break;
+      }
       ptr = std::move(std::unique_ptr<Serializer>(
         new KvSerializer(sess, key, std::move(rv.value()))));
       break;
+    }
     case RecordType::RT_LIST_META:
       ptr = std::move(std::unique_ptr<Serializer>(
         new ListSerializer(sess, key, std::move(rv.value()))));
@@ -1648,7 +1659,8 @@ class IncrMetaCommand : public Command {
             return entry.status();
           }
           offset += size;
-          auto eMeta = parseReplLogValueEntryV2(entry.value(), startRevision);
+          auto eMeta =
+            parseReplLogValueEntryV2(txn, entry.value(), startRevision);
           if (eMeta.ok()) {
             auto meta = eMeta.value();
             auto search = incrKeys.find(meta);
@@ -1679,7 +1691,8 @@ class IncrMetaCommand : public Command {
   }
 
   // parse ReplLogValueEntryV2 key smaller than startRevision will filterd
-  Expected<IncrMeta> parseReplLogValueEntryV2(const ReplLogValueEntryV2& entry,
+  Expected<IncrMeta> parseReplLogValueEntryV2(Transaction* txn,
+                                              const ReplLogValueEntryV2& entry,
                                               uint64_t startRevision) {
     switch (entry.getOp()) {
       case ReplOp::REPL_OP_SET: {
@@ -1744,6 +1757,50 @@ class IncrMetaCommand : public Command {
       case ReplOp::REPL_OP_DEL_RANGE: {
         break;
       }
+      case ReplOp::REPL_OP_MERGE: {
+        Expected<RecordKey> opkey = RecordKey::decode(entry.getOpKey());
+        if (!opkey.ok()) {
+          return opkey.status();
+        }
+
+        // NOTE(tendis): the operand of INCRBY/APPEND/HINCRBY carries
+        // neither the ttl nor the version of the key, and it is written
+        // on the meta of a string or on a field of a hash. Read the
+        // meta from the txn to report the key like a REPL_OP_SET does.
+        // If the key is gone, a later REPL_OP_DEL reports it.
+        auto key = opkey.value();
+        if (key.getRecordType() != RecordType::RT_DATA_META &&
+            key.getRecordType() != RecordType::RT_HASH_ELE) {
+          break;
+        }
+        RecordKey metaRk(key.getChunkId(),
+                         key.getDbId(),
+                         RecordType::RT_DATA_META,
+                         key.getPrimaryKey(),
+                         "");
+        auto eValue = txn->getKV(metaRk.encode());
+        if (eValue.status().code() == ErrorCodes::ERR_NOTFOUND) {
+          break;
+        } else if (!eValue.ok()) {
+          return eValue.status();
+        }
+        Expected<RecordValue> opvalue = RecordValue::decode(eValue.value());
+        if (!opvalue.ok()) {
+          return opvalue.status();
+        }
+        const auto& value = opvalue.value();
+        uint64_t version = value.getVersionEP();
+        if (version > startRevision) {
+          IncrMeta im(key.getPrimaryKey(),
+                      ReplOp::REPL_OP_SET,
+                      decodeType(value.getRecordType()),
+                      entry.getTimestamp(),
+                      value.getTtl(),
+                      version);
+          return im;
+        }
+        break;
+      }
       default:
         INVARIANT_D(0);
         return {ErrorCodes::ERR_DECODE, "not a valid binlog"};
@@ -71,25 +71,32 @@ Expected<bool> expireAfterNow(Session* sess,
     auto vt = rv.getRecordType();
     Status s;
 
-    if (vt != RecordType::RT_KV) {
+    if (rcd_util::needTTLIndex(rv)) {
       if (!Command::noExpire()) {
         // delete old index entry
         auto oldTTL = rv.getTtl();
+        TTLIndex n_ictx(key, vt, pCtx->getDbId(), expireAt);
+        bool sameIndex = false;
         if (oldTTL != 0) {
           TTLIndex o_ictx(key, vt, pCtx->getDbId(), oldTTL);
-
-          s = txn->delKV(o_ictx.encode());
-          if (!s.ok()) {
-            return s;
+          // NOTE(tendis): a ttl refreshed in the same bucket keeps the
+          // index record
+          sameIndex = o_ictx.encode() == n_ictx.encode();
+          if (!sameIndex) {
+            s = txn->delKV(o_ictx.encode());
+            if (!s.ok()) {
+              return s;
+            }
           }
         }
 
         // add new index entry
-        TTLIndex n_ictx(key, vt, pCtx->getDbId(), expireAt);
-        s = txn->setKV(n_ictx.encode(),
-                       RecordValue(RecordType::RT_TTL_INDEX).encode());
-        if (!s.ok()) {
-          return s;
+        if (!sameIndex) {
+          s = txn->setKV(n_ictx.encode(),
+                         RecordValue(RecordType::RT_TTL_INDEX).encode());
+          if (!s.ok()) {
+            return s;
+          }
         }
       }
     }
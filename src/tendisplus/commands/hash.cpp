@@ -15,6 +15,7 @@
 #include "tendisplus/utils/string.h"
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/time.h"
 #include "tendisplus/commands/command.h"
 
 namespace tendisplus {
@@ -158,6 +159,79 @@ Expected<std::string> hincrGeneric(Session* sess,
   }
 }
 
+// In the merge write mode (kv-merge-write), an existing field of a hash
+// is increased by a merge operand, the meta is not written. The key is
+// locked in LOCK_X as the reply is the new value, see
+// GetSetGeneral::runMerge(). return ERR_NOTFOUND if the field can't be
+// merged, the caller goes on with hincrGeneric().
+Expected<std::string> hincrMerge(Session* sess,
+                                 const std::string& key,
+                                 const std::string& subkey,
+                                 int64_t inc) {
+  SessionCtx* pCtx = sess->getCtx();
+  // NOTE(tendis): the transaction of EXEC may read the field again, it
+  // fails after a merge.
+  if (pCtx->isInMulti()) {
+    return {ErrorCodes::ERR_NOTFOUND, ""};
+  }
+  auto server = sess->getServerEntry();
+  auto expdb = server->getSegmentMgr()->getDbWithKeyLock(
+    sess, key, mgl::LockMode::LOCK_X);
+  if (!expdb.ok()) {
+    return expdb.status();
+  }
+  PStore kvstore = expdb.value().store;
+  RecordKey metaRk(expdb.value().chunkId,
+                   pCtx->getDbId(),
+                   RecordType::RT_HASH_META,
+                   key,
+                   "");
+  RecordKey subRk(expdb.value().chunkId,
+                  pCtx->getDbId(),
+                  RecordType::RT_HASH_ELE,
+                  key,
+                  subkey);
+  auto ptxn = kvstore->createTransaction(sess);
+  if (!ptxn.ok()) {
+    return ptxn.status();
+  }
+  std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+  auto eMeta = kvstore->getKV(metaRk, txn.get());
+  if (!eMeta.ok()) {
+    return eMeta.status();
+  }
+  // the expired keys are left to hincrGeneric(), and the meta is written
+  // there if the versionEP changes.
+  uint64_t ttl = eMeta.value().getTtl();
+  if (eMeta.value().getRecordType() != RecordType::RT_HASH_META ||
+      (!Command::noExpire() && ttl != 0 && ttl <= msSinceEpoch()) ||
+      eMeta.value().getVersionEP() != pCtx->getVersionEP()) {
+    return {ErrorCodes::ERR_NOTFOUND, ""};
+  }
+  auto eSub = kvstore->getKV(subRk, txn.get());
+  if (!eSub.ok()) {
+    return eSub.status();
+  }
+  Expected<int64_t> val = ::tendisplus::stoll(eSub.value().getValue());
+  if (!val.ok()) {
+    return {ErrorCodes::ERR_DECODE, "hash value is not an integer "};
+  }
+  int64_t nowVal = val.value();
+  if ((inc < 0 && nowVal < 0 && inc < (LLONG_MIN - nowVal)) ||
+      (inc > 0 && nowVal > 0 && inc > (LLONG_MAX - nowVal))) {
+    return {ErrorCodes::ERR_OVERFLOW, "increment or decrement would overflow"};
+  }
+  auto s = kvstore->mergeKV(subRk, rcd_util::makeIncrOperand(inc), txn.get());
+  if (!s.ok()) {
+    return s;
+  }
+  auto exptCommit = txn->commit();
+  if (!exptCommit.ok()) {
+    return exptCommit.status();
+  }
+  return Command::fmtLongLong(nowVal + inc);
+}
+
 class HLenCommand : public Command {
  public:
   HLenCommand() : Command("hlen", "rF") {}
@@ -655,6 +729,13 @@ class HIncrByCommand : public Command {
       return inc.status();
     }
 
+    if (Command::mergeWrite()) {
+      auto merged = hincrMerge(sess, key, subkey, inc.value());
+      if (merged.status().code() != ErrorCodes::ERR_NOTFOUND) {
+        return merged;
+      }
+    }
+
     auto server = sess->getServerEntry();
     auto expdb = server->getSegmentMgr()->getDbWithKeyLock(
       sess, key, mgl::LockMode::LOCK_X);
@@ -1144,6 +1225,8 @@ class HMSetGeneric : public Command {
       return ptxn.status();
     }
     std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+    // the key is locked X by the callers
+    txn->setBulkWrite(true);
 
     HashMetaValue hashMeta;
     uint64_t ttl = 0;
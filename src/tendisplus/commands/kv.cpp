@@ -16,7 +16,9 @@
 #include "tendisplus/utils/string.h"
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/bitops.h"
 #include "tendisplus/commands/command.h"
+#include "tendisplus/storage/pieced_kv.h"
 #include "tendisplus/utils/scopeguard.h"
 
 namespace tendisplus {
@@ -53,6 +55,8 @@ Expected<std::string> setGeneric(Session* sess,
   bool diffType = false;
   bool needExpire = false;
   bool notExist = false;
+  bool oldPieced = false;
+  bool oldChecked = false;
   if ((flags & REDIS_SET_NX) || (flags & REDIS_SET_XX) ||
       (flags & REDIS_SET_NXEX)) {
     Expected<RecordValue> eValue = store->getKV(key, txn);
@@ -63,12 +67,14 @@ Expected<std::string> setGeneric(Session* sess,
     uint64_t currentTs = 0;
     uint64_t targetTtl = 0;
     checkType = false;
+    oldChecked = true;
     if (eValue.ok()) {
       currentTs = msSinceEpoch();
       targetTtl = eValue.value().getTtl();
       if (eValue.value().getRecordType() != RecordType::RT_KV) {
         diffType = true;
       }
+      oldPieced = rcd_util::isPiecedKV(eValue.value());
     } else if (eValue.status().code() == ErrorCodes::ERR_NOTFOUND) {
       notExist = true;
     } else {
@@ -92,15 +98,20 @@ Expected<std::string> setGeneric(Session* sess,
   // override other meta type. It would lead to some garbage in rocksdb.
   // In fact, because of the redis layer, the override problem would
   // never happen. So keep the set() directly.
-  if (checkType) {
-    // if you want to open this options, checkkeytypeforset on
-
-    // only check the recordtype, not care about the ttl
+  // NOTE(tendis): a pieced string can't be overwritten by set() directly,
+  // its pieces, bitmap summaries and TTL index would be left in rocksdb.
+  // It may be written before kv-piece-threshold is set back to 0, so the
+  // old value is always read here, if not read above.
+  if (!oldChecked) {
+    // only check the recordtype if checkkeytypeforset on, not care about
+    // the ttl
     Expected<RecordValue> eValue = store->getKV(key, txn);
     if (eValue.ok()) {
-      if (eValue.value().getRecordType() != RecordType::RT_KV) {
+      if (checkType &&
+          eValue.value().getRecordType() != RecordType::RT_KV) {
         diffType = true;
       }
+      oldPieced = rcd_util::isPiecedKV(eValue.value());
     } else if (eValue.status().code() == ErrorCodes::ERR_NOTFOUND) {
       notExist = true;
     } else {
@@ -108,8 +119,8 @@ Expected<std::string> setGeneric(Session* sess,
     }
   }
 
-  if (!notExist &&
-      (needExpire || diffType || (!Command::noExpire() && val.getTtl() > 0))) {
+  if (!notExist && (needExpire || diffType || oldPieced ||
+                    (!Command::noExpire() && val.getTtl() > 0))) {
     auto s =
       Command::delKey(sess, key.getPrimaryKey(), RecordType::RT_DATA_META);
     if (!s.ok() && s.code() != ErrorCodes::ERR_NOTFOUND) {
@@ -118,7 +129,18 @@ Expected<std::string> setGeneric(Session* sess,
   }
 
   // here we have no need to check expire since we will overwrite it
-  Status status = store->setKV(key, val, txn);
+  Status status;
+  if (PiecedKV::needPieces(val.getValue().size())) {
+    status = PiecedKV::set(store, key, val, txn);
+    if (status.ok() && !Command::noExpire() && val.getTtl() > 0) {
+      TTLIndex ictx(
+        key.getPrimaryKey(), RecordType::RT_KV, key.getDbId(), val.getTtl());
+      status = txn->setKV(ictx.encode(),
+                          RecordValue(RecordType::RT_TTL_INDEX).encode());
+    }
+  } else {
+    status = store->setKV(key, val, txn);
+  }
   TEST_SYNC_POINT("setGeneric::SetKV::1");
   if (!status.ok()) {
     return status;
@@ -549,13 +571,15 @@ class StrlenCommand : public Command {
     INVARIANT(pCtx != nullptr);
     const std::string& key = sess->getArgs()[1];
     Expected<RecordValue> rv =
-      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV);
+      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV, true, false);
     if (rv.status().code() == ErrorCodes::ERR_EXPIRED) {
       return Command::fmtZero();
     } else if (rv.status().code() == ErrorCodes::ERR_NOTFOUND) {
       return Command::fmtZero();
     } else if (!rv.status().ok()) {
       return rv.status();
+    } else if (rcd_util::isPiecedKV(rv.value())) {
+      return Command::fmtLongLong(rv.value().getTotalSize());
     } else {
       return Command::fmtLongLong(rv.value().getValue().size());
     }
@@ -596,8 +620,16 @@ class BitPosCommand : public Command {
     } else {
       return {ErrorCodes::ERR_PARSEOPT, "The bit argument must be 1 or 0."};
     }
+    auto server = sess->getServerEntry();
+    INVARIANT(server != nullptr);
+    // hold the lock, so that the meta and the pages are consistent
+    auto expdb =
+      server->getSegmentMgr()->getDbWithKeyLock(sess, key, Command::RdLock());
+    if (!expdb.ok()) {
+      return expdb.status();
+    }
     Expected<RecordValue> rv =
-      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV);
+      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV, true, false);
     if (rv.status().code() == ErrorCodes::ERR_EXPIRED ||
         rv.status().code() == ErrorCodes::ERR_NOTFOUND) {
       /* If the key does not exist, from our point of view it is an
@@ -612,9 +644,11 @@ class BitPosCommand : public Command {
     } else if (!rv.status().ok()) {
       return rv.status();
     }
+    bool pieced = rcd_util::isPiecedKV(rv.value());
     int64_t start = 0;
     const std::string& target = rv.value().getValue();
-    int64_t end = target.size() - 1;
+    ssize_t len = pieced ? rv.value().getTotalSize() : target.size();
+    int64_t end = len - 1;
     if (args.size() == 4 || args.size() == 5) {
       Expected<int64_t> estart = ::tendisplus::stoll(args[3]);
       if (!estart.ok()) {
@@ -630,7 +664,6 @@ class BitPosCommand : public Command {
         endGiven = true;
       }
 
-      ssize_t len = rv.value().getValue().size();
       if (start < 0) {
         start = len + start;
       }
@@ -654,8 +687,28 @@ class BitPosCommand : public Command {
     if (start > end) {
       return Command::fmtLongLong(-1);
     }
-    int64_t result =
-      redis_port::bitPos(target.c_str() + start, end - start + 1, bit);
+    int64_t result = 0;
+    if (pieced) {
+      // the pages without the bit are skipped by the page summaries
+      RecordKey rk(expdb.value().chunkId,
+                   pCtx->getDbId(),
+                   RecordType::RT_KV,
+                   key,
+                   "");
+      auto ptxn = expdb.value().store->createTransaction(sess);
+      if (!ptxn.ok()) {
+        return ptxn.status();
+      }
+      PiecedKV pkv(rk, rv.value(), expdb.value().store);
+      auto epos = pkv.bitPos(start, end, bit, ptxn.value().get());
+      if (!epos.ok()) {
+        return epos.status();
+      }
+      result = epos.value();
+    } else {
+      result =
+        redis_port::bitPos(target.c_str() + start, end - start + 1, bit);
+    }
     if (endGiven && bit == 0 && result == (end - start + 1) * 8) {
       return Command::fmtLongLong(-1);
     }
@@ -690,8 +743,16 @@ class BitCountCommand : public Command {
     SessionCtx* pCtx = sess->getCtx();
     INVARIANT(pCtx != nullptr);
     const std::string& key = sess->getArgs()[1];
+    auto server = sess->getServerEntry();
+    INVARIANT(server != nullptr);
+    // hold the lock, so that the meta and the pages are consistent
+    auto expdb =
+      server->getSegmentMgr()->getDbWithKeyLock(sess, key, Command::RdLock());
+    if (!expdb.ok()) {
+      return expdb.status();
+    }
     Expected<RecordValue> rv =
-      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV);
+      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV, true, false);
     if (rv.status().code() == ErrorCodes::ERR_EXPIRED) {
       return Command::fmtZero();
     } else if (rv.status().code() == ErrorCodes::ERR_NOTFOUND) {
@@ -699,9 +760,11 @@ class BitCountCommand : public Command {
     } else if (!rv.status().ok()) {
       return rv.status();
     }
+    bool pieced = rcd_util::isPiecedKV(rv.value());
     int64_t start = 0;
     const std::string& target = rv.value().getValue();
-    int64_t end = target.size() - 1;
+    ssize_t len = pieced ? rv.value().getTotalSize() : target.size();
+    int64_t end = len - 1;
     if (sess->getArgs().size() == 4) {
       Expected<int64_t> estart = ::tendisplus::stoll(sess->getArgs()[2]);
       Expected<int64_t> eend = ::tendisplus::stoll(sess->getArgs()[3]);
@@ -713,7 +776,6 @@ class BitCountCommand : public Command {
       if (start < 0 && end < 0 && start > end) {
         return Command::fmtZero();
       }
-      ssize_t len = rv.value().getValue().size();
       if (start < 0) {
         start = len + start;
       }
@@ -737,8 +799,26 @@ class BitCountCommand : public Command {
     if (start > end) {
       return Command::fmtZero();
     }
+    if (pieced) {
+      // the whole pages are counted by the page summaries
+      RecordKey rk(expdb.value().chunkId,
+                   sess->getCtx()->getDbId(),
+                   RecordType::RT_KV,
+                   key,
+                   "");
+      auto ptxn = expdb.value().store->createTransaction(sess);
+      if (!ptxn.ok()) {
+        return ptxn.status();
+      }
+      PiecedKV pkv(rk, rv.value(), expdb.value().store);
+      auto ecnt = pkv.bitCount(start, end, ptxn.value().get());
+      if (!ecnt.ok()) {
+        return ecnt.status();
+      }
+      return Command::fmtLongLong(ecnt.value());
+    }
     return Command::fmtLongLong(
-      redis_port::popCount(target.c_str() + start, end - start + 1));
+      bitops::popCount(target.c_str() + start, end - start + 1));
   }
 } bitcntCmd;
 
@@ -762,6 +842,63 @@ class GetGenericCmd : public Command {
       return rv.value().getValue();
     }
   }
+
+ protected:
+  // return the [start, end] of the value, start and end are normalized
+  // as GETRANGE does. A big string stored in pieces only reads the pieces
+  // covering the range, see PiecedKV.
+  Expected<std::string> getRange(Session* sess, int64_t start, int64_t end) {
+    SessionCtx* pCtx = sess->getCtx();
+    INVARIANT(pCtx != nullptr);
+    const std::string& key = sess->getArgs()[1];
+    auto server = sess->getServerEntry();
+    INVARIANT(server != nullptr);
+    // hold the lock, so that the meta and the pieces are consistent
+    auto expdb =
+      server->getSegmentMgr()->getDbWithKeyLock(sess, key, Command::RdLock());
+    if (!expdb.ok()) {
+      return expdb.status();
+    }
+    Expected<RecordValue> rv =
+      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV, true, false);
+    if (!rv.ok()) {
+      return rv.status();
+    }
+    bool pieced = rcd_util::isPiecedKV(rv.value());
+    int64_t size = pieced ? rv.value().getTotalSize()
+                          : rv.value().getValue().size();
+    if (start < 0) {
+      start = size + start;
+    }
+    if (end < 0) {
+      end = size + end;
+    }
+    if (start < 0) {
+      start = 0;
+    }
+    if (end < 0) {
+      end = 0;
+    }
+    if (end >= size) {
+      end = size - 1;
+    }
+    if (start > end || size == 0) {
+      return std::string();
+    }
+    if (!pieced) {
+      return rv.value().getValue().substr(start, end - start + 1);
+    }
+
+    PStore kvstore = expdb.value().store;
+    auto ptxn = kvstore->createTransaction(sess);
+    if (!ptxn.ok()) {
+      return ptxn.status();
+    }
+    RecordKey rk(
+      expdb.value().chunkId, pCtx->getDbId(), RecordType::RT_KV, key, "");
+    PiecedKV pkv(rk, rv.value(), kvstore);
+    return pkv.read(start, end - start + 1, ptxn.value().get());
+  }
 };
 
 class GetVsnCommand : public Command {
@@ -875,33 +1012,14 @@ class GetRangeGenericCommand : public GetGenericCmd {
     }
     int64_t end = eend.value();
 
-    auto v = GetGenericCmd::run(sess);
+    auto v = getRange(sess, start, end);
     if (v.status().code() == ErrorCodes::ERR_EXPIRED ||
         v.status().code() == ErrorCodes::ERR_NOTFOUND) {
       return Command::fmtBulk("");
     } else if (!v.ok()) {
       return v.status();
     }
-    std::string s = std::move(v.value());
-    if (start < 0) {
-      start = s.size() + start;
-    }
-    if (end < 0) {
-      end = s.size() + end;
-    }
-    if (start < 0) {
-      start = 0;
-    }
-    if (end < 0) {
-      end = 0;
-    }
-    if (end >= static_cast<ssize_t>(s.size())) {
-      end = s.size() - 1;
-    }
-    if (start > end || s.size() == 0) {
-      return Command::fmtBulk("");
-    }
-    return Command::fmtBulk(s.substr(start, end - start + 1));
+    return Command::fmtBulk(v.value());
   }
 };
 
@@ -927,11 +1045,113 @@ class GetSetGeneral : public Command {
   virtual Expected<RecordValue> newValueFromOld(
     Session* sess, const Expected<RecordValue>& oldValue) const = 0;
 
-  Expected<RecordValue> runGeneral(Session* sess) {
+  // APPEND/SETRANGE/SETBIT update a big string stored in pieces in place,
+  // only the affected pieces are written, see PiecedKV.
+  // return the reply of the command
+  virtual Expected<std::string> updatePieces(Session* sess,
+                                             PiecedKV* pkv,
+                                             Transaction* txn) const {
+    INVARIANT_D(0);
+    return {ErrorCodes::ERR_INTERNAL, "not support"};
+  }
+
+  // whether the command can be run by runMerge()
+  virtual bool canMerge() const {
+    return false;
+  }
+
+  // the merge operand turning oldValue into newValue, return ERR_NOTFOUND
+  // if it can't be done by a merge
+  virtual Expected<std::string> mergeOperand(
+    Session* sess,
+    const RecordValue& oldValue,
+    const RecordValue& newValue) const {
+    return {ErrorCodes::ERR_NOTFOUND, ""};
+  }
+
+  // In the merge write mode (kv-merge-write), an existing plain string is
+  // updated by a merge operand instead of the whole new value, so that an
+  // APPEND doesn't rewrite the value and the key is not tracked by the
+  // txn. The reply is the new value, so the key is still locked in
+  // LOCK_X: the value read counts all the merges before, and no other
+  // merge of the key is in flight until the txn commits.
+  // return ERR_NOTFOUND if the key can't be merged, the caller goes on
+  // with the common path.
+  Expected<RecordValue> runMerge(Session* sess) {
+    const std::string& key = sess->getArgs()[firstkey()];
+    SessionCtx* pCtx = sess->getCtx();
+    // NOTE(tendis): the transaction of EXEC may read the key again, it
+    // fails after a merge.
+    if (pCtx->isInMulti()) {
+      return {ErrorCodes::ERR_NOTFOUND, ""};
+    }
+
+    auto server = sess->getServerEntry();
+    auto expdb = server->getSegmentMgr()->getDbWithKeyLock(
+      sess, key, mgl::LockMode::LOCK_X);
+    if (!expdb.ok()) {
+      return expdb.status();
+    }
+    PStore kvstore = expdb.value().store;
+    RecordKey rk(
+      expdb.value().chunkId, pCtx->getDbId(), RecordType::RT_KV, key, "");
+    auto ptxn = kvstore->createTransaction(sess);
+    if (!ptxn.ok()) {
+      return ptxn.status();
+    }
+    std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+    Expected<RecordValue> rv = kvstore->getKV(rk, txn.get());
+    if (!rv.ok()) {
+      return rv.status();
+    }
+    const RecordValue& oldValue = rv.value();
+    uint64_t ttl = oldValue.getTtl();
+    // the expired and the pieced keys are left to runGeneral()
+    if (oldValue.getRecordType() != RecordType::RT_KV ||
+        rcd_util::isPiecedKV(oldValue) ||
+        (!Command::noExpire() && ttl != 0 && ttl <= msSinceEpoch()) ||
+        oldValue.getVersionEP() != pCtx->getVersionEP()) {
+      return {ErrorCodes::ERR_NOTFOUND, ""};
+    }
+
+    auto newValue = newValueFromOld(sess, rv);
+    if (!newValue.ok()) {
+      return newValue.status();
+    }
+    if (newValue.value().getTtl() != ttl) {
+      return {ErrorCodes::ERR_NOTFOUND, ""};
+    }
+    auto operand = mergeOperand(sess, oldValue, newValue.value());
+    if (!operand.ok()) {
+      return operand.status();
+    }
+    auto s = kvstore->mergeKV(rk, operand.value(), txn.get());
+    if (!s.ok()) {
+      return s;
+    }
+    auto eCommit = txn->commit();
+    if (!eCommit.ok()) {
+      return eCommit.status();
+    }
+    return newValue;
+  }
+
+  // if piecedReply is not null and the key is a big string stored in
+  // pieces, it is updated by updatePieces(), and *piecedReply is set to
+  // the reply.
+  Expected<RecordValue> runGeneral(Session* sess,
+                                   std::string* piecedReply = nullptr) {
     const std::string& key = sess->getArgs()[firstkey()];
     SessionCtx* pCtx = sess->getCtx();
     INVARIANT(pCtx != nullptr);
 
+    if (canMerge() && Command::mergeWrite()) {
+      auto merged = runMerge(sess);
+      if (merged.status().code() != ErrorCodes::ERR_NOTFOUND) {
+        return merged;
+      }
+    }
+
     auto server = sess->getServerEntry();
     INVARIANT(server != nullptr);
     auto expdb = server->getSegmentMgr()->getDbWithKeyLock(
@@ -941,8 +1161,8 @@ class GetSetGeneral : public Command {
     }
 
     // expire if possible
-    Expected<RecordValue> rv =
-      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV);
+    Expected<RecordValue> rv = Command::expireKeyIfNeeded(
+      sess, key, RecordType::RT_KV, true, piecedReply == nullptr);
     if (rv.status().code() != ErrorCodes::ERR_OK &&
         rv.status().code() != ErrorCodes::ERR_EXPIRED &&
         rv.status().code() != ErrorCodes::ERR_NOTFOUND) {
@@ -959,6 +1179,28 @@ class GetSetGeneral : public Command {
         return ptxn.status();
       }
       std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+      if (rv.ok() && rcd_util::isPiecedKV(rv.value())) {
+        INVARIANT_D(piecedReply != nullptr);
+        PiecedKV pkv(rk, rv.value(), kvstore);
+        auto reply = updatePieces(sess, &pkv, txn.get());
+        if (!reply.ok()) {
+          return reply.status();
+        }
+        auto s = pkv.save(txn.get(), pCtx->getVersionEP());
+        if (!s.ok()) {
+          return s;
+        }
+        auto eCommit = txn->commit();
+        if (eCommit.ok()) {
+          *piecedReply = std::move(reply.value());
+          return pkv.getMeta();
+        }
+        if (eCommit.status().code() != ErrorCodes::ERR_COMMIT_RETRY ||
+            i == RETRY_CNT - 1) {
+          return eCommit.status();
+        }
+        continue;
+      }
       const Expected<RecordValue>& newValue = newValueFromOld(sess, rv);
       if (newValue.status().code() == ErrorCodes::ERR_NOTFOUND) {
         return RecordValue(
@@ -1103,11 +1345,40 @@ class AppendCommand : public GetSetGeneral {
       std::move(cat), type, sess->getCtx()->getVersionEP(), ttl, oldValue));
   }
 
+  Expected<std::string> updatePieces(Session* sess,
+                                     PiecedKV* pkv,
+                                     Transaction* txn) const final {
+    const std::string& val = sess->getArgs()[2];
+    auto s = pkv->write(pkv->getSize(), val, txn);
+    if (!s.ok()) {
+      return s;
+    }
+    return Command::fmtLongLong(pkv->getSize());
+  }
+
+  bool canMerge() const final {
+    return true;
+  }
+
+  Expected<std::string> mergeOperand(
+    Session* sess,
+    const RecordValue& oldValue,
+    const RecordValue& newValue) const final {
+    if (PiecedKV::needPieces(newValue.getValue().size())) {
+      return {ErrorCodes::ERR_NOTFOUND, ""};
+    }
+    return rcd_util::makeAppendOperand(sess->getArgs()[2]);
+  }
+
   Expected<std::string> run(Session* sess) final {
-    const Expected<RecordValue>& rv = runGeneral(sess);
+    std::string piecedReply;
+    const Expected<RecordValue>& rv = runGeneral(sess, &piecedReply);
     if (!rv.ok()) {
       return rv.status();
     }
+    if (!piecedReply.empty()) {
+      return piecedReply;
+    }
     return Command::fmtLongLong(rv.value().getValue().size());
   }
 } appendCmd;
@@ -1173,11 +1444,38 @@ class SetRangeCommand : public GetSetGeneral {
       std::move(cat), type, sess->getCtx()->getVersionEP(), ttl, oldValue);
   }
 
+  Expected<std::string> updatePieces(Session* sess,
+                                     PiecedKV* pkv,
+                                     Transaction* txn) const final {
+    const std::string& val = sess->getArgs()[3];
+    Expected<int64_t> eoffset = ::tendisplus::stoll(sess->getArgs()[2]);
+    if (!eoffset.ok()) {
+      return eoffset.status();
+    }
+    if (eoffset.value() < 0) {
+      return {ErrorCodes::ERR_PARSEOPT, "offset is out of range"};
+    }
+    uint64_t offset = eoffset.value();
+    if (offset + val.size() > 512 * 1024 * 1024) {
+      return {ErrorCodes::ERR_PARSEOPT,
+              "string exceeds maximum allowed size (512MB)"};
+    }
+    auto s = pkv->write(offset, val, txn);
+    if (!s.ok()) {
+      return s;
+    }
+    return Command::fmtLongLong(pkv->getSize());
+  }
+
   Expected<std::string> run(Session* sess) final {
-    const Expected<RecordValue>& rv = runGeneral(sess);
+    std::string piecedReply;
+    const Expected<RecordValue>& rv = runGeneral(sess, &piecedReply);
     if (!rv.ok()) {
       return rv.status();
     }
+    if (!piecedReply.empty()) {
+      return piecedReply;
+    }
     return Command::fmtLongLong(rv.value().getValue().size());
   }
 } setrangeCmd;
@@ -1255,11 +1553,56 @@ class SetBitCommand : public GetSetGeneral {
       std::move(tomodify), type, sess->getCtx()->getVersionEP(), ttl, oldValue);
   }
 
+  Expected<std::string> updatePieces(Session* sess,
+                                     PiecedKV* pkv,
+                                     Transaction* txn) const final {
+    Expected<uint64_t> epos = ::tendisplus::stoul(sess->getArgs()[2]);
+    if (!epos.ok()) {
+      return epos.status();
+    }
+    uint64_t pos = epos.value();
+    if ((pos >> 3) >= (512 * 1024 * 1024)) {
+      return {ErrorCodes::ERR_PARSEOPT,
+              "bit offset is not an integer or out of range"};
+    }
+    int on = 0;
+    if (sess->getArgs()[3] == "1") {
+      on = 1;
+    } else if (sess->getArgs()[3] == "0") {
+      on = 0;
+    } else {
+      return {ErrorCodes::ERR_PARSEOPT,
+              "bit is not an integer or out of range"};
+    }
+
+    uint64_t byte = (pos >> 3);
+    auto eold = pkv->read(byte, 1, txn);
+    if (!eold.ok()) {
+      return eold.status();
+    }
+    uint8_t oldval = eold.value().empty()
+      ? 0
+      : static_cast<uint8_t>(eold.value()[0]);
+    uint8_t bit = 7 - (pos & 0x7);
+    uint8_t byteval = oldval;
+    byteval &= ~(1 << bit);
+    byteval |= ((on & 0x1) << bit);
+    auto s = pkv->write(byte, std::string(1, byteval), txn);
+    if (!s.ok()) {
+      return s;
+    }
+    return (oldval & (1 << bit)) ? Command::fmtOne() : Command::fmtZero();
+  }
+
   Expected<std::string> run(Session* sess) final {
-    const Expected<RecordValue>& rv = runGeneral(sess);
+    std::string piecedReply;
+    const Expected<RecordValue>& rv = runGeneral(sess, &piecedReply);
     if (!rv.ok()) {
       return rv.status();
     }
+    if (!piecedReply.empty()) {
+      return piecedReply;
+    }
 
     Expected<uint64_t> epos = ::tendisplus::stoul(sess->getArgs()[2]);
     if (!epos.ok()) {
@@ -1352,6 +1695,24 @@ class IncrDecrGeneral : public GetSetGeneral {
     return sum;
   }
 
+  bool canMerge() const final {
+    return true;
+  }
+
+  Expected<std::string> mergeOperand(
+    Session* sess,
+    const RecordValue& oldValue,
+    const RecordValue& newValue) const final {
+    auto oldSum = ::tendisplus::stoll(oldValue.getValue());
+    auto newSum = ::tendisplus::stoll(newValue.getValue());
+    if (!oldSum.ok() || !newSum.ok()) {
+      return {ErrorCodes::ERR_NOTFOUND, ""};
+    }
+    // no overflow, it is checked by sumIncr() on the value read with the
+    // key locked
+    return rcd_util::makeIncrOperand(newSum.value() - oldSum.value());
+  }
+
   virtual Expected<std::string> run(Session* sess) {
     const Expected<RecordValue>& rv = runGeneral(sess);
     if (!rv.ok()) {
@@ -1807,28 +2168,32 @@ class BitopCommand : public Command {
       Command::delKeyChkExpire(sess, targetKey, RecordType::RT_KV);
       return Command::fmtZero();
     }
-    std::string result(maxLen, 0);
-    for (size_t i = 0; i < maxLen; ++i) {
-      unsigned char output = (vals[0].size() <= i) ? 0 : vals[0][i];
-      if (op == Op::BITOP_NOT)
-        output = ~output;
-      for (size_t j = 1; j < numKeys; ++j) {
-        unsigned char byte = (vals[j].size() <= i) ? 0 : vals[j][i];
-        switch (op) {
-          case Op::BITOP_AND:
-            output &= byte;
-            break;
-          case Op::BITOP_OR:
-            output |= byte;
-            break;
-          case Op::BITOP_XOR:
-            output ^= byte;
-            break;
-          default:
-            INVARIANT_D(0);
-        }
+    // the shorter strings are treated as zero padded, the kernels only
+    // run on the common part.
+    std::string result(std::move(vals[0]));
+    result.resize(maxLen, 0);
+    unsigned char* output = reinterpret_cast<unsigned char*>(&result[0]);
+    if (op == Op::BITOP_NOT) {
+      bitops::bitNot(output, maxLen);
+    }
+    for (size_t j = 1; j < numKeys; ++j) {
+      const unsigned char* input =
+        reinterpret_cast<const unsigned char*>(vals[j].data());
+      size_t size = vals[j].size();
+      switch (op) {
+        case Op::BITOP_AND:
+          bitops::bitAnd(output, input, size);
+          memset(output + size, 0, maxLen - size);
+          break;
+        case Op::BITOP_OR:
+          bitops::bitOr(output, input, size);
+          break;
+        case Op::BITOP_XOR:
+          bitops::bitXor(output, input, size);
+          break;
+        default:
+          INVARIANT_D(0);
       }
-      result[i] = output;
     }
 
 
@@ -1936,6 +2301,8 @@ class MSetGenericCommand : public Command {
           failed = true;
           break;
         }
+        // all the keys are locked X
+        etxn.value()->setBulkWrite(true);
 
         // NOTE(vinchen): commit one by one is not corect
         auto result = setGeneric(sess,
@@ -2143,24 +2510,22 @@ class RenameGenericCommand : public Command {
     if (!s.ok()) {
       return s;
     }
-    if (rv.value().getRecordType() != RecordType::RT_KV &&
-        rv.value().getTtl() > 0) {
+    if (rcd_util::needTTLIndex(rv.value()) && rv.value().getTtl() > 0) {
       if (!Command::noExpire()) {
         TTLIndex ictx(dst,
                       rv.value().getRecordType(),
                       sess->getCtx()->getDbId(),
                       rv.value().getTtl());
-        if (ictx.getType() != RecordType::RT_KV) {
-          s = dptxn.value()->setKV(
-            ictx.encode(), RecordValue(RecordType::RT_TTL_INDEX).encode());
-          if (!s.ok()) {
-            return s;
-          }
+        s = dptxn.value()->setKV(
+          ictx.encode(), RecordValue(RecordType::RT_TTL_INDEX).encode());
+        if (!s.ok()) {
+          return s;
         }
       }
     }
 
-    if (rv.value().getRecordType() == RecordType::RT_KV) {
+    if (rv.value().getRecordType() == RecordType::RT_KV &&
+        !rcd_util::isPiecedKV(rv.value())) {
       pCtx->commitAll("rename");
       rollback = false;
       return _flagnx ? Command::fmtOne() : Command::fmtOK();
@@ -2229,7 +2594,14 @@ class RenameGenericCommand : public Command {
   std::vector<std::string> getEleType(const RecordKey& rk,
                                       const RecordType& type) {
     std::vector<std::string> ret;
-    if (type == RecordType::RT_HASH_META) {
+    if (type == RecordType::RT_KV) {
+      RecordKey fakeRk(rk.getChunkId(),
+                       rk.getDbId(),
+                       RecordType::RT_KV_PIECE,
+                       rk.getPrimaryKey(),
+                       "");
+      ret.push_back(fakeRk.prefixPk());
+    } else if (type == RecordType::RT_HASH_META) {
       RecordKey fakeRk(rk.getChunkId(),
                        rk.getDbId(),
                        RecordType::RT_HASH_ELE,
@@ -2308,7 +2680,12 @@ class GetBitCommand : public GetGenericCmd {
       return {ErrorCodes::ERR_PARSEOPT,
               "bit offset is not an integer or out of range"};
     }
-    auto v = GetGenericCmd::run(sess);
+    size_t byte, bit;
+    uint8_t bitval = 0;
+
+    byte = pos >> 3;
+    bit = 7 - (pos & 0x7);
+    auto v = getRange(sess, byte, byte);
     if (v.status().code() == ErrorCodes::ERR_EXPIRED ||
         v.status().code() == ErrorCodes::ERR_NOTFOUND) {
       return Command::fmtZero();
@@ -2316,17 +2693,10 @@ class GetBitCommand : public GetGenericCmd {
     if (!v.ok()) {
       return v.status();
     }
-
-    std::string bitValue = v.value();
-    size_t byte, bit;
-    uint8_t bitval = 0;
-
-    byte = pos >> 3;
-    bit = 7 - (pos & 0x7);
-    if (byte > bitValue.size()) {
+    if (v.value().empty()) {
       return Command::fmtZero();
     }
-    bitval = static_cast<uint8_t>(bitValue[byte]) & (1 << bit);
+    bitval = static_cast<uint8_t>(v.value()[0]) & (1 << bit);
     return bitval ? Command::fmtOne() : Command::fmtZero();
   }
 } getbitCommand;
@@ -2508,6 +2878,10 @@ class BitFieldCommand : public Command {
 
     bool readonly(1);
     size_t highestOffset(0);
+    // the bytes touched by all the ops, a pieced value only reads
+    // (and writes) the pages covering [lowestByte, highestByte]
+    size_t lowestByte(SIZE_MAX);
+    size_t highestByte(0);
     BFOverFlowType owtype(BFOverFlowType::BFOVERFLOW_WRAP);
     for (size_t i = 2; i < args.size(); i++) {
       int remaining = args.size() - i - 1;
@@ -2573,6 +2947,10 @@ class BitFieldCommand : public Command {
                 "bit offset is not an integer or out of range"};
       }
 
+      lowestByte = std::min(lowestByte, static_cast<size_t>(offset >> 3));
+      highestByte =
+        std::max(highestByte, static_cast<size_t>((offset + bits - 1) >> 3));
+
       ++i;
       if (opcode != FieldOpType::BITFIELDOP_GET) {
         readonly = 0;
@@ -2596,8 +2974,11 @@ class BitFieldCommand : public Command {
     auto pCtx = sess->getCtx();
     auto expdb = server->getSegmentMgr()->getDbWithKeyLock(
       sess, key, mgl::LockMode::LOCK_X);
+    if (!expdb.ok()) {
+      return expdb.status();
+    }
     Expected<RecordValue> eRv =
-      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV);
+      Command::expireKeyIfNeeded(sess, key, RecordType::RT_KV, true, false);
     if (eRv.status().code() == ErrorCodes::ERR_EXPIRED ||
         eRv.status().code() == ErrorCodes::ERR_NOTFOUND) {
       if (readonly)
@@ -2609,6 +2990,31 @@ class BitFieldCommand : public Command {
       value = rv.getValue();
     }
 
+    RecordKey rk(
+      expdb.value().chunkId, pCtx->getDbId(), RecordType::RT_KV, key, "");
+    PStore kvstore = expdb.value().store;
+    auto ptxn = kvstore->createTransaction(sess);
+    if (!ptxn.ok()) {
+      return ptxn.status();
+    }
+    std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+    std::unique_ptr<PiecedKV> pkv;
+    // the offsets of the ops are relative to baseBit in value
+    size_t baseBit = 0;
+    if (rcd_util::isPiecedKV(rv)) {
+      pkv = std::make_unique<PiecedKV>(rk, rv, kvstore);
+      auto ewindow = pkv->read(
+        lowestByte, highestByte - lowestByte + 1, txn.get());
+      if (!ewindow.ok()) {
+        return ewindow.status();
+      }
+      value = std::move(ewindow.value());
+      baseBit = lowestByte << 3;
+      if (!readonly) {
+        highestOffset -= baseBit;
+      }
+    }
+
     if (!readonly) {
       uint64_t maxbyte = highestOffset >> 3;
       if (value.size() < maxbyte + 1)
@@ -2622,6 +3028,7 @@ class BitFieldCommand : public Command {
     for (size_t i = 0; i < size; i++) {
       BitfieldOp op = ops.front();
       ops.pop();
+      op.offset -= baseBit;
       if (op.opcode == FieldOpType::BITFIELDOP_SET ||
           op.opcode == FieldOpType::BITFIELDOP_INCRBY) {
         if (op.sign) {
@@ -2700,24 +3107,36 @@ class BitFieldCommand : public Command {
         }
       }
     }  // end of ops' loop
-    if (changes) {
-      RecordKey rk(
-        expdb.value().chunkId, pCtx->getDbId(), RecordType::RT_KV, key, "");
-      RecordValue newrv(
-        value, RecordType::RT_KV, pCtx->getVersionEP(), rv.getTtl(), rv);
-      PStore kvstore = expdb.value().store;
-      auto ptxn = kvstore->createTransaction(sess);
-      if (!ptxn.ok()) {
-        return ptxn.status();
+    if (changes && pkv) {
+      // only write back the pages covering the window
+      auto s = pkv->write(lowestByte, value, txn.get());
+      if (!s.ok()) {
+        return s;
       }
-      std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-      Status s = kvstore->setKV(rk, newrv, txn.get());
+      s = pkv->save(txn.get(), pCtx->getVersionEP());
       if (!s.ok()) {
         return s;
       }
-      auto eCmt = txn->commit();
-      if (!eCmt.ok()) {
-        return eCmt.status();
+      auto eCommit = txn->commit();
+      if (!eCommit.ok()) {
+        return eCommit.status();
+      }
+    } else if (changes) {
+      RecordValue newrv(
+        value, RecordType::RT_KV, pCtx->getVersionEP(), rv.getTtl(), rv);
+      // a big string may be stored in pieces, use setGeneric()
+      auto result = setGeneric(sess,
+                               kvstore,
+                               txn.get(),
+                               REDIS_SET_NO_FLAGS,
+                               rk,
+                               newrv,
+                               false,
+                               true,
+                               "",
+                               "");
+      if (!result.ok()) {
+        return result.status();
       }
     }
 
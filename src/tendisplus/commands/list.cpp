@@ -363,6 +363,8 @@ class ListPushWrapper : public Command {
         return ptxn.status();
       }
       std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+      // the key is locked X
+      txn->setBulkWrite(true);
       Expected<std::string> s1 = genericPush(
         sess, kvstore, txn.get(), metaRk, rv, valargs, _pos, _needExist);
       if (!s1.ok()) {
@@ -17,6 +17,7 @@
 #include "tendisplus/utils/string.h"
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/hll_card_cache.h"
 #include "tendisplus/commands/command.h"
 #include "tendisplus/storage/varint.h"
 
@@ -427,6 +428,8 @@ class PfAddCommand : public Command {
       if (!c.ok()) {
         return c.status();
       }
+      HllCardCache::getInstance().invalidate(
+        HllCardCache::makeKey(pCtx->getDbId(), key));
     }
     return updated ? Command::fmtOne() : Command::fmtZero();
   }
@@ -523,7 +526,31 @@ class PfCountCommand : public Command {
       return Command::fmtZero();
     }
 
-    auto hpll = std::make_unique<HPLLObject>(rv.value().getValue());
+    const std::string& value = rv.value().getValue();
+    // the cardinality cached in the header is still used if it is valid,
+    // e.g. the value is restored from redis.
+    auto hdr = reinterpret_cast<const redis_port::hllhdr*>(value.c_str());
+    if (HLL_VALID_CACHE(hdr)) {
+      uint64_t card = 0;
+      for (int i = 7; i >= 0; i--) {
+        card = (card << 8) | hdr->card[i];
+      }
+      return Command::fmtLongLong(card);
+    }
+
+    auto& cache = HllCardCache::getInstance();
+    std::string cacheKey;
+    uint64_t fp = 0;
+    if (cache.enabled()) {
+      uint64_t card = 0;
+      cacheKey = HllCardCache::makeKey(sess->getCtx()->getDbId(), key);
+      fp = HllCardCache::fingerprint(value);
+      if (cache.get(cacheKey, fp, &card)) {
+        return Command::fmtLongLong(card);
+      }
+    }
+
+    auto hpll = std::make_unique<HPLLObject>(value);
 
     // NOTE(vinchen): pfcount should be a read only command,
     // so here it should not use hpll->getHllCountFast()
@@ -531,6 +558,9 @@ class PfCountCommand : public Command {
     if (count == (uint64_t)-1) {
       return {ErrorCodes::ERR_INVALID_HLL, ""};
     }
+    if (cache.enabled()) {
+      cache.put(cacheKey, fp, count);
+    }
 
     return Command::fmtLongLong(count);
   }
@@ -641,6 +671,17 @@ class PfMergeCommand : public Command {
       return c.status();
     }
 
+    // the merged registers are the same as the result, count them now
+    auto& cache = HllCardCache::getInstance();
+    auto cacheKey = HllCardCache::makeKey(pCtx->getDbId(), key);
+    auto count = cache.enabled() ? hpll->getHllCount() : (uint64_t)-1;
+    if (count != (uint64_t)-1) {
+      cache.put(
+        cacheKey, HllCardCache::fingerprint(value.getValue()), count);
+    } else {
+      cache.invalidate(cacheKey);
+    }
+
     return Command::fmtOK();
   }
 } pfmergeCmd;
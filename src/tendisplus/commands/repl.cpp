@@ -20,6 +20,7 @@
 #include "tendisplus/utils/base64.h"
 #include "tendisplus/storage/varint.h"
 #include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/storage/rocks/rocks_rdbimporter.h"
 
 namespace tendisplus {
 
@@ -43,17 +44,28 @@ class BackupCommand : public Command {
     return 0;
   }
 
+  // backup dir [ckpt|copy]
+  // backup dir inc basedir
+  // basedir: the backup of ckpt or inc, whose sst files are not copied
   Expected<std::string> run(Session* sess) final {
     const std::string& dir = sess->getArgs()[1];
     auto mode = KVStore::BackupMode::BACKUP_COPY;
+    std::string baseDir;
     if (sess->getArgs().size() >= 3) {
       const std::string& str_mode = toLower(sess->getArgs()[2]);
       if (str_mode == "ckpt") {
         mode = KVStore::BackupMode::BACKUP_CKPT;
       } else if (str_mode == "copy") {
         mode = KVStore::BackupMode::BACKUP_COPY;
+      } else if (str_mode == "inc" && sess->getArgs().size() >= 4) {
+        mode = KVStore::BackupMode::BACKUP_CKPT_INC;
+        baseDir = sess->getArgs()[3];
+        if (!filesystem::exists(baseDir)) {
+          return {ErrorCodes::ERR_MANUAL, "basedir not exist:" + baseDir};
+        }
       } else {
-        return {ErrorCodes::ERR_MANUAL, "mode error, should be ckpt or copy"};
+        return {ErrorCodes::ERR_MANUAL,
+                "mode error, should be ckpt, copy or inc basedir"};
       }
     }
     auto svr = sess->getServerEntry();
@@ -118,8 +130,10 @@ class BackupCommand : public Command {
         continue;
       }
       std::string dbdir = dir + "/" + std::to_string(i) + "/";
-      Expected<BackupInfo> bkInfo =
-        store->backup(dbdir, mode, svr->getCatalog()->getBinlogVersion());
+      std::string baseDbdir =
+        baseDir.empty() ? "" : baseDir + "/" + std::to_string(i) + "/";
+      Expected<BackupInfo> bkInfo = store->backup(
+        dbdir, mode, svr->getCatalog()->getBinlogVersion(), baseDbdir);
       if (!bkInfo.ok()) {
         svr->onBackupEndFailed(i, bkInfo.status().toString());
         return bkInfo.status();
@@ -307,13 +321,164 @@ class RestoreBackupCommand : public Command {
   }
 } restoreBackupCommand;
 
-// fullSync storeId dstStoreId ip port
+// rdbimport file [file ...] [binlog|fullsync] [slots start end]
+// it runs in background, see ServerEntry::runBgCommand(), the rdb files
+// are parsed without blocking a worker.
+class RdbImportCommand : public Command {
+ public:
+  RdbImportCommand() : Command("rdbimport", "aw") {}
+
+  bool isBgCmd() const {
+    return true;
+  }
+
+  ssize_t arity() const {
+    return -2;
+  }
+
+  int32_t firstkey() const {
+    return 0;
+  }
+
+  int32_t lastkey() const {
+    return 0;
+  }
+
+  int32_t keystep() const {
+    return 0;
+  }
+
+  Expected<std::string> run(Session* sess) final {
+    auto svr = sess->getServerEntry();
+    INVARIANT(svr != nullptr);
+    const auto& args = sess->getArgs();
+    auto cfg = svr->getParams();
+
+    RdbImportOptions opts;
+    opts.dbNum = cfg->dbNum;
+    opts.tmpDir = cfg->dumpPath + "/rdbimport";
+    opts.threads = std::max(cfg->rdbImportThreads, 1u);
+    opts.bufferBytes = static_cast<uint64_t>(cfg->rdbImportBufferMB) << 20;
+    if (svr->isClusterEnabled()) {
+      auto myself =
+        svr->getClusterMgr()->getClusterState()->getMyselfNode();
+      opts.slots = myself->getSlots();
+    }
+    for (size_t i = 1; i < args.size(); ++i) {
+      auto arg = toLower(args[i]);
+      if (arg == "binlog") {
+        opts.genBinlog = true;
+      } else if (arg == "fullsync") {
+        opts.genBinlog = false;
+      } else if (arg == "slots" && i + 2 < args.size()) {
+        auto start = ::tendisplus::stoul(args[i + 1]);
+        RET_IF_ERR_EXPECTED(start);
+        auto end = ::tendisplus::stoul(args[i + 2]);
+        RET_IF_ERR_EXPECTED(end);
+        if (start.value() > end.value() || end.value() >= CLUSTER_SLOTS) {
+          return {ErrorCodes::ERR_PARSEOPT, "invalid slots range"};
+        }
+        opts.slots.reset();
+        for (auto j = start.value(); j <= end.value(); ++j) {
+          opts.slots.set(j);
+        }
+        i += 2;
+      } else {
+        opts.files.push_back(args[i]);
+      }
+    }
+    if (opts.files.empty()) {
+      return {ErrorCodes::ERR_PARSEOPT, "no rdb file"};
+    }
+
+    std::vector<PStore> stores;
+    for (uint32_t i = 0; i < svr->getKVStoreCount(); ++i) {
+      if (svr->getReplManager()->isSlaveOfSomeone(i)) {
+        return {ErrorCodes::ERR_INTERNAL, "has master, slaveof no one first"};
+      }
+      auto expdb =
+        svr->getSegmentMgr()->getDb(sess, i, mgl::LockMode::LOCK_IS, true);
+      RET_IF_ERR_EXPECTED(expdb);
+      if (!expdb.value().store->isOpen()) {
+        return {ErrorCodes::ERR_INTERNAL, "store not open"};
+      }
+      stores.push_back(expdb.value().store);
+    }
+
+    // NOTE(tendis): the sst files are built without any lock, the stores
+    // should be kept empty (by the caller) until they are ingested.
+    RdbSstImporter importer(stores, opts);
+    auto s = importer.build();
+    if (!s.ok()) {
+      LOG(ERROR) << "rdbimport build failed:" << s.toString();
+      return s;
+    }
+
+    // NOTE(tendis): all the stores are locked until the end, so that the
+    // stores ingested can be flushed if a later one fails, no one has
+    // seen the keys imported. The stores are checked again with the lock
+    // held, a key written during the build would be overwritten.
+    std::vector<DbWithLock> dbs;
+    for (uint32_t i = 0; i < svr->getKVStoreCount(); ++i) {
+      auto expdb =
+        svr->getSegmentMgr()->getDb(sess, i, mgl::LockMode::LOCK_X, true);
+      RET_IF_ERR_EXPECTED(expdb);
+      if (!expdb.value().store->isEmpty(true)) {
+        return {ErrorCodes::ERR_INTERNAL,
+                "store " + std::to_string(i) + " is written during import"};
+      }
+      dbs.emplace_back(std::move(expdb.value()));
+    }
+    for (uint32_t i = 0; i < dbs.size(); ++i) {
+      s = importer.ingest(i);
+      if (!s.ok()) {
+        LOG(ERROR) << "rdbimport ingest store:" << i
+                   << " failed:" << s.toString();
+        rollback(sess, dbs, i);
+        return s;
+      }
+    }
+    if (!opts.genBinlog) {
+      for (uint32_t i = 0; i < dbs.size(); ++i) {
+        s = svr->getReplManager()->requireFullSync(i, dbs[i].store);
+        if (!s.ok()) {
+          return s;
+        }
+      }
+    }
+    LOG(INFO) << "rdbimport done," << importer.getStatInfo();
+    return Command::fmtOK();
+  }
+
+ private:
+  // flush the stores [0, end] ingested (or half ingested), they were
+  // empty before the import, as FLUSHALL does.
+  void rollback(Session* sess, const std::vector<DbWithLock>& dbs,
+                uint32_t end) {
+    auto svr = sess->getServerEntry();
+    for (uint32_t i = 0; i <= end; ++i) {
+      auto store = dbs[i].store;
+      auto nextBinlogid = store->getNextBinlogSeq();
+      auto eflush = store->flush(sess, nextBinlogid);
+      if (!eflush.ok()) {
+        LOG(ERROR) << "rdbimport rollback store:" << i
+                   << " failed:" << eflush.status().toString();
+        continue;
+      }
+      svr->getReplManager()->onFlush(i, eflush.value());
+    }
+  }
+} rdbImportCmd;
+
+// fullSync storeId ip port [resume]
+// resume: the slave asks for the files of the backup one by one, and may
+// fetch them by fullsyncfiles connections at the same time
 class FullSyncCommand : public Command {
  public:
   FullSyncCommand() : Command("fullsync", "a") {}
 
   ssize_t arity() const {
-    return 4;
+    return -4;
   }
 
   int32_t firstkey() const {
@@ -339,6 +504,40 @@ class FullSyncCommand : public Command {
   }
 } fullSyncCommand;
 
+// fullSyncFiles storeId binlogPos
+// a data connection of a resumable full sync, it fetches the files of the
+// backup made for the fullsync command
+class FullSyncFilesCommand : public Command {
+ public:
+  FullSyncFilesCommand() : Command("fullsyncfiles", "a") {}
+
+  ssize_t arity() const {
+    return 3;
+  }
+
+  int32_t firstkey() const {
+    return 0;
+  }
+
+  int32_t lastkey() const {
+    return 0;
+  }
+
+  int32_t keystep() const {
+    return 0;
+  }
+
+  bool isBgCmd() const {
+    return true;
+  }
+
+  Expected<std::string> run(Session* sess) final {
+    LOG(FATAL) << "fullsyncfiles should not be called";
+    // void compiler complain
+    return {ErrorCodes::ERR_INTERNAL, "shouldn't be called"};
+  }
+} fullSyncFilesCommand;
+
 class QuitCommand : public Command {
  public:
   QuitCommand() : Command("quit", "a") {}
@@ -410,7 +609,7 @@ class IncrSyncCommand : public Command {
   IncrSyncCommand() : Command("incrsync", "a") {}
 
   ssize_t arity() const {
-    return 6;
+    return -6;
   }
 
   int32_t firstkey() const {
@@ -429,8 +628,9 @@ class IncrSyncCommand : public Command {
     return true;
   }
 
-  // incrSync storeId dstStoreId binlogId ip port
+  // incrSync storeId dstStoreId binlogId ip port [compress]
   // binlogId: the last binlog that has been applied
+  // compress: lz4 to receive the binlog batches compressed
   Expected<std::string> run(Session* sess) final {
     LOG(FATAL) << "incrsync should not be called";
 
@@ -457,12 +657,15 @@ class ApplyBinlogsGeneric : public Command {
                           uint32_t storeId,
                           const std::string& binlogs,
                           size_t binlogCnt,
-                          BinlogApplyMode mode) {
+                          BinlogApplyMode mode,
+                          uint64_t* lastBinlogId) {
     auto svr = sess->getServerEntry();
     auto replMgr = svr->getReplManager();
     INVARIANT(replMgr != nullptr);
 
     size_t cnt = 0;
+    // the binlogs of the master are applied as a batch, see BinlogApplier
+    std::vector<ReplLogRawV2> logs;
     BinlogReader reader(binlogs);
     while (true) {
       auto eLog = reader.next();
@@ -472,43 +675,50 @@ class ApplyBinlogsGeneric : public Command {
         LOG(ERROR) << "reader.next() failed:" << eLog.status().toString();
         return eLog.status();
       }
-      Status s;
+      *lastBinlogId = eLog.value().getBinlogId();
+      cnt++;
       if (mode == BinlogApplyMode::KEEP_BINLOG_ID) {
-        s = replMgr->applyRepllogV2(sess,
-                                    storeId,
-                                    eLog.value().getReplLogKey(),
-                                    eLog.value().getReplLogValue());
-      } else {
-        if (!svr->isClusterEnabled()) {
-          LOG(ERROR) << "not ClusterEnabled.";
-          return {ErrorCodes::ERR_INTERNAL, "not ClusterEnabled"};
-        }
-        auto migrateMgr = svr->getMigrateManager();
-        s = migrateMgr->applyRepllog(sess,
-                                     storeId,
-                                     mode,
-                                     eLog.value().getReplLogKey(),
-                                     eLog.value().getReplLogValue());
+        logs.emplace_back(std::move(eLog.value()));
+        continue;
       }
+      if (!svr->isClusterEnabled()) {
+        LOG(ERROR) << "not ClusterEnabled.";
+        return {ErrorCodes::ERR_INTERNAL, "not ClusterEnabled"};
+      }
+      auto migrateMgr = svr->getMigrateManager();
+      auto s = migrateMgr->applyRepllog(sess,
+                                        storeId,
+                                        mode,
+                                        eLog.value().getReplLogKey(),
+                                        eLog.value().getReplLogValue());
       if (!s.ok()) {
         LOG(ERROR) << "applyRepllog failed,mode:" << (uint32_t)mode
-                   << " err:" << eLog.status().toString();
+                   << " err:" << s.toString();
         return s;
       }
-      cnt++;
     }
 
     if (cnt != binlogCnt) {
       return {ErrorCodes::ERR_PARSEOPT, "invalid binlog size of binlog count"};
     }
 
+    if (!logs.empty()) {
+      auto s = replMgr->applyRepllogsV2(sess, storeId, &logs);
+      if (!s.ok()) {
+        LOG(ERROR) << "applyRepllogsV2 failed, store:" << storeId
+                   << " err:" << s.toString();
+        return s;
+      }
+    }
+
     return {ErrorCodes::ERR_OK, ""};
   }
 
   static Status runFlush(Session* sess,
                          uint32_t storeId,
                          const std::string& binlogs,
-                         size_t binlogCnt) {
+                         size_t binlogCnt,
+                         uint64_t* lastBinlogId) {
     auto svr = sess->getServerEntry();
     auto replMgr = svr->getReplManager();
     INVARIANT(replMgr != nullptr);
@@ -552,13 +762,15 @@ class ApplyBinlogsGeneric : public Command {
     INVARIANT_D(eflush.value() == eLog.value().getReplLogKey().getBinlogId());
 
     replMgr->onFlush(storeId, eflush.value());
+    *lastBinlogId = eflush.value();
     return {ErrorCodes::ERR_OK, ""};
   }
 
   static Status runMigrate(Session* sess,
                            uint32_t storeId,
                            const std::string& binlogs,
-                           size_t binlogCnt) {
+                           size_t binlogCnt,
+                           uint64_t* lastBinlogId) {
     auto svr = sess->getServerEntry();
     if (!svr->isClusterEnabled()) {
       LOG(ERROR) << "not ClusterEnabled.";
@@ -637,6 +849,7 @@ class ApplyBinlogsGeneric : public Command {
     std::unique_ptr<Transaction> txn = std::move(ptxn.value());
 
     uint64_t binlogId = key.value().getBinlogId();
+    *lastBinlogId = binlogId;
     // store the binlog directly, same as master
     auto s = txn->setBinlogKV(binlogId, logKey, logValue);
     if (!s.ok()) {
@@ -652,7 +865,9 @@ class ApplyBinlogsGeneric : public Command {
     return {ErrorCodes::ERR_OK, ""};
   }
 
-  // applybinlogsv2 storeId binlogs cnt flag
+  // applybinlogsv2 storeId binlogs cnt flag [lastBinlogId]
+  // with lastBinlogId, the reply is the last binlog id applied, so that
+  // the master can send the batches without waiting for each reply.
   // why is there no storeId ? storeId is contained in this
   // session in fact.
   // please refer to comments of ReplManager::registerIncrSync
@@ -682,29 +897,50 @@ class ApplyBinlogsGeneric : public Command {
     if (!eflag.ok()) {
       return {ErrorCodes::ERR_PARSEOPT, "invalid binlog flags"};
     }
+    // the batch compressed by the master or the migrating source
+    std::string raw;
+    if (Binlog::isCompressed(args[2])) {
+      auto eRaw = Binlog::uncompress(args[2]);
+      RET_IF_ERR_EXPECTED(eRaw);
+      raw = std::move(eRaw.value());
+    }
+    const std::string& binlogs = raw.empty() ? args[2] : raw;
+    uint64_t lastBinlogId = 0;
     switch ((BinlogFlag)eflag.value()) {
       case BinlogFlag::NORMAL: {
-        auto s = runNormal(sess, storeId, args[2], binlogCnt, _mode);
+        auto s =
+          runNormal(sess, storeId, binlogs, binlogCnt, _mode, &lastBinlogId);
         if (!s.ok()) {
           return s;
         }
         break;
       }
       case BinlogFlag::FLUSH: {
-        auto s = runFlush(sess, storeId, args[2], binlogCnt);
+        auto s = runFlush(sess, storeId, binlogs, binlogCnt, &lastBinlogId);
         if (!s.ok()) {
           return s;
         }
         break;
       }
       case BinlogFlag::MIGRATE: {
-        auto s = runMigrate(sess, storeId, args[2], binlogCnt);
+        auto s =
+          runMigrate(sess, storeId, binlogs, binlogCnt, &lastBinlogId);
         if (!s.ok()) {
           return s;
         }
         break;
       }
     }
+    if (args.size() > 5) {
+      auto expectId = ::tendisplus::stoul(args[5]);
+      RET_IF_ERR_EXPECTED(expectId);
+      if (expectId.value() != lastBinlogId) {
+        LOG(ERROR) << "store:" << storeId << " applied binlog:" << lastBinlogId
+                   << " but the master sent:" << expectId.value();
+        return {ErrorCodes::ERR_INTERNAL, "binlog id mismatch"};
+      }
+      return Command::fmtLongLong(lastBinlogId);
+    }
     return Command::fmtOK();
   }
 };
@@ -716,7 +952,7 @@ class ApplyBinlogsCommandV2 : public ApplyBinlogsGeneric {
         "applybinlogsv2", "aw", BinlogApplyMode::KEEP_BINLOG_ID) {}
 
   ssize_t arity() const {
-    return 5;
+    return -5;
   }
 
   int32_t firstkey() const {
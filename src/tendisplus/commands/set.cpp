@@ -9,6 +9,7 @@
 #include <cctype>
 #include <clocale>
 #include <vector>
+#include <iterator>
 #include "tendisplus/utils/sync_point.h"
 #include "tendisplus/utils/string.h"
 #include "tendisplus/utils/invariant.h"
@@ -682,6 +683,8 @@ class SaddCommand : public Command {
         return ptxn.status();
       }
       std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+      // the key is locked X
+      txn->setBulkWrite(true);
 
       Expected<std::string> s =
         genericSAdd(sess, kvstore, txn.get(), metaRk, rv, args);
@@ -834,138 +837,302 @@ class SRemCommand : public Command {
   }
 } sremCommand;
 
-class SdiffgenericCommand : public Command {
+// SetMemberCursor walks the members of a set in the order of its subkeys.
+// It also answers membership probes on the same set: the probes of
+// SINTER/SDIFF/SUNION mostly come in increasing order, so the cursor
+// first steps forward a few records from where the last probe stopped,
+// and only seeks when the member is far ahead or behind.
+// NOTE(tendis): the subkeys of different sets can't be merged directly,
+// the encoded subkey ends with len(pk), so two sets may order the same
+// members differently. Every probe compares keys of the probed set only.
+class SetMemberCursor {
  public:
-  SdiffgenericCommand(const std::string& name, const char* sflags, bool store)
-    : Command(name, sflags), _store(store) {}
-
-  Expected<std::string> run(Session* sess) final {
-    const std::vector<std::string>& args = sess->getArgs();
-    size_t startkey = _store ? 2 : 1;
-    std::set<std::string> result;
-    auto server = sess->getServerEntry();
-    SessionCtx* pCtx = sess->getCtx();
+  SetMemberCursor(Session* sess, const std::string& key)
+    : _sess(sess), _key(key), _chunkId(0), _dbId(0) {}
 
-    std::vector<int> index = getKeysFromCommand(args);
-    auto lock = server->getSegmentMgr()->getAllKeysLocked(
-      sess, args, index, _store ? mgl::LockMode::LOCK_X : Command::RdLock());
-    if (!lock.ok()) {
-      return lock.status();
+  Status init() {
+    auto server = _sess->getServerEntry();
+    auto expdb = server->getSegmentMgr()->getDbHasLocked(_sess, _key);
+    if (!expdb.ok()) {
+      return expdb.status();
+    }
+    _chunkId = expdb.value().chunkId;
+    _dbId = _sess->getCtx()->getDbId();
+    auto ptxn = expdb.value().store->createTransaction(_sess);
+    if (!ptxn.ok()) {
+      return ptxn.status();
     }
+    _txn = std::move(ptxn.value());
+    _cursor = _txn->createDataCursor();
+    RecordKey fakeRk(_chunkId, _dbId, RecordType::RT_SET_ELE, _key, "");
+    _prefix = fakeRk.prefixPk();
+    _cursor->seek(_prefix);
+    return {ErrorCodes::ERR_OK, ""};
+  }
 
-    for (size_t i = startkey; i < args.size(); ++i) {
-      Expected<RecordValue> rv =
-        Command::expireKeyIfNeeded(sess, args[i], RecordType::RT_SET_META);
-      if (rv.status().code() == ErrorCodes::ERR_EXPIRED) {
-        continue;
-      } else if (rv.status().code() == ErrorCodes::ERR_NOTFOUND) {
-        continue;
-      } else if (!rv.ok()) {
-        return rv.status();
-      }
+  // return ERR_EXHAUST if there is no more member
+  Expected<std::string> next() {
+    Expected<Record> exptRcd = _cursor->next();
+    if (!exptRcd.ok()) {
+      return exptRcd.status();
+    }
+    const RecordKey& rcdKey = exptRcd.value().getRecordKey();
+    if (rcdKey.prefixPk() != _prefix) {
+      return {ErrorCodes::ERR_EXHAUST, "no more members"};
+    }
+    return rcdKey.getSecondaryKey();
+  }
 
-      auto expdb = server->getSegmentMgr()->getDbHasLocked(sess, args[i]);
-      if (!expdb.ok()) {
-        return expdb.status();
+  Expected<bool> contains(const std::string& member) {
+    const std::string target =
+      RecordKey(_chunkId, _dbId, RecordType::RT_SET_ELE, _key, member)
+        .encode();
+    bool behind = false;
+    for (uint32_t i = 0; i <= SKIP_STEPS; i++) {
+      Expected<std::string> exptKey = _cursor->key();
+      if (exptKey.status().code() == ErrorCodes::ERR_EXHAUST) {
+        break;
+      } else if (!exptKey.ok()) {
+        return exptKey.status();
+      }
+      int cmp = exptKey.value().compare(target);
+      if (cmp == 0) {
+        return true;
+      } else if (cmp > 0) {
+        if (behind) {
+          // the cursor passed over target
+          return false;
+        }
+        break;
       }
-
-      PStore kvstore = expdb.value().store;
-      auto ptxn = kvstore->createTransaction(sess);
-      if (!ptxn.ok()) {
-        return ptxn.status();
+      behind = true;
+      if (i == SKIP_STEPS) {
+        break;
       }
-      std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-      auto cursor = txn->createDataCursor();
-      RecordKey fake = {expdb.value().chunkId,
-                        pCtx->getDbId(),
-                        RecordType::RT_SET_ELE,
-                        args[i],
-                        ""};
-      cursor->seek(fake.prefixPk());
-      while (true) {
-        Expected<Record> exptRcd = cursor->next();
-        if (exptRcd.status().code() == ErrorCodes::ERR_EXHAUST) {
-          break;
-        }
-        if (!exptRcd.ok()) {
-          return exptRcd.status();
-        }
-        Record& rcd = exptRcd.value();
-        const RecordKey& rcdkey = rcd.getRecordKey();
-        if (rcdkey.prefixPk() != fake.prefixPk()) {
-          break;
-        }
-        if (i == startkey) {
-          result.insert(rcdkey.getSecondaryKey());
-        } else {
-          result.erase(rcdkey.getSecondaryKey());
-        }
+      Expected<Record> exptRcd = _cursor->next();
+      if (!exptRcd.ok() &&
+          exptRcd.status().code() != ErrorCodes::ERR_EXHAUST) {
+        return exptRcd.status();
       }
     }
 
-    if (!_store) {
+    _cursor->seek(target);
+    Expected<std::string> exptKey = _cursor->key();
+    if (exptKey.status().code() == ErrorCodes::ERR_EXHAUST) {
+      return false;
+    } else if (!exptKey.ok()) {
+      return exptKey.status();
+    }
+    return exptKey.value() == target;
+  }
+
+ private:
+  static constexpr uint32_t SKIP_STEPS = 8;
+
+  Session* _sess;
+  const std::string _key;
+  uint32_t _chunkId;
+  uint32_t _dbId;
+  std::string _prefix;
+  std::unique_ptr<Transaction> _txn;
+  std::unique_ptr<BasicDataCursor> _cursor;
+};
+
+// SetOpResult receives the members of SDIFF/SINTER/SUNION one by one.
+// Without a storeKey, they are formatted into the reply. Otherwise they
+// are written into storeKey in batches of STORE_BATCH members, every
+// batch is a transaction updating the members and the meta, so neither
+// the result nor the write batch grows with the size of the sets.
+// If storeKey is one of the source sets, it can't be deleted before
+// all the sources are read, the members are kept in memory until
+// finish() in that case.
+class SetOpResult {
+ public:
+  SetOpResult(Session* sess, const std::string* storeKey, bool deferred)
+    : _sess(sess), _storeKey(storeKey), _deferred(deferred), _count(0) {}
+
+  Status begin() {
+    if (!_storeKey || _deferred) {
+      return {ErrorCodes::ERR_OK, ""};
+    }
+    return clearStoreKey();
+  }
+
+  Status add(const std::string& member) {
+    _count++;
+    if (!_storeKey) {
+      Command::fmtBulk(_ss, member);
+      return {ErrorCodes::ERR_OK, ""};
+    }
+    _members.push_back(member);
+    if (!_deferred && _members.size() >= STORE_BATCH) {
+      return flush();
+    }
+    return {ErrorCodes::ERR_OK, ""};
+  }
+
+  Expected<std::string> finish() {
+    if (!_storeKey) {
       std::stringstream ss;
-      Command::fmtMultiBulkLen(ss, result.size());
-      for (auto& v : result) {
-        Command::fmtBulk(ss, v);
-      }
+      Command::fmtMultiBulkLen(ss, _count);
+      ss << _ss.str();
       return ss.str();
     }
+    if (_deferred) {
+      auto s = clearStoreKey();
+      if (!s.ok()) {
+        return s;
+      }
+    }
+    while (_members.size() > 0) {
+      auto s = flush();
+      if (!s.ok()) {
+        return s;
+      }
+    }
+    return Command::fmtLongLong(_count);
+  }
+
+ private:
+  static constexpr size_t STORE_BATCH = 1024;
 
-    const std::string& storeKey = args[1];
-    Expected<bool> deleted = delGeneric(sess, storeKey);
-    // Expected<bool> deleted = Command::delKeyChkExpire(sess, storeKey,
-    // RecordType::RT_SET_META);
+  Status clearStoreKey() {
+    Expected<bool> deleted = delGeneric(_sess, *_storeKey);
     if (!deleted.ok()) {
       return deleted.status();
     }
+    return {ErrorCodes::ERR_OK, ""};
+  }
 
-    std::vector<std::string> newKeys(2);
-    for (auto& v : result) {
-      newKeys.push_back(std::move(v));
-    }
-
-    auto expdb = server->getSegmentMgr()->getDbHasLocked(sess, storeKey);
+  // write at most STORE_BATCH members of _members into storeKey
+  Status flush() {
+    auto server = _sess->getServerEntry();
+    auto expdb = server->getSegmentMgr()->getDbHasLocked(_sess, *_storeKey);
     if (!expdb.ok()) {
       return expdb.status();
     }
     PStore kvstore = expdb.value().store;
     RecordKey storeRk(expdb.value().chunkId,
-                      pCtx->getDbId(),
+                      _sess->getCtx()->getDbId(),
                       RecordType::RT_SET_META,
-                      storeKey,
+                      *_storeKey,
                       "");
-    for (uint32_t i = 0; i < RETRY_CNT; ++i) {
-      auto ptxn = kvstore->createTransaction(sess);
+    size_t n = std::min(_members.size(), STORE_BATCH);
+    // the first two args are skipped by genericSAdd
+    std::vector<std::string> newKeys(2);
+    newKeys.insert(newKeys.end(),
+                   std::make_move_iterator(_members.end() - n),
+                   std::make_move_iterator(_members.end()));
+    _members.resize(_members.size() - n);
+
+    for (uint32_t i = 0; i < Command::RETRY_CNT; ++i) {
+      auto ptxn = kvstore->createTransaction(_sess);
       if (!ptxn.ok()) {
         return ptxn.status();
       }
       std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-
-      Expected<std::string> addStore = genericSAdd(
-        sess,
-        kvstore,
-        txn.get(),
-        storeRk,
-        {ErrorCodes::ERR_NOTFOUND, ""}, /* storeKey has been deleted */
-        newKeys);
+      // NOTFOUND for the first batch, storeKey has been deleted
+      Expected<RecordValue> rv = kvstore->getKV(storeRk, txn.get());
+      Expected<std::string> addStore =
+        genericSAdd(_sess, kvstore, txn.get(), storeRk, rv, newKeys);
       if (addStore.ok()) {
         auto s1 = txn->commit();
-        if (!s1.ok()) {
-          return s1.status();
+        if (s1.ok()) {
+          return {ErrorCodes::ERR_OK, ""};
         }
-        return addStore.value();
+        addStore = s1.status();
       }
-      if (addStore.status().code() != ErrorCodes::ERR_COMMIT_RETRY) {
+      if (addStore.status().code() != ErrorCodes::ERR_COMMIT_RETRY ||
+          i == Command::RETRY_CNT - 1) {
         return addStore.status();
       }
-      if (i == RETRY_CNT - 1) {
-        return addStore.status();
-      } else {
+    }
+    return {ErrorCodes::ERR_INTERNAL, "not reachable"};
+  }
+
+  Session* _sess;
+  const std::string* _storeKey;
+  const bool _deferred;
+  uint64_t _count;
+  std::stringstream _ss;
+  std::vector<std::string> _members;
+};
+
+bool isSourceKey(const std::vector<std::string>& args,
+                 size_t startkey,
+                 const std::string& key) {
+  return std::find(args.begin() + startkey, args.end(), key) != args.end();
+}
+class SdiffgenericCommand : public Command {
+ public:
+  SdiffgenericCommand(const std::string& name, const char* sflags, bool store)
+    : Command(name, sflags), _store(store) {}
+
+  Expected<std::string> run(Session* sess) final {
+    const std::vector<std::string>& args = sess->getArgs();
+    size_t startkey = _store ? 2 : 1;
+    auto server = sess->getServerEntry();
+
+    std::vector<int> index = getKeysFromCommand(args);
+    auto lock = server->getSegmentMgr()->getAllKeysLocked(
+      sess, args, index, _store ? mgl::LockMode::LOCK_X : Command::RdLock());
+    if (!lock.ok()) {
+      return lock.status();
+    }
+
+    // the members of the first set are streamed, every member is probed
+    // in the other sets
+    std::vector<std::unique_ptr<SetMemberCursor>> cursors;
+    for (size_t i = startkey; i < args.size(); ++i) {
+      Expected<RecordValue> rv =
+        Command::expireKeyIfNeeded(sess, args[i], RecordType::RT_SET_META);
+      if (rv.status().code() == ErrorCodes::ERR_EXPIRED ||
+          rv.status().code() == ErrorCodes::ERR_NOTFOUND) {
+        if (i == startkey) {
+          // the first set is empty, so is the result
+          break;
+        }
         continue;
+      } else if (!rv.ok()) {
+        return rv.status();
+      }
+      cursors.emplace_back(std::make_unique<SetMemberCursor>(sess, args[i]));
+      auto s = cursors.back()->init();
+      if (!s.ok()) {
+        return s;
+      }
+    }
+
+    const std::string* storeKey = _store ? &args[1] : nullptr;
+    SetOpResult result(
+      sess, storeKey, _store && isSourceKey(args, startkey, args[1]));
+    auto s = result.begin();
+    if (!s.ok()) {
+      return s;
+    }
+    while (cursors.size() > 0) {
+      Expected<std::string> member = cursors[0]->next();
+      if (member.status().code() == ErrorCodes::ERR_EXHAUST) {
+        break;
+      } else if (!member.ok()) {
+        return member.status();
+      }
+      bool found = false;
+      for (size_t i = 1; i < cursors.size() && !found; ++i) {
+        Expected<bool> exist = cursors[i]->contains(member.value());
+        if (!exist.ok()) {
+          return exist.status();
+        }
+        found = exist.value();
+      }
+      if (!found) {
+        s = result.add(member.value());
+        if (!s.ok()) {
+          return s;
+        }
       }
     }
-    return {ErrorCodes::ERR_INTERNAL, "currently unrechable"};
+    return result.finish();
   }
 
  private:
@@ -1025,9 +1192,7 @@ class SintergenericCommand : public Command {
   Expected<std::string> run(Session* sess) final {
     const std::vector<std::string>& args = sess->getArgs();
     size_t startkey = _store ? 2 : 1;
-    std::set<std::string> result;
     auto server = sess->getServerEntry();
-    SessionCtx* pCtx = sess->getCtx();
 
     std::vector<int> index = getKeysFromCommand(args);
     auto lock = server->getSegmentMgr()->getAllKeysLocked(
@@ -1038,6 +1203,7 @@ class SintergenericCommand : public Command {
 
     // stored all sets sorted by their length
     std::vector<std::pair<size_t, uint64_t>> setList;
+    bool empty = false;
     for (size_t i = startkey; i < args.size(); i++) {
       Expected<RecordValue> rv =
         Command::expireKeyIfNeeded(sess, args[i], RecordType::RT_SET_META);
@@ -1046,160 +1212,76 @@ class SintergenericCommand : public Command {
       // return it.
       if (rv.status().code() == ErrorCodes::ERR_EXPIRED ||
           rv.status().code() == ErrorCodes::ERR_NOTFOUND) {
-        if (_store) {
-          continue;
-        }
-        return Command::fmtNull();
+        empty = true;
+        break;
       } else if (!rv.ok()) {
         return rv.status();
       }
 
       Expected<SetMetaValue> expSetMeta =
         SetMetaValue::decode(rv.value().getValue());
-
+      if (!expSetMeta.ok()) {
+        return expSetMeta.status();
+      }
       uint64_t setLength = expSetMeta.value().getCount();
       if (setLength == 0) {
-        if (_store) {
-          continue;
-        }
-        return Command::fmtNull();
+        empty = true;
+        break;
       }
       setList.push_back(std::make_pair(i, setLength));
     }
-    std::sort(setList.begin(), setList.end(), [](auto& left, auto& right) {
-      return left.second < right.second;
-    });
-
-    for (size_t i = 0; i < setList.size(); i++) {
-      const std::string& key = args[setList[i].first];
-      auto expdb = server->getSegmentMgr()->getDbHasLocked(sess, key);
-      if (!expdb.ok()) {
-        return expdb.status();
-      }
-      PStore kvstore = expdb.value().store;
-      auto ptxn = kvstore->createTransaction(sess);
-      if (!ptxn.ok()) {
-        return ptxn.status();
-      }
-      std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-      if (i == 0) {
-        auto cursor = txn->createDataCursor();
-        RecordKey fakeRk(expdb.value().chunkId,
-                         pCtx->getDbId(),
-                         RecordType::RT_SET_ELE,
-                         key,
-                         "");
-        cursor->seek(fakeRk.prefixPk());
-        while (true) {
-          Expected<Record> expRcd = cursor->next();
-          if (expRcd.status().code() == ErrorCodes::ERR_EXHAUST) {
-            break;
-          }
-          if (!expRcd.ok()) {
-            return expRcd.status();
-          }
-          Record& rcd = expRcd.value();
-          const RecordKey& rcdKey = rcd.getRecordKey();
-          if (rcdKey.prefixPk() != fakeRk.prefixPk()) {
-            break;
-          }
-          result.insert(rcdKey.getSecondaryKey());
-        }
-        // for the smallest set
-        // input all its keys into set, then goto next loop;
-        continue;
-      }
-      if (result.size() == 0) {
-        if (_store) {
-          // we must del the storeKey before we return
-          break;
-        }
-        // has no intersection, just return empty set
+    if (empty) {
+      if (!_store) {
         return Command::fmtNull();
       }
-
-      for (auto iter = result.begin(); iter != result.end();) {
-        RecordKey subRk(expdb.value().chunkId,
-                        pCtx->getDbId(),
-                        RecordType::RT_SET_ELE,
-                        key,
-                        *iter);
-        Expected<RecordValue> subValue = kvstore->getKV(subRk, txn.get());
-        // if key not found, erase it
-        if (!subValue.ok() ||
-            subValue.status().code() == ErrorCodes::ERR_NOTFOUND) {
-          // then the old iterator will be invalid
-          // new value is the iterator to the next element
-          iter = result.erase(iter);
-        } else {
-          // otherwise move forward manually
-          iter++;
-        }
-      }
+      setList.clear();
     }
+    std::sort(setList.begin(), setList.end(), [](auto& left, auto& right) {
+      return left.second < right.second;
+    });
 
-    if (!_store) {
-      std::stringstream ss;
-      Command::fmtMultiBulkLen(ss, result.size());
-      for (auto& v : result) {
-        Command::fmtBulk(ss, v);
+    // the members of the smallest set are streamed, every member is
+    // probed in the bigger sets
+    std::vector<std::unique_ptr<SetMemberCursor>> cursors;
+    for (const auto& v : setList) {
+      cursors.emplace_back(
+        std::make_unique<SetMemberCursor>(sess, args[v.first]));
+      auto s = cursors.back()->init();
+      if (!s.ok()) {
+        return s;
       }
-      return ss.str();
     }
 
-    const std::string& storeKey = args[1];
-    Expected<bool> deleted = delGeneric(sess, storeKey);
-    // Expected<bool> deleted = Command::delKeyChkExpire(sess, storeKey,
-    // RecordType::RT_SET_META);
-    if (!deleted.ok()) {
-      return deleted.status();
-    }
-
-    std::vector<std::string> newKeys(2);
-    for (auto& v : result) {
-      newKeys.push_back(std::move(v));
-    }
-
-    auto expdb = server->getSegmentMgr()->getDbHasLocked(sess, storeKey);
-    if (!expdb.ok()) {
-      return expdb.status();
+    const std::string* storeKey = _store ? &args[1] : nullptr;
+    SetOpResult result(
+      sess, storeKey, _store && isSourceKey(args, startkey, args[1]));
+    auto s = result.begin();
+    if (!s.ok()) {
+      return s;
     }
-    PStore kvstore = expdb.value().store;
-    RecordKey storeRk(expdb.value().chunkId,
-                      pCtx->getDbId(),
-                      RecordType::RT_SET_META,
-                      storeKey,
-                      "");
-    for (uint32_t i = 0; i < RETRY_CNT; ++i) {
-      auto ptxn = kvstore->createTransaction(sess);
-      if (!ptxn.ok()) {
-        return ptxn.status();
-      }
-      std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-      Expected<std::string> addStore =
-        genericSAdd(sess,
-                    kvstore,
-                    txn.get(),
-                    storeRk,
-                    {ErrorCodes::ERR_NOTFOUND, ""},
-                    newKeys);
-      if (addStore.ok()) {
-        auto s1 = txn->commit();
-        if (!s1.ok()) {
-          return s1.status();
+    while (cursors.size() > 0) {
+      Expected<std::string> member = cursors[0]->next();
+      if (member.status().code() == ErrorCodes::ERR_EXHAUST) {
+        break;
+      } else if (!member.ok()) {
+        return member.status();
+      }
+      bool found = true;
+      for (size_t i = 1; i < cursors.size() && found; ++i) {
+        Expected<bool> exist = cursors[i]->contains(member.value());
+        if (!exist.ok()) {
+          return exist.status();
         }
-        return addStore.value();
+        found = exist.value();
       }
-      if (addStore.status().code() != ErrorCodes::ERR_COMMIT_RETRY) {
-        return addStore.status();
-      }
-      if (i == RETRY_CNT - 1) {
-        return addStore.status();
-      } else {
-        continue;
+      if (found) {
+        s = result.add(member.value());
+        if (!s.ok()) {
+          return s;
+        }
       }
     }
-    return {ErrorCodes::ERR_INTERNAL, "currently unrechable"};
+    return result.finish();
   }
 
  private:
@@ -1396,9 +1478,7 @@ class SuniongenericCommand : public Command {
   Expected<std::string> run(Session* sess) final {
     const std::vector<std::string>& args = sess->getArgs();
     size_t startkey = _store ? 2 : 1;
-    std::unordered_set<std::string> result;
     auto server = sess->getServerEntry();
-    SessionCtx* pCtx = sess->getCtx();
 
     std::vector<int> index = getKeysFromCommand(args);
     auto lock = server->getSegmentMgr()->getAllKeysLocked(
@@ -1407,6 +1487,7 @@ class SuniongenericCommand : public Command {
       return lock.status();
     }
 
+    std::vector<std::unique_ptr<SetMemberCursor>> cursors;
     for (size_t i = startkey; i < args.size(); ++i) {
       Expected<RecordValue> rv =
         Command::expireKeyIfNeeded(sess, args[i], RecordType::RT_SET_META);
@@ -1416,102 +1497,47 @@ class SuniongenericCommand : public Command {
       } else if (!rv.ok()) {
         return rv.status();
       }
-
-      auto expdb = server->getSegmentMgr()->getDbHasLocked(sess, args[i]);
-      if (!expdb.ok()) {
-        return expdb.status();
-      }
-      PStore kvstore = expdb.value().store;
-      auto ptxn = kvstore->createTransaction(sess);
-      if (!ptxn.ok()) {
-        return ptxn.status();
+      cursors.emplace_back(std::make_unique<SetMemberCursor>(sess, args[i]));
+      auto s = cursors.back()->init();
+      if (!s.ok()) {
+        return s;
       }
-      std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-      auto cursor = txn->createDataCursor();
-      RecordKey fakeRk(expdb.value().chunkId,
-                       pCtx->getDbId(),
-                       RecordType::RT_SET_ELE,
-                       args[i],
-                       "");
-      cursor->seek(fakeRk.prefixPk());
+    }
+
+    const std::string* storeKey = _store ? &args[1] : nullptr;
+    SetOpResult result(
+      sess, storeKey, _store && isSourceKey(args, startkey, args[1]));
+    auto s = result.begin();
+    if (!s.ok()) {
+      return s;
+    }
+    // a member of the i-th set is a new one if it isn't in the sets
+    // before it, so no member needs to be remembered.
+    for (size_t i = 0; i < cursors.size(); ++i) {
       while (true) {
-        Expected<Record> exptRcd = cursor->next();
-        if (exptRcd.status().code() == ErrorCodes::ERR_EXHAUST) {
+        Expected<std::string> member = cursors[i]->next();
+        if (member.status().code() == ErrorCodes::ERR_EXHAUST) {
           break;
+        } else if (!member.ok()) {
+          return member.status();
         }
-        if (!exptRcd.ok()) {
-          return exptRcd.status();
-        }
-
-        Record& rcd = exptRcd.value();
-        const RecordKey& rcdkey = rcd.getRecordKey();
-        if (rcdkey.prefixPk() != fakeRk.prefixPk()) {
-          break;
+        bool found = false;
+        for (size_t j = 0; j < i && !found; ++j) {
+          Expected<bool> exist = cursors[j]->contains(member.value());
+          if (!exist.ok()) {
+            return exist.status();
+          }
+          found = exist.value();
         }
-        result.insert(rcdkey.getSecondaryKey());
-      }
-    }
-
-    if (!_store) {
-      std::stringstream ss;
-      Command::fmtMultiBulkLen(ss, result.size());
-      for (const auto& v : result) {
-        Command::fmtBulk(ss, v);
-      }
-      return ss.str();
-    }
-
-    const std::string& storeKey = args[1];
-    Expected<bool> deleted = delGeneric(sess, storeKey);
-    if (!deleted.ok()) {
-      return deleted.status();
-    }
-
-    std::vector<std::string> newKeys(2);
-    for (const auto& v : result) {
-      newKeys.push_back(std::move(v));
-    }
-
-    auto expdb = server->getSegmentMgr()->getDbHasLocked(sess, storeKey);
-    if (!expdb.ok()) {
-      return expdb.status();
-    }
-    PStore kvstore = expdb.value().store;
-    RecordKey storeRk(expdb.value().chunkId,
-                      pCtx->getDbId(),
-                      RecordType::RT_SET_META,
-                      storeKey,
-                      "");
-    for (uint32_t i = 0; i < RETRY_CNT; ++i) {
-      auto ptxn = kvstore->createTransaction(sess);
-      if (!ptxn.ok()) {
-        return ptxn.status();
-      }
-      std::unique_ptr<Transaction> txn = std::move(ptxn.value());
-      Expected<std::string> addStore =
-        genericSAdd(sess,
-                    kvstore,
-                    txn.get(),
-                    storeRk,
-                    {ErrorCodes::ERR_NOTFOUND, ""},
-                    newKeys);
-      if (addStore.ok()) {
-        auto s1 = txn->commit();
-        if (!s1.ok()) {
-          return s1.status();
+        if (!found) {
+          s = result.add(member.value());
+          if (!s.ok()) {
+            return s;
+          }
         }
-        return addStore.value();
-      }
-      if (addStore.status().code() != ErrorCodes::ERR_COMMIT_RETRY) {
-        return addStore.status();
-      }
-      if (i == RETRY_CNT - 1) {
-        return addStore.status();
-      } else {
-        continue;
       }
     }
-    return {ErrorCodes::ERR_INTERNAL, "not reachable"};
+    return result.finish();
   }
 
  private:
@@ -13,6 +13,7 @@
 #include "tendisplus/utils/string.h"
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/storage/skiplist.h"
+#include "tendisplus/storage/pieced_kv.h"
 
 namespace tendisplus {
 constexpr uint64_t MAXSEQ = 9223372036854775807ULL;
@@ -111,6 +112,10 @@ class SortCommand : public Command {
       if (!kvVal.ok()) {
         return kvVal.status();
       }
+      auto s = PiecedKV::load(byStore, kvRk, &kvVal.value(), ROTxn.get());
+      if (!s.ok()) {
+        return s;
+      }
       return std::move(kvVal.value().getValue());
     }
   }
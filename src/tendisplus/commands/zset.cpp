@@ -143,6 +143,8 @@ Expected<std::string> genericZadd(Session* sess,
   }
 
   std::unique_ptr<Transaction> txn = std::move(ptxn.value());
+  // the key is locked X by the callers
+  txn->setBulkWrite(true);
   ZSlMetaValue meta;
 
   if (eMeta.ok()) {
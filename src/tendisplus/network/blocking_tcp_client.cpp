@@ -11,6 +11,10 @@
 #include <string>
 
 #include <algorithm>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/sendfile.h>
+#endif
 #include "asio.hpp"
 #include "glog/logging.h"
 #include "tendisplus/utils/invariant.h"
@@ -243,6 +247,81 @@ Expected<std::string> BlockingTcpClient::read(size_t bufSize,
   return result;
 }
 
+Status BlockingTcpClient::readExactly(char* buf,
+                                      size_t size,
+                                      std::chrono::seconds timeout) {
+  // the bytes read ahead by readLine() first
+  size_t buffered = std::min(size, _inputBuf.size());
+  asio::buffer_copy(asio::buffer(buf, buffered), _inputBuf.data());
+  _inputBuf.consume(buffered);
+  if (buffered == size) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+
+  _notified = false;
+  auto self(shared_from_this());
+  asio::async_read(_socket,
+                   asio::buffer(buf + buffered, size - buffered),
+                   asio::transfer_exactly(size - buffered),
+                   [this, self](const asio::error_code& oec, size_t) {
+                     std::unique_lock<std::mutex> lk(_mutex);
+                     _ec = oec;
+                     _notified = true;
+                     _cv.notify_one();
+                   });
+
+  std::unique_lock<std::mutex> lk(_mutex);
+  if (!_cv.wait_for(lk, timeout, [this] { return _notified; })) {
+    closeSocket();
+    return {ErrorCodes::ERR_TIMEOUT, "read timeout"};
+  } else if (_ec) {
+    closeSocket();
+    return {ErrorCodes::ERR_NETWORK, _ec.message()};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+#ifdef __linux__
+Status BlockingTcpClient::sendFile(int fd,
+                                   uint64_t offset,
+                                   size_t size,
+                                   std::chrono::seconds timeout) {
+  int sock = _socket.native_handle();
+  off_t off = offset;
+  size_t remain = size;
+  while (remain) {
+    ssize_t n = ::sendfile(sock, fd, &off, remain);
+    if (n > 0) {
+      remain -= n;
+      continue;
+    } else if (n == 0) {
+      return {ErrorCodes::ERR_INTERNAL, "sendfile reaches end of file"};
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      std::string err = strerror(errno);
+      closeSocket();
+      return {ErrorCodes::ERR_NETWORK, err};
+    }
+    // NOTE(tendis): the socket is non-blocking, wait until it is writable
+    struct pollfd pfd = {sock, POLLOUT, 0};
+    int ret = ::poll(&pfd, 1, timeout.count() * 1000);
+    if (ret == 0) {
+      closeSocket();
+      return {ErrorCodes::ERR_TIMEOUT, "sendfile timeout"};
+    } else if (ret < 0 && errno != EINTR) {
+      std::string err = strerror(errno);
+      closeSocket();
+      return {ErrorCodes::ERR_NETWORK, err};
+    }
+  }
+  if (_rateLimiter) {
+    _rateLimiter->Request(size);
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+#endif
+
 Status BlockingTcpClient::writeData(const std::string& data) {
   uint32_t cur_size = 0;
   uint32_t total_size = data.size();
@@ -37,11 +37,22 @@ class BlockingTcpClient
   Status tryWaitConnect();
   Expected<std::string> readLine(std::chrono::seconds timeout);
   Expected<std::string> read(size_t bufSize, std::chrono::seconds timeout);
+  // read exactly size bytes into buf, bypassing the input buffer for the
+  // bytes not buffered yet
+  Status readExactly(char* buf, size_t size, std::chrono::seconds timeout);
   Status writeLine(const std::string& line);
   Status writeOneBatch(const char* data,
                        uint32_t size,
                        std::chrono::seconds timeout);
   Status writeData(const std::string& data);
+#ifdef __linux__
+  // send [offset, offset + size) of the file by sendfile(2), the bytes
+  // are not copied to user space
+  Status sendFile(int fd,
+                  uint64_t offset,
+                  size_t size,
+                  std::chrono::seconds timeout);
+#endif
 
   std::string getRemoteRepr() const {
     try {
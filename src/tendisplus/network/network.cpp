@@ -2,6 +2,7 @@
 // Please refer to the license text that comes with this tendis open source
 // project for additional information.
 
+#include <chrono>  // NOLINT
 #include <iostream>
 #include <memory>
 #include <string>
@@ -861,6 +862,8 @@ void NetSession::processReq() {
   }
   if (!continueSched) {
     endSession();
+  } else if (_ctx->isWriteParked()) {
+    parkReq();
   } else if (!_closeAfterRsp) {
     resetMultiBulkCtx();
     if (_queryBufPos == 0) {
@@ -876,6 +879,18 @@ void NetSession::processReq() {
   }
 }
 
+// the request is a write of a stalled store, it is tried again at its
+// slot by the io thread, the worker thread is not held meanwhile
+void NetSession::parkReq() {
+  auto self(shared_from_this());
+  auto timer = std::make_shared<asio::steady_timer>(_sock.get_io_context());
+  timer->expires_after(std::chrono::microseconds(_ctx->getWriteStallWaitUs()));
+  timer->async_wait([this, self, timer](const std::error_code& ec) {
+    INVARIANT_D(_state.load(std::memory_order_relaxed) == State::Process);
+    schedule();
+  });
+}
+
 void NetSession::drainRsp(std::shared_ptr<SendBuffer> buf) {
   auto self(shared_from_this());
   uint64_t now = nsSinceEpoch();
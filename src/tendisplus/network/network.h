@@ -189,6 +189,8 @@ class NetSession : public Session {
 
   // handle msg parsed from drainReqCallback
   virtual void processReq();
+  // try the parked write again later, see SessionCtx::parkWrite()
+  void parkReq();
   // cleanup state for next request
   virtual void resetMultiBulkCtx();
 
@@ -3,6 +3,11 @@
 // project for additional information.
 
 #include <stdio.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <algorithm>
@@ -401,4 +406,74 @@ TEST(BlockingTcpClient, RateLimit) {
   thd1.join();
 }
 
+#ifdef __linux__
+TEST(BlockingTcpClient, SendFile) {
+  auto ioCtx = std::make_shared<asio::io_context>();
+  auto ioCtx1 = std::make_shared<asio::io_context>();
+  uint32_t port = 54021;
+  const auto guard = MakeGuard([] { remove("sendfile.data"); });
+
+  std::string data = randomStr(4 * 1024 * 1024, false);
+  {
+    std::ofstream out("sendfile.data", std::ios::binary);
+    out.write(data.c_str(), data.size());
+  }
+
+  asio::ip::tcp::acceptor acceptor(
+    *ioCtx, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port));
+  acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+
+  std::thread thd([&ioCtx] {
+    asio::io_context::work work(*ioCtx);
+    ioCtx->run();
+  });
+  std::thread thd1([&ioCtx1] {
+    asio::io_context::work work(*ioCtx1);
+    ioCtx1->run();
+  });
+
+  auto sender =
+    std::make_shared<BlockingTcpClient>(ioCtx1, 128, 1024 * 1024, 10);
+  Status s = sender->connect("127.0.0.1", port, std::chrono::seconds(1));
+  EXPECT_TRUE(s.ok());
+  auto receiver =
+    std::make_shared<BlockingTcpClient>(ioCtx, acceptor.accept(), 128);
+
+  std::thread sendThd([&sender, &data] {
+    auto s = sender->writeLine("sendfile.data");
+    EXPECT_TRUE(s.ok());
+    int fd = ::open("sendfile.data", O_RDONLY);
+    EXPECT_GE(fd, 0);
+    // in batches, from an offset
+    size_t batch = 1024 * 1024 + 1;
+    for (size_t offset = 0; offset < data.size(); offset += batch) {
+      size_t size = std::min(batch, data.size() - offset);
+      s = sender->sendFile(fd, offset, size, std::chrono::seconds(10));
+      EXPECT_TRUE(s.ok()) << s.toString();
+    }
+    ::close(fd);
+  });
+
+  auto eName = receiver->readLine(std::chrono::seconds(3));
+  EXPECT_TRUE(eName.ok());
+  EXPECT_EQ(eName.value(), "sendfile.data");
+  // some bytes of the file may be read ahead into the buffer
+  std::string recv(data.size(), '\0');
+  size_t batch = 64 * 1024 - 1;
+  for (size_t offset = 0; offset < data.size(); offset += batch) {
+    size_t size = std::min(batch, data.size() - offset);
+    s = receiver->readExactly(&recv[offset], size, std::chrono::seconds(10));
+    EXPECT_TRUE(s.ok()) << s.toString();
+  }
+  EXPECT_EQ(recv, data);
+  EXPECT_EQ(receiver->getReadBufSize(), size_t(0));
+
+  sendThd.join();
+  ioCtx->stop();
+  ioCtx1->stop();
+  thd.join();
+  thd1.join();
+}
+#endif
+
 }  // namespace tendisplus
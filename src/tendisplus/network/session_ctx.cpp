@@ -11,6 +11,7 @@
 #include "tendisplus/network/session_ctx.h"
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/string.h"
+#include "tendisplus/utils/time.h"
 
 namespace tendisplus {
 
@@ -31,7 +32,9 @@ SessionCtx::SessionCtx(Session* sess)
     _replOnly(false),
     _session(sess),
     _isMonitor(false),
-    _flags(0) {
+    _flags(0),
+    _multiDirty(false),
+    _writeStallDeadline(0) {
   _perfContext.Reset();
   _ioContext.Reset();
 }
@@ -122,6 +125,22 @@ Expected<Transaction*> SessionCtx::createTransaction(const PStore& kvstore) {
   return txn;
 }
 
+void SessionCtx::setExecTxn(const std::string& storeId, Transaction* txn) {
+  _execTxns[storeId] = txn;
+}
+
+Transaction* SessionCtx::getExecTxn(const std::string& storeId) const {
+  if (_execTxns.empty()) {
+    return nullptr;
+  }
+  auto it = _execTxns.find(storeId);
+  return it == _execTxns.end() ? nullptr : it->second;
+}
+
+void SessionCtx::clearExecTxns() {
+  _execTxns.clear();
+}
+
 Status SessionCtx::commitAll(const std::string& cmd) {
   std::lock_guard<std::mutex> lk(_mutex);
   Status s;
@@ -280,4 +299,39 @@ bool SessionCtx::verifyVersion(uint64_t keyVersion) {
   return true;
 }
 
+uint64_t SessionCtx::getWriteStallSlot(uint32_t storeId) const {
+  auto it = _writeStallSlots.find(storeId);
+  return it == _writeStallSlots.end() ? 0 : it->second;
+}
+
+void SessionCtx::setWriteStallSlot(uint32_t storeId, uint64_t slotUs) {
+  if (slotUs == 0) {
+    _writeStallSlots.erase(storeId);
+  } else {
+    _writeStallSlots[storeId] = slotUs;
+  }
+}
+
+bool SessionCtx::parkWrite(uint64_t timeoutMs) {
+  uint64_t now = msSinceEpoch();
+  if (_writeStallDeadline == 0) {
+    _writeStallDeadline = now + timeoutMs;
+  }
+  return now < _writeStallDeadline && !_writeStallSlots.empty();
+}
+
+uint64_t SessionCtx::getWriteStallWaitUs() const {
+  uint64_t now = nsSinceEpoch() / 1000;
+  uint64_t retry = _writeStallDeadline * 1000;
+  for (const auto& slot : _writeStallSlots) {
+    retry = std::min(retry, slot.second);
+  }
+  return retry > now ? retry - now : 0;
+}
+
+void SessionCtx::clearWriteStall() {
+  _writeStallDeadline = 0;
+  _writeStallSlots.clear();
+}
+
 }  // namespace tendisplus
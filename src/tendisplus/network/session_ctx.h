@@ -119,7 +119,27 @@ class SessionCtx {
   inline void resetMulti() {
     _flags &= ~InMulti;
     _txnVersion = -1;
+    _multiCmds.clear();
+    _multiDirty = false;
   }
+  // the commands queued after MULTI, they run in EXEC
+  void queueMultiCmd(const std::vector<std::string>& args) {
+    _multiCmds.push_back(args);
+  }
+  const std::vector<std::vector<std::string>>& getMultiCmds() const {
+    return _multiCmds;
+  }
+  // a command is rejected after MULTI, EXEC will be aborted
+  void setMultiDirty() {
+    _multiDirty = true;
+  }
+  bool isMultiDirty() const {
+    return _multiDirty;
+  }
+  // the transactions of EXEC by kvstore id, they are not owned by me
+  void setExecTxn(const std::string& storeId, Transaction* txn);
+  Transaction* getExecTxn(const std::string& storeId) const;
+  void clearExecTxns();
   uint32_t getFlags() {
     return _flags;
   }
@@ -131,6 +151,19 @@ class SessionCtx {
   }
   bool verifyVersion(uint64_t keyVersion);
 
+  // the slot of the write in a stalled store, see KVStore::admitWrite()
+  uint64_t getWriteStallSlot(uint32_t storeId) const;
+  void setWriteStallSlot(uint32_t storeId, uint64_t slotUs);
+  // park the write failed with ERR_WRITE_STALL, it is tried again at its
+  // slot. return false if it is parked for timeoutMs already.
+  bool parkWrite(uint64_t timeoutMs);
+  bool isWriteParked() const {
+    return _writeStallDeadline != 0;
+  }
+  // the time in us the parked write waits before it is tried again
+  uint64_t getWriteStallWaitUs() const;
+  void clearWriteStall();
+
   static constexpr uint64_t VERSIONEP_UNINITED = -1;
   static constexpr uint64_t TSEP_UNINITED = -1;
 
@@ -154,6 +187,12 @@ class SessionCtx {
   std::unordered_map<std::string, mgl::LockMode> _keylockmap;
   bool _isMonitor;
   uint32_t _flags;
+  std::vector<std::vector<std::string>> _multiCmds;
+  bool _multiDirty;
+  std::unordered_map<std::string, Transaction*> _execTxns;
+  // the time in ms a parked write fails, 0 if not parked
+  uint64_t _writeStallDeadline;
+  std::unordered_map<uint32_t, uint64_t> _writeStallSlots;
 
   mutable std::mutex _mutex;
 
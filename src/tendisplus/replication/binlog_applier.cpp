@@ -0,0 +1,398 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include "tendisplus/replication/binlog_applier.h"
+
+#include <algorithm>
+#include <condition_variable>  // NOLINT
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "glog/logging.h"
+#include "tendisplus/replication/repl_util.h"
+#include "tendisplus/server/segment_manager.h"
+#include "tendisplus/server/server_entry.h"
+#include "tendisplus/server/session.h"
+#include "tendisplus/utils/sync_point.h"
+
+namespace tendisplus {
+
+BinlogApplier::BinlogApplier(ServerEntry* svr, size_t storeCount)
+  : _svr(svr),
+    _lanes(1),
+    _matrix(std::make_shared<PoolMatrix>()),
+    _pool(nullptr),
+    _recoverTo(storeCount, 0),
+    _binlogs(0),
+    _txns(0) {}
+
+Status BinlogApplier::startup(size_t lanes) {
+  _lanes = std::max(lanes, static_cast<size_t>(1));
+  if (_lanes == 1) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  _pool = std::make_unique<WorkerPool>("tx-repl-apply", _matrix);
+  return _pool->startup(_lanes);
+}
+
+void BinlogApplier::stop() {
+  if (_pool) {
+    _pool->stop();
+  }
+}
+
+Expected<uint64_t> BinlogApplier::recoverPos(uint32_t storeId, PStore store) {
+  uint64_t highest = store->getHighestBinlogId();
+  auto ptxn = store->createTransaction(nullptr);
+  if (!ptxn.ok()) {
+    return ptxn.status();
+  }
+  auto txn = std::move(ptxn.value());
+  auto minId = RepllogCursorV2::getMinBinlogId(txn.get());
+  if (minId.status().code() == ErrorCodes::ERR_EXHAUST) {
+    return highest;
+  } else if (!minId.ok()) {
+    return minId.status();
+  }
+
+  // NOTE(tendis): the binlog ids of the master may have holes too, then
+  // the binlogs after the hole are synced again and skipped, it's ok.
+  uint64_t start = highest > MAX_SEGMENT ? highest - MAX_SEGMENT : 0;
+  start = std::max(start, minId.value());
+  for (uint64_t id = start; id < highest; ++id) {
+    auto eval = txn->getKV(ReplLogKeyV2(id).encode());
+    if (eval.ok()) {
+      continue;
+    } else if (eval.status().code() != ErrorCodes::ERR_NOTFOUND) {
+      return eval.status();
+    }
+    LOG(WARNING) << "store:" << storeId << " binlog:" << id
+                 << " is missing below the highest binlog:" << highest
+                 << ", sync from it again";
+    std::lock_guard<std::mutex> lk(_mutex);
+    _recoverTo[storeId] = std::max(_recoverTo[storeId], highest);
+    return id - 1;
+  }
+  return highest;
+}
+
+// the lane of a binlog is hashed by the primary keys it writes, the ttl
+// indexes go with their keys. *barrier is set if the keys go to more than
+// one lane, or the binlog can't be applied with the others.
+Expected<BinlogApplier::PTask> BinlogApplier::prepare(ReplLogRawV2* log,
+                                                      bool* barrier) {
+  auto value = ReplLogValueV2::decode(log->getReplLogValue());
+  if (!value.ok()) {
+    return value.status();
+  }
+  auto chunkId = value.value().getChunkId();
+  *barrier = chunkId == Transaction::CHUNKID_FLUSH ||
+    chunkId == Transaction::CHUNKID_MIGRATE ||
+    chunkId == Transaction::CHUNKID_DEL_RANGE;
+
+  auto task = std::make_unique<Task>();
+  task->firstId = log->getBinlogId();
+  task->binlogId = task->firstId;
+  task->binlogs = 1;
+  size_t offset = value.value().getHdrSize();
+  auto data = value.value().getData();
+  size_t dataSize = value.value().getDataSize();
+  bool hashed = false;
+  while (offset < dataSize) {
+    size_t size = 0;
+    auto entry = ReplLogValueEntryV2::decode(
+      (const char*)data + offset, dataSize - offset, &size);
+    if (!entry.ok()) {
+      return entry.status();
+    }
+    offset += size;
+    task->binlogTs = entry.value().getTimestamp();
+
+    if (!*barrier && entry.value().getOp() == ReplOp::REPL_OP_DEL_RANGE) {
+      *barrier = true;
+    } else if (!*barrier && _lanes > 1) {
+      auto rk = RecordKey::decode(entry.value().getOpKey());
+      if (!rk.ok()) {
+        return rk.status();
+      }
+      uint32_t dbId = rk.value().getDbId();
+      std::string pk = rk.value().getPrimaryKey();
+      if (rk.value().getRecordType() == RecordType::RT_TTL_INDEX) {
+        auto index = TTLIndex::decode(rk.value());
+        if (!index.ok()) {
+          return index.status();
+        }
+        dbId = index.value().getDbId();
+        pk = index.value().getPriKey();
+      }
+      size_t lane = (std::hash<std::string>()(pk) + dbId) % _lanes;
+      if (hashed && lane != task->lane) {
+        *barrier = true;
+      }
+      task->lane = lane;
+      hashed = true;
+    }
+    task->entries.emplace_back(std::move(entry.value()));
+  }
+  if (offset != dataSize) {
+    return {ErrorCodes::ERR_INTERNAL, "bad binlog"};
+  }
+  task->barrier = *barrier;
+  return std::move(task);
+}
+
+// store the binlog directly, same as master. It makes the binlog alive in
+// the store, in id order, before any of them committed. The binlog joins
+// the txn of the last task if they are in the same lane, the txn keeps only
+// the last binlog of the group alive, no binlog is between them.
+Status BinlogApplier::addTask(Session* sess,
+                              PStore store,
+                              ReplLogRawV2* log,
+                              PTask task,
+                              std::vector<PTask>* segment) {
+  auto prev = segment->empty() ? nullptr : segment->back().get();
+  if (prev && !prev->barrier && !task->barrier && prev->lane == task->lane &&
+      prev->binlogs < _svr->getParams()->replApplyBatch) {
+    auto s = prev->txn->setBinlogKV(
+      task->binlogId, log->getReplLogKey(), log->getReplLogValue());
+    if (!s.ok()) {
+      return s;
+    }
+    prev->binlogId = task->binlogId;
+    prev->binlogTs = task->binlogTs;
+    prev->binlogs++;
+    std::move(task->entries.begin(),
+              task->entries.end(),
+              std::back_inserter(prev->entries));
+    return {ErrorCodes::ERR_OK, ""};
+  }
+
+  auto ptxn = store->createTransaction(sess);
+  if (!ptxn.ok()) {
+    LOG(ERROR) << "createTransaction failed:" << ptxn.status().toString();
+    return ptxn.status();
+  }
+  task->txn = std::move(ptxn.value());
+  auto s = task->txn->setBinlogKV(
+    task->binlogId, log->getReplLogKey(), log->getReplLogValue());
+  if (!s.ok()) {
+    return s;
+  }
+  segment->emplace_back(std::move(task));
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status BinlogApplier::applyTask(Task* task) {
+  // the binlogs of the task, and the status to fail the lane in the tests
+  std::tuple<uint64_t, uint64_t, Status> point(
+    task->firstId, task->binlogId, {ErrorCodes::ERR_OK, ""});
+  TEST_SYNC_POINT_CALLBACK("BinlogApplier::applyTask", &point);
+  if (!std::get<2>(point).ok()) {
+    return std::get<2>(point);
+  }
+  for (const auto& entry : task->entries) {
+    auto s = task->txn->applyBinlog(entry);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  auto expCmit = task->txn->commit();
+  if (!expCmit.ok()) {
+    return expCmit.status();
+  }
+  task->done = true;
+  _binlogs += task->binlogs;
+  ++_txns;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+// apply the tasks of the segment by their lanes and wait for all of them
+Status BinlogApplier::drain(std::vector<PTask>* segment,
+                            BinlogResult* applied) {
+  if (segment->empty()) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  std::vector<std::vector<Task*>> lanes(_lanes);
+  size_t busy = 0;
+  for (auto& task : *segment) {
+    if (lanes[task->lane].empty()) {
+      busy++;
+    }
+    lanes[task->lane].push_back(task.get());
+  }
+
+  // NOTE(tendis): after a lane fails, the other lanes don't commit the
+  // binlogs after the failed one, they are synced again with it. The ones
+  // committed already are not visible until it's applied, see
+  // RocksKVStore::popCommittedBinlogsInLock()
+  std::atomic<uint64_t> failedId(std::numeric_limits<uint64_t>::max());
+  auto runLane = [this,
+                  &failedId](const std::vector<Task*>& tasks) -> Status {
+    for (auto task : tasks) {
+      if (task->firstId > failedId.load(std::memory_order_acquire)) {
+        break;
+      }
+      auto s = applyTask(task);
+      if (!s.ok()) {
+        uint64_t id = failedId.load(std::memory_order_relaxed);
+        while (task->firstId < id &&
+               !failedId.compare_exchange_weak(id, task->firstId)) {
+        }
+        return s;
+      }
+    }
+    return {ErrorCodes::ERR_OK, ""};
+  };
+
+  Status status = {ErrorCodes::ERR_OK, ""};
+  if (busy == 1) {
+    status = runLane(lanes[segment->front()->lane]);
+  } else {
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t running = busy;
+    for (const auto& tasks : lanes) {
+      if (tasks.empty()) {
+        continue;
+      }
+      _pool->schedule([&, tasks = &tasks]() {
+        auto s = runLane(*tasks);
+        std::lock_guard<std::mutex> lk(mutex);
+        if (!s.ok() && status.ok()) {
+          status = s;
+        }
+        if (--running == 0) {
+          cv.notify_one();
+        }
+      });
+    }
+    std::unique_lock<std::mutex> lk(mutex);
+    cv.wait(lk, [&running] { return running == 0; });
+  }
+
+  for (const auto& task : *segment) {
+    if (!task->done) {
+      break;
+    }
+    applied->binlogId = task->binlogId;
+    applied->binlogTs = task->binlogTs;
+  }
+  // the txns not committed are rolled back
+  segment->clear();
+  return status;
+}
+
+Status BinlogApplier::apply(Session* sess,
+                            uint32_t storeId,
+                            std::vector<ReplLogRawV2>* logs,
+                            BinlogResult* applied) {
+  if (!sess->getCtx()->isReplOnly()) {
+    INVARIANT_D(0);
+    return {ErrorCodes::ERR_INTERNAL, "It is not a slave"};
+  }
+  auto expdb =
+    _svr->getSegmentMgr()->getDb(sess, storeId, mgl::LockMode::LOCK_IX);
+  if (!expdb.ok()) {
+    LOG(ERROR) << "getDb failed:" << expdb.status().toString();
+    return expdb.status();
+  }
+  auto store = std::move(expdb.value().store);
+  INVARIANT(store != nullptr);
+
+  uint64_t recoverTo = 0;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    recoverTo = _recoverTo[storeId];
+  }
+
+  BinlogResult last = *applied;
+  std::vector<PTask> segment;
+  Status s = {ErrorCodes::ERR_OK, ""};
+  for (auto& log : *logs) {
+    uint64_t binlogId = log.getBinlogId();
+    bool recovering = binlogId < store->getNextBinlogSeq();
+    if (recovering && binlogId > recoverTo) {
+      std::string err = "binlogId:" + std::to_string(binlogId) +
+        " can't be smaller than highestBinlogId:" +
+        std::to_string(store->getHighestBinlogId());
+      LOG(ERROR) << err;
+      s = {ErrorCodes::ERR_MANUAL, err};
+      break;
+    }
+    if (recovering || (!segment.empty() &&
+                       binlogId - segment.front()->firstId >= MAX_SEGMENT)) {
+      s = drain(&segment, &last);
+      if (!s.ok()) {
+        break;
+      }
+    }
+    if (recovering) {
+      // skip the binlogs applied before the hole
+      auto ptxn = store->createTransaction(sess);
+      if (!ptxn.ok()) {
+        s = ptxn.status();
+        break;
+      }
+      auto eval = ptxn.value()->getKV(log.getReplLogKey());
+      if (eval.ok()) {
+        last.binlogId = binlogId;
+        last.binlogTs = log.getTimestamp();
+        continue;
+      } else if (eval.status().code() != ErrorCodes::ERR_NOTFOUND) {
+        s = eval.status();
+        break;
+      }
+    }
+
+    bool barrier = false;
+    auto task = prepare(&log, &barrier);
+    if (!task.ok()) {
+      s = task.status();
+      break;
+    }
+    barrier = barrier || recovering;
+    task.value()->barrier = barrier;
+    if (barrier) {
+      s = drain(&segment, &last);
+      if (!s.ok()) {
+        break;
+      }
+    }
+    s = addTask(sess, store, &log, std::move(task.value()), &segment);
+    if (!s.ok()) {
+      break;
+    }
+    if (barrier) {
+      s = drain(&segment, &last);
+      if (!s.ok()) {
+        break;
+      }
+    }
+  }
+  // the binlogs registered are applied anyway
+  auto ds = drain(&segment, &last);
+  if (s.ok()) {
+    s = ds;
+  }
+
+  if (last.binlogId != applied->binlogId) {
+    // NOTE(vinchen): store the binlog time spov when txn commited.
+    // only need to set the last timestamp
+    store->setBinlogTime(last.binlogTs);
+  }
+  *applied = last;
+  if (!s.ok()) {
+    // the binlogs after the last applied one may be committed already
+    std::lock_guard<std::mutex> lk(_mutex);
+    _recoverTo[storeId] =
+      std::max(_recoverTo[storeId], store->getNextBinlogSeq() - 1);
+  }
+  return s;
+}
+
+}  // namespace tendisplus
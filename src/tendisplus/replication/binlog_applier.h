@@ -0,0 +1,115 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_REPLICATION_BINLOG_APPLIER_H_
+#define SRC_TENDISPLUS_REPLICATION_BINLOG_APPLIER_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tendisplus/network/worker_pool.h"
+#include "tendisplus/storage/kvstore.h"
+#include "tendisplus/storage/record.h"
+
+namespace tendisplus {
+
+class ServerEntry;
+class Session;
+
+struct BinlogResult;
+
+// BinlogApplier applies the binlog batches from the master on a slave.
+// The binlogs are registered to the store in id order by the session,
+// then applied and committed by the lanes of a worker pool. A binlog goes
+// to the lane hashed by the primary keys it writes, so the binlogs of a
+// key are applied in order. A binlog writing the keys of more than one
+// lane, deleting a range, or flushing/migrating is a barrier: the lanes
+// are drained and it is applied alone.
+// The store makes a binlog visible only if the binlogs before are all
+// committed, so _highestVisible still advances in binlog id order. When a
+// lane fails, the other lanes stop before the binlogs after the failed
+// one, and the store keeps _highestVisible below it until it's applied
+// again. But a crash may leave holes below the highest binlog in rocksdb.
+// The binlogs from the first hole are synced again, recoverPos() finds
+// it, and the binlogs already applied are skipped.
+// The binlogs in a row of a lane are applied by one txn, so that they are
+// written into rocksdb by one WriteBatch, at most repl-apply-batch of them.
+class BinlogApplier {
+ public:
+  BinlogApplier(ServerEntry* svr, size_t storeCount);
+  BinlogApplier(const BinlogApplier&) = delete;
+  BinlogApplier(BinlogApplier&&) = delete;
+  // lanes <= 1 applies the binlogs in the session
+  Status startup(size_t lanes);
+  void stop();
+  size_t lanes() const {
+    return _lanes;
+  }
+  uint64_t appliedBinlogs() const {
+    return _binlogs.load(std::memory_order_relaxed);
+  }
+  uint64_t appliedTxns() const {
+    return _txns.load(std::memory_order_relaxed);
+  }
+  // the binlog id to sync from, the binlogs not greater than it are all
+  // applied. It is called for the slave stores before syncing.
+  Expected<uint64_t> recoverPos(uint32_t storeId, PStore store);
+  // apply the binlogs of a batch in order, the caller makes sure only one
+  // batch of a store is applied at a time. *applied is the last binlog of
+  // which the binlogs before are all applied, even if it fails.
+  Status apply(Session* sess,
+               uint32_t storeId,
+               std::vector<ReplLogRawV2>* logs,
+               BinlogResult* applied);
+
+  // the holes can only be in so many binlog ids below the highest one
+  static constexpr uint64_t MAX_SEGMENT = 1024;
+
+ private:
+  FRIEND_TEST(RocksKVStore, ApplyBinlogGroup);
+
+  // a task is one txn, applying one binlog or a group of binlogs
+  struct Task {
+    // the first and the last binlog of the group
+    uint64_t firstId = 0;
+    uint64_t binlogId = 0;
+    uint64_t binlogTs = 0;
+    size_t binlogs = 0;
+    size_t lane = 0;
+    bool barrier = false;
+    std::unique_ptr<Transaction> txn;
+    std::vector<ReplLogValueEntryV2> entries;
+    bool done = false;
+  };
+  using PTask = std::unique_ptr<Task>;
+
+  Expected<PTask> prepare(ReplLogRawV2* log, bool* barrier);
+  Status addTask(Session* sess,
+                 PStore store,
+                 ReplLogRawV2* log,
+                 PTask task,
+                 std::vector<PTask>* segment);
+  Status drain(std::vector<PTask>* segment, BinlogResult* applied);
+  Status applyTask(Task* task);
+
+  ServerEntry* _svr;
+  size_t _lanes;
+  std::shared_ptr<PoolMatrix> _matrix;
+  std::unique_ptr<WorkerPool> _pool;
+  std::mutex _mutex;
+  // the binlogs not greater than it may be applied already, they are
+  // skipped if exist, or applied alone to fill the holes
+  std::vector<uint64_t> _recoverTo;
+  // the binlogs applied and the txns committed for them
+  std::atomic<uint64_t> _binlogs;
+  std::atomic<uint64_t> _txns;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_REPLICATION_BINLOG_APPLIER_H_
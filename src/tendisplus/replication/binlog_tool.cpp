@@ -2,18 +2,151 @@
 // Please refer to the license text that comes with this tendis open source
 // project for additional information.
 
+#include <algorithm>
+#include <chrono>  // NOLINT
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <thread>  // NOLINT
+#include <utility>
 #include <vector>
 
+#include "asio.hpp"
+#include "tendisplus/commands/command.h"
+#include "tendisplus/network/blocking_tcp_client.h"
 #include "tendisplus/utils/param_manager.h"
+#include "tendisplus/utils/portable.h"
+#include "tendisplus/utils/string.h"
 #include "tendisplus/utils/base64.h"
+#include "tendisplus/storage/binlog_archive.h"
 #include "tendisplus/storage/kvstore.h"
 #include "tendisplus/storage/varint.h"
 #include "tendisplus/storage/record.h"
 
 namespace tendisplus {
 
+// BinlogFileReader reads the binlogs of a dump file in binlog id order,
+// whether it's a V2 file or an archive file of binlog-archive.
+class BinlogFileReader {
+ public:
+  explicit BinlogFileReader(const std::string& path)
+    : _path(path), _pf(nullptr), _storeId(0), _seekId(0) {}
+  BinlogFileReader(const BinlogFileReader&) = delete;
+  BinlogFileReader(BinlogFileReader&&) = delete;
+  ~BinlogFileReader() {
+    if (_pf) {
+      fclose(_pf);
+    }
+  }
+
+  Status open() {
+    if (BinlogArchiveReader::isArchive(_path)) {
+      _archive = std::make_unique<BinlogArchiveReader>(_path);
+      auto s = _archive->open();
+      if (!s.ok()) {
+        return s;
+      }
+      _storeId = _archive->storeId();
+      return {ErrorCodes::ERR_OK, ""};
+    }
+
+    _pf = fopen(_path.c_str(), "r");
+    if (_pf == NULL) {
+      return {ErrorCodes::ERR_INTERNAL, "fopen failed"};
+    }
+    char buff[BINLOG_HEADER_V2_LEN + 1];
+    int ret = fread(buff, BINLOG_HEADER_V2_LEN, 1, _pf);
+    if (ret != 1 || strncmp(buff, BINLOG_HEADER_V2, strlen(BINLOG_HEADER_V2))) {
+      return {ErrorCodes::ERR_INTERNAL, "read head failed"};
+    }
+    _storeId = int32Decode(buff + strlen(BINLOG_HEADER_V2));
+    return {ErrorCodes::ERR_OK, ""};
+  }
+
+  uint32_t storeId() const {
+    return _storeId;
+  }
+
+  bool isArchive() const {
+    return _archive != nullptr;
+  }
+
+  // the first binlog not less than binlogId is read next
+  void seek(uint64_t binlogId) {
+    if (_archive) {
+      _archive->seek(binlogId);
+    } else {
+      _seekId = binlogId;
+    }
+  }
+
+  // skip the blocks of the timestamps less than ts, only the archive files
+  // have the timestamps indexed
+  void seekTimestamp(uint64_t ts) {
+    if (_archive) {
+      _archive->seekTimestamp(ts);
+    }
+  }
+
+  // ERR_EXHAUST after the last binlog
+  Expected<ReplLogRawV2> next() {
+    if (_archive) {
+      return _archive->next();
+    }
+    while (true) {
+      char buff[sizeof(uint32_t)];
+      // keylen
+      int ret = fread(buff, sizeof(uint32_t), 1, _pf);
+      if (ret != 1) {
+        if (feof(_pf)) {
+          return {ErrorCodes::ERR_EXHAUST, ""};
+        }
+        return {ErrorCodes::ERR_INTERNAL, "read keylen failed"};
+      }
+      uint32_t keylen = int32Decode(buff);
+
+      // key
+      std::string key;
+      key.resize(keylen);
+      ret = fread(const_cast<char*>(key.c_str()), keylen, 1, _pf);
+      if (ret != 1) {
+        return {ErrorCodes::ERR_INTERNAL, "read key failed"};
+      }
+
+      // valuelen
+      ret = fread(buff, sizeof(uint32_t), 1, _pf);
+      if (ret != 1) {
+        return {ErrorCodes::ERR_INTERNAL, "read valuelen failed"};
+      }
+      uint32_t valuelen = int32Decode(buff);
+
+      // value
+      std::string value;
+      value.resize(valuelen);
+      ret = fread(const_cast<char*>(value.c_str()), valuelen, 1, _pf);
+      if (ret != 1) {
+        return {ErrorCodes::ERR_INTERNAL, "read value failed"};
+      }
+
+      // a key broken is left to be reported by the caller
+      ReplLogRawV2 log(std::move(key), std::move(value));
+      if (_seekId > 0 && log.getReplLogKey().size() >= RecordKey::minSize() &&
+          log.getBinlogId() < _seekId) {
+        continue;
+      }
+      return std::move(log);
+    }
+  }
+
+ private:
+  const std::string _path;
+  FILE* _pf;
+  std::unique_ptr<BinlogArchiveReader> _archive;
+  uint32_t _storeId;
+  uint64_t _seekId;
+};
+
 // TODO(takenliu) print error to stderr or logfile?
 class BinlogScanner {
  public:
@@ -94,15 +227,25 @@ class BinlogScanner {
         offset += size;
 
         Expected<RecordKey> opkey = RecordKey::decode(entry.value().getOpKey());
-        Expected<RecordValue> opvalue =
-          RecordValue::decode(entry.value().getOpValue());
-        if (!opkey.ok() || !opvalue.ok()) {
-          return "decode opkey or opvalue failed";
+        if (!opkey.ok()) {
+          return "decode opkey failed";
+        }
+        // the value of a merge is an operand, not a RecordValue
+        std::string opvalue;
+        if (entry.value().getOp() == ReplOp::REPL_OP_MERGE) {
+          opvalue = entry.value().getOpValue();
+        } else {
+          Expected<RecordValue> eValue =
+            RecordValue::decode(entry.value().getOpValue());
+          if (!eValue.ok()) {
+            return "decode opvalue failed";
+          }
+          opvalue = eValue.value().getValue();
         }
         std::cout << "  op:" << (uint32_t)entry.value().getOp()
                   << " fkey:" << opkey.value().getPrimaryKey()
                   << " skey:" << opkey.value().getSecondaryKey()
-                  << " opvalue:" << opvalue.value().getValue() << std::endl;
+                  << " opvalue:" << opvalue << std::endl;
       }
     } else if (_mode == TOOL_MODE::BASE64_SHOW) {
       std::string baseKey =
@@ -124,72 +267,36 @@ class BinlogScanner {
   }
 
   Expected<std::string> scan() {
-    FILE* pf = fopen(_logfile.c_str(), "r");
-    if (pf == NULL) {
-      return {ErrorCodes::ERR_INTERNAL, "fopen failed"};
+    BinlogFileReader reader(_logfile);
+    auto s = reader.open();
+    if (!s.ok()) {
+      return s;
     }
-    const uint32_t kBuffLen = 4096;
-    char buff[kBuffLen];
-
-    int ret = fread(buff, BINLOG_HEADER_V2_LEN, 1, pf);
-    if (ret != 1 || strstr(buff, BINLOG_HEADER_V2) != buff) {
-      fclose(pf);
-      return {ErrorCodes::ERR_INTERNAL, "read head failed"};
+    // the archive files are indexed, the blocks before the start position
+    // or the start datetime are skipped
+    if (_startPosition > 0) {
+      reader.seek(_startPosition);
+    } else if (_startDatetime > 0) {
+      reader.seekTimestamp(_startDatetime);
     }
-    buff[BINLOG_HEADER_V2_LEN] = '\0';
-    uint32_t storeId =
-      be32toh(*reinterpret_cast<uint32_t*>(buff + strlen(BINLOG_HEADER_V2)));
-
-    while (!feof(pf)) {
-      // keylen
-      uint32_t keylen = 0;
-      ret = fread(buff, sizeof(uint32_t), 1, pf);
-      if (ret != 1) {
-        if (feof(pf)) {
-          fclose(pf);
-          return {ErrorCodes::ERR_OK, ""};
+    while (true) {
+      auto log = reader.next();
+      if (!log.ok()) {
+        if (log.status().code() == ErrorCodes::ERR_EXHAUST) {
+          break;
         }
-        fclose(pf);
-        return {ErrorCodes::ERR_INTERNAL, "read keylen failed"};
-      }
-      buff[sizeof(uint32_t)] = '\0';
-      keylen = int32Decode(buff);
-
-      // key
-      std::string key;
-      key.resize(keylen);
-      ret = fread(const_cast<char*>(key.c_str()), keylen, 1, pf);
-      if (ret != 1) {
-        fclose(pf);
-        return {ErrorCodes::ERR_INTERNAL, "read key failed"};
-      }
-
-      // valuelen
-      uint32_t valuelen = 0;
-      ret = fread(buff, sizeof(uint32_t), 1, pf);
-      if (ret != 1) {
-        fclose(pf);
-        return {ErrorCodes::ERR_INTERNAL, "read valuelen failed"};
+        return log.status();
       }
-      buff[sizeof(uint32_t)] = '\0';
-      valuelen = int32Decode(buff);
-
-      // value
-      std::string value;
-      value.resize(valuelen);
-      ret = fread(const_cast<char*>(value.c_str()), valuelen, 1, pf);
-      if (ret != 1) {
-        fclose(pf);
-        return {ErrorCodes::ERR_INTERNAL, "read value failed"};
+      if (reader.isArchive() && log.value().getBinlogId() > _endPosition) {
+        break;
       }
-
-      auto retStr = process(key, value, storeId);
+      auto retStr = process(log.value().getReplLogKey(),
+                            log.value().getReplLogValue(),
+                            reader.storeId());
       if (!retStr.empty()) {
         return retStr;
       }
     }
-
-    fclose(pf);
     return {ErrorCodes::ERR_OK, ""};
   }
 
@@ -224,6 +331,308 @@ class BinlogScanner {
   uint64_t _lastbinlogtime = UINT64_MAX;
 };
 
+// BinlogRestorer replays the dump files of all the stores to a server
+// concurrently, for the point in time restore. The binlogs of a store are
+// sent as restorebinlogv2 commands pipelined on one connection, with at
+// most window commands not replied. A session processes its commands one
+// by one, so the binlogs are applied in order.
+class BinlogRestorer {
+ public:
+  struct StoreStat {
+    uint32_t storeId = 0;
+    uint64_t files = 0;
+    uint64_t binlogs = 0;
+    uint64_t bytes = 0;
+    uint64_t lastId = 0;
+    uint64_t lastTs = 0;
+    uint64_t elapsedMs = 0;
+    Status status = {ErrorCodes::ERR_OK, ""};
+  };
+
+  void init(const tendisplus::ParamManager& pm) {
+    _dumpdir = pm.getString("dumpdir");
+    _host = pm.getString("host", "127.0.0.1");
+    _port = pm.getUint64("port", 0);
+    _password = pm.getString("password");
+    _window = std::max(pm.getUint64("window", _window), (uint64_t)2);
+    _startPosition = pm.getUint64("start-position", _startPosition);
+    _endDatetime = pm.getUint64("end-datetime", _endDatetime);
+    _endPosition = pm.getUint64("end-position", _endPosition);
+    for (const auto& id : stringSplit(pm.getString("stores"), ",")) {
+      auto eid = ::tendisplus::stoul(id);
+      if (eid.ok()) {
+        _stores.push_back(eid.value());
+      }
+    }
+  }
+
+  Expected<std::string> run() {
+    if (_dumpdir.empty() || _port == 0) {
+      return {ErrorCodes::ERR_PARSEOPT, "dumpdir and port are required"};
+    }
+    if (_stores.empty()) {
+      std::error_code ec;
+      for (auto& p : filesystem::directory_iterator(_dumpdir, ec)) {
+        auto eid = ::tendisplus::stoul(p.path().filename().string());
+        if (filesystem::is_directory(p) && eid.ok()) {
+          _stores.push_back(eid.value());
+        }
+      }
+      if (ec) {
+        return {ErrorCodes::ERR_INTERNAL, "list dumpdir failed"};
+      }
+      std::sort(_stores.begin(), _stores.end());
+    }
+
+    auto ctx = std::make_shared<asio::io_context>();
+    std::thread ioThd([ctx] {
+      asio::io_context::work work(*ctx);
+      ctx->run();
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<StoreStat> stats(_stores.size());
+    std::vector<std::thread> thds;
+    for (size_t i = 0; i < _stores.size(); i++) {
+      stats[i].storeId = _stores[i];
+      thds.emplace_back([this, ctx, &stats, i] {
+        auto begin = std::chrono::steady_clock::now();
+        stats[i].status = restoreStore(ctx, &stats[i]);
+        stats[i].elapsedMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - begin)
+            .count();
+      });
+    }
+    for (auto& thd : thds) {
+      thd.join();
+    }
+    auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    ctx->stop();
+    ioThd.join();
+
+    uint64_t binlogs = 0;
+    uint64_t bytes = 0;
+    std::string errmsg;
+    for (const auto& st : stats) {
+      std::cout << "storeid:" << st.storeId << " files:" << st.files
+                << " binlogs:" << st.binlogs << " bytes:" << st.bytes
+                << " lastbinlogid:" << st.lastId
+                << " lastbinlogtime:" << st.lastTs
+                << " elapsed(ms):" << st.elapsedMs;
+      if (!st.status.ok()) {
+        std::cout << " error:" << st.status.toString();
+        errmsg += "store " + std::to_string(st.storeId) +
+          " failed: " + st.status.toString() + ". ";
+      }
+      std::cout << std::endl;
+      binlogs += st.binlogs;
+      bytes += st.bytes;
+    }
+    double secs = std::max(elapsedMs, (int64_t)1) / 1000.0;
+    std::cout << "stores:" << stats.size() << " binlogs:" << binlogs
+              << " bytes:" << bytes << " elapsed(ms):" << elapsedMs
+              << " binlogs/s:" << static_cast<uint64_t>(binlogs / secs)
+              << " MB/s:" << bytes / secs / 1024 / 1024 << std::endl;
+
+    if (!errmsg.empty()) {
+      return {ErrorCodes::ERR_INTERNAL, errmsg};
+    }
+    return {ErrorCodes::ERR_OK, ""};
+  }
+
+ private:
+  Expected<std::string> command(BlockingTcpClient* client,
+                                const std::vector<std::string>& args) {
+    std::stringstream ss;
+    Command::fmtMultiBulkLen(ss, args.size());
+    for (const auto& arg : args) {
+      Command::fmtBulk(ss, arg);
+    }
+    auto s = client->writeData(ss.str());
+    if (!s.ok()) {
+      return s;
+    }
+    return client->readLine(std::chrono::seconds(kTimeoutSec));
+  }
+
+  Status readReplies(BlockingTcpClient* client, uint64_t* inflight,
+                     uint64_t remain) {
+    while (*inflight > remain) {
+      auto reply = client->readLine(std::chrono::seconds(kTimeoutSec));
+      if (!reply.ok()) {
+        return reply.status();
+      }
+      if (reply.value() != "+OK") {
+        return {ErrorCodes::ERR_INTERNAL, "restorebinlogv2 " + reply.value()};
+      }
+      (*inflight)--;
+    }
+    return {ErrorCodes::ERR_OK, ""};
+  }
+
+  Status restoreStore(std::shared_ptr<asio::io_context> ctx, StoreStat* st) {
+    std::string dir = _dumpdir + "/" + std::to_string(st->storeId) + "/";
+    std::vector<std::string> files;
+    std::error_code ec;
+    for (auto& p : filesystem::directory_iterator(dir, ec)) {
+      if (filesystem::is_regular_file(p) &&
+          p.path().filename().string().substr(0, 6) == "binlog") {
+        files.push_back(p.path().string());
+      }
+    }
+    if (ec) {
+      return {ErrorCodes::ERR_INTERNAL, "list " + dir + " failed"};
+    }
+    std::sort(files.begin(), files.end());
+
+    auto client = std::make_shared<BlockingTcpClient>(ctx, 64 * 1024);
+    auto s = client->connect(_host, _port, std::chrono::milliseconds(1000));
+    if (!s.ok()) {
+      return s;
+    }
+    if (!_password.empty()) {
+      auto reply = command(client.get(), {"auth", _password});
+      if (!reply.ok()) {
+        return reply.status();
+      } else if (reply.value() != "+OK") {
+        return {ErrorCodes::ERR_AUTH, "auth " + reply.value()};
+      }
+    }
+
+    // continue from the highest binlog of the store by default
+    std::string storeId = std::to_string(st->storeId);
+    uint64_t startPosition = _startPosition;
+    if (startPosition == 0) {
+      auto reply = command(client.get(), {"binlogpos", storeId});
+      if (!reply.ok()) {
+        return reply.status();
+      }
+      const std::string& str = reply.value();
+      auto pos = ::tendisplus::stoul(str.empty() ? str : str.substr(1));
+      if (str.empty() || str[0] != ':' || !pos.ok()) {
+        return {ErrorCodes::ERR_INTERNAL, "binlogpos " + str};
+      }
+      startPosition = pos.value() + 1;
+    }
+
+    // replies are read after a batch is sent, to keep a batch in flight
+    // while the next one is built
+    const uint64_t batch = _window / 2;
+    uint64_t inflight = 0;
+    uint64_t pending = 0;
+    std::stringstream ss;
+    bool stopped = false;
+    for (const auto& file : files) {
+      if (stopped) {
+        break;
+      }
+      BinlogFileReader reader(file);
+      s = reader.open();
+      if (!s.ok()) {
+        return {s.code(), s.toString() + ". file name: " + file};
+      }
+      if (reader.storeId() != st->storeId) {
+        return {ErrorCodes::ERR_INTERNAL, "storeid not match: " + file};
+      }
+      // the first binlog past the end datetime is found by the block max
+      // timestamps of an archive file, the blocks before it are restored
+      // without loading it
+      uint64_t endPosition = _endPosition;
+      if (reader.isArchive() && _endDatetime != UINT64_MAX) {
+        reader.seekTimestamp(_endDatetime + 1);
+        auto log = reader.next();
+        if (log.ok()) {
+          endPosition = std::min(endPosition, log.value().getBinlogId() - 1);
+        } else if (log.status().code() != ErrorCodes::ERR_EXHAUST) {
+          return {log.status().code(),
+                  log.status().toString() + ". file name: " + file};
+        }
+      }
+      reader.seek(startPosition);
+      st->files++;
+
+      while (true) {
+        auto log = reader.next();
+        if (!log.ok()) {
+          if (log.status().code() == ErrorCodes::ERR_EXHAUST) {
+            break;
+          }
+          return {log.status().code(),
+                  log.status().toString() + ". file name: " + file};
+        }
+        const auto& key = log.value().getReplLogKey();
+        const auto& value = log.value().getReplLogValue();
+        if (key.size() < RecordKey::minSize()) {
+          return {ErrorCodes::ERR_DECODE, "decode logkey failed: " + file};
+        }
+        uint64_t binlogId = log.value().getBinlogId();
+        // NOTE(tendis): the restore stops at the first binlog past the end
+        // datetime, the binlogs after it are not restored even if their
+        // timestamps are not greater, unlike --mode=base64
+        uint64_t ts = log.value().getTimestamp();
+        if (binlogId > endPosition || ts > _endDatetime) {
+          stopped = true;
+          break;
+        }
+        if (binlogId < startPosition) {
+          continue;
+        }
+
+        Command::fmtMultiBulkLen(ss, 4);
+        Command::fmtBulk(ss, "restorebinlogv2");
+        Command::fmtBulk(ss, storeId);
+        Command::fmtBulk(ss, Base64::Encode((unsigned char*)key.c_str(),
+                                            key.size()));
+        Command::fmtBulk(ss, Base64::Encode((unsigned char*)value.c_str(),
+                                            value.size()));
+        pending++;
+        st->binlogs++;
+        st->bytes += key.size() + value.size();
+        st->lastId = binlogId;
+        st->lastTs = ts;
+        if (pending < batch) {
+          continue;
+        }
+        s = client->writeData(ss.str());
+        if (!s.ok()) {
+          return s;
+        }
+        ss.str("");
+        inflight += pending;
+        pending = 0;
+        s = readReplies(client.get(), &inflight, _window - batch);
+        if (!s.ok()) {
+          return s;
+        }
+      }
+    }
+
+    if (pending > 0) {
+      s = client->writeData(ss.str());
+      if (!s.ok()) {
+        return s;
+      }
+      inflight += pending;
+    }
+    return readReplies(client.get(), &inflight, 0);
+  }
+
+  static constexpr uint64_t kTimeoutSec = 60;
+
+  std::string _dumpdir;
+  std::string _host;
+  uint64_t _port = 0;
+  std::string _password;
+  uint64_t _window = 64;
+  std::vector<uint32_t> _stores;
+  uint64_t _startPosition = 0;
+  uint64_t _endDatetime = UINT64_MAX;
+  uint64_t _endPosition = UINT64_MAX;
+};
+
 }  // namespace tendisplus
 
 void usage() {
@@ -231,6 +640,15 @@ void usage() {
             << " --start-datetime=1111 --end-datetime=22222"
             << " --start-position=333333 --end-position=55555"
             << /*" --keys=1,2,4,5,6,7,8,9" <<*/ std::endl;
+  std::cerr << "  the binlogs of timestamps out of the datetimes are skipped"
+            << std::endl;
+  std::cerr << "binlog_tool --mode=restore --dumpdir=./dump"
+            << " --host=127.0.0.1 --port=51002 --password=xxx"
+            << " --stores=0,1,2 --window=64"
+            << " --start-position=333333 --end-datetime=22222"
+            << " --end-position=55555" << std::endl;
+  std::cerr << "  a store is restored until the first binlog past"
+            << " --end-datetime or --end-position" << std::endl;
 }
 
 int main(int argc, char** argv) {
@@ -241,9 +659,16 @@ int main(int argc, char** argv) {
   tendisplus::ParamManager pm;
   pm.init(argc, argv);
 
-  tendisplus::BinlogScanner bs;
-  bs.init(pm);
-  auto e = bs.run();
+  tendisplus::Expected<std::string> e = {tendisplus::ErrorCodes::ERR_OK, ""};
+  if (pm.getString("mode") == "restore") {
+    tendisplus::BinlogRestorer br;
+    br.init(pm);
+    e = br.run();
+  } else {
+    tendisplus::BinlogScanner bs;
+    bs.init(pm);
+    e = bs.run();
+  }
   if (e.ok()) {
     return 0;
   }
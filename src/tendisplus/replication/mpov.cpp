@@ -5,22 +5,27 @@
 #include <list>
 #include <chrono>  // NOLINT
 #include <fstream>
+#include <map>
 #include <string>
 #include <memory>
+#include <utility>
 
 #include "glog/logging.h"
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 
 #include "tendisplus/replication/repl_manager.h"
+#include "tendisplus/utils/portable.h"
 #include "tendisplus/utils/scopeguard.h"
+#include "tendisplus/utils/string.h"
 
 namespace tendisplus {
 
 bool ReplManager::supplyFullSync(asio::ip::tcp::socket sock,
                                  const std::string& storeIdArg,
                                  const std::string& slaveIpArg,
-                                 const std::string& slavePortArg) {
+                                 const std::string& slavePortArg,
+                                 const std::string& modeArg) {
   std::shared_ptr<BlockingTcpClient> client =
     std::move(_svr->getNetwork()->createBlockingClient(std::move(sock),
                                                        64 * 1024 * 1024));
@@ -51,17 +56,57 @@ bool ReplManager::supplyFullSync(asio::ip::tcp::socket sock,
   LOG(INFO) << "ReplManager::supplyFullSync storeId:" << storeIdArg << " "
             << slaveIpArg << ":" << slavePortArg;
   uint16_t slavePort = static_cast<uint16_t>(expSlavePort.value());
+  if (modeArg != "" && modeArg != "resume") {
+    client->writeLine("-ERR invalid mode");
+    return false;
+  }
+  bool resume = modeArg == "resume";
   _fullPusher->schedule([this,
                          storeId,
                          client(std::move(client)),
                          slaveIpArg,
-                         slavePort]() mutable {
-    supplyFullSyncRoutine(std::move(client), storeId, slaveIpArg, slavePort);
+                         slavePort,
+                         resume]() mutable {
+    supplyFullSyncRoutine(
+      std::move(client), storeId, slaveIpArg, slavePort, resume);
   });
 
   return true;
 }
 
+bool ReplManager::supplyFullSyncFiles(asio::ip::tcp::socket sock,
+                                      const std::string& storeIdArg,
+                                      const std::string& binlogPosArg) {
+  std::shared_ptr<BlockingTcpClient> client =
+    std::move(_svr->getNetwork()->createBlockingClient(std::move(sock),
+                                                       64 * 1024 * 1024));
+
+  // the slave goes on with less streams
+  if (isFullSupplierFull()) {
+    LOG(WARNING) << "ReplManager::supplyFullSyncFiles fullPusher isFull.";
+    client->writeLine("-ERR workerpool full");
+    return false;
+  }
+
+  auto expStoreId = tendisplus::stoul(storeIdArg);
+  if (!expStoreId.ok() || expStoreId.value() >= _fullSyncBackup.size()) {
+    client->writeLine("-ERR invalid storeId");
+    return false;
+  }
+  uint32_t storeId = static_cast<uint32_t>(expStoreId.value());
+  auto expPos = tendisplus::stoul(binlogPosArg);
+  if (!expPos.ok()) {
+    client->writeLine("-ERR invalid binlogPos");
+    return false;
+  }
+  uint64_t binlogPos = expPos.value();
+  _fullPusher->schedule(
+    [this, storeId, client(std::move(client)), binlogPos]() mutable {
+      supplyFullSyncFilesRoutine(std::move(client), storeId, binlogPos);
+    });
+  return true;
+}
+
 bool ReplManager::isFullSupplierFull() const {
   return _fullPusher->isFull();
 }
@@ -89,6 +134,7 @@ void ReplManager::masterPushRoutine(uint32_t storeId, uint64_t clientId) {
 
   uint64_t binlogPos = 0;
   BlockingTcpClient* client = nullptr;
+  std::shared_ptr<BinlogSendWindow> window;
   uint32_t dstStoreId = 0;
   bool needHeartbeat = false;
   {
@@ -101,15 +147,39 @@ void ReplManager::masterPushRoutine(uint32_t storeId, uint64_t clientId) {
     }
     binlogPos = _pushStatus[storeId][clientId]->binlogPos;
     client = _pushStatus[storeId][clientId]->client.get();
+    if (!_pushStatus[storeId][clientId]->window) {
+      _pushStatus[storeId][clientId]->window =
+        std::make_shared<BinlogSendWindow>();
+    }
+    window = _pushStatus[storeId][clientId]->window;
     dstStoreId = _pushStatus[storeId][clientId]->dstStoreId;
     lastSend = _pushStatus[storeId][clientId]->lastSendBinlogTime;
+    // NOTE(tendis): the slave misses the data changed without binlogs,
+    // drop it, it is refused by INCRSYNC and turns to full sync.
+    if (binlogPos < _fullSyncBarrier[storeId]) {
+      LOG(WARNING) << "drop slave:" << client->getRemoteRepr()
+                   << " of store:" << storeId << ",binlogPos:" << binlogPos
+                   << " before fullsync barrier:"
+                   << _fullSyncBarrier[storeId];
+#if defined(WIN32) && _MSC_VER > 1900
+      delete _pushStatus[storeId][clientId];
+#endif
+      _pushStatus[storeId].erase(clientId);
+      return;
+    }
   }
   if (lastSend + std::chrono::seconds(gBinlogHeartbeatSecs) < SCLOCK::now()) {
     needHeartbeat = true;
   }
 
-  auto ret = masterSendBinlogV2(
-    client, storeId, dstStoreId, binlogPos, needHeartbeat, _svr, _cfg);
+  auto ret = masterSendBinlogV2(client,
+                                storeId,
+                                dstStoreId,
+                                binlogPos,
+                                needHeartbeat,
+                                _svr,
+                                _cfg,
+                                window.get());
   if (!ret.ok()) {
     LOG(WARNING) << "masterSendBinlog to client:" << client->getRemoteRepr()
                  << " failed:" << ret.status().toString();
@@ -123,7 +193,7 @@ void ReplManager::masterPushRoutine(uint32_t storeId, uint64_t clientId) {
     _pushStatus[storeId].erase(clientId);
     return;
   } else {
-    if (ret.value().binlogId > binlogPos) {
+    if (ret.value().binlogId > binlogPos || !window->inflight.empty()) {
       nextSched = SCLOCK::now();
       lastSend = nextSched;
     } else {
@@ -154,7 +224,8 @@ bool ReplManager::registerIncrSync(asio::ip::tcp::socket sock,
                                    const std::string& dstStoreIdArg,
                                    const std::string& binlogPosArg,
                                    const std::string& listenIpArg,
-                                   const std::string& listenPortArg) {
+                                   const std::string& listenPortArg,
+                                   const std::string& compressArg) {
   std::shared_ptr<BlockingTcpClient> client =
     std::move(_svr->getNetwork()->createBlockingClient(std::move(sock),
                                                        64 * 1024 * 1024));
@@ -181,6 +252,13 @@ bool ReplManager::registerIncrSync(asio::ip::tcp::socket sock,
     return false;
   }
 
+  if (compressArg != "" && compressArg != "lz4") {
+    client->writeLine("-ERR invalid compress type");
+    return false;
+  }
+  auto window = std::make_shared<BinlogSendWindow>();
+  window->lz4 = compressArg == "lz4";
+
   // NOTE(vinchen): In the cluster view, storeID of source and dest must be
   // same.
   if (storeId != dstStoreId) {
@@ -200,10 +278,21 @@ bool ReplManager::registerIncrSync(asio::ip::tcp::socket sock,
 
   uint64_t firstPos = 0;
   uint64_t lastFlushBinlogId = 0;
+  uint64_t barrier = 0;
   {
     std::lock_guard<std::mutex> lk(_mutex);
     firstPos = _logRecycStatus[storeId]->firstBinlogId;
     lastFlushBinlogId = _logRecycStatus[storeId]->lastFlushBinlogId;
+    barrier = _fullSyncBarrier[storeId];
+  }
+
+  if (binlogPos < barrier) {
+    std::stringstream ss;
+    ss << "-ERR FULLSYNC required,storeId:" << storeId
+       << ",slave binlogPos:" << binlogPos << ",barrier:" << barrier;
+    client->writeLine(ss.str());
+    LOG(WARNING) << ss.str();
+    return false;
   }
 
   // NOTE(deyukong): this check is not precise
@@ -241,6 +330,7 @@ bool ReplManager::registerIncrSync(asio::ip::tcp::socket sock,
                       dstStoreId,
                       binlogPos,
                       client = std::move(client),
+                      window,
                       listenIpArg,
                       listen_port]() mutable {
     std::lock_guard<std::mutex> lk(_mutex);
@@ -291,6 +381,7 @@ bool ReplManager::registerIncrSync(asio::ip::tcp::socket sock,
                      listenIpArg,
                      listen_port}));
 #endif
+    _pushStatus[storeId][clientId]->window = window;
     return true;
   }();
   LOG(INFO) << "slave:" << remoteHost << " registerIncrSync "
@@ -299,24 +390,160 @@ bool ReplManager::registerIncrSync(asio::ip::tcp::socket sock,
   return registPosOk;
 }
 
+Expected<std::shared_ptr<FullSyncBackup>> ReplManager::acquireFullSyncBackup(
+  uint32_t storeId, PStore store) {
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto& kept = _fullSyncBackup[storeId];
+    if (kept) {
+      std::error_code ec;
+      if (filesystem::exists(store->dftBackupDir(), ec)) {
+        kept->users++;
+        return kept;
+      }
+      // the backup dir is removed with the store, such as by a restart
+      if (kept->users != 0) {
+        return {ErrorCodes::ERR_INTERNAL, "backup dir removed"};
+      }
+      LOG(WARNING) << "store:" << storeId << " fullsync backup removed";
+      kept.reset();
+      store->releaseBackup();
+    }
+  }
+
+  uint64_t currTime = nsSinceEpoch();
+  Expected<BackupInfo> bkInfo =
+    store->backup(store->dftBackupDir(),
+                  KVStore::BackupMode::BACKUP_CKPT_INTER,
+                  _svr->getCatalog()->getBinlogVersion());
+  if (!bkInfo.ok()) {
+    return bkInfo.status();
+  }
+  LOG(INFO) << "storeId:" << storeId
+            << ",backup cost:" << (nsSinceEpoch() - currTime) << "ns"
+            << ",pos:" << bkInfo.value().getBinlogPos();
+
+  auto backup = std::make_shared<FullSyncBackup>();
+  backup->info = std::move(bkInfo.value());
+  backup->users = 1;
+  std::lock_guard<std::mutex> lk(_mutex);
+  INVARIANT_D(_fullSyncBackup[storeId] == nullptr);
+  _fullSyncBackup[storeId] = backup;
+  return backup;
+}
+
+void ReplManager::releaseFullSyncBackup(uint32_t storeId,
+                                        PStore store,
+                                        bool hasError) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  auto& backup = _fullSyncBackup[storeId];
+  INVARIANT(backup != nullptr && backup->users > 0);
+  backup->users--;
+  if (hasError) {
+    // the slave may resume it in a while
+    backup->expireTime =
+      SCLOCK::now() + std::chrono::seconds(_cfg->fullSyncKeepSecs);
+  }
+  if (backup->users != 0 || SCLOCK::now() < backup->expireTime) {
+    return;
+  }
+  Status s = store->releaseBackup();
+  if (!s.ok()) {
+    LOG(ERROR) << "supplyFullSync end clean store:" << storeId
+               << " error:" << s.toString();
+  }
+  backup.reset();
+}
+
+Status ReplManager::computeFullSyncChecksums(PStore store,
+                                             FullSyncBackup* backup) {
+  std::lock_guard<std::mutex> lk(backup->mutex);
+  if (!backup->checksums.empty()) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  uint64_t currTime = nsSinceEpoch();
+  std::map<std::string, uint32_t> checksums;
+  for (const auto& kv : backup->info.getFileList()) {
+    auto crc = fileChecksum(store->dftBackupDir() + "/" + kv.first);
+    if (!crc.ok()) {
+      return crc.status();
+    }
+    checksums[kv.first] = crc.value();
+  }
+  LOG(INFO) << "store:" << store->dbId() << " fullsync checksums cost:"
+            << (nsSinceEpoch() - currTime) << "ns";
+  backup->checksums = std::move(checksums);
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+// serve the requests of a resumable full sync until +OK
+//     FILE name batchSize: send the file in batches
+//     PING: keep the connection while the slave waits for other streams
+Status ReplManager::serveFullSyncFiles(BlockingTcpClient* client,
+                                       PStore store,
+                                       const FullSyncBackup& backup) {
+  const auto& flist = backup.info.getFileList();
+  uint32_t secs = _cfg->timeoutSecBinlogWaitRsp;
+  while (true) {
+    auto line = client->readLine(std::chrono::seconds(secs));
+    if (!line.ok()) {
+      return line.status();
+    }
+    if (line.value() == "+OK") {
+      return {ErrorCodes::ERR_OK, ""};
+    }
+    if (line.value() == "PING") {
+      continue;
+    }
+    auto args = stringSplit(line.value(), " ");
+    if (args.size() != 3 || args[0] != "FILE") {
+      return {ErrorCodes::ERR_PARSEOPT, "invalid request:" + line.value()};
+    }
+    auto it = flist.find(args[1]);
+    auto batch = tendisplus::stoul(args[2]);
+    if (it == flist.end() || !batch.ok() || batch.value() == 0) {
+      client->writeLine("-ERR invalid file");
+      return {ErrorCodes::ERR_PARSEOPT, "invalid request:" + line.value()};
+    }
+    Status s = sendFullSyncFile(client,
+                                store->dftBackupDir() + "/" + it->first,
+                                it->second,
+                                batch.value(),
+                                _rateLimiter.get(),
+                                secs);
+    if (!s.ok()) {
+      LOG(ERROR) << "send client:" << client->getRemoteRepr()
+                 << " file:" << it->first << ",size:" << it->second
+                 << " failed:" << s.toString();
+      return s;
+    }
+    LOG(INFO) << "fulsync send file success:" << it->first;
+  }
+}
+
 // mpov's network communicate procedure
 // send binlogpos low watermark
 // send filelist={filename->filesize}
-// foreach file
-//     send filename
-//     send content
+// if resume
+//     send checksums={filename->crc32c}
+//     serveFullSyncFiles()
+// else
+//     foreach file
+//         send filename
+//         send content
+//         read +OK
 //     read +OK
-// read +OK
 void ReplManager::supplyFullSyncRoutine(
   std::shared_ptr<BlockingTcpClient> client,
   uint32_t storeId,
   const string& slave_listen_ip,
-  uint16_t slave_listen_port) {
+  uint16_t slave_listen_port,
+  bool resume) {
   LocalSessionGuard sg(_svr.get());
   sg.getSession()->setArgs(
     {"masterfullsync", client->getRemoteRepr(), std::to_string(storeId)});
   LOG(INFO) << "client:" << client->getRemoteRepr() << ",storeId:" << storeId
-            << ",begins fullsync";
+            << ",begins fullsync" << (resume ? " resume" : "");
   auto expdb = _svr->getSegmentMgr()->getDb(
     sg.getSession(), storeId, mgl::LockMode::LOCK_IS);
   if (!expdb.ok()) {
@@ -335,15 +562,23 @@ void ReplManager::supplyFullSyncRoutine(
     return;
   }
 
+  string slaveNode = slave_listen_ip + ":" + to_string(slave_listen_port);
   {
     std::lock_guard<std::mutex> lk(_mutex);
     uint64_t highestBinlogid = store->getHighestBinlogId();
-    string slaveNode = slave_listen_ip + ":" + to_string(slave_listen_port);
+    // the binlogs after the kept backup are needed if it is used
+    if (_fullSyncBackup[storeId]) {
+      highestBinlogid = std::min(
+        highestBinlogid, _fullSyncBackup[storeId]->info.getBinlogPos());
+    }
     auto iter = _fullPushStatus[storeId].find(slaveNode);
     if (iter != _fullPushStatus[storeId].end()) {
       LOG(INFO) << "supplyFullSyncRoutine already have _fullPushStatus, "
                 << iter->second->toString();
       if (iter->second->state == FullPushState::ERR) {
+#if defined(_WIN32) && _MSC_VER > 1900
+        delete iter->second;
+#endif
         _fullPushStatus[storeId].erase(iter);
       } else {
         client->writeLine("-ERR already have _fullPushStatus, " +
@@ -379,67 +614,64 @@ void ReplManager::supplyFullSyncRoutine(
 #endif
   }
   bool hasError = true;
-  auto guard_0 = MakeGuard(
-    [this, store, storeId, &hasError, slave_listen_ip, slave_listen_port]() {
-      std::lock_guard<std::mutex> lk(_mutex);
-      string slaveNode = slave_listen_ip + ":" + to_string(slave_listen_port);
-      auto iter = _fullPushStatus[storeId].find(slaveNode);
-      if (iter != _fullPushStatus[storeId].end()) {
-        if (hasError) {
-          LOG(INFO) << "supplyFullSyncRoutine hasError, _fullPushStatus erase, "
-                    << iter->second->toString();
-          _fullPushStatus[storeId].erase(iter);
-        } else {
-          iter->second->endTime = SCLOCK::now();
-          iter->second->state = FullPushState::SUCESS;
-        }
+  auto guard_0 = MakeGuard([this, storeId, &hasError, slaveNode]() {
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto iter = _fullPushStatus[storeId].find(slaveNode);
+    if (iter != _fullPushStatus[storeId].end()) {
+      // NOTE(tendis): the failed one is kept for a while to protect the
+      // binlogs after the backup, see recycleFullPushStatus()
+      iter->second->endTime = SCLOCK::now();
+      if (hasError) {
+        LOG(INFO) << "supplyFullSyncRoutine hasError, "
+                  << iter->second->toString();
+        iter->second->state = FullPushState::ERR;
       } else {
-        LOG(ERROR) << "supplyFullSyncRoutine, _fullPushStatus find node "
-                      "failed, storeid:"
-                   << storeId << " slave node:" << slaveNode;
+        iter->second->state = FullPushState::SUCESS;
       }
-    });
+    } else {
+      LOG(ERROR) << "supplyFullSyncRoutine, _fullPushStatus find node "
+                    "failed, storeid:"
+                 << storeId << " slave node:" << slaveNode;
+    }
+  });
 
-  uint64_t currTime = nsSinceEpoch();
-  Expected<BackupInfo> bkInfo =
-    store->backup(store->dftBackupDir(),
-                  KVStore::BackupMode::BACKUP_CKPT_INTER,
-                  _svr->getCatalog()->getBinlogVersion());
-  if (!bkInfo.ok()) {
+  auto ebackup = acquireFullSyncBackup(storeId, store);
+  if (!ebackup.ok()) {
     std::stringstream ss;
-    ss << "-ERR backup failed:" << bkInfo.status().toString();
+    ss << "-ERR backup failed:" << ebackup.status().toString();
     client->writeLine(ss.str());
-    LOG(ERROR) << "backup failed:" << bkInfo.status().toString();
+    LOG(ERROR) << "backup failed:" << ebackup.status().toString();
     return;
-  } else {
-    LOG(INFO) << "storeId:" << storeId
-              << ",backup cost:" << (nsSinceEpoch() - currTime) << "ns"
-              << ",pos:" << bkInfo.value().getBinlogPos();
   }
-
-  auto guard = MakeGuard([this, store, storeId]() {
-    Status s = store->releaseBackup();
-    if (!s.ok()) {
-      LOG(ERROR) << "supplyFullSync end clean store:" << storeId
-                 << " error:" << s.toString();
+  auto backup = std::move(ebackup.value());
+  const BackupInfo& bkInfo = backup->info;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto iter = _fullPushStatus[storeId].find(slaveNode);
+    if (iter != _fullPushStatus[storeId].end()) {
+      iter->second->binlogPos = bkInfo.getBinlogPos();
     }
+  }
+
+  auto guard = MakeGuard([this, store, storeId, &hasError]() {
+    releaseFullSyncBackup(storeId, store, hasError);
   });
 
   // send binlogPos
-  Status s = client->writeLine(std::to_string(bkInfo.value().getBinlogPos()));
+  Status s = client->writeLine(std::to_string(bkInfo.getBinlogPos()));
   if (!s.ok()) {
     LOG(ERROR) << "store:" << storeId
                << " fullsync send binlogpos failed:" << s.toString();
     return;
   }
   LOG(INFO) << "fullsync " << storeId
-            << " send binlogPos success:" << bkInfo.value().getBinlogPos();
+            << " send binlogPos success:" << bkInfo.getBinlogPos();
 
   // send fileList
   rapidjson::StringBuffer sb;
   rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
   writer.StartObject();
-  for (const auto& kv : bkInfo.value().getFileList()) {
+  for (const auto& kv : bkInfo.getFileList()) {
     writer.Key(kv.first.c_str());
     writer.Uint64(kv.second);
   }
@@ -454,10 +686,43 @@ void ReplManager::supplyFullSyncRoutine(
   LOG(INFO) << "fullsync " << storeId
             << " send fileList success:" << sb.GetString();
 
-  std::string readBuf;
+  if (resume) {
+    // the slave skips the files it has by the checksums
+    s = computeFullSyncChecksums(store, backup.get());
+    if (!s.ok()) {
+      client->writeLine("-ERR checksum failed:" + s.toString());
+      LOG(ERROR) << "store:" << storeId
+                 << " fullsync checksum failed:" << s.toString();
+      return;
+    }
+    rapidjson::StringBuffer csb;
+    rapidjson::Writer<rapidjson::StringBuffer> cwriter(csb);
+    cwriter.StartObject();
+    for (const auto& kv : backup->checksums) {
+      cwriter.Key(kv.first.c_str());
+      cwriter.Uint(kv.second);
+    }
+    cwriter.EndObject();
+    s = client->writeLine(csb.GetString());
+    if (!s.ok()) {
+      LOG(ERROR) << "store:" << storeId
+                 << " fullsync send checksums failed:" << s.toString();
+      return;
+    }
+    s = serveFullSyncFiles(client.get(), store, *backup);
+    if (!s.ok()) {
+      LOG(ERROR) << "fullsync storeid:" << storeId << " "
+                 << client->getRemoteRepr() << " failed:" << s.toString();
+      return;
+    }
+    LOG(INFO) << "fullsync storeid:" << storeId << " done, "
+              << client->getRemoteRepr() << " port:" << slave_listen_port;
+    hasError = false;
+    return;
+  }
+
   size_t fileBatch = (_cfg->binlogRateLimitMB * 1024 * 1024) / 10;
-  readBuf.reserve(fileBatch);
-  for (auto& fileInfo : bkInfo.value().getFileList()) {
+  for (auto& fileInfo : bkInfo.getFileList()) {
     s = client->writeLine(fileInfo.first);
     if (!s.ok()) {
       LOG(ERROR) << "write fname:" << fileInfo.first
@@ -466,39 +731,19 @@ void ReplManager::supplyFullSyncRoutine(
     }
     LOG(INFO) << "fulsync send filename success:" << fileInfo.first;
     std::string fname = store->dftBackupDir() + "/" + fileInfo.first;
-    auto myfile = std::ifstream(fname, std::ios::binary);
-    if (!myfile.is_open()) {
-      LOG(ERROR) << "open file:" << fname << " for read failed";
+    secs = _cfg->timeoutSecBinlogWaitRsp;  // 10
+    s = sendFullSyncFile(client.get(),
+                         fname,
+                         fileInfo.second,
+                         fileBatch,
+                         _rateLimiter.get(),
+                         secs);
+    if (!s.ok()) {
+      LOG(ERROR) << "send client:" << client->getRemoteRepr()
+                 << "file:" << fileInfo.first << ",size:" << fileInfo.second
+                 << " failed:" << s.toString();
       return;
     }
-    size_t remain = fileInfo.second;
-    while (remain) {
-      size_t batchSize = std::min(remain, fileBatch);
-      _rateLimiter->Request(batchSize);
-      readBuf.resize(batchSize);
-      remain -= batchSize;
-      myfile.read(&readBuf[0], batchSize);
-      if (!myfile) {
-        LOG(ERROR) << "read file:" << fname
-                   << " failed with err:" << strerror(errno);
-        return;
-      }
-      s = client->writeData(readBuf);
-      if (!s.ok()) {
-        LOG(ERROR) << "write bulk to client failed:" << s.toString();
-        return;
-      }
-      secs = _cfg->timeoutSecBinlogWaitRsp;  // 10
-      auto rpl = client->readLine(std::chrono::seconds(secs));
-      if (!rpl.ok() || rpl.value() != "+OK") {
-        LOG(ERROR) << "send client:" << client->getRemoteRepr()
-                   << "file:" << fileInfo.first << ",size:" << fileInfo.second
-                   << " failed:"
-                   << (rpl.ok() ? rpl.value()
-                                : rpl.status().toString());  // NOLINT
-        return;
-      }
-    }
     LOG(INFO) << "fulsync send file success:" << fname;
   }
   secs = _cfg->timeoutSecBinlogWaitRsp;  // 10
@@ -514,4 +759,47 @@ void ReplManager::supplyFullSyncRoutine(
   }
 }
 
+// an extra stream of a resumable full sync, it fetches the files of the
+// backup used by the primary one
+void ReplManager::supplyFullSyncFilesRoutine(
+  std::shared_ptr<BlockingTcpClient> client,
+  uint32_t storeId,
+  uint64_t binlogPos) {
+  LocalSessionGuard sg(_svr.get());
+  sg.getSession()->setArgs(
+    {"masterfullsyncfiles", client->getRemoteRepr(), std::to_string(storeId)});
+  auto expdb = _svr->getSegmentMgr()->getDb(
+    sg.getSession(), storeId, mgl::LockMode::LOCK_IS);
+  if (!expdb.ok()) {
+    client->writeLine("-ERR store error: " + expdb.status().toString());
+    return;
+  }
+  auto store = std::move(expdb.value().store);
+  INVARIANT(store != nullptr);
+
+  std::shared_ptr<FullSyncBackup> backup;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    backup = _fullSyncBackup[storeId];
+    if (!backup || backup->users == 0 ||
+        backup->info.getBinlogPos() != binlogPos) {
+      client->writeLine("-ERR no such backup");
+      return;
+    }
+    backup->users++;
+  }
+  auto guard = MakeGuard([this, store, storeId]() {
+    releaseFullSyncBackup(storeId, store, false);
+  });
+
+  Status s = client->writeLine("+OK");
+  if (s.ok()) {
+    s = serveFullSyncFiles(client.get(), store, *backup);
+  }
+  if (!s.ok()) {
+    LOG(WARNING) << "fullsync files storeid:" << storeId << " "
+                 << client->getRemoteRepr() << " failed:" << s.toString();
+  }
+}
+
 }  // namespace tendisplus
@@ -27,6 +27,7 @@
 #include "tendisplus/utils/redis_port.h"
 #include "tendisplus/utils/scopeguard.h"
 #include "tendisplus/utils/string.h"
+#include "tendisplus/utils/time.h"
 
 namespace tendisplus {
 
@@ -183,6 +184,13 @@ Status ReplManager::startup() {
     return s;
   }
 
+  _applier =
+    std::make_unique<BinlogApplier>(_svr.get(), _svr->getKVStoreCount());
+  s = _applier->startup(_cfg->replApplyThreads);
+  if (!s.ok()) {
+    return s;
+  }
+
   for (uint32_t i = 0; i < _svr->getKVStoreCount(); i++) {
     // here we are starting up, dont acquire a storelock.
     auto expdb =
@@ -227,6 +235,7 @@ Status ReplManager::startup() {
     _fullPushStatus.emplace_back(
       std::map<string, std::unique_ptr<MPovFullPushStatus>>());
 #endif
+    _fullSyncBackup.emplace_back(nullptr);
 
     Status status;
 
@@ -239,7 +248,13 @@ Status ReplManager::startup() {
         // NOTE(vinchen): the binlog of slave is sync from master,
         // when the slave startup, _syncMeta[i]->binlogId should depend
         // on store->getHighestBinlogId();
-        _syncMeta[i]->binlogId = store->getHighestBinlogId();
+        // NOTE(tendis): or the binlog before the holes left by the
+        // parallel apply, see BinlogApplier::recoverPos()
+        auto pos = _applier->recoverPos(i, store);
+        if (!pos.ok()) {
+          return pos.status();
+        }
+        _syncMeta[i]->binlogId = pos.value();
       }
       if (!status.ok()) {
         return status;
@@ -313,6 +328,18 @@ Status ReplManager::startup() {
       }
     }
     _logRecycStatus.emplace_back(std::move(recBinlogStat));
+
+    uint64_t barrier = Transaction::TXNID_UNINITED;
+    if (isOpen) {
+      auto emeta = store->getVersionMeta(VersionMeta::FULLSYNC_BARRIER);
+      if (!emeta.ok()) {
+        return emeta.status();
+      }
+      if (emeta.value().getVersion() != UINT64_MAX) {
+        barrier = emeta.value().getVersion();
+      }
+    }
+    _fullSyncBarrier.push_back(barrier);
     LOG(INFO) << "store:" << i
               << ",_firstBinlogId:" << _logRecycStatus.back()->firstBinlogId
               << ",_timestamp:" << _logRecycStatus.back()->timestamp;
@@ -464,6 +491,27 @@ Status ReplManager::resetRecycleState(uint32_t storeId) {
   return {ErrorCodes::ERR_OK, ""};
 }
 
+Status ReplManager::requireFullSync(uint32_t storeId, PStore store) {
+  // NOTE(tendis): the barrier is set before the marker is written, so
+  // no slave before it can get the marker by incr-sync. A slave full
+  // synced from a backup with the marker is at the barrier at least.
+  uint64_t barrier = store->getNextBinlogSeq();
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    _fullSyncBarrier[storeId] = barrier;
+  }
+  auto s = store->setVersionMeta(
+    VersionMeta::FULLSYNC_BARRIER, msSinceEpoch(), barrier);
+  if (!s.ok()) {
+    LOG(ERROR) << "store:" << storeId
+               << " save fullsync barrier failed:" << s.toString();
+    return s;
+  }
+  LOG(INFO) << "store:" << storeId << " slaves need fullsync before binlog:"
+            << barrier;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
 std::shared_ptr<BlockingTcpClient> ReplManager::createClient(
   const StoreMeta& metaSnapshot, uint64_t timeoutMs) {
   std::shared_ptr<BlockingTcpClient> client =
@@ -580,18 +628,47 @@ void ReplManager::controlRoutine() {
 
 void ReplManager::recycleFullPushStatus() {
   auto now = SCLOCK::now();
+  auto keepSecs = std::chrono::seconds(_cfg->fullSyncKeepSecs);
   for (size_t i = 0; i < _fullPushStatus.size(); i++) {
-    for (auto& mpov : _fullPushStatus[i]) {
+    for (auto it = _fullPushStatus[i].begin();
+         it != _fullPushStatus[i].end();) {
       // if timeout, delte it.
-      if (mpov.second->state == FullPushState::SUCESS &&
-          now > mpov.second->endTime + std::chrono::seconds(600)) {
-        LOG(ERROR) << "timeout, _fullPushStatus erase,"
-                   << mpov.second->toString();
-        _fullPushStatus[i].erase(mpov.first);
+      // NOTE(tendis): a failed one is kept for fullsync-keep-secs, so that
+      // the binlogs after the backup are not recycled before it resumes
+      auto& mpov = it->second;
+      if ((mpov->state == FullPushState::SUCESS &&
+           now > mpov->endTime + std::chrono::seconds(600)) ||
+          (mpov->state == FullPushState::ERR &&
+           now > mpov->endTime + keepSecs)) {
+        LOG(ERROR) << "timeout, _fullPushStatus erase," << mpov->toString();
+#if defined(_WIN32) && _MSC_VER > 1900
+        delete mpov;
+#endif
+        it = _fullPushStatus[i].erase(it);
+      } else {
+        ++it;
       }
     }
+
+    auto& backup = _fullSyncBackup[i];
+    if (backup && backup->users == 0 && now >= backup->expireTime) {
+      auto expdb = _svr->getSegmentMgr()->getDb(
+        nullptr, i, mgl::LockMode::LOCK_NONE);
+      if (!expdb.ok()) {
+        continue;
+      }
+      LOG(INFO) << "store:" << i << " release the fullsync backup, pos:"
+                << backup->info.getBinlogPos();
+      Status s = expdb.value().store->releaseBackup();
+      if (!s.ok()) {
+        LOG(ERROR) << "release fullsync backup of store:" << i
+                   << " error:" << s.toString();
+      }
+      backup.reset();
+    }
   }
 }
+
 void ReplManager::onFlush(uint32_t storeId, uint64_t binlogid) {
   std::lock_guard<std::mutex> lk(_mutex);
   auto& v = _logRecycStatus[storeId];
@@ -769,12 +846,37 @@ void ReplManager::recycleBinlog(uint32_t storeId) {
 
   uint64_t newStart = 0;
   uint64_t newSave = 0;
+  uint64_t written = 0;
+  uint64_t ts = 0;
+  bool changeNewFile = false;
+  BinlogArchiveWriter* archive = nullptr;
+  uint64_t archiveSize = 0;
+  // NOTE(tendis): the binlogs archived but not deleted are dropped from the
+  // archive, and archived again in the same file from the binlog next to
+  // the last one committed.
+  auto rollbackArchive = [&]() {
+    auto s = archive->rollback();
+    if (!s.ok()) {
+      LOG(ERROR) << "rollback binlog archive of store:" << storeId
+                 << " failed:" << s.toString();
+      updateCurBinlogFs(storeId, 0, 0, true);
+    } else {
+      updateCurBinlogFs(storeId, archive->size() - archiveSize, 0);
+    }
+    if (archive->committedId() != 0) {
+      save = archive->committedId() + 1;
+    }
+  };
   {
     std::ofstream* fs = nullptr;
     int64_t maxWriteLen = 0;
     if (saveLogs) {
-      fs = getCurBinlogFs(storeId);
-      if (!fs) {
+      if (_cfg->binlogArchive) {
+        archive = getCurBinlogArchive(storeId);
+      } else {
+        fs = getCurBinlogFs(storeId);
+      }
+      if (!fs && !archive) {
         LOG(ERROR) << "getCurBinlogFs() store;" << storeId << "failed:";
         hasError = true;
         return;
@@ -783,19 +885,25 @@ void ReplManager::recycleBinlog(uint32_t storeId) {
       maxWriteLen = _cfg->binlogFileSizeMB * 1024 * 1024 -
         _logRecycStatus[storeId]->fileSize;
     }
+    if (archive) {
+      archiveSize = archive->size();
+    }
     DLOG(INFO) << "store:" << storeId << " "
                << _logRecycStatus[storeId]->toString();
     auto s = kvstore->truncateBinlogV2(
-      start, end, save, txn.get(), fs, maxWriteLen, tailSlave);
+      start, end, save, txn.get(), fs, archive, maxWriteLen, tailSlave);
     if (!s.ok()) {
       LOG(ERROR) << "kvstore->truncateBinlogV2 store:" << storeId
                  << "failed:" << s.status().toString();
+      if (archive) {
+        rollbackArchive();
+      }
       hasError = true;
       return;
     }
-    bool changeNewFile = s.value().ret < 0;
-    updateCurBinlogFs(
-      storeId, s.value().written, s.value().timestamp, changeNewFile);
+    changeNewFile = s.value().ret < 0;
+    written = s.value().written;
+    ts = s.value().timestamp;
     // TODO(vinchen): stat for binlog deleted
     newStart = s.value().newStart;
     newSave = s.value().newSave;
@@ -805,9 +913,19 @@ void ReplManager::recycleBinlog(uint32_t storeId) {
   if (!commitStat.ok()) {
     LOG(ERROR) << "truncate binlog store:" << storeId
                << "commit failed:" << commitStat.status().toString();
+    if (archive) {
+      rollbackArchive();
+    } else {
+      updateCurBinlogFs(storeId, written, ts, changeNewFile);
+    }
     hasError = true;
     return;
   }
+  if (archive) {
+    archive->commit();
+  }
+  // the archive may be finished here, after the binlogs in it are deleted
+  updateCurBinlogFs(storeId, written, ts, changeNewFile);
   // DLOG(INFO) << "storeid:" << storeId << " truncate binlog from:" << start
   //    << " to end:" << newStart << " success."
   //    << "addr:" << _svr->getNetwork()->getIp()
@@ -876,6 +994,19 @@ Expected<uint64_t> ReplManager::getSaveBinlogId(uint32_t storeId,
     return {ErrorCodes::ERR_INTERNAL, "parse fileno failed"};
   }
 
+  if (BinlogArchiveReader::isArchive(maxPath)) {
+    BinlogArchiveReader reader(maxPath);
+    auto s = reader.open();
+    if (!s.ok()) {
+      LOG(ERROR) << "open file:" << maxPath << " failed:" << s.toString();
+      return s;
+    }
+    if (reader.blocks().empty()) {
+      return {ErrorCodes::ERR_NO_KEY, ""};
+    }
+    return reader.blocks().back().lastId;
+  }
+
   std::ifstream fs(maxPath);
   if (!fs.is_open()) {
     LOG(ERROR) << "open file:" << maxPath << " for read failed";
@@ -1335,6 +1466,9 @@ void ReplManager::getReplInfoSimple(std::stringstream& ss) const {
     }
     ss << "slave_priority:" << slave_priority << "\r\n";
     ss << "slave_read_only:" << slave_read_only << "\r\n";
+    // the binlogs per txn applied, see repl-apply-batch
+    ss << "slave_apply_binlogs:" << _applier->appliedBinlogs() << "\r\n";
+    ss << "slave_apply_txns:" << _applier->appliedTxns() << "\r\n";
   }
   // master point of view
   std::map<std::string, ReplMPovStatus> pstatus;
@@ -1438,6 +1572,13 @@ void ReplManager::getReplInfoDetail(std::stringstream& ss) const {
       // lag in seconds
       ss << ",lag=" << (msSinceEpoch() - iter->second->binlogTs) / 1000;
       ss << ",binlog_lag=" << highestBinlogid - iter->second->binlogPos;
+      auto window = iter->second->window;
+      if (window) {
+        ss << ",compress=" << (window->lz4 ? "lz4" : "none");
+        ss << ",raw_bytes=" << window->rawBytes.load();
+        ss << ",wire_bytes=" << window->wireBytes.load();
+        ss << ",compress_us=" << window->compressUs.load();
+      }
       ss << "\r\n";
     }
     j = 0;
@@ -1533,6 +1674,7 @@ void ReplManager::stop() {
   _fullReceiver->stop();
   _incrChecker->stop();
   _logRecycler->stop();
+  _applier->stop();
 
 #if defined(_WIN32) && _MSC_VER > 1900
   for (size_t i = 0; i < _pushStatus.size(); i++) {
@@ -1557,6 +1699,14 @@ void ReplManager::stop() {
       _logRecycStatus[i]->fs->close();
       _logRecycStatus[i]->fs.reset();
     }
+    if (_logRecycStatus[i]->archive) {
+      auto s = _logRecycStatus[i]->archive->finish();
+      if (!s.ok()) {
+        LOG(ERROR) << "finish binlog archive of store:" << i
+                   << " failed:" << s.toString();
+      }
+      _logRecycStatus[i]->archive.reset();
+    }
   }
   LOG(WARNING) << "repl manager stops succ";
 }
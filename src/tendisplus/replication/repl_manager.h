@@ -10,6 +10,7 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>  // NOLINT
 #include <string>
 #include <utility>
 #include <vector>
@@ -18,8 +19,10 @@
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include "tendisplus/network/blocking_tcp_client.h"
+#include "tendisplus/replication/binlog_applier.h"
 #include "tendisplus/replication/repl_util.h"
 #include "tendisplus/server/server_entry.h"
+#include "tendisplus/storage/binlog_archive.h"
 #include "tendisplus/storage/catalog.h"
 #include "tendisplus/utils/rate_limiter.h"
 
@@ -39,6 +42,8 @@ struct SPovStatus {
   uint64_t lastBinlogTs;    // in milliseconds
 };
 
+struct BinlogSendWindow;
+
 struct MPovStatus {
   bool isRunning = false;
   uint32_t dstStoreId = 0;
@@ -52,6 +57,8 @@ struct MPovStatus {
   uint64_t clientId = 0;
   string slave_listen_ip;
   uint16_t slave_listen_port = 0;
+  // the batches in flight, only the push routine uses it
+  std::shared_ptr<BinlogSendWindow> window;
 };
 
 enum class FullPushState {
@@ -77,6 +84,18 @@ struct MPovFullPushStatus {
   uint16_t slave_listen_port;
 };
 
+// master's pov, a backup shared by the full syncs of a store
+struct FullSyncBackup {
+  BackupInfo info;
+  // the full syncs using it, guarded by the mutex of ReplManager
+  uint32_t users = 0;
+  // a backup without users is kept until then
+  SCLOCK::time_point expireTime = SCLOCK::time_point::min();
+  // the crc32c of the files, computed when a slave asks for them
+  std::mutex mutex;
+  std::map<std::string, uint32_t> checksums;
+};
+
 struct RecycleBinlogStatus {
   bool isRunning;
   SCLOCK::time_point nextSchedTime;
@@ -90,6 +109,8 @@ struct RecycleBinlogStatus {
   std::unique_ptr<std::ofstream> fs;
   bool needNewFile;
   uint64_t saveBinlogId;
+  // instead of fs with binlog-archive
+  std::unique_ptr<BinlogArchiveWriter> archive;
   std::string toString() const {
     std::stringstream ss;
     ss << "firstBinlogId:" << firstBinlogId << ",saveBinlogId:" << saveBinlogId
@@ -116,9 +137,10 @@ struct RecycleBinlogStatus {
 // no matter network error or process crashes, slave will turn
 // to REPL_CONNECT state and retry from 1)
 
-// 4) on master side, each store can have only one slave copying
-// physical data. the backup will be released after failure or
-// procedure done.
+// 4) on master side, the slaves of a store share one backup of it, see
+// FullSyncBackup. the backup is released when the last slave done, or
+// kept for fullsync-keep-secs after a failure, so that the slave can
+// resume the transfer from the files it has, see fullsync-streams.
 enum class ReplState : std::uint8_t {
   REPL_NONE = 0,
   REPL_CONNECT = 1,
@@ -153,13 +175,19 @@ class ReplManager {
   bool supplyFullSync(asio::ip::tcp::socket sock,
                       const std::string& storeIdArg,
                       const std::string& slaveIpArg,
-                      const std::string& slavePortArg);
+                      const std::string& slavePortArg,
+                      const std::string& modeArg);
+  // the extra streams of a resumable full sync
+  bool supplyFullSyncFiles(asio::ip::tcp::socket sock,
+                           const std::string& storeIdArg,
+                           const std::string& binlogPosArg);
   bool registerIncrSync(asio::ip::tcp::socket sock,
                         const std::string& storeIdArg,
                         const std::string& dstStoreIdArg,
                         const std::string& binlogPosArg,
                         const std::string& listenIpArg,
-                        const std::string& listenPortArg);
+                        const std::string& listenPortArg,
+                        const std::string& compressArg);
   Status replicationSetMaster(std::string ip,
                               uint32_t port,
                               bool checkEmpty = true);
@@ -176,6 +204,10 @@ class ReplManager {
                         uint32_t storeId,
                         const std::string& logKey,
                         const std::string& logValue);
+  // apply a batch of binlogs from the master, see BinlogApplier
+  Status applyRepllogsV2(Session* sess,
+                         uint32_t storeId,
+                         std::vector<ReplLogRawV2>* logs);
 #endif
   bool flushCurBinlogFs(uint32_t storeId);
   void appendJSONStat(rapidjson::PrettyWriter<rapidjson::StringBuffer>&) const;
@@ -186,6 +218,10 @@ class ReplManager {
   bool isSlaveOfSomeone();
   bool isSlaveFullSyncDone();
   Status resetRecycleState(uint32_t storeId);
+  // the data of the store is changed without binlogs, such as RDBIMPORT,
+  // the slaves of the store before now need a full sync. The caller holds
+  // the X lock of the store.
+  Status requireFullSync(uint32_t storeId, PStore store);
   Expected<uint64_t> getSaveBinlogId(uint32_t storeId, uint32_t fileSeq);
 
   void fullPusherResize(size_t size);
@@ -213,7 +249,11 @@ class ReplManager {
   void supplyFullSyncRoutine(std::shared_ptr<BlockingTcpClient> client,
                              uint32_t storeId,
                              const string& slave_listen_ip,
-                             uint16_t slave_listen_port);
+                             uint16_t slave_listen_port,
+                             bool resume);
+  void supplyFullSyncFilesRoutine(std::shared_ptr<BlockingTcpClient> client,
+                                  uint32_t storeId,
+                                  uint64_t binlogPos);
   bool isFullSupplierFull() const;
 
   std::shared_ptr<BlockingTcpClient> createClient(const StoreMeta&,
@@ -221,6 +261,10 @@ class ReplManager {
   void slaveStartFullsync(const StoreMeta&);
   void slaveChkSyncStatus(const StoreMeta&);
   std::ofstream* getCurBinlogFs(uint32_t storeid);
+  BinlogArchiveWriter* getCurBinlogArchive(uint32_t storeId);
+  std::string newDumpFileName(uint32_t storeId,
+                              uint32_t fileSeq,
+                              uint64_t ts) const;
 
 #ifdef BINLOG_V1
   // binlogPos: the greatest id that has been applied
@@ -254,6 +298,19 @@ class ReplManager {
   void getReplInfoDetail(std::stringstream& ss) const;
   void recycleFullPushStatus();
 
+  Expected<std::shared_ptr<FullSyncBackup>> acquireFullSyncBackup(
+    uint32_t storeId, PStore store);
+  void releaseFullSyncBackup(uint32_t storeId, PStore store, bool hasError);
+  Status computeFullSyncChecksums(PStore store, FullSyncBackup* backup);
+  Status serveFullSyncFiles(BlockingTcpClient* client,
+                            PStore store,
+                            const FullSyncBackup& backup);
+  Status fetchFullSyncFiles(BlockingTcpClient* client,
+                            const StoreMeta& metaSnapshot,
+                            const std::string& dir,
+                            const BackupInfo& bkInfo,
+                            const std::map<std::string, uint32_t>& checksums);
+
  private:
   const std::shared_ptr<ServerParams> _cfg;
   mutable std::mutex _mutex;
@@ -281,6 +338,13 @@ class ReplManager {
     _fullPushStatus;
 #endif
 
+  // master's pov, the backup for the full syncs of each store
+  std::vector<std::shared_ptr<FullSyncBackup>> _fullSyncBackup;
+
+  // master's pov, the slaves whose binlogPos is before it need a full
+  // sync, see VersionMeta::FULLSYNC_BARRIER
+  std::vector<uint64_t> _fullSyncBarrier;
+
   // master and slave's pov, smallest binlogId, moves on when truncated
   std::vector<std::unique_ptr<RecycleBinlogStatus>> _logRecycStatus;
 
@@ -302,6 +366,9 @@ class ReplManager {
   // slave's pov, periodly check incr-sync status
   std::unique_ptr<WorkerPool> _incrChecker;
 
+  // slave's pov, applies the binlogs by lanes, see repl-apply-threads
+  std::unique_ptr<BinlogApplier> _applier;
+
   // master and slave's pov, log recycler
   std::unique_ptr<WorkerPool> _logRecycler;
 
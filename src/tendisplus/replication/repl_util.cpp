@@ -4,11 +4,20 @@
 
 #include "tendisplus/replication/repl_util.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <utility>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "glog/logging.h"
+#include "util/crc32c.h"
 #include "tendisplus/commands/command.h"
+#include "tendisplus/utils/portable.h"
+#include "tendisplus/utils/scopeguard.h"
+#include "tendisplus/utils/string.h"
 
 namespace tendisplus {
 
@@ -49,6 +58,96 @@ std::shared_ptr<BlockingTcpClient> createClient(const string& ip,
   return std::move(client);
 }
 
+// read a batch of binlogs from the cursor, a flush or migrate binlog
+// is sent alone, so it is left in *pending if the batch is not empty.
+static Status readBinlogBatch(RepllogCursorV2* cursor,
+                              BinlogWriter* writer,
+                              std::unique_ptr<ReplLogRawV2>* pending,
+                              BinlogResult* last,
+                              uint32_t storeId) {
+  while (true) {
+    std::unique_ptr<ReplLogRawV2> log = std::move(*pending);
+    if (!log) {
+      Expected<ReplLogRawV2> explog = cursor->next();
+      if (explog.status().code() == ErrorCodes::ERR_EXHAUST) {
+        // no more data
+        return {ErrorCodes::ERR_OK, ""};
+      } else if (!explog.ok()) {
+        LOG(ERROR) << "iter binlog failed:" << explog.status().toString();
+        return explog.status();
+      }
+      log = std::make_unique<ReplLogRawV2>(std::move(explog.value()));
+    }
+
+    if (log->getChunkId() == Transaction::CHUNKID_FLUSH) {
+      // flush binlog should be alone
+      LOG(INFO) << "masterSendBinlogV2 deal with chunk flush: "
+                << log->getChunkId();
+      if (writer->getCount() > 0) {
+        *pending = std::move(log);
+        return {ErrorCodes::ERR_OK, ""};
+      }
+
+      writer->setFlag(BinlogFlag::FLUSH);
+      LOG(INFO) << "masterSendBinlogV2 send flush binlog to slave, store:"
+                << storeId;
+    } else if (log->getChunkId() == Transaction::CHUNKID_MIGRATE) {
+      // migrate binlog should be alone
+      LOG(INFO) << "masterSendBinlogV2 deal with chunk migrate: "
+                << log->getChunkId();
+      if (writer->getCount() > 0) {
+        *pending = std::move(log);
+        return {ErrorCodes::ERR_OK, ""};
+      }
+
+      writer->setFlag(BinlogFlag::MIGRATE);
+      LOG(INFO) << "masterSendBinlogV2 send migrate binlog to slave, store:"
+                << storeId;
+    }
+
+    last->binlogId = log->getBinlogId();
+    last->binlogTs = log->getTimestamp();
+
+    if (writer->writeRepllogRaw(*log) ||
+        writer->getFlag() == BinlogFlag::FLUSH ||
+        writer->getFlag() == BinlogFlag::MIGRATE) {
+      // full or flush
+      return {ErrorCodes::ERR_OK, ""};
+    }
+  }
+}
+
+// the reply of the oldest batch in flight, it is the last binlog id of the
+// batch if the binlog id is sent with the batch
+static Status readBinlogAck(BlockingTcpClient* client,
+                            BinlogSendWindow* window,
+                            bool ackId,
+                            uint32_t storeId,
+                            uint32_t dstStoreId,
+                            uint32_t secs) {
+  INVARIANT_D(!window->inflight.empty());
+  Expected<std::string> exptOK = client->readLine(std::chrono::seconds(secs));
+  if (!exptOK.ok()) {
+    LOG(WARNING) << "store:" << storeId << " dst Store:" << dstStoreId
+                 << " readLine failed:" << exptOK.status().toString()
+                 << "; inflight:" << window->inflight.size()
+                 << "; Seconds:" << secs;
+    return exptOK.status();
+  }
+  const BinlogResult& br = window->inflight.front();
+  std::string expected =
+    ackId ? ":" + std::to_string(br.binlogId) : std::string("+OK");
+  if (exptOK.value() != expected) {
+    LOG(WARNING) << "store:" << storeId << " dst Store:" << dstStoreId
+                 << " apply binlogs failed:" << exptOK.value()
+                 << ", expected:" << expected;
+    return {ErrorCodes::ERR_NETWORK, "bad return string"};
+  }
+  window->acked = br;
+  window->inflight.pop_front();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
 Expected<BinlogResult> masterSendBinlogV2(
   BlockingTcpClient* client,
   uint32_t storeId,
@@ -56,9 +155,20 @@ Expected<BinlogResult> masterSendBinlogV2(
   uint64_t binlogPos,
   bool needHeartBeart,
   std::shared_ptr<ServerEntry> svr,
-  const std::shared_ptr<ServerParams> cfg) {
+  const std::shared_ptr<ServerParams> cfg,
+  BinlogSendWindow* window) {
   uint32_t suggestBatch = svr->getParams()->bingLogSendBatch;
   size_t suggestBytes = svr->getParams()->bingLogSendBytes;
+  uint32_t winSize = std::max(cfg->binlogSendWindow, 1u);
+  // the old slaves reply +OK only, the binlog id is acked if windowed
+  bool ackId = winSize > 1;
+  uint32_t secs = cfg->timeoutSecBinlogWaitRsp;
+
+  if (window->inflight.empty()) {
+    window->sentPos = binlogPos;
+    window->acked.binlogId = binlogPos;
+  }
+  INVARIANT_D(window->acked.binlogId == binlogPos);
 
   LocalSessionGuard sg(svr.get());
   sg.getSession()->setArgs({"mastersendlog",
@@ -80,110 +190,118 @@ Expected<BinlogResult> masterSendBinlogV2(
     return ptxn.status();
   }
 
-  BinlogResult br;
-
+  // NOTE(tendis): the cursor is kept for at most winSize batches in a
+  // round, the batches left in flight are acked in the next round, which
+  // reads the binlogs after sentPos.
   std::unique_ptr<Transaction> txn = std::move(ptxn.value());
   std::unique_ptr<RepllogCursorV2> cursor =
-    txn->createRepllogCursorV2(binlogPos + 1);
+    txn->createRepllogCursorV2(window->sentPos + 1);
+  // the slaves catching up read the binlogs of the cache
+  cursor->setCache(store->getBinlogCache());
+  std::unique_ptr<ReplLogRawV2> pending;
 
-  BinlogWriter writer(suggestBytes, suggestBatch);
+  uint32_t batches = 0;
+  bool exhausted = false;
   while (true) {
-    Expected<ReplLogRawV2> explog = cursor->next();
-    if (explog.ok()) {
-      if (explog.value().getChunkId() == Transaction::CHUNKID_FLUSH) {
-        // flush binlog should be alone
-        LOG(INFO) << "masterSendBinlogV2 deal with chunk flush: "
-                  << explog.value().getChunkId();
-        if (writer.getCount() > 0)
-          break;
-
-        writer.setFlag(BinlogFlag::FLUSH);
-        LOG(INFO) << "masterSendBinlogV2 send flush binlog to slave, store:"
-                  << storeId;
-      } else if (explog.value().getChunkId() == Transaction::CHUNKID_MIGRATE) {
-        // migrate binlog should be alone
-        LOG(INFO) << "masterSendBinlogV2 deal with chunk migrate: "
-                  << explog.value().getChunkId();
-        if (writer.getCount() > 0)
-          break;
-
-        writer.setFlag(BinlogFlag::MIGRATE);
-        LOG(INFO) << "masterSendBinlogV2 send migrate binlog to slave, store:"
-                  << storeId;
+    while (!exhausted && batches < winSize &&
+           window->inflight.size() < winSize) {
+      BinlogWriter writer(suggestBytes, suggestBatch);
+      BinlogResult last;
+      auto s =
+        readBinlogBatch(cursor.get(), &writer, &pending, &last, storeId);
+      if (!s.ok()) {
+        return s;
       }
-
-      br.binlogId = explog.value().getBinlogId();
-      br.binlogTs = explog.value().getTimestamp();
-
-      if (writer.writeRepllogRaw(explog.value()) ||
-          writer.getFlag() == BinlogFlag::FLUSH ||
-          writer.getFlag() == BinlogFlag::MIGRATE) {
-        // full or flush
+      if (writer.getCount() == 0) {
+        exhausted = true;
         break;
       }
 
-    } else if (explog.status().code() == ErrorCodes::ERR_EXHAUST) {
-      // no more data
+      // TODO(vinchen): too more copy
+      std::string binlogs = writer.getBinlogStr();
+      window->rawBytes += binlogs.size();
+      if (window->lz4) {
+        auto start = SCLOCK::now();
+        binlogs = Binlog::compress(binlogs);
+        window->compressUs += std::chrono::duration_cast<
+          std::chrono::microseconds>(SCLOCK::now() - start).count();
+      }
+      window->wireBytes += binlogs.size();
+      std::stringstream ss2;
+      Command::fmtMultiBulkLen(ss2, ackId ? 6 : 5);
+      Command::fmtBulk(ss2, "applybinlogsv2");
+      Command::fmtBulk(ss2, std::to_string(dstStoreId));
+      Command::fmtBulk(ss2, binlogs);
+      Command::fmtBulk(ss2, std::to_string(writer.getCount()));
+      Command::fmtBulk(ss2, std::to_string((uint32_t)writer.getFlag()));
+      if (ackId) {
+        Command::fmtBulk(ss2, std::to_string(last.binlogId));
+      }
+      std::string stringtoWrite = ss2.str();
+      s = client->writeData(stringtoWrite);
+      if (!s.ok()) {
+        LOG(WARNING) << "store:" << storeId << " dst Store:" << dstStoreId
+                     << " writeData failed:" << s.toString()
+                     << "; Size:" << stringtoWrite.size();
+        return s;
+      }
+      INVARIANT_D(window->sentPos + writer.getCount() <= last.binlogId);
+      window->sentPos = last.binlogId;
+      window->inflight.push_back(last);
+      batches++;
+    }
+
+    if (window->inflight.empty()) {
+      break;
+    }
+    auto s =
+      readBinlogAck(client, window, ackId, storeId, dstStoreId, secs);
+    if (!s.ok()) {
+      return s;
+    }
+    // drain the window if there is nothing more to send, or leave the
+    // batches in flight for the next round
+    if (!exhausted && batches >= winSize) {
       break;
-    } else {
-      LOG(ERROR) << "iter binlog failed:" << explog.status().toString();
-      return explog.status();
     }
   }
 
-  std::stringstream ss2;
-  if (writer.getCount() == 0) {
-    br.binlogId = binlogPos;
-    br.binlogTs = msSinceEpoch();
+  if (batches > 0 || window->acked.binlogId > binlogPos) {
+    return window->acked;
+  }
 
-    if (!needHeartBeart) {
-      return br;
-    }
-    // keep the client alive
-    Command::fmtMultiBulkLen(ss2, 3);
-    Command::fmtBulk(ss2, "binlog_heartbeat");
-    Command::fmtBulk(ss2, std::to_string(dstStoreId));
-    /* add timestamp which binlog_heartbeat created */
-    Command::fmtBulk(ss2, std::to_string(br.binlogTs));
-  } else {
-    // TODO(vinchen): too more copy
-    Command::fmtMultiBulkLen(ss2, 5);
-    Command::fmtBulk(ss2, "applybinlogsv2");
-    Command::fmtBulk(ss2, std::to_string(dstStoreId));
-    Command::fmtBulk(ss2, writer.getBinlogStr());
-    Command::fmtBulk(ss2, std::to_string(writer.getCount()));
-    Command::fmtBulk(ss2, std::to_string((uint32_t)writer.getFlag()));
+  window->acked.binlogTs = msSinceEpoch();
+  if (!needHeartBeart) {
+    return window->acked;
   }
 
-  std::string stringtoWrite = ss2.str();
+  // keep the client alive
+  std::stringstream ss2;
+  Command::fmtMultiBulkLen(ss2, 3);
+  Command::fmtBulk(ss2, "binlog_heartbeat");
+  Command::fmtBulk(ss2, std::to_string(dstStoreId));
+  /* add timestamp which binlog_heartbeat created */
+  Command::fmtBulk(ss2, std::to_string(window->acked.binlogTs));
 
-  Status s = client->writeData(stringtoWrite);
+  Status s = client->writeData(ss2.str());
   if (!s.ok()) {
     LOG(WARNING) << "store:" << storeId << " dst Store:" << dstStoreId
-                 << " writeData failed:" << s.toString()
-                 << "; Size:" << stringtoWrite.size();
+                 << " writeData failed:" << s.toString();
     return s;
   }
 
-  uint32_t secs = cfg->timeoutSecBinlogWaitRsp;
   Expected<std::string> exptOK = client->readLine(std::chrono::seconds(secs));
   if (!exptOK.ok()) {
     LOG(WARNING) << "store:" << storeId << " dst Store:" << dstStoreId
                  << " readLine failed:" << exptOK.status().toString()
-                 << "; Size:" << stringtoWrite.size() << "; Seconds:" << secs;
+                 << "; Seconds:" << secs;
     return exptOK.status();
   } else if (exptOK.value() != "+OK") {
     LOG(WARNING) << "store:" << storeId << " dst Store:" << dstStoreId
-                 << " apply binlogs failed:" << exptOK.value();
+                 << " binlog heartbeat failed:" << exptOK.value();
     return {ErrorCodes::ERR_NETWORK, "bad return string"};
   }
-
-  if (writer.getCount() == 0) {
-    return br;
-  } else {
-    INVARIANT_D(binlogPos + writer.getCount() <= br.binlogId);
-    return br;
-  }
+  return window->acked;
 }
 
 Expected<BinlogResult> applySingleTxnV2(Session* sess,
@@ -296,14 +414,19 @@ Status sendWriter(BinlogWriter* writer,
                   const std::string& taskId,
                   bool needHeartBeart,
                   bool* needRetry,
-                  uint32_t secs) {
+                  uint32_t secs,
+                  bool lz4) {
   std::stringstream ss2;
 
   if (writer && writer->getCount() > 0) {
     Command::fmtMultiBulkLen(ss2, 5);
     Command::fmtBulk(ss2, "migratebinlogs");
     Command::fmtBulk(ss2, std::to_string(dstStoreId));
-    Command::fmtBulk(ss2, writer->getBinlogStr());
+    if (lz4) {
+      Command::fmtBulk(ss2, Binlog::compress(writer->getBinlogStr()));
+    } else {
+      Command::fmtBulk(ss2, writer->getBinlogStr());
+    }
     Command::fmtBulk(ss2, std::to_string(writer->getCount()));
     Command::fmtBulk(ss2, std::to_string((uint32_t)writer->getFlag()));
   } else {
@@ -359,6 +482,8 @@ Status SendSlotsBinlog(BlockingTcpClient* client,
   uint32_t suggestBatch = svr->getParams()->bingLogSendBatch;
   size_t suggestBytes = svr->getParams()->bingLogSendBytes;
   uint32_t timeoutSecs = svr->getParams()->timeoutSecBinlogWaitRsp;
+  // NOTE(tendis): the target should be able to uncompress the batches
+  bool lz4 = svr->getParams()->binlogCompress == "lz4";
 
   LocalSessionGuard sg(svr.get());
   sg.getSession()->setArgs({"mastersendlog",
@@ -382,6 +507,8 @@ Status SendSlotsBinlog(BlockingTcpClient* client,
   std::unique_ptr<Transaction> txn = std::move(ptxn.value());
   std::unique_ptr<RepllogCursorV2> cursor =
     txn->createRepllogCursorV2(binlogPos + 1);
+  // the binlogs to catch up are usually the latest ones
+  cursor->setCache(store->getBinlogCache());
 
   std::unique_ptr<BinlogWriter> writer =
     std::make_unique<BinlogWriter>(suggestBytes, suggestBatch);
@@ -451,7 +578,8 @@ Status SendSlotsBinlog(BlockingTcpClient* client,
                             taskid,
                             needHeartBeart,
                             needRetry,
-                            timeoutSecs);
+                            timeoutSecs,
+                            lz4);
         if (!s.ok()) {
           LOG(ERROR) << "send writer bulk fail on slot:" << slot << " "
                      << s.toString();
@@ -476,7 +604,8 @@ Status SendSlotsBinlog(BlockingTcpClient* client,
                         taskid,
                         needHeartBeart,
                         needRetry,
-                        timeoutSecs);
+                        timeoutSecs,
+                        lz4);
     if (!s.ok()) {
       LOG(ERROR) << "send writer bulk fail, cout:" << writer->getCount();
       return s;
@@ -493,4 +622,222 @@ Status SendSlotsBinlog(BlockingTcpClient* client,
   return {ErrorCodes::ERR_OK, ""};
 }
 
+Status sendFullSyncFile(BlockingTcpClient* client,
+                        const std::string& path,
+                        uint64_t size,
+                        size_t batch,
+                        RateLimiter* limiter,
+                        uint32_t secs) {
+#ifdef __linux__
+  // NOTE(tendis): the file is sent by sendfile(2) in batches, so that
+  // the rate limiter and the acks of the slave work as before
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "open file:" << path
+               << " for read failed:" << strerror(errno);
+    return {ErrorCodes::ERR_INTERNAL, "open file failed"};
+  }
+  auto fdGuard = MakeGuard([fd] { ::close(fd); });
+#else
+  std::string readBuf;
+  readBuf.reserve(std::min(size, static_cast<uint64_t>(batch)));
+  auto myfile = std::ifstream(path, std::ios::binary);
+  if (!myfile.is_open()) {
+    LOG(ERROR) << "open file:" << path << " for read failed";
+    return {ErrorCodes::ERR_INTERNAL, "open file failed"};
+  }
+#endif
+  uint64_t remain = size;
+  while (remain) {
+    size_t batchSize = std::min(remain, static_cast<uint64_t>(batch));
+    limiter->Request(batchSize);
+#ifdef __linux__
+    Status s = client->sendFile(
+      fd, size - remain, batchSize, std::chrono::seconds(secs));
+    remain -= batchSize;
+#else
+    readBuf.resize(batchSize);
+    remain -= batchSize;
+    myfile.read(&readBuf[0], batchSize);
+    if (!myfile) {
+      LOG(ERROR) << "read file:" << path
+                 << " failed with err:" << strerror(errno);
+      return {ErrorCodes::ERR_INTERNAL, "read file failed"};
+    }
+    Status s = client->writeData(readBuf);
+#endif
+    if (!s.ok()) {
+      LOG(ERROR) << "write bulk to client failed:" << s.toString();
+      return s;
+    }
+    auto rpl = client->readLine(std::chrono::seconds(secs));
+    if (!rpl.ok()) {
+      return rpl.status();
+    }
+    if (rpl.value() != "+OK") {
+      return {ErrorCodes::ERR_NETWORK, "bad reply:" + rpl.value()};
+    }
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status recvFullSyncFile(BlockingTcpClient* client,
+                        const std::string& path,
+                        uint64_t size,
+                        std::vector<char>* buf,
+                        uint32_t* crc) {
+  filesystem::path fileDir = filesystem::path(path).remove_filename();
+  if (!filesystem::exists(fileDir)) {
+    LOG(INFO) << "recvFullSyncFile create_directories:" << fileDir;
+    filesystem::create_directories(fileDir);
+  }
+  auto myfile = std::fstream(
+    path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!myfile.is_open()) {
+    LOG(ERROR) << "open file:" << path << " for write failed";
+    return {ErrorCodes::ERR_INTERNAL, "open file failed"};
+  }
+  uint32_t value = 0;
+  uint64_t remain = size;
+  while (remain) {
+    size_t batchSize = std::min(remain, static_cast<uint64_t>(buf->size()));
+    remain -= batchSize;
+    Status s =
+      client->readExactly(buf->data(), batchSize, std::chrono::seconds(100));
+    if (!s.ok()) {
+      LOG(ERROR) << "fullsync read bulk data failed:" << s.toString();
+      return s;
+    }
+    myfile.write(buf->data(), batchSize);
+    if (myfile.bad()) {
+      LOG(ERROR) << "write file:" << path << " failed:" << strerror(errno);
+      return {ErrorCodes::ERR_INTERNAL, "write file failed"};
+    }
+    if (crc) {
+      value = rocksdb::crc32c::Extend(value, buf->data(), batchSize);
+    }
+    s = client->writeLine("+OK");
+    if (!s.ok()) {
+      LOG(ERROR) << "write file:" << path << " reply failed:" << s.toString();
+      return s;
+    }
+  }
+  myfile.close();
+  if (myfile.fail()) {
+    return {ErrorCodes::ERR_INTERNAL, "close file failed"};
+  }
+  if (crc) {
+    *crc = value;
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status syncFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return {ErrorCodes::ERR_INTERNAL,
+            "open " + path + " failed:" + strerror(errno)};
+  }
+  int ret = fsync(fd);
+  int err = errno;
+  close(fd);
+  if (ret != 0) {
+    return {ErrorCodes::ERR_INTERNAL,
+            "fsync " + path + " failed:" + strerror(err)};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+FullSyncManifest::FullSyncManifest(const std::string& dir)
+  : _dir(dir), _path(dir + "/" + FILENAME) {}
+
+Status FullSyncManifest::load() {
+  std::lock_guard<std::mutex> lk(_mutex);
+  {
+    std::ifstream in(_path);
+    std::string line;
+    // a line broken by a crash is skipped, the file is received again
+    while (std::getline(in, line)) {
+      auto args = stringSplit(line, " ");
+      if (args.size() == 2 && args[1] == "-") {
+        _files.erase(args[0]);
+        continue;
+      }
+      if (args.size() != 3) {
+        continue;
+      }
+      auto size = tendisplus::stoul(args[1]);
+      auto crc = tendisplus::stoul(args[2]);
+      if (!size.ok() || !crc.ok()) {
+        continue;
+      }
+      _files[args[0]] = {size.value(), static_cast<uint32_t>(crc.value())};
+    }
+  }
+  _out.open(_path, std::ios::out | std::ios::app);
+  if (!_out.is_open()) {
+    return {ErrorCodes::ERR_INTERNAL, "open manifest failed:" + _path};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+bool FullSyncManifest::has(const std::string& name,
+                           uint64_t size,
+                           uint32_t crc) const {
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto it = _files.find(name);
+    if (it == _files.end() || it->second.first != size ||
+        it->second.second != crc) {
+      return false;
+    }
+  }
+  // NOTE(tendis): the file may be removed or truncated since then, e.g.
+  // by hand or by a crash of the disk, it is received again.
+  std::error_code ec;
+  auto fileSize = filesystem::file_size(_dir + "/" + name, ec);
+  return !ec && fileSize == size;
+}
+
+Status FullSyncManifest::append(const std::string& line) {
+  // begin with a new line, in case the last one is broken
+  _out << "\n" << line << "\n";
+  _out.flush();
+  if (!_out) {
+    return {ErrorCodes::ERR_INTERNAL, "write manifest failed:" + _path};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status FullSyncManifest::add(const std::string& name,
+                             uint64_t size,
+                             uint32_t crc) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  auto s = append(name + " " + std::to_string(size) + " " +
+                  std::to_string(crc));
+  if (!s.ok()) {
+    return s;
+  }
+  _files[name] = {size, crc};
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status FullSyncManifest::remove(const std::string& name) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  if (_files.find(name) == _files.end()) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  auto s = append(name + " -");
+  if (!s.ok()) {
+    return s;
+  }
+  _files.erase(name);
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+size_t FullSyncManifest::size() const {
+  std::lock_guard<std::mutex> lk(_mutex);
+  return _files.size();
+}
+
 }  // namespace tendisplus
@@ -5,11 +5,19 @@
 #ifndef SRC_TENDISPLUS_REPLICATION_REPL_UTIL_H_
 #define SRC_TENDISPLUS_REPLICATION_REPL_UTIL_H_
 
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <map>
 #include <memory>
+#include <mutex>  // NOLINT
 #include <string>
+#include <utility>
+#include <vector>
 #include "tendisplus/cluster/cluster_manager.h"
 #include "tendisplus/network/blocking_tcp_client.h"
 #include "tendisplus/server/server_entry.h"
+#include "tendisplus/utils/rate_limiter.h"
 
 namespace tendisplus {
 
@@ -42,6 +50,23 @@ struct BinlogResult {
   uint64_t binlogTs = 0;
 };
 
+// the batches sent to a slave but not acked, see binlog-send-window
+struct BinlogSendWindow {
+  // the last binlog sent
+  uint64_t sentPos = 0;
+  // the last binlog acked by the slave
+  BinlogResult acked;
+  // the last binlog of each batch in flight, in order
+  std::deque<BinlogResult> inflight;
+  // the slave asks for the batches compressed by lz4
+  bool lz4 = false;
+  // the bytes of the batches before and after compressed, and the time
+  // compressing them, read by INFO without the push routine
+  std::atomic<uint64_t> rawBytes{0};
+  std::atomic<uint64_t> wireBytes{0};
+  std::atomic<uint64_t> compressUs{0};
+};
+
 Expected<BinlogResult> masterSendBinlogV2(
   BlockingTcpClient*,
   uint32_t storeId,
@@ -49,7 +74,8 @@ Expected<BinlogResult> masterSendBinlogV2(
   uint64_t binlogPos,
   bool needHeartBeart,
   std::shared_ptr<ServerEntry> svr,
-  const std::shared_ptr<ServerParams> cfg);
+  const std::shared_ptr<ServerParams> cfg,
+  BinlogSendWindow* window);
 
 
 Expected<BinlogResult> applySingleTxnV2(Session* sess,
@@ -64,7 +90,8 @@ Status sendWriter(BinlogWriter* writer,
                   const std::string& taskid,
                   bool needHeartBeat,
                   bool* needRetry,
-                  uint32_t secs);
+                  uint32_t secs,
+                  bool lz4 = false);
 
 
 Status SendSlotsBinlog(BlockingTcpClient*,
@@ -81,6 +108,53 @@ Status SendSlotsBinlog(BlockingTcpClient*,
                        bool* needRetry,
                        uint64_t* binlogTimeStamp);
 
+// send a file of the backup to a slave in batches, each batch is acked by
+// the slave with +OK
+Status sendFullSyncFile(BlockingTcpClient* client,
+                        const std::string& path,
+                        uint64_t size,
+                        size_t batch,
+                        RateLimiter* limiter,
+                        uint32_t secs);
+
+// receive a file sent by sendFullSyncFile() into path, *crc is the crc32c
+// of the file if not nullptr
+Status recvFullSyncFile(BlockingTcpClient* client,
+                        const std::string& path,
+                        uint64_t size,
+                        std::vector<char>* buf,
+                        uint32_t* crc);
+
+// flush the data of the file to the disk
+Status syncFile(const std::string& path);
+
+// the files a slave has received for a resumable full sync, one line for
+// each file: name size crc32c, or "name -" for a file removed. It lives in
+// the directory of the files, so that a full sync broken can skip them
+// next time, see fullsync-streams.
+class FullSyncManifest {
+ public:
+  explicit FullSyncManifest(const std::string& dir);
+  Status load();
+  // whether the file is received, and it is still there in the same size
+  bool has(const std::string& name, uint64_t size, uint32_t crc) const;
+  // the file should be synced to the disk before it is added
+  Status add(const std::string& name, uint64_t size, uint32_t crc);
+  Status remove(const std::string& name);
+  size_t size() const;
+
+  static constexpr const char* FILENAME = "fullsync_manifest";
+
+ private:
+  Status append(const std::string& line);
+
+  const std::string _dir;
+  const std::string _path;
+  mutable std::mutex _mutex;
+  std::map<std::string, std::pair<uint64_t, uint32_t>> _files;
+  std::ofstream _out;
+};
+
 }  // namespace tendisplus
 
 #endif  // SRC_TENDISPLUS_REPLICATION_REPL_UTIL_H_
@@ -4,14 +4,19 @@
 
 #include <algorithm>
 #include <chrono>  // NOLINT
+#include <condition_variable>  // NOLINT
+#include <deque>
 #include <fstream>
 #include <limits>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>  // NOLINT
 #include <set>
 #include <string>
+#include <thread>  // NOLINT
 #include <utility>
+#include <vector>
 
 #include "glog/logging.h"
 #include "rapidjson/document.h"
@@ -28,15 +33,21 @@
 #include "tendisplus/utils/redis_port.h"
 #include "tendisplus/utils/scopeguard.h"
 #include "tendisplus/utils/string.h"
+#include "tendisplus/utils/sync_point.h"
 
 namespace tendisplus {
 
 Expected<BackupInfo> getBackupInfo(BlockingTcpClient* client,
                                    const StoreMeta& metaSnapshot,
                                    const string& ip,
-                                   uint16_t port) {
+                                   uint16_t port,
+                                   std::map<std::string, uint32_t>* checksums) {
   std::stringstream ss;
   ss << "FULLSYNC " << metaSnapshot.syncFromId << " " << ip << " " << port;
+  // NOTE(tendis): the master should support it, or FULLSYNC is refused
+  if (checksums) {
+    ss << " resume";
+  }
   Status s = client->writeLine(ss.str());
   if (!s.ok()) {
     LOG(WARNING) << "fullSync master failed:" << s.toString();
@@ -85,16 +96,271 @@ Expected<BackupInfo> getBackupInfo(BlockingTcpClient* client,
     result[o.name.GetString()] = o.value.GetUint64();
   }
   bkInfo.setFileList(result);
+  if (!checksums) {
+    return bkInfo;
+  }
+
+  // the master computes them if the backup is new
+  auto expSums = client->readLine(std::chrono::seconds(1000));
+  if (!expSums.ok()) {
+    LOG(WARNING) << "fullSync req checksums error:"
+                 << expSums.status().toString();
+    return expSums.status();
+  }
+  if (expSums.value().size() == 0 || expSums.value()[0] == '-') {
+    LOG(WARNING) << "fullSync req checksums failed:" << expSums.value();
+    return {ErrorCodes::ERR_INTERNAL, "fullSync master not ok"};
+  }
+  rapidjson::Document sumDoc;
+  sumDoc.Parse(expSums.value());
+  if (sumDoc.HasParseError()) {
+    return {ErrorCodes::ERR_NETWORK,
+            rapidjson::GetParseError_En(sumDoc.GetParseError())};
+  }
+  if (!sumDoc.IsObject()) {
+    return {ErrorCodes::ERR_NOTFOUND, "checksums not json obj"};
+  }
+  for (auto& o : sumDoc.GetObject()) {
+    if (!o.value.IsUint()) {
+      return {ErrorCodes::ERR_NOTFOUND, "json value not uint"};
+    }
+    (*checksums)[o.name.GetString()] = o.value.GetUint();
+  }
+  for (const auto& kv : result) {
+    if (checksums->find(kv.first) == checksums->end()) {
+      return {ErrorCodes::ERR_NOTFOUND, "no checksum of " + kv.first};
+    }
+  }
   return bkInfo;
 }
 
+// NOTE(tendis): the sst files are never changed once written, the store
+// may have some of the backup of the master, such as from a former full
+// sync. They are linked into dir before the store is cleared, and used if
+// the same as the ones of the master by the checksums.
+static void linkSstFiles(const std::string& dbDir, const std::string& dir) {
+  std::error_code ec;
+  filesystem::create_directories(dir, ec);
+  if (ec || !filesystem::exists(dbDir, ec)) {
+    return;
+  }
+  for (auto& entry : filesystem::directory_iterator(dbDir, ec)) {
+    if (entry.path().extension() != ".sst") {
+      continue;
+    }
+    auto target = filesystem::path(dir) / entry.path().filename();
+    if (filesystem::exists(target, ec)) {
+      continue;
+    }
+    filesystem::create_hard_link(entry.path(), target, ec);
+    if (ec) {
+      LOG(WARNING) << "link " << entry.path() << " failed:" << ec.message();
+    }
+  }
+}
+
+// fetch the files of the backup into dir by fullsync-streams connections,
+// the files of dir the same as the master are skipped
+Status ReplManager::fetchFullSyncFiles(
+  BlockingTcpClient* client,
+  const StoreMeta& metaSnapshot,
+  const std::string& dir,
+  const BackupInfo& bkInfo,
+  const std::map<std::string, uint32_t>& checksums) {
+  const auto& flist = bkInfo.getFileList();
+  FullSyncManifest manifest(dir);
+  Status s = manifest.load();
+  if (!s.ok()) {
+    return s;
+  }
+
+  // the files not in the backup are left by a former full sync
+  std::error_code ec;
+  std::vector<filesystem::path> stale;
+  for (auto& entry : filesystem::directory_iterator(dir, ec)) {
+    auto name = entry.path().filename().string();
+    if (name == FullSyncManifest::FILENAME ||
+        flist.find(name) != flist.end()) {
+      continue;
+    }
+    stale.push_back(entry.path());
+  }
+  for (const auto& path : stale) {
+    s = manifest.remove(path.filename().string());
+    if (!s.ok()) {
+      return s;
+    }
+    filesystem::remove_all(path, ec);
+  }
+
+  std::deque<std::string> todo;
+  size_t skipped = 0;
+  for (const auto& kv : flist) {
+    uint32_t crc = checksums.at(kv.first);
+    if (manifest.has(kv.first, kv.second, crc)) {
+      skipped++;
+      continue;
+    }
+    std::string path = dir + "/" + kv.first;
+    if (filesystem::exists(path, ec) &&
+        filesystem::file_size(path, ec) == kv.second) {
+      auto local = fileChecksum(path);
+      if (local.ok() && local.value() == crc) {
+        s = manifest.add(kv.first, kv.second, crc);
+        if (!s.ok()) {
+          return s;
+        }
+        skipped++;
+        continue;
+      }
+    }
+    // the file is not trusted any more until it is received again
+    s = manifest.remove(kv.first);
+    if (!s.ok()) {
+      return s;
+    }
+    todo.push_back(kv.first);
+  }
+  LOG(INFO) << "store:" << metaSnapshot.id << " fullsync files:"
+            << flist.size() << ",skipped:" << skipped;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  Status status = {ErrorCodes::ERR_OK, ""};
+  size_t running = 0;
+  size_t fileBatch = (_cfg->binlogRateLimitMB * 1024 * 1024) / 10;
+
+  // fetch the files of todo until it is empty. A file failed is put back,
+  // so that another stream fetches it.
+  auto fetch = [&](BlockingTcpClient* c) -> Status {
+    std::vector<char> bulkBuf(fileBatch);
+    while (true) {
+      std::string name;
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (todo.empty() || !status.ok()) {
+          return {ErrorCodes::ERR_OK, ""};
+        }
+        name = todo.front();
+        todo.pop_front();
+      }
+      uint64_t size = flist.at(name);
+      std::string path = dir + "/" + name;
+      uint32_t crc = 0;
+      TEST_SYNC_POINT_CALLBACK("ReplManager::fetchFullSyncFiles::fetch",
+                               &name);
+      Status s = c->writeLine("FILE " + name + " " + std::to_string(fileBatch));
+      if (s.ok()) {
+        s = recvFullSyncFile(c, path, size, &bulkBuf, &crc);
+      }
+      if (s.ok() && crc != checksums.at(name)) {
+        s = {ErrorCodes::ERR_INTERNAL, "checksum mismatch of " + name};
+      }
+      // the file is on the disk before the manifest says so
+      if (s.ok()) {
+        s = syncFile(path);
+      }
+      TEST_SYNC_POINT_CALLBACK("ReplManager::fetchFullSyncFiles::received",
+                               &s);
+      if (s.ok()) {
+        s = manifest.add(name, size, crc);
+      }
+      if (!s.ok()) {
+        std::lock_guard<std::mutex> lk(mutex);
+        todo.push_back(name);
+        return s;
+      }
+      LOG(INFO) << "fullsync file:" << path << " transfer done";
+    }
+  };
+
+  std::vector<std::thread> streams;
+  size_t n = std::min(static_cast<size_t>(_cfg->fullSyncStreams), todo.size());
+  for (size_t i = 1; i < n; i++) {
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      running++;
+    }
+    streams.emplace_back([this, &metaSnapshot, &bkInfo, &fetch, &mutex, &cv,
+                          &running]() {
+      auto guard = MakeGuard([&mutex, &cv, &running] {
+        std::lock_guard<std::mutex> lk(mutex);
+        running--;
+        cv.notify_all();
+      });
+      auto c = createClient(metaSnapshot, _connectMasterTimeoutMs);
+      if (c == nullptr) {
+        return;
+      }
+      std::stringstream ss;
+      ss << "FULLSYNCFILES " << metaSnapshot.syncFromId << " "
+         << bkInfo.getBinlogPos();
+      Status s = c->writeLine(ss.str());
+      if (!s.ok()) {
+        return;
+      }
+      auto rpl = c->readLine(std::chrono::seconds(10));
+      if (!rpl.ok() || rpl.value() != "+OK") {
+        LOG(WARNING) << "store:" << metaSnapshot.id << " fullsync stream:"
+                     << (rpl.ok() ? rpl.value() : rpl.status().toString());
+        return;
+      }
+      s = fetch(c.get());
+      if (!s.ok()) {
+        LOG(WARNING) << "store:" << metaSnapshot.id
+                     << " fullsync stream failed:" << s.toString();
+        return;
+      }
+      c->writeLine("+OK");
+    });
+  }
+
+  // the primary stream fetches the files left by the others too, and
+  // keeps alive while waiting for them
+  while (true) {
+    s = fetch(client);
+    std::unique_lock<std::mutex> lk(mutex);
+    if (!s.ok()) {
+      status = s;
+    }
+    if (!status.ok() || (todo.empty() && running == 0)) {
+      break;
+    }
+    if (todo.empty()) {
+      cv.wait_for(lk, std::chrono::seconds(1));
+    }
+    if (todo.empty()) {
+      lk.unlock();
+      s = client->writeLine("PING");
+      lk.lock();
+      if (!s.ok()) {
+        status = s;
+        break;
+      }
+    }
+  }
+  for (auto& t : streams) {
+    t.join();
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  LOG(INFO) << "store:" << metaSnapshot.id << " fullsync fetched files:"
+            << manifest.size() << "/" << flist.size();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
 // spov's network communicate procedure
 // read binlogpos low watermark
 // read filelist={filename->filesize}
-// foreach file
-//     read filename
-//     read content
-//     send +OK
+// if fullsync-streams
+//     read checksums={filename->crc32c}
+//     fetchFullSyncFiles()
+// else
+//     foreach file
+//         read filename
+//         read content
+//         send +OK
 // send +OK
 void ReplManager::slaveStartFullsync(const StoreMeta& metaSnapshot) {
   LOG(INFO) << "store:" << metaSnapshot.id << " fullsync start";
@@ -123,6 +389,12 @@ void ReplManager::slaveStartFullsync(const StoreMeta& metaSnapshot) {
     return;
   }
   INVARIANT_D(!store->isRunning());
+  // the files received are kept in it until all done, see fullsync-streams
+  bool resume = _cfg->fullSyncStreams > 0;
+  std::string fullDir = store->dbPath() + "/" + store->dbId() + "_fullsync";
+  if (resume) {
+    linkSstFiles(store->dbPath() + "/" + store->dbId(), fullDir);
+  }
   Status clearStatus = store->clear();
   if (!clearStatus.ok()) {
     LOG(FATAL) << "Unexpected store:" << metaSnapshot.id << " clear"
@@ -173,10 +445,12 @@ void ReplManager::slaveStartFullsync(const StoreMeta& metaSnapshot) {
 
   // 4) read backupinfo from master
   // get binlogPos and filelist, other messages get from "backup_meta" file
+  std::map<std::string, uint32_t> checksums;
   auto ebkInfo = getBackupInfo(client.get(),
                                metaSnapshot,
                                _svr->getParams()->bindIp,
-                               _svr->getParams()->port);
+                               _svr->getParams()->port,
+                               resume ? &checksums : nullptr);
   if (!ebkInfo.ok()) {
     LOG(WARNING) << "storeId:" << metaSnapshot.id
                  << ",syncMaster:" << metaSnapshot.syncFromHost << ":"
@@ -203,9 +477,30 @@ void ReplManager::slaveStartFullsync(const StoreMeta& metaSnapshot) {
   }
 
   auto flist = ebkInfo.value().getFileList();
+  if (resume) {
+    Status s = fetchFullSyncFiles(
+      client.get(), metaSnapshot, fullDir, ebkInfo.value(), checksums);
+    if (!s.ok()) {
+      LOG(WARNING) << "store:" << metaSnapshot.id
+                   << " fetch fullsync files failed:" << s.toString();
+      return;
+    }
+    std::error_code ec;
+    filesystem::remove(fullDir + "/" + FullSyncManifest::FILENAME, ec);
+    filesystem::rename(fullDir, store->dftBackupDir(), ec);
+    if (ec) {
+      LOG(ERROR) << "store:" << metaSnapshot.id << " rename " << fullDir
+                 << " failed:" << ec.message();
+      return;
+    }
+  }
 
+  // the bulks are read from the socket into it and written to the files
+  // directly, without buffered by the client and copied into strings
+  size_t fileBatch = (_cfg->binlogRateLimitMB * 1024 * 1024) / 10;
+  std::vector<char> bulkBuf(resume ? 0 : fileBatch);
   std::set<std::string> finishedFiles;
-  while (true) {
+  while (!resume) {
     if (finishedFiles.size() == flist.size()) {
       break;
     }
@@ -221,42 +516,11 @@ void ReplManager::slaveStartFullsync(const StoreMeta& metaSnapshot) {
     }
     std::string fullFileName = store->dftBackupDir() + "/" + s.value();
     LOG(INFO) << "fullsync file:" << fullFileName << " transfer begin";
-
-    filesystem::path fileDir = filesystem::path(fullFileName).remove_filename();
-    if (!filesystem::exists(fileDir)) {
-      LOG(INFO) << "slaveStartFullsync create_directories:" << fileDir;
-      filesystem::create_directories(fileDir);
-    }
-    auto myfile = std::fstream(fullFileName, std::ios::out | std::ios::binary);
-    if (!myfile.is_open()) {
-      LOG(ERROR) << "open file:" << fullFileName << " for write failed";
+    Status rs = recvFullSyncFile(
+      client.get(), fullFileName, flist.at(s.value()), &bulkBuf, nullptr);
+    if (!rs.ok()) {
       return;
     }
-    size_t remain = flist.at(s.value());
-    size_t fileBatch = (_cfg->binlogRateLimitMB * 1024 * 1024) / 10;
-    while (remain) {
-      size_t batchSize = std::min(remain, fileBatch);
-      remain -= batchSize;
-      Expected<std::string> exptData =
-        client->read(batchSize, std::chrono::seconds(100));
-      if (!exptData.ok()) {
-        LOG(ERROR) << "fullsync read bulk data failed:"
-                   << exptData.status().toString();
-        return;
-      }
-      myfile.write(exptData.value().c_str(), exptData.value().size());
-      if (myfile.bad()) {
-        LOG(ERROR) << "write file:" << fullFileName
-                   << " failed:" << strerror(errno);
-        return;
-      }
-      Status s = client->writeLine("+OK");
-      if (!s.ok()) {
-        LOG(ERROR) << "write file:" << fullFileName
-                   << " reply failed:" << s.toString();
-        return;
-      }
-    }
     LOG(INFO) << "fullsync file:" << fullFileName << " transfer done";
     finishedFiles.insert(s.value());
   }
@@ -318,7 +582,7 @@ void ReplManager::slaveStartFullsync(const StoreMeta& metaSnapshot) {
   rollback = false;
 
   LOG(INFO) << "store:" << metaSnapshot.id
-            << ",fullsync Done, files:" << finishedFiles.size()
+            << ",fullsync Done, files:" << flist.size()
             << ",binlogId:" << newMeta->binlogId
             << ",restart binlogId:" << restartStatus.value();
 }
@@ -369,6 +633,10 @@ void ReplManager::slaveChkSyncStatus(const StoreMeta& metaSnapshot) {
   std::stringstream ss;
   ss << "INCRSYNC " << metaSnapshot.syncFromId << ' ' << metaSnapshot.id << ' '
      << metaSnapshot.binlogId << ' ' << _cfg->bindIp << ' ' << _cfg->port;
+  // NOTE(tendis): the master should support it, or INCRSYNC is refused
+  if (_cfg->binlogCompress == "lz4") {
+    ss << " lz4";
+  }
   auto status = client->writeLine(ss.str());
   if (!status.ok()) {
     errStr =
@@ -381,6 +649,17 @@ void ReplManager::slaveChkSyncStatus(const StoreMeta& metaSnapshot) {
       errPrefix + "psync master failed with error:" + s.status().toString();
     return;
   }
+  if (s.value().find("-ERR FULLSYNC") == 0) {
+    // the master changed the data without binlogs, sync it again
+    LOG(WARNING) << errPrefix << "turns to fullsync:" << s.value();
+    has_error = false;
+    auto newMeta = metaSnapshot.copy();
+    newMeta->replState = ReplState::REPL_CONNECT;
+    newMeta->binlogId = Transaction::TXNID_UNINITED;
+    newMeta->replErr = "";
+    changeReplState(*newMeta, true);
+    return;
+  }
   if (s.value().size() == 0 || s.value()[0] != '+') {
     errStr = errPrefix + "incrsync master bad return:" + s.value();
     return;
@@ -535,6 +814,46 @@ Status ReplManager::applyRepllogV2(Session* sess,
   return {ErrorCodes::ERR_OK, ""};
 }
 
+Status ReplManager::applyRepllogsV2(Session* sess,
+                                    uint32_t storeId,
+                                    std::vector<ReplLogRawV2>* logs) {
+  [this, storeId]() {
+    std::unique_lock<std::mutex> lk(_mutex);
+    _cv.wait(lk, [this, storeId] { return !_syncStatus[storeId]->isRunning; });
+    _syncStatus[storeId]->isRunning = true;
+  }();
+
+  uint64_t sessionId = sess->id();
+  BinlogResult applied;
+  bool idMatch = [this, storeId, sessionId, &applied]() {
+    std::unique_lock<std::mutex> lk(_mutex);
+    applied.binlogId = _syncMeta[storeId]->binlogId;
+    return (sessionId == _syncStatus[storeId]->sessionId);
+  }();
+  uint64_t firstId = applied.binlogId;
+  auto guard = MakeGuard([this, storeId, &applied, &idMatch, firstId] {
+    std::unique_lock<std::mutex> lk(_mutex);
+    INVARIANT_D(_syncStatus[storeId]->isRunning);
+    _syncStatus[storeId]->isRunning = false;
+    if (idMatch) {
+      _syncStatus[storeId]->lastSyncTime = SCLOCK::now();
+      if (applied.binlogId != firstId) {
+        // NOTE(vinchen): store the binlogId without changeReplState()
+        // If it's shutdown, we can get the largest binlogId from rocksdb.
+        _syncMeta[storeId]->binlogId = applied.binlogId;
+      }
+      if (applied.binlogTs > _syncStatus[storeId]->lastBinlogTs) {
+        _syncStatus[storeId]->lastBinlogTs = applied.binlogTs;
+      }
+    }
+  });
+
+  if (!idMatch) {
+    return {ErrorCodes::ERR_NOTFOUND, "sessionId not match"};
+  }
+  return _applier->apply(sess, storeId, logs, &applied);
+}
+
 std::ofstream* ReplManager::getCurBinlogFs(uint32_t storeId) {
   std::ofstream* fs = nullptr;
   uint32_t currentId = 0;
@@ -546,28 +865,7 @@ std::ofstream* ReplManager::getCurBinlogFs(uint32_t storeId) {
     ts = _logRecycStatus[storeId]->timestamp;
   }
   if (fs == nullptr) {
-    if (ts == 0) {
-      ts = _svr->getStartupTimeNs() / 1000000;
-    }
-    char fname[256], tbuf[256];
-    memset(fname, 0, 128);
-    memset(tbuf, 0, 128);
-
-    // ms to second
-    time_t time = (time_t)(uint32_t)(ts / 1000);
-    struct tm lt;
-    (void)localtime_r(&time, &lt);
-    strftime(tbuf, sizeof(tbuf), "%Y%m%d%H%M%S", &lt);
-
-    snprintf(fname,
-             sizeof(fname),
-             "%s/%d/binlog-%d-%07d-%s.log",
-             _dumpPath.c_str(),
-             storeId,
-             storeId,
-             currentId + 1,
-             tbuf);
-
+    auto fname = newDumpFileName(storeId, currentId + 1, ts);
     fs = KVStore::createBinlogFile(fname, storeId);
     if (!fs) {
       return fs;
@@ -584,6 +882,68 @@ std::ofstream* ReplManager::getCurBinlogFs(uint32_t storeId) {
   return fs;
 }
 
+BinlogArchiveWriter* ReplManager::getCurBinlogArchive(uint32_t storeId) {
+  BinlogArchiveWriter* archive = nullptr;
+  uint32_t currentId = 0;
+  uint64_t ts = 0;
+  {
+    std::unique_lock<std::mutex> lk(_mutex);
+    archive = _logRecycStatus[storeId]->archive.get();
+    currentId = _logRecycStatus[storeId]->fileSeq;
+    ts = _logRecycStatus[storeId]->timestamp;
+  }
+  if (archive == nullptr) {
+    auto writer = std::make_unique<BinlogArchiveWriter>(
+      newDumpFileName(storeId, currentId + 1, ts),
+      storeId,
+      _cfg->binlogArchiveBlockKB * 1024,
+      _cfg->binlogArchiveCompress == "lz4");
+    auto s = writer->open();
+    if (!s.ok()) {
+      LOG(ERROR) << "open binlog archive of store:" << storeId
+                 << " failed:" << s.toString();
+      return nullptr;
+    }
+    archive = writer.get();
+
+    std::unique_lock<std::mutex> lk(_mutex);
+    auto& v = _logRecycStatus[storeId];
+    v->archive = std::move(writer);
+    v->fileSeq = currentId + 1;
+    v->fileCreateTime = SCLOCK::now();
+    v->fileSize = archive->size();
+    v->needNewFile = false;
+  }
+  return archive;
+}
+
+std::string ReplManager::newDumpFileName(uint32_t storeId,
+                                         uint32_t fileSeq,
+                                         uint64_t ts) const {
+  if (ts == 0) {
+    ts = _svr->getStartupTimeNs() / 1000000;
+  }
+  char fname[256], tbuf[256];
+  memset(fname, 0, 128);
+  memset(tbuf, 0, 128);
+
+  // ms to second
+  time_t time = (time_t)(uint32_t)(ts / 1000);
+  struct tm lt;
+  (void)localtime_r(&time, &lt);
+  strftime(tbuf, sizeof(tbuf), "%Y%m%d%H%M%S", &lt);
+
+  snprintf(fname,
+           sizeof(fname),
+           "%s/%d/binlog-%d-%07d-%s.log",
+           _dumpPath.c_str(),
+           storeId,
+           storeId,
+           fileSeq,
+           tbuf);
+  return fname;
+}
+
 bool ReplManager::newBinlogFs(uint32_t storeId) {
   {
     std::unique_lock<std::mutex> lk(_mutex);
@@ -623,6 +983,14 @@ void ReplManager::updateCurBinlogFs(uint32_t storeId,
       v->fs->close();
       v->fs.reset();
     }
+    if (v->archive) {
+      auto s = v->archive->finish();
+      if (!s.ok()) {
+        LOG(ERROR) << "finish binlog archive of store:" << storeId
+                   << " failed:" << s.toString();
+      }
+      v->archive.reset();
+    }
     if (ts) {
       v->timestamp = ts;
     }
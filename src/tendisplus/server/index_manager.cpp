@@ -4,7 +4,9 @@
 
 #include "tendisplus/server/index_manager.h"
 
+#include <algorithm>
 #include <chrono>  // NOLINT
+#include <map>
 #include <memory>
 #include <vector>
 #include <utility>
@@ -13,15 +15,27 @@
 #include "glog/logging.h"
 
 #include "tendisplus/commands/command.h"
+#include "tendisplus/server/lazyfree_manager.h"
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/sync_point.h"
 #include "tendisplus/utils/portable.h"
 #include "tendisplus/utils/string.h"
 #include "tendisplus/utils/scopeguard.h"
+#include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/time.h"
 
 
 namespace tendisplus {
 
+// the keys deleted in one transaction is between EXPIRE_BATCH_MIN and
+// expire-batch-max-keys. It is halved if a transaction takes more than
+// EXPIRE_BATCH_TARGET_MS, which happens when the keys are busy or the
+// store is slowed down by writes, otherwise it grows slowly.
+static constexpr uint32_t EXPIRE_BATCH_MIN = 16;
+static constexpr uint64_t EXPIRE_BATCH_TARGET_MS = 20;
+// the pause between two rounds while there are keys to delete
+static constexpr uint64_t BUSY_PAUSE_MS = 100;
+
 IndexManager::IndexManager(std::shared_ptr<ServerEntry> svr,
                            std::shared_ptr<ServerParams> cfg)
   : _isRunning(false),
@@ -30,18 +44,23 @@ IndexManager::IndexManager(std::shared_ptr<ServerEntry> svr,
     _deleterMatrix(std::make_shared<PoolMatrix>()),
     _totalDequeue(0),
     _totalEnqueue(0),
+    _totalExpired(0),
+    _totalExpireTxns(0),
     _scanBatch(cfg->scanCntIndexMgr),
     _scanPoolSize(cfg->scanJobCntIndexMgr),
     _delBatch(cfg->delCntIndexMgr),
     _delPoolSize(cfg->delJobCntIndexMgr),
-    _pauseTime(cfg->pauseTimeIndexMgr) {
+    _pauseTime(cfg->pauseTimeIndexMgr),
+    _expireBatchMax(std::max(cfg->expireBatchMaxKeys, 1u)) {
   for (size_t storeId = 0; storeId < svr->getKVStoreCount(); ++storeId) {
     _scanPoints[storeId] = std::move(std::string());
+    _legacyScanPoints[storeId] = std::move(std::string());
     _scanJobStatus[storeId] = {false};
     _delJobStatus[storeId] = {false};
     _disableStatus[storeId] = {false};
     _scanJobCnt[storeId] = {0u};
     _delJobCnt[storeId] = {0u};
+    _expireBatchSize[storeId] = {_expireBatchMax};
   }
 }
 
@@ -69,6 +88,48 @@ Status IndexManager::startup() {
   return {ErrorCodes::ERR_OK, ""};
 }
 
+// scan the due indexes of one layout from *point, until scanned has room
+// elements. *point is set to the last index scanned.
+static void scanTTLIndexes(TTLIndexCursor* cursor,
+                           bool legacy,
+                           size_t room,
+                           std::string* point,
+                           std::list<TTLIndex>* scanned) {
+  if (point->empty()) {
+    cursor->seek(legacy ? RecordKey::prefixTTLIndex()
+                        : TTLIndex::prefixBucket());
+  } else {
+    // seek to the place where we left NOTE: skip the entry
+    // already push into list
+    cursor->seek(*point);
+    auto key = cursor->key();
+    if (!key.ok()) {
+      return;
+    }
+    if (key.value() == *point) {
+      cursor->next();
+    }
+  }
+
+  while (scanned->size() < room) {
+    auto record = cursor->next();
+    if (!record.ok() || record.value().isLegacy() != legacy) {
+      // if no ttl index, or if ttl index not expired
+      // scan again from the point again
+      //
+      // here's the invariant: if a ttl index T was picked
+      // up by the scanner (which means its associate
+      // key is expired), any attempt to inserting an ttl
+      // index before T will result in a deletion of the
+      // key. A bucket is returned only if its last ms is
+      // expired.
+      break;
+    }
+    point->assign(record.value().encode());
+    scanned->push_back(std::move(record.value()));
+  }
+}
+
 Status IndexManager::scanExpiredKeysJob(uint32_t storeId) {
   bool expected = false;
   if (!_scanJobStatus[storeId].compare_exchange_strong(
@@ -116,59 +177,53 @@ Status IndexManager::scanExpiredKeysJob(uint32_t storeId) {
   // store->getCurrentTime()
   auto cursor = txn->createTTLIndexCursor(store->getCurrentTime());
   INVARIANT(_scanPoints.find(storeId) != _scanPoints.end());
-  // seek to the place where we left NOTE: skip the entry
-  // already push into list
-  std::string prefix;
+  // NOTE(tendis): the legacy indexes are before the bucketed ones, and
+  // each layout is in ttl order, so both are resumed from where we left.
+  // The legacy ones are never written again, they drain as time goes.
+  std::string legacyPoint;
+  std::string point;
   {
     std::lock_guard<std::mutex> lk(_mutex);
-    prefix = _scanPoints[storeId];
+    legacyPoint = _legacyScanPoints[storeId];
+    point = _scanPoints[storeId];
   }
 
-  if (prefix.size() > 0) {
-    cursor->seek(prefix);
-    auto key = cursor->key();
-    if (!key.ok()) {
-      return {ErrorCodes::ERR_OK, ""};
-    }
-    if (!prefix.compare(key.value())) {
-      cursor->next();
+  // NOTE(tendis): the indexes are collected without _mutex, and queued
+  // at once, so the deleter is not blocked by the scanner.
+  size_t room = 0;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (_expiredKeys[storeId].size() < _scanBatch) {
+      room = _scanBatch - _expiredKeys[storeId].size();
     }
-    // we need to firstly check whether there is ttl index in the
-    // defalut colum_family
   }
 
   // TODO(takenliu) _scanPoints has error, _expiredKeys[storeId] will be
   // pushed back twice
-  while (true) {
-    auto record = cursor->next();
-    if (!record.ok()) {
-      // if no ttl index, or if ttl index not expired
-      // scan again from _scanPoints[storeId] again
-      // and we always resume from where we left, which
-      // is remembered by _scanPoints[storeI]
-      //
-      // here's the invariant: if a ttl index T was picked
-      // up by the scanner (which means its associate
-      // key is expired), any attempt to inserting an ttl
-      // index before T will result in a deletion of the
-      // key.
-      break;
-    }
-
-    {
-      std::lock_guard<std::mutex> lk(_mutex);
-      _scanPoints[storeId].assign(record.value().encode());
-      _expiredKeys[storeId].push_back(std::move(record.value()));
-      _totalEnqueue++;
-      if (_expiredKeys[storeId].size() == _scanBatch) {
-        break;
-      }
-    }
+  std::list<TTLIndex> scanned;
+  scanTTLIndexes(cursor.get(), true, room, &legacyPoint, &scanned);
+  scanTTLIndexes(cursor.get(), false, room, &point, &scanned);
+  bool moved = !scanned.empty();
+  // the keys unlinked are being freed by the LazyFreeManager already
+  auto lazyMgr = _svr->getLazyFreeMgr();
+  if (lazyMgr) {
+    scanned.remove_if([&lazyMgr, storeId](const TTLIndex& index) {
+      return index.getTTL() == LazyFreeManager::LAZYFREE_TTL &&
+        lazyMgr->isQueued(storeId, index.getDbId(), index.getPriKey());
+    });
+  }
 
-    TEST_SYNC_POINT_CALLBACK("InspectTotalEnqueue", &_totalEnqueue);
-    TEST_SYNC_POINT_CALLBACK("InspectScanJobCnt", &_scanJobCnt[storeId]);
+  if (moved) {
+    std::lock_guard<std::mutex> lk(_mutex);
+    _legacyScanPoints[storeId] = std::move(legacyPoint);
+    _scanPoints[storeId] = std::move(point);
+    _totalEnqueue += scanned.size();
+    _expiredKeys[storeId].splice(_expiredKeys[storeId].end(), scanned);
   }
 
+  TEST_SYNC_POINT_CALLBACK("InspectTotalEnqueue", &_totalEnqueue);
+  TEST_SYNC_POINT_CALLBACK("InspectScanJobCnt", &_scanJobCnt[storeId]);
+
   return {ErrorCodes::ERR_OK, ""};
 }
 
@@ -178,6 +233,7 @@ Status IndexManager::stopStore(uint32_t storeId) {
   _expiredKeys[storeId].clear();
 
   _scanPoints[storeId] = std::move(std::string());
+  _legacyScanPoints[storeId] = std::move(std::string());
   _scanJobCnt[storeId] = {0u};
   _delJobCnt[storeId] = {0u};
   _disableStatus[storeId].store(true, std::memory_order_relaxed);
@@ -198,36 +254,35 @@ int IndexManager::tryDelExpiredKeysJob(uint32_t storeId) {
 
   _delJobCnt[storeId]++;
   uint32_t deletes = 0;
+  uint32_t minSize = std::min(EXPIRE_BATCH_MIN, _expireBatchMax);
 
-  while (true) {
-    TTLIndex index;
-
+  while (deletes < _delBatch) {
+    uint32_t batchSize = _expireBatchSize[storeId].load();
+    std::vector<TTLIndex> batch;
     {
       std::lock_guard<std::mutex> lk(_mutex);
-      if (_expiredKeys[storeId].empty()) {
-        break;
+      auto& keys = _expiredKeys[storeId];
+      while (!keys.empty() && batch.size() < batchSize &&
+             deletes + batch.size() < _delBatch) {
+        batch.push_back(std::move(keys.front()));
+        keys.pop_front();
       }
-      index = _expiredKeys[storeId].front();
+      _totalDequeue += batch.size();
     }
-    LocalSessionGuard sg(_svr.get());
-    auto sess = sg.getSession();
-    sess->getCtx()->setAuthed();
-    sess->getCtx()->setDbId(index.getDbId());
-    Command::expireKeyIfNeeded(
-      sg.getSession(), index.getPriKey(), index.getType());
-
-    {
-      std::lock_guard<std::mutex> lk(_mutex);
-      INVARIANT(!_expiredKeys[storeId].empty());
-      _expiredKeys[storeId].pop_front();
-      _totalDequeue++;
-      deletes++;
+    if (batch.empty()) {
+      break;
     }
 
-    // break if delete a number of keys in the current store
-    if (deletes == _delBatch) {
-      break;
+    auto start = msSinceEpoch();
+    _totalExpired += delExpiredBatch(storeId, batch);
+    auto elapsed = msSinceEpoch() - start;
+    if (elapsed > EXPIRE_BATCH_TARGET_MS) {
+      batchSize = std::max(minSize, batchSize / 2);
+    } else if (batch.size() == batchSize) {
+      batchSize = std::min(_expireBatchMax, batchSize + minSize);
     }
+    _expireBatchSize[storeId] = batchSize;
+    deletes += batch.size();
 
     TEST_SYNC_POINT_CALLBACK("InspectTotalDequeue", &_totalDequeue);
     TEST_SYNC_POINT_CALLBACK("InspectDelJobCnt", &_delJobCnt[storeId]);
@@ -238,6 +293,97 @@ int IndexManager::tryDelExpiredKeysJob(uint32_t storeId) {
   return deletes;
 }
 
+uint32_t IndexManager::delExpiredBatch(uint32_t storeId,
+                                       const std::vector<TTLIndex>& batch) {
+  std::map<uint32_t, std::vector<TTLIndex>> dbKeys;
+  for (const auto& index : batch) {
+    dbKeys[index.getDbId()].push_back(index);
+  }
+  uint32_t deleted = 0;
+  for (auto& v : dbKeys) {
+    deleted += delExpiredKeysOfDb(storeId, v.first, &v.second);
+  }
+  return deleted;
+}
+
+uint32_t IndexManager::delExpiredKeysOfDb(uint32_t storeId,
+                                          uint32_t dbId,
+                                          std::vector<TTLIndex>* keys) {
+  LocalSessionGuard sg(_svr.get());
+  auto sess = sg.getSession();
+  sess->getCtx()->setAuthed();
+  sess->getCtx()->setDbId(dbId);
+
+  auto segMgr = _svr->getSegmentMgr();
+  std::vector<std::pair<uint32_t, TTLIndex>> sorted;
+  for (auto& index : *keys) {
+    const std::string key = index.getPriKey();
+    uint32_t chunkId = redis_port::keyHashSlot(key.c_str(), key.size()) %
+      segMgr->getChunkSize();
+    sorted.emplace_back(chunkId, std::move(index));
+  }
+  // NOTE(tendis): the keys are locked in the same order as
+  // getAllKeysLocked(), by chunk id and then by key, so a batch can't
+  // deadlock with the commands locking many keys.
+  auto less = [](const std::pair<uint32_t, TTLIndex>& a,
+                 const std::pair<uint32_t, TTLIndex>& b) {
+    return a.first < b.first ||
+      (a.first == b.first && a.second.getPriKey() < b.second.getPriKey());
+  };
+  std::sort(sorted.begin(), sorted.end(), less);
+
+  std::vector<DbWithLock> locks;
+  std::vector<std::pair<uint32_t, TTLIndex>> locked;
+  for (auto& v : sorted) {
+    if (!locked.empty() && !less(locked.back(), v)) {
+      // the same key
+      continue;
+    }
+    auto expdb =
+      segMgr->getDbWithKeyLock(sess, v.second.getPriKey(), Command::RdLock());
+    if (!expdb.ok()) {
+      continue;
+    }
+    INVARIANT_D(expdb.value().dbId == storeId);
+    locks.emplace_back(std::move(expdb.value()));
+    locked.emplace_back(std::move(v));
+  }
+
+  uint32_t deleted = 0;
+  std::vector<TTLIndex> left;
+  auto expDeleted =
+    Command::delExpiredKeysInLock(sess, storeId, locked, &left);
+  if (expDeleted.ok()) {
+    deleted = expDeleted.value();
+    if (deleted > 0) {
+      _totalExpireTxns++;
+    }
+  } else {
+    LOG(WARNING) << "delete expired keys of store " << storeId
+                 << " failed:" << expDeleted.status().toString();
+    left.clear();
+    for (const auto& v : locked) {
+      left.push_back(v.second);
+    }
+  }
+  locks.clear();
+
+  // big keys, or the keys of a failed batch are freed in background, or
+  // deleted one by one if the queue of LazyFreeManager is full
+  auto lazyMgr = _svr->getLazyFreeMgr();
+  for (const auto& index : left) {
+    if (lazyMgr && lazyMgr->enqueue(storeId, dbId, index.getPriKey())) {
+      continue;
+    }
+    auto rv = Command::expireKeyIfNeeded(
+      sess, index.getPriKey(), index.getType(), true, false);
+    if (rv.status().code() == ErrorCodes::ERR_EXPIRED) {
+      deleted++;
+    }
+  }
+  return deleted;
+}
+
 // call this in a forever loop
 Status IndexManager::run() {
   auto scheScanExpired = [this]() {
@@ -270,8 +416,13 @@ Status IndexManager::run() {
   TEST_SYNC_POINT_CALLBACK("BeforeIndexManagerLoop", &_isRunning);
   while (_isRunning.load(std::memory_order_relaxed)) {
     scheScanExpired();
-    schedDelExpired();
-    std::this_thread::sleep_for(std::chrono::seconds(_pauseTime));
+    // NOTE(tendis): while there are keys to delete, the next round
+    // starts soon, the expiration is not limited by pauseTime.
+    if (schedDelExpired()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(BUSY_PAUSE_MS));
+    } else {
+      std::this_thread::sleep_for(std::chrono::seconds(_pauseTime));
+    }
   }
 
   LOG(WARNING) << "index manager exiting...";
@@ -291,4 +442,28 @@ void IndexManager::stop() {
 bool IndexManager::isRunning() {
   return _isRunning.load(std::memory_order_relaxed);
 }
+
+void IndexManager::getStatInfo(std::stringstream& ss) {
+  uint64_t pending = 0;
+  uint64_t scanned = 0;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    for (const auto& v : _expiredKeys) {
+      pending += v.second.size();
+    }
+    scanned = _totalEnqueue;
+  }
+  uint64_t batchSize = 0;
+  for (const auto& v : _expireBatchSize) {
+    batchSize += v.second.load();
+  }
+  if (_expireBatchSize.size() > 0) {
+    batchSize /= _expireBatchSize.size();
+  }
+  ss << "expire_scanned_keys:" << scanned << "\r\n";
+  ss << "expire_deleted_keys:" << _totalExpired.load() << "\r\n";
+  ss << "expire_txns:" << _totalExpireTxns.load() << "\r\n";
+  ss << "expire_pending_keys:" << pending << "\r\n";
+  ss << "expire_batch_size:" << batchSize << "\r\n";
+}
 }  // namespace tendisplus
@@ -8,8 +8,10 @@
 
 #include <unordered_map>
 #include <list>
+#include <sstream>
 #include <string>
 #include <memory>
+#include <vector>
 #include "tendisplus/server/server_entry.h"
 #include "tendisplus/network/worker_pool.h"
 
@@ -29,18 +31,33 @@ class IndexManager {
   int tryDelExpiredKeysJob(uint32_t storeId);
   bool isRunning();
   Status stopStore(uint32_t storeId);
+  void getStatInfo(std::stringstream& ss);
 
  private:
+  // delete the keys of batch in transactions of at most
+  // _expireBatchSize[storeId] keys, return the number of keys deleted
+  uint32_t delExpiredBatch(uint32_t storeId,
+                           const std::vector<TTLIndex>& batch);
+  // delete the keys of one db in one transaction
+  uint32_t delExpiredKeysOfDb(uint32_t storeId,
+                              uint32_t dbId,
+                              std::vector<TTLIndex>* keys);
+
   std::unique_ptr<WorkerPool> _indexScanner;
   std::unique_ptr<WorkerPool> _keyDeleter;
   std::unordered_map<std::size_t, std::list<TTLIndex>> _expiredKeys;
   std::unordered_map<std::size_t, std::string> _scanPoints;
+  // scan points of the ttl indexes in the legacy layout
+  std::unordered_map<std::size_t, std::string> _legacyScanPoints;
   JobStatus _scanJobStatus;
   JobStatus _delJobStatus;
   // when destroystore, _disableStatus[storeId] = true
   JobStatus _disableStatus;
   JobCnt _scanJobCnt;
   JobCnt _delJobCnt;
+  // keys deleted in one transaction, it is adjusted by the time
+  // the transactions take, see delExpiredBatch()
+  JobCnt _expireBatchSize;
 
   std::atomic<bool> _isRunning;
   std::shared_ptr<ServerEntry> _svr;
@@ -52,12 +69,15 @@ class IndexManager {
 
   uint64_t _totalDequeue;
   uint64_t _totalEnqueue;
+  std::atomic<uint64_t> _totalExpired;
+  std::atomic<uint64_t> _totalExpireTxns;
 
   uint32_t _scanBatch;
   uint32_t _scanPoolSize;
   uint32_t _delBatch;
   uint32_t _delPoolSize;
   uint32_t _pauseTime;
+  uint32_t _expireBatchMax;
 };
 
 }  // namespace tendisplus
@@ -3,12 +3,15 @@
 // project for additional information.
 
 #include <memory>
+#include <sstream>
+#include <string>
 #include <utility>
 
 #include "gtest/gtest.h"
 #include "glog/logging.h"
 #include "tendisplus/server/server_entry.h"
 #include "tendisplus/server/index_manager.h"
+#include "tendisplus/server/lazyfree_manager.h"
 #include "tendisplus/server/segment_manager.h"
 #include "tendisplus/commands/command.h"
 #include "tendisplus/network/network.h"
@@ -262,6 +265,52 @@ TEST(IndexManager, scanIndexWhileExpire) {
   SyncPoint::GetInstance()->ClearAllCallBacks();
 }
 
+TEST(IndexManager, batchExpire) {
+  uint64_t totalDequeue = 0;
+  uint64_t totalEnqueue = 0;
+
+  const auto guard = MakeGuard([] { destroyEnv(); });
+
+  EXPECT_TRUE(setupEnv());
+
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  SyncPoint::GetInstance()->LoadDependency({
+    {"AfterGenerateTTLIndex", "BeforeIndexManagerLoop"},
+  });
+
+  auto cfg = makeServerParam();
+  cfg->expireBatchMaxKeys = 64;
+  auto server = std::make_shared<ServerEntry>(cfg);
+
+  testScanIndex(server, cfg, 2048, 1, false, &totalEnqueue, &totalDequeue);
+
+  std::stringstream ss;
+  server->getIndexMgr()->getStatInfo(ss);
+  auto info = ss.str();
+  LOG(INFO) << info;
+  auto getStat = [&info](const std::string& name) {
+    auto pos = info.find(name + ":");
+    EXPECT_NE(pos, std::string::npos);
+    return std::stoull(info.substr(pos + name.size() + 1));
+  };
+  uint64_t deleted = getStat("expire_deleted_keys");
+  uint64_t txns = getStat("expire_txns");
+  EXPECT_EQ(deleted, 2048 * 4u);
+  // the keys are deleted in batches
+  EXPECT_GT(txns, 0u);
+  EXPECT_LT(txns * 2, deleted);
+  EXPECT_EQ(getStat("expire_pending_keys"), 0u);
+  EXPECT_LE(getStat("expire_batch_size"), 64u);
+
+  server->stop();
+  ASSERT_EQ(totalDequeue, 2048 * 4u);
+  ASSERT_EQ(totalEnqueue, 2048 * 4u);
+  ASSERT_EQ(server.use_count(), 1);
+
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+}
+
 TEST(IndexManager, singleJobRunning) {
   uint64_t totalDequeue = 0;
   uint64_t totalEnqueue = 0;
@@ -305,4 +354,124 @@ TEST(IndexManager, singleJobRunning) {
   SyncPoint::GetInstance()->DisableProcessing();
   SyncPoint::GetInstance()->ClearAllCallBacks();
 }
+
+TEST(IndexManager, lazyFree) {
+  const auto guard = MakeGuard([] { destroyEnv(); });
+
+  EXPECT_TRUE(setupEnv());
+
+  std::atomic<uint32_t> freed(0);
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  SyncPoint::GetInstance()->SetCallBack(
+    "LazyFreeManager::freeKey::Done", [&](void* arg) { freed++; });
+  SyncPoint::GetInstance()->EnableProcessing();
+
+  auto cfg = makeServerParam();
+  cfg->lazyfreeDelMinSubKeys = 100;
+  cfg->lazyfreeBatchSubKeys = 16;
+  auto server = std::make_shared<ServerEntry>(cfg);
+  auto s = server->startup(cfg);
+  ASSERT_TRUE(s.ok());
+
+  {
+    // big keys are freed in background, small keys are deleted at once
+    for (uint32_t i = 0; i < 200; i++) {
+      auto field = std::to_string(i);
+      runCommand(server, {"hset", "unlinked", field, field});
+      runCommand(server, {"hset", "deleted", field, field});
+      if (i < 50) {
+        runCommand(server, {"hset", "small", field, field});
+      }
+    }
+    EXPECT_EQ(runCommand(server, {"unlink", "unlinked"}),
+              Command::fmtLongLong(1));
+    EXPECT_EQ(runCommand(server, {"del", "deleted", "small"}),
+              Command::fmtLongLong(2));
+    for (auto& key : {"unlinked", "deleted", "small"}) {
+      EXPECT_EQ(runCommand(server, {"exists", key}),
+                Command::fmtLongLong(0));
+    }
+
+    for (uint32_t i = 0; i < 100 && freed < 2; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_EQ(freed, 2u);
+    std::stringstream ss;
+    server->getLazyFreeMgr()->getStatInfo(ss);
+    EXPECT_NE(ss.str().find("lazyfree_freed_keys:2\r\n"), std::string::npos);
+    EXPECT_NE(ss.str().find("lazyfree_queued_keys:2\r\n"), std::string::npos);
+  }
+
+  server->stop();
+  ASSERT_EQ(server.use_count(), 1);
+
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+}
+
+TEST(IndexManager, lazyFreeInline) {
+  const auto guard = MakeGuard([] { destroyEnv(); });
+
+  EXPECT_TRUE(setupEnv());
+
+  std::atomic<uint32_t> freed(0);
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  SyncPoint::GetInstance()->SetCallBack(
+    "LazyFreeManager::freeKey::Done", [&](void* arg) { freed++; });
+  SyncPoint::GetInstance()->EnableProcessing();
+
+  auto cfg = makeServerParam();
+  cfg->lazyfreeDelMinSubKeys = 100;
+  cfg->lazyfreeBatchSubKeys = 16;
+  cfg->lazyfreeBatchPauseMs = 1000;
+  auto server = std::make_shared<ServerEntry>(cfg);
+  auto s = server->startup(cfg);
+  ASSERT_TRUE(s.ok());
+
+  {
+    uint32_t count = Command::LAZYFREE_INLINE_SUBKEYS + 52;
+    for (uint32_t i = 0; i < count; i++) {
+      auto field = std::to_string(i);
+      runCommand(server, {"hset", "unlinked", field, field});
+    }
+    EXPECT_EQ(runCommand(server, {"unlink", "unlinked"}),
+              Command::fmtLongLong(1));
+
+    // the reads see it expired, it is not deleted or queued again
+    EXPECT_EQ(runCommand(server, {"exists", "unlinked"}),
+              Command::fmtLongLong(0));
+    EXPECT_EQ(runCommand(server, {"hget", "unlinked", "1"}),
+              Command::fmtNull());
+    std::stringstream ss;
+    server->getLazyFreeMgr()->getStatInfo(ss);
+    EXPECT_NE(ss.str().find("lazyfree_queued_keys:1\r\n"), std::string::npos);
+
+    // the job is paused after its first batch, a write deletes at most
+    // LAZYFREE_INLINE_SUBKEYS subkeys left, or fails with -TRYAGAIN
+    asio::io_context ioContext;
+    asio::ip::tcp::socket socket(ioContext);
+    NetSession sess(server, std::move(socket), 1, false, nullptr, nullptr);
+    sess.setArgs({"hset", "unlinked", "a", "b"});
+    auto expect = Command::runSessionCmd(&sess);
+    EXPECT_EQ(expect.status().code(), ErrorCodes::ERR_LAZYFREE_BUSY);
+    EXPECT_EQ(expect.status().toString().find("-TRYAGAIN"), 0U);
+    EXPECT_EQ(runCommand(server, {"hset", "unlinked", "a", "b"}),
+              Command::fmtOne());
+    EXPECT_EQ(runCommand(server, {"hlen", "unlinked"}), Command::fmtOne());
+
+    // the job sees the key written again, and leaves it
+    for (uint32_t i = 0; i < 100 && freed < 1; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_EQ(freed, 1u);
+    EXPECT_EQ(runCommand(server, {"hget", "unlinked", "a"}),
+              Command::fmtBulk("b"));
+  }
+
+  server->stop();
+  ASSERT_EQ(server.use_count(), 1);
+
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+}
 }  // namespace tendisplus
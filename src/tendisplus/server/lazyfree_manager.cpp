@@ -0,0 +1,196 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include "tendisplus/server/lazyfree_manager.h"
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <thread>  // NOLINT
+#include <utility>
+
+#include "glog/logging.h"
+
+#include "tendisplus/commands/command.h"
+#include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/sync_point.h"
+
+namespace tendisplus {
+
+LazyFreeManager::LazyFreeManager(std::shared_ptr<ServerEntry> svr,
+                                 std::shared_ptr<ServerParams> cfg)
+  : _svr(svr),
+    _poolMatrix(std::make_shared<PoolMatrix>()),
+    _isRunning(false),
+    _queues(svr->getKVStoreCount()),
+    _queuedSet(svr->getKVStoreCount()),
+    _scheduled(svr->getKVStoreCount(), false),
+    _queuedKeys(0),
+    _rejectedKeys(0),
+    _freedKeys(0),
+    _freedSubKeys(0),
+    _freeTxns(0),
+    _threads(std::max(cfg->lazyfreeThreads, 1u)),
+    _queueMax(cfg->lazyfreeQueueMaxKeys),
+    _batchSubKeys(std::max(cfg->lazyfreeBatchSubKeys, 1u)),
+    _batchPauseMs(cfg->lazyfreeBatchPauseMs) {}
+
+Status LazyFreeManager::startup() {
+  _pool = std::make_unique<WorkerPool>("tx-lazyfree", _poolMatrix);
+  auto s = _pool->startup(_threads);
+  if (!s.ok()) {
+    return s;
+  }
+  _isRunning.store(true, std::memory_order_relaxed);
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+void LazyFreeManager::stop() {
+  LOG(WARNING) << "lazyfree manager begins to stop...";
+  _isRunning.store(false, std::memory_order_relaxed);
+  if (_pool) {
+    _pool->stop();
+  }
+  // NOTE(tendis): the keys left are expired with ttl indexes, they are
+  // deleted by the IndexManager after restart.
+  std::lock_guard<std::mutex> lk(_mutex);
+  for (auto& queue : _queues) {
+    queue.clear();
+  }
+  for (auto& keys : _queuedSet) {
+    keys.clear();
+  }
+  LOG(WARNING) << "lazyfree manager stops succ";
+}
+
+Status LazyFreeManager::stopStore(uint32_t storeId) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  INVARIANT_D(storeId < _queues.size());
+  _queues[storeId].clear();
+  _queuedSet[storeId].clear();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+bool LazyFreeManager::enqueue(uint32_t storeId,
+                              uint32_t dbId,
+                              const std::string& key) {
+  if (!_isRunning.load(std::memory_order_relaxed) ||
+      storeId >= _queues.size()) {
+    return false;
+  }
+  bool schedule = false;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (_queuedSet[storeId].count({dbId, key})) {
+      return true;
+    }
+    if (_queues[storeId].size() >= _queueMax) {
+      _rejectedKeys++;
+      return false;
+    }
+    _queues[storeId].push_back({dbId, key});
+    _queuedSet[storeId].insert({dbId, key});
+    if (!_scheduled[storeId]) {
+      _scheduled[storeId] = true;
+      schedule = true;
+    }
+  }
+  _queuedKeys++;
+  if (schedule) {
+    _pool->schedule([this, storeId]() { freeKeysJob(storeId); });
+  }
+  return true;
+}
+
+void LazyFreeManager::freeKeysJob(uint32_t storeId) {
+  while (true) {
+    Task task;
+    {
+      std::lock_guard<std::mutex> lk(_mutex);
+      auto& queue = _queues[storeId];
+      if (queue.empty() || !_isRunning.load(std::memory_order_relaxed)) {
+        _scheduled[storeId] = false;
+        return;
+      }
+      task = std::move(queue.front());
+      queue.pop_front();
+    }
+    if (freeKey(storeId, task)) {
+      _freedKeys++;
+    }
+    // NOTE(tendis): a key failed to free is queued again by the next
+    // command on it, or by the IndexManager after restart.
+    std::lock_guard<std::mutex> lk(_mutex);
+    _queuedSet[storeId].erase({task.dbId, task.key});
+  }
+}
+
+bool LazyFreeManager::isQueued(uint32_t storeId,
+                               uint32_t dbId,
+                               const std::string& key) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  return storeId < _queuedSet.size() && _queuedSet[storeId].count({dbId, key});
+}
+
+bool LazyFreeManager::freeKey(uint32_t storeId, const Task& task) {
+  LocalSessionGuard sg(_svr.get());
+  auto sess = sg.getSession();
+  sess->getCtx()->setAuthed();
+  sess->getCtx()->setDbId(task.dbId);
+
+  // NOTE(tendis): the key is locked for each batch only, a command on
+  // the key between two batches sees it expired, and deletes the rest.
+  while (_isRunning.load(std::memory_order_relaxed)) {
+    bool done = false;
+    {
+      auto expdb = _svr->getSegmentMgr()->getDbWithKeyLock(
+        sess, task.key, mgl::LockMode::LOCK_X);
+      if (!expdb.ok()) {
+        LOG(WARNING) << "lazyfree lock key failed:"
+                     << expdb.status().toString();
+        return false;
+      }
+      INVARIANT_D(expdb.value().dbId == storeId);
+      RecordKey mk(expdb.value().chunkId,
+                   task.dbId,
+                   RecordType::RT_DATA_META,
+                   task.key,
+                   "");
+      auto cnt =
+        Command::lazyFreeStep(sess, storeId, mk, _batchSubKeys, &done);
+      if (!cnt.ok()) {
+        LOG(WARNING) << "lazyfree key of store " << storeId
+                     << " failed:" << cnt.status().toString();
+        return false;
+      }
+      _freedSubKeys += cnt.value();
+      _freeTxns++;
+    }
+    if (done) {
+      TEST_SYNC_POINT("LazyFreeManager::freeKey::Done");
+      return true;
+    }
+    if (_batchPauseMs > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(_batchPauseMs));
+    }
+  }
+  return false;
+}
+
+void LazyFreeManager::getStatInfo(std::stringstream& ss) {
+  uint64_t pending = 0;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    for (const auto& queue : _queues) {
+      pending += queue.size();
+    }
+  }
+  ss << "lazyfree_pending_keys:" << pending << "\r\n";
+  ss << "lazyfree_queued_keys:" << _queuedKeys.load() << "\r\n";
+  ss << "lazyfree_rejected_keys:" << _rejectedKeys.load() << "\r\n";
+  ss << "lazyfree_freed_keys:" << _freedKeys.load() << "\r\n";
+  ss << "lazyfree_freed_subkeys:" << _freedSubKeys.load() << "\r\n";
+  ss << "lazyfree_txns:" << _freeTxns.load() << "\r\n";
+}
+
+}  // namespace tendisplus
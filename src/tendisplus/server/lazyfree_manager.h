@@ -0,0 +1,88 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_SERVER_LAZYFREE_MANAGER_H_
+#define SRC_TENDISPLUS_SERVER_LAZYFREE_MANAGER_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "tendisplus/server/server_entry.h"
+#include "tendisplus/network/worker_pool.h"
+
+namespace tendisplus {
+
+// LazyFreeManager deletes the subkeys of big keys in background, for
+// UNLINK, the DEL of big keys and the big keys expired.
+// A key queued is expired already: UNLINK/DEL set its ttl to
+// LAZYFREE_TTL with a ttl index, so it is invisible at once, and it is
+// deleted by the IndexManager if the task is lost in a restart.
+// Each store has a queue of at most lazyfree-queue-max-keys keys, which
+// is consumed by one job at a time in a pool of lazyfree-threads. A key
+// is queued once until it is freed, the IndexManager skips it meanwhile.
+// If the queue is full, the caller deletes the key by itself.
+// A key is deleted in transactions of lazyfree-batch-subkeys subkeys with
+// the key locked, and a pause of lazyfree-batch-pause-ms between them.
+// The meta is deleted with the last batch.
+class LazyFreeManager {
+ public:
+  LazyFreeManager(std::shared_ptr<ServerEntry> svr,
+                  std::shared_ptr<ServerParams> cfg);
+  Status startup();
+  void stop();
+  Status stopStore(uint32_t storeId);
+  // queue the expired key, return false if the queue is full. A key
+  // queued already is not queued again.
+  bool enqueue(uint32_t storeId, uint32_t dbId, const std::string& key);
+  // whether the key is queued or being freed
+  bool isQueued(uint32_t storeId, uint32_t dbId, const std::string& key);
+  void getStatInfo(std::stringstream& ss);
+
+  // the ttl of a key unlinked, it is expired
+  static constexpr uint64_t LAZYFREE_TTL = 1;
+  // UNLINK frees the keys of so many subkeys in background, as redis
+  static constexpr uint64_t UNLINK_MIN_SUBKEYS = 64;
+
+ private:
+  struct Task {
+    uint32_t dbId;
+    std::string key;
+  };
+  void freeKeysJob(uint32_t storeId);
+  // return false if the key is not freed, because of stop
+  bool freeKey(uint32_t storeId, const Task& task);
+
+  std::shared_ptr<ServerEntry> _svr;
+  std::unique_ptr<WorkerPool> _pool;
+  std::shared_ptr<PoolMatrix> _poolMatrix;
+  std::atomic<bool> _isRunning;
+
+  std::mutex _mutex;
+  std::vector<std::list<Task>> _queues;
+  // the keys of the queues and the ones being freed
+  std::vector<std::set<std::pair<uint32_t, std::string>>> _queuedSet;
+  // whether a job of the store is scheduled
+  std::vector<bool> _scheduled;
+
+  std::atomic<uint64_t> _queuedKeys;
+  std::atomic<uint64_t> _rejectedKeys;
+  std::atomic<uint64_t> _freedKeys;
+  std::atomic<uint64_t> _freedSubKeys;
+  std::atomic<uint64_t> _freeTxns;
+
+  const uint32_t _threads;
+  const uint32_t _queueMax;
+  const uint32_t _batchSubKeys;
+  const uint32_t _batchPauseMs;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_SERVER_LAZYFREE_MANAGER_H_
@@ -2,7 +2,9 @@
 // Please refer to the license text that comes with this tendis open source
 // project for additional information.
 
+#include <atomic>
 #include <memory>
+#include <tuple>
 #include <utility>
 #include <thread>  // NOLINT
 
@@ -1007,4 +1009,403 @@ TEST(Repl, BinlogVersion) {
   ASSERT_EQ(version2_slave2.use_count(), 1);
 }
 
+TEST(Repl, BinlogSendWindow) {
+  const auto guard = MakeGuard([] {
+    destroyReplEnv();
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+  });
+
+  EXPECT_TRUE(setupEnv(master_dir));
+  EXPECT_TRUE(setupEnv(slave_dir));
+  uint32_t kvstoreNum = 2;
+  auto cfg1 = makeServerParam(master_port, kvstoreNum, master_dir, false);
+  // many small batches in flight
+  cfg1->binlogSendWindow = 8;
+  cfg1->bingLogSendBatch = 16;
+  auto cfg2 = makeServerParam(slave_port, kvstoreNum, slave_dir, false);
+
+  auto master = std::make_shared<ServerEntry>(cfg1);
+  auto s = master->startup(cfg1);
+  INVARIANT(s.ok());
+  auto slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  {
+    auto ctx = std::make_shared<asio::io_context>();
+    auto session = makeSession(slave, ctx);
+
+    WorkLoad work(slave, session);
+    work.init();
+    work.slaveof("127.0.0.1", master_port);
+  }
+
+  initData(master, recordSize);
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+
+  // the slave resumes from the binlogs it applied after restart
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+  initData(master, recordSize);
+  slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  initData(master, recordSize);
+
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+
+#ifndef _WIN32
+  master->stop();
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+#endif
+}
+
+TEST(Repl, BinlogCompress) {
+  const auto guard = MakeGuard([] {
+    destroyReplEnv();
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+  });
+
+  EXPECT_TRUE(setupEnv(master_dir));
+  EXPECT_TRUE(setupEnv(slave_dir));
+  uint32_t kvstoreNum = 2;
+  auto cfg1 = makeServerParam(master_port, kvstoreNum, master_dir, false);
+  cfg1->binlogSendWindow = 4;
+  auto cfg2 = makeServerParam(slave_port, kvstoreNum, slave_dir, false);
+  // the slave asks for the batches compressed
+  cfg2->binlogCompress = "lz4";
+
+  auto master = std::make_shared<ServerEntry>(cfg1);
+  auto s = master->startup(cfg1);
+  INVARIANT(s.ok());
+  auto slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  {
+    auto ctx = std::make_shared<asio::io_context>();
+    auto session = makeSession(slave, ctx);
+
+    WorkLoad work(slave, session);
+    work.init();
+    work.slaveof("127.0.0.1", master_port);
+  }
+
+  initData(master, recordSize);
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+
+  std::stringstream ss;
+  master->getReplManager()->getReplInfo(ss);
+  EXPECT_NE(ss.str().find("compress=lz4"), std::string::npos) << ss.str();
+
+#ifndef _WIN32
+  master->stop();
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+#endif
+}
+
+TEST(Repl, FullSyncStreams) {
+  const auto guard = MakeGuard([] {
+    destroyReplEnv();
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+  });
+
+  EXPECT_TRUE(setupEnv(master_dir));
+  EXPECT_TRUE(setupEnv(slave_dir));
+  uint32_t kvstoreNum = 2;
+  auto cfg1 = makeServerParam(master_port, kvstoreNum, master_dir, false);
+  auto cfg2 = makeServerParam(slave_port, kvstoreNum, slave_dir, false);
+  // the files of the backup are fetched by three connections
+  cfg2->fullSyncStreams = 3;
+
+  auto master = std::make_shared<ServerEntry>(cfg1);
+  auto s = master->startup(cfg1);
+  INVARIANT(s.ok());
+  auto slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+
+  initData(master, recordSize);
+  {
+    auto ctx = std::make_shared<asio::io_context>();
+    auto session = makeSession(slave, ctx);
+
+    WorkLoad work(slave, session);
+    work.init();
+    work.slaveof("127.0.0.1", master_port);
+  }
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+
+  for (uint32_t i = 0; i < kvstoreNum; i++) {
+    auto id = std::to_string(i);
+    std::string slaveDb = std::string(slave_dir) + "/db/" + id;
+    std::string masterDb = std::string(master_dir) + "/db/" + id;
+    // the staging dir is moved into the store
+    EXPECT_FALSE(filesystem::exists(slaveDb + "_fullsync"));
+    // the backup is released after the full sync done
+    EXPECT_FALSE(filesystem::exists(masterDb + "_bak"));
+  }
+
+#ifndef _WIN32
+  master->stop();
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+#endif
+}
+
+// a full sync broken in the middle goes on with the files received, and
+// receives again the files removed or truncated since then
+TEST(Repl, FullSyncResume) {
+  const auto guard = MakeGuard([] {
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+    destroyReplEnv();
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+  });
+
+  EXPECT_TRUE(setupEnv(master_dir));
+  EXPECT_TRUE(setupEnv(slave_dir));
+  // one store and one stream, the files are received in order
+  uint32_t kvstoreNum = 1;
+  auto cfg1 = makeServerParam(master_port, kvstoreNum, master_dir, false);
+  auto cfg2 = makeServerParam(slave_port, kvstoreNum, slave_dir, false);
+  cfg2->fullSyncStreams = 1;
+
+  auto master = std::make_shared<ServerEntry>(cfg1);
+  auto s = master->startup(cfg1);
+  INVARIANT(s.ok());
+  auto slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  initData(master, recordSize);
+
+  std::string fullDir = std::string(slave_dir) + "/db/0_fullsync/";
+  std::mutex mutex;
+  int attempt = 1;
+  std::string current;
+  std::vector<std::string> received;
+  std::set<std::string> refetched;
+  SyncPoint::GetInstance()->SetCallBack(
+    "ReplManager::fetchFullSyncFiles::fetch", [&](void* arg) {
+      std::lock_guard<std::mutex> lk(mutex);
+      current = *reinterpret_cast<std::string*>(arg);
+      if (attempt == 2) {
+        refetched.insert(current);
+      }
+    });
+  SyncPoint::GetInstance()->SetCallBack(
+    "ReplManager::fetchFullSyncFiles::received", [&](void* arg) {
+      std::lock_guard<std::mutex> lk(mutex);
+      auto ps = reinterpret_cast<Status*>(arg);
+      if (attempt != 1 || !ps->ok()) {
+        return;
+      }
+      if (received.size() < 2) {
+        received.push_back(current);
+        return;
+      }
+      // break the transfer at the third file, after the first one is
+      // truncated and the second one is removed
+      std::error_code ec;
+      filesystem::resize_file(fullDir + received[0], 1, ec);
+      EXPECT_FALSE(ec) << ec.message();
+      EXPECT_TRUE(filesystem::remove(fullDir + received[1], ec));
+      *ps = {ErrorCodes::ERR_INTERNAL, "transfer broken"};
+      attempt = 2;
+    });
+  SyncPoint::GetInstance()->EnableProcessing();
+
+  {
+    auto ctx = std::make_shared<asio::io_context>();
+    auto session = makeSession(slave, ctx);
+
+    WorkLoad work(slave, session);
+    work.init();
+    work.slaveof("127.0.0.1", master_port);
+  }
+
+  // wait for the full sync retried
+  auto ctx1 = std::make_shared<asio::io_context>();
+  WorkLoad work1(master, makeSession(master, ctx1));
+  work1.init();
+  auto ctx2 = std::make_shared<asio::io_context>();
+  WorkLoad work2(slave, makeSession(slave, ctx2));
+  work2.init();
+  auto masterPos = work1.getIntResult({"binlogpos", "0"});
+  ASSERT_TRUE(masterPos.ok());
+  for (int i = 0; i < 120; i++) {
+    auto slavePos = work2.getIntResult({"binlogpos", "0"});
+    if (slavePos.ok() && slavePos.value() >= masterPos.value()) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    EXPECT_EQ(attempt, 2);
+    ASSERT_EQ(received.size(), 2U);
+    EXPECT_EQ(refetched.count(received[0]), 1U);
+    EXPECT_EQ(refetched.count(received[1]), 1U);
+  }
+  EXPECT_FALSE(filesystem::exists(fullDir));
+
+#ifndef _WIN32
+  master->stop();
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+#endif
+}
+
+TEST(Repl, ParallelApply) {
+  const auto guard = MakeGuard([] {
+    destroyReplEnv();
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+  });
+
+  EXPECT_TRUE(setupEnv(master_dir));
+  EXPECT_TRUE(setupEnv(slave_dir));
+  uint32_t kvstoreNum = 2;
+  auto cfg1 = makeServerParam(master_port, kvstoreNum, master_dir, false);
+  auto cfg2 = makeServerParam(slave_port, kvstoreNum, slave_dir, false);
+  // the binlogs of a batch are applied by lanes, and grouped in the lanes
+  cfg2->replApplyThreads = 4;
+  cfg2->replApplyBatch = 16;
+
+  auto master = std::make_shared<ServerEntry>(cfg1);
+  auto s = master->startup(cfg1);
+  INVARIANT(s.ok());
+  auto slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  {
+    auto ctx = std::make_shared<asio::io_context>();
+    auto session = makeSession(slave, ctx);
+
+    WorkLoad work(slave, session);
+    work.init();
+    work.slaveof("127.0.0.1", master_port);
+  }
+
+  initData(master, recordSize);
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+
+  // the binlogs are visible in order, the slave resumes from them
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+  initData(master, recordSize);
+  slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  initData(master, recordSize);
+
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+
+#ifndef _WIN32
+  master->stop();
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+#endif
+}
+
+TEST(Repl, ParallelApplyFail) {
+  const auto guard = MakeGuard([] {
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+    destroyReplEnv();
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+  });
+
+  EXPECT_TRUE(setupEnv(master_dir));
+  EXPECT_TRUE(setupEnv(slave_dir));
+  uint32_t kvstoreNum = 1;
+  auto cfg1 = makeServerParam(master_port, kvstoreNum, master_dir, false);
+  auto cfg2 = makeServerParam(slave_port, kvstoreNum, slave_dir, false);
+  cfg2->replApplyThreads = 4;
+
+  auto master = std::make_shared<ServerEntry>(cfg1);
+  auto s = master->startup(cfg1);
+  INVARIANT(s.ok());
+  auto slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  {
+    auto ctx = std::make_shared<asio::io_context>();
+    auto session = makeSession(slave, ctx);
+
+    WorkLoad work(slave, session);
+    work.init();
+    work.slaveof("127.0.0.1", master_port);
+  }
+  initData(master, recordSize);
+  waitSlaveCatchup(master, slave);
+
+  // the lane applying failId fails, or all the lanes with failAll
+  const uint64_t failId = master->getStores()[0]->getHighestBinlogId() + 100;
+  std::atomic<bool> failAll(false);
+  std::atomic<uint32_t> failures(0);
+  SyncPoint::GetInstance()->SetCallBack(
+    "BinlogApplier::applyTask", [&](void* arg) {
+      auto point =
+        reinterpret_cast<std::tuple<uint64_t, uint64_t, Status>*>(arg);
+      if (failAll ||
+          (std::get<0>(*point) <= failId && failId <= std::get<1>(*point))) {
+        std::get<2>(*point) = {ErrorCodes::ERR_INTERNAL, "lane failed"};
+        failures++;
+      }
+    });
+  SyncPoint::GetInstance()->EnableProcessing();
+
+  initData(master, recordSize);
+  for (int i = 0; i < 60 && failures == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  EXPECT_GT(failures.load(), 0U);
+  // the binlogs committed by the other lanes are not visible past it
+  EXPECT_LT(slave->getStores()[0]->getHighestBinlogId(), failId);
+
+  // the slave restarts from the binlog before the first one missing, it
+  // doesn't move with all the lanes failed
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+  failAll = true;
+  slave = std::make_shared<ServerEntry>(cfg2);
+  s = slave->startup(cfg2);
+  INVARIANT(s.ok());
+  uint64_t recoverPos = slave->getReplManager()->getSyncMeta().binlogId;
+  EXPECT_LT(recoverPos, failId);
+  {
+    auto ptxn = slave->getStores()[0]->createTransaction(nullptr);
+    EXPECT_TRUE(ptxn.ok());
+    auto txn = std::move(ptxn.value());
+    EXPECT_TRUE(txn->getKV(ReplLogKeyV2(recoverPos).encode()).ok());
+    EXPECT_EQ(txn->getKV(ReplLogKeyV2(recoverPos + 1).encode()).status().code(),
+              ErrorCodes::ERR_NOTFOUND);
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  EXPECT_EQ(slave->getReplManager()->getSyncMeta().binlogId, recoverPos);
+
+  // the binlogs from recoverPos are applied again
+  SyncPoint::GetInstance()->DisableProcessing();
+  waitSlaveCatchup(master, slave);
+  compareData(master, slave);
+  EXPECT_EQ(slave->getStores()[0]->getHighestBinlogId(),
+            master->getStores()[0]->getHighestBinlogId());
+
+#ifndef _WIN32
+  master->stop();
+  slave->stop();
+  ASSERT_EQ(slave.use_count(), 1);
+#endif
+}
+
 }  // namespace tendisplus
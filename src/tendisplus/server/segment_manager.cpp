@@ -12,12 +12,64 @@
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/redis_port.h"
 #include "tendisplus/server/server_entry.h"
+#include "tendisplus/utils/string.h"
+#include "tendisplus/commands/command.h"
 
 
 namespace tendisplus {
 
 SegmentMgr::SegmentMgr(const std::string& name) : _name(name) {}
 
+// NOTE(tendis): the writes of the clients wait for a stalled store before
+// locking the keys, so that they don't block in rocksdb with the keys
+// locked. The writes of the slaves are not throttled, an error breaks the
+// replication. The reads may lock the keys in LOCK_X too, see
+// Command::RdLock(), so the writes are told by the command.
+static bool isWriteCommand(Session* sess) {
+  auto cmd = Command::getCommand(sess);
+  if (!cmd) {
+    return false;
+  }
+  if (cmd->isWriteable()) {
+    return true;
+  }
+  // EXEC locks the keys of the commands queued
+  if (cmd->getName() != "exec" || !sess->getCtx()) {
+    return false;
+  }
+  for (const auto& args : sess->getCtx()->getMultiCmds()) {
+    auto it = commandMap().find(toLower(args[0]));
+    if (it != commandMap().end() && it->second->isWriteable()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool needAdmitWrite(Session* sess,
+                           const PStore& store,
+                           mgl::LockMode mode) {
+  if (mode != mgl::LockMode::LOCK_X && mode != mgl::LockMode::LOCK_IX) {
+    return false;
+  }
+  return sess && sess->getServerEntry() &&
+    store->getMode() == KVStore::StoreMode::READ_WRITE &&
+    isWriteCommand(sess);
+}
+
+// the slot got by the last try of the write is kept by the session, the
+// write is parked and tried again at it, see ServerEntry::processRequest()
+static Status admitWrite(Session* sess, const PStore& store, uint32_t storeId) {
+  if (!sess->getCtx()) {
+    uint64_t slot = 0;
+    return store->admitWrite(&slot);
+  }
+  uint64_t slot = sess->getCtx()->getWriteStallSlot(storeId);
+  auto s = store->admitWrite(&slot);
+  sess->getCtx()->setWriteStallSlot(storeId, slot);
+  return s;
+}
+
 SegmentMgrFnvHash64::SegmentMgrFnvHash64(
   const std::vector<std::shared_ptr<KVStore>>& ins, const size_t chunkSize)
   : SegmentMgr("fnv_hash_64"),
@@ -69,6 +121,15 @@ Expected<DbWithLock> SegmentMgrFnvHash64::getDbWithKeyLock(
     sess->getCtx()->setReplOnly(true);
   }
 
+  // the key locked by the session already, e.g. in EXEC, was admitted
+  if (needAdmitWrite(sess, _instances[segId], mode) &&
+      !(sess->getCtx() && sess->getCtx()->isLockedByMe(key, mode))) {
+    auto s = admitWrite(sess, _instances[segId], segId);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
   if (mode != mgl::LockMode::LOCK_NONE) {
     auto elk = KeyLock::AquireKeyLock(segId,
                                       chunkId,
@@ -181,6 +242,25 @@ SegmentMgrFnvHash64::getAllKeysLocked(Session* sess,
     }
   }
 
+  for (const auto& element : segList) {
+    if (!needAdmitWrite(sess, _instances[element.first], mode)) {
+      continue;
+    }
+    // the keys locked by the session already, e.g. in EXEC, were admitted
+    bool locked = sess->getCtx() &&
+      std::all_of(element.second.begin(),
+                  element.second.end(),
+                  [&](const std::pair<uint32_t, std::string>& k) {
+                    return sess->getCtx()->isLockedByMe(k.second, mode);
+                  });
+    if (!locked) {
+      auto s = admitWrite(sess, _instances[element.first], element.first);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+  }
+
   /* NOTE(vinchen): lock sequence
       lock kvstores from small to big(kvstore id)
           lock chunks from small to big(chunk id) in kvstore
@@ -17,7 +17,10 @@
 #include "tendisplus/utils/time.h"
 #include "tendisplus/commands/command.h"
 #include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/storage/skiplist.h"
+#include "tendisplus/storage/pieced_kv.h"
 #include "tendisplus/utils/string.h"
+#include "tendisplus/utils/hll_card_cache.h"
 #include "tendisplus/lock/lock.h"
 
 namespace tendisplus {
@@ -214,6 +217,7 @@ ServerEntry::ServerEntry()
     _replMgr(nullptr),
     _migrateMgr(nullptr),
     _indexMgr(nullptr),
+    _lazyFreeMgr(nullptr),
     _pessimisticMgr(nullptr),
     _mgLockMgr(nullptr),
     _clusterMgr(nullptr),
@@ -223,6 +227,8 @@ ServerEntry::ServerEntry()
     _poolMatrix(std::make_shared<PoolMatrix>()),
     _reqMatrix(std::make_shared<RequestMatrix>()),
     _cronThd(nullptr),
+    _bgCmdThd(nullptr),
+    _bgCmdRunning(false),
     _enableCluster(false),
     _requirepass(""),
     _masterauth(""),
@@ -465,6 +471,11 @@ Status ServerEntry::startup(const std::shared_ptr<ServerParams>& cfg) {
 
   // set command config
   Command::setNoExpire(cfg->noexpire);
+  Command::setMergeWrite(cfg->kvMergeWrite);
+  SkipListCache::getInstance().setLimit(cfg->skiplistCacheMaxNodes,
+                                        cfg->skiplistCacheMinCount);
+  PiecedKV::setConfig(cfg->kvPieceThreshold, cfg->kvPieceSize);
+  HllCardCache::getInstance().setLimit(cfg->hllCardCacheMaxKeys);
   Command::changeCommand(gRenameCmdList, "rename");
   Command::changeCommand(gMappingCmdList, "mapping");
 
@@ -652,6 +663,14 @@ Status ServerEntry::startup(const std::shared_ptr<ServerParams>& cfg) {
   }
 
   if (!cfg->noexpire) {
+    _lazyFreeMgr = std::make_unique<LazyFreeManager>(shared_from_this(), cfg);
+    s = _lazyFreeMgr->startup();
+    if (!s.ok()) {
+      LOG(ERROR) << "ServerEntry::startup failed, _lazyFreeMgr->startup:"
+                 << s.toString();
+      return s;
+    }
+
     _indexMgr = std::make_unique<IndexManager>(shared_from_this(), cfg);
     s = _indexMgr->startup();
     if (!s.ok()) {
@@ -718,6 +737,10 @@ IndexManager* ServerEntry::getIndexMgr() {
   return _indexMgr.get();
 }
 
+LazyFreeManager* ServerEntry::getLazyFreeMgr() {
+  return _lazyFreeMgr.get();
+}
+
 ClusterManager* ServerEntry::getClusterMgr() {
   return _clusterMgr.get();
 }
@@ -981,11 +1004,19 @@ bool ServerEntry::processRequest(Session* sess) {
   if (!_isRunning.load(std::memory_order_relaxed)) {
     return false;
   }
+  // a parked write tried again is logged and replied to monitors already
+  bool retried = sess->getCtx()->isWriteParked();
   // general log if nessarry
-  sess->getServerEntry()->logGeneral(sess);
+  if (!retried) {
+    sess->getServerEntry()->logGeneral(sess);
+  }
 
   auto expCmd = Command::precheck(sess);
   if (!expCmd.ok()) {
+    if (sess->getCtx()->isInMulti()) {
+      // EXEC will be aborted, as redis
+      sess->getCtx()->setMultiDirty();
+    }
     auto s =
       sess->setResponse(redis_port::errorReply(expCmd.status().toString()));
     if (!s.ok()) {
@@ -994,7 +1025,9 @@ bool ServerEntry::processRequest(Session* sess) {
     return true;
   }
 
-  replyMonitors(sess);
+  if (!retried) {
+    replyMonitors(sess);
+  }
 
   if (expCmd.value()->isBgCmd()) {
     auto expCmdName = expCmd.value()->getName();
@@ -1004,21 +1037,40 @@ bool ServerEntry::processRequest(Session* sess) {
       NetSession* ns = dynamic_cast<NetSession*>(sess);
       INVARIANT(ns != nullptr);
       std::vector<std::string> args = ns->getArgs();
-      // we have called precheck, it should have 4 args
-      INVARIANT(args.size() == 4);
-      _replMgr->supplyFullSync(ns->borrowConn(), args[1], args[2], args[3]);
+      // we have called precheck, it should have 4 args at least
+      INVARIANT(args.size() >= 4);
+      _replMgr->supplyFullSync(ns->borrowConn(),
+                               args[1],
+                               args[2],
+                               args[3],
+                               args.size() > 4 ? args[4] : "");
       ++_serverStat.syncFull;
       return false;
+    } else if (expCmdName == "fullsyncfiles") {
+      LOG(WARNING) << "[master] session id:" << sess->id()
+                   << " socket borrowed";
+      NetSession* ns = dynamic_cast<NetSession*>(sess);
+      INVARIANT(ns != nullptr);
+      std::vector<std::string> args = ns->getArgs();
+      // we have called precheck, it should have 3 args
+      INVARIANT(args.size() == 3);
+      _replMgr->supplyFullSyncFiles(ns->borrowConn(), args[1], args[2]);
+      return false;
     } else if (expCmdName == "incrsync") {
       LOG(WARNING) << "[master] session id:" << sess->id()
                    << " socket borrowed";
       NetSession* ns = dynamic_cast<NetSession*>(sess);
       INVARIANT(ns != nullptr);
       std::vector<std::string> args = ns->getArgs();
-      // we have called precheck, it should have 2 args
-      INVARIANT(args.size() == 6);
-      bool ret = _replMgr->registerIncrSync(
-        ns->borrowConn(), args[1], args[2], args[3], args[4], args[5]);
+      // we have called precheck, it should have 6 args at least
+      INVARIANT(args.size() >= 6);
+      bool ret = _replMgr->registerIncrSync(ns->borrowConn(),
+                                            args[1],
+                                            args[2],
+                                            args[3],
+                                            args[4],
+                                            args[5],
+                                            args.size() > 6 ? args[6] : "");
       if (ret) {
         ++_serverStat.syncPartialOk;
       } else {
@@ -1048,6 +1100,12 @@ bool ServerEntry::processRequest(Session* sess) {
       _migrateMgr->dstPrepareMigrate(
         ns->borrowConn(), args[1], args[2], args[3], storeNum);
       return false;
+    } else if (expCmdName == "rdbimport") {
+      LOG(INFO) << "[bgcmd] session id:" << sess->id() << " socket borrowed";
+      NetSession* ns = dynamic_cast<NetSession*>(sess);
+      INVARIANT(ns != nullptr);
+      runBgCommand(ns->borrowConn(), ns->getArgs());
+      return false;
     } else if (expCmdName == "quit") {
       LOG(INFO) << "quit command";
       NetSession* ns = dynamic_cast<NetSession*>(sess);
@@ -1062,6 +1120,17 @@ bool ServerEntry::processRequest(Session* sess) {
   }
 
   auto expect = Command::runSessionCmd(sess);
+  // NOTE(tendis): a write of a stalled store fails before locking the
+  // keys, it is parked by the net session and tried again, without
+  // holding the worker thread. EXEC can't be tried again, it ends the
+  // MULTI anyway.
+  if (expect.status().code() == ErrorCodes::ERR_WRITE_STALL &&
+      sess->getType() == Session::Type::NET &&
+      expCmd.value()->getName() != "exec" &&
+      sess->getCtx()->parkWrite(_cfg->writeStallTimeoutMs)) {
+    return true;
+  }
+  sess->getCtx()->clearWriteStall();
   if (!expect.ok()) {
     auto s = sess->setResponse(Command::fmtErr(expect.status().toString()));
     if (!s.ok()) {
@@ -1078,6 +1147,60 @@ bool ServerEntry::processRequest(Session* sess) {
   return true;
 }
 
+void ServerEntry::runBgCommand(asio::ip::tcp::socket sock,
+                               const std::vector<std::string>& args) {
+  std::shared_ptr<BlockingTcpClient> client = std::move(
+    _network->createBlockingClient(std::move(sock), 64 * 1024 * 1024));
+  auto giveBack = [this, client]() {
+    if (!_isRunning.load(std::memory_order_relaxed)) {
+      return;
+    }
+    auto eSess = _network->client2Session(client);
+    if (!eSess.ok()) {
+      LOG(WARNING) << "[bgcmd] client2Session failed:"
+                   << eSess.status().toString();
+    }
+  };
+
+  bool started = false;
+  std::unique_ptr<std::thread> last;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (!_bgCmdRunning) {
+      last = std::move(_bgCmdThd);
+      _bgCmdRunning = true;
+      started = true;
+      _bgCmdThd = std::make_unique<std::thread>([this, client, args,
+                                                 giveBack]() {
+        LocalSessionGuard sg(this);
+        sg.getSession()->getCtx()->setAuthed();
+        sg.getSession()->setArgs(args);
+        auto expect = Command::runSessionCmd(sg.getSession());
+        auto reply = expect.ok()
+          ? expect.value()
+          : Command::fmtErr(expect.status().toString());
+        auto s = client->writeData(reply);
+        if (!s.ok()) {
+          LOG(WARNING) << "[bgcmd] reply " << args[0]
+                       << " failed:" << s.toString();
+        } else {
+          giveBack();
+        }
+        std::lock_guard<std::mutex> lk(_mutex);
+        _bgCmdRunning = false;
+      });
+    }
+  }
+  if (last) {
+    // the last command has finished
+    last->join();
+  }
+  if (!started) {
+    client->writeData(Command::fmtErr("a background command is running"));
+    giveBack();
+  }
+}
+
 void ServerEntry::getStatInfo(std::stringstream& ss) const {
   ss << "total_connections_received:" << _netMatrix->connCreated.get()
      << "\r\n";
@@ -1139,6 +1262,22 @@ void ServerEntry::getStatInfo(std::stringstream& ss) const {
   ss << "keyspace_misses:" << _serverStat.keyspaceMisses.get() << "\r\n";
   ss << "keyspace_wrong_versionep:" << _serverStat.keyspaceIncorrectEp.get()
      << "\r\n";
+  auto& slCache = SkipListCache::getInstance();
+  ss << "skiplist_cache_hits:" << slCache.getHits() << "\r\n";
+  ss << "skiplist_cache_misses:" << slCache.getMisses() << "\r\n";
+  ss << "skiplist_cache_evictions:" << slCache.getEvictions() << "\r\n";
+  ss << "skiplist_cache_keys:" << slCache.getEntryCount() << "\r\n";
+  ss << "skiplist_cache_nodes:" << slCache.getNodeCount() << "\r\n";
+  auto& hllCache = HllCardCache::getInstance();
+  ss << "hll_card_cache_hits:" << hllCache.getHits() << "\r\n";
+  ss << "hll_card_cache_misses:" << hllCache.getMisses() << "\r\n";
+  ss << "hll_card_cache_keys:" << hllCache.getKeyCount() << "\r\n";
+  if (_indexMgr) {
+    _indexMgr->getStatInfo(ss);
+  }
+  if (_lazyFreeMgr) {
+    _lazyFreeMgr->getStatInfo(ss);
+  }
   ss << "scheduleNum:" << _scheduleNum << "\r\n";
 }
 
@@ -1323,6 +1462,15 @@ Status ServerEntry::destroyStore(Session* sess,
     }
   }
 
+  if (_lazyFreeMgr) {
+    status = _lazyFreeMgr->stopStore(storeId);
+    if (!status.ok()) {
+      LOG(ERROR) << "lazyFreeMgr stopStore :" << storeId
+                 << " failed:" << status.toString();
+      return status;
+    }
+  }
+
   return status;
 }
 
@@ -1462,11 +1610,21 @@ void ServerEntry::stop() {
   for (auto& executor : _executorRecycleSet) {
     executor->stop();
   }
+  std::unique_ptr<std::thread> bgCmdThd;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    bgCmdThd = std::move(_bgCmdThd);
+  }
+  if (bgCmdThd) {
+    bgCmdThd->join();
+  }
   _replMgr->stop();
   if (_migrateMgr)
     _migrateMgr->stop();
   if (_indexMgr)
     _indexMgr->stop();
+  if (_lazyFreeMgr)
+    _lazyFreeMgr->stop();
   {
     std::lock_guard<std::mutex> lk(_mutex);
     _sessions.clear();
@@ -1488,6 +1646,8 @@ void ServerEntry::stop() {
     _migrateMgr.reset();
     if (_indexMgr)
       _indexMgr.reset();
+    if (_lazyFreeMgr)
+      _lazyFreeMgr.reset();
     _pessimisticMgr.reset();
     _mgLockMgr.reset();
     _segmentMgr.reset();
@@ -23,6 +23,7 @@
 #include "tendisplus/replication/repl_manager.h"
 #include "tendisplus/cluster/migrate_manager.h"
 #include "tendisplus/server/index_manager.h"
+#include "tendisplus/server/lazyfree_manager.h"
 #include "tendisplus/storage/kvstore.h"
 #include "tendisplus/storage/catalog.h"
 #include "tendisplus/lock/mgl/mgl_mgr.h"
@@ -42,6 +43,7 @@ class Catalog;
 class ReplManager;
 class MigrateManager;
 class IndexManager;
+class LazyFreeManager;
 class ClusterManager;
 class GCManager;
 
@@ -189,6 +191,7 @@ class ServerEntry : public std::enable_shared_from_this<ServerEntry> {
   PessimisticMgr* getPessimisticMgr();
   mgl::MGLockMgr* getMGLockMgr();
   IndexManager* getIndexMgr();
+  LazyFreeManager* getLazyFreeMgr();
   ClusterManager* getClusterMgr();
   GCManager* getGcMgr();
 
@@ -293,6 +296,10 @@ class ServerEntry : public std::enable_shared_from_this<ServerEntry> {
   ServerEntry();
   Status adaptSomeThreadNumByCpuNum(const std::shared_ptr<ServerParams>& cfg);
   void serverCron();
+  // run a long command, e.g. rdbimport, in a thread of its own, the reply
+  // is written to sock, then it is a session again
+  void runBgCommand(asio::ip::tcp::socket sock,
+                    const std::vector<std::string>& args);
   void replyMonitors(Session* sess);
   void DelMonitorNoLock(uint64_t connId);
   void resizeExecutorThreadNum(uint64_t newThreadNum);
@@ -318,6 +325,7 @@ class ServerEntry : public std::enable_shared_from_this<ServerEntry> {
   std::unique_ptr<ReplManager> _replMgr;
   std::unique_ptr<MigrateManager> _migrateMgr;
   std::unique_ptr<IndexManager> _indexMgr;
+  std::unique_ptr<LazyFreeManager> _lazyFreeMgr;
   std::unique_ptr<PessimisticMgr> _pessimisticMgr;
   std::unique_ptr<mgl::MGLockMgr> _mgLockMgr;
   std::unique_ptr<ClusterManager> _clusterMgr;
@@ -330,6 +338,9 @@ class ServerEntry : public std::enable_shared_from_this<ServerEntry> {
   std::shared_ptr<PoolMatrix> _poolMatrix;
   std::shared_ptr<RequestMatrix> _reqMatrix;
   std::unique_ptr<std::thread> _cronThd;
+  // only one command runs in background at a time
+  std::unique_ptr<std::thread> _bgCmdThd;
+  bool _bgCmdRunning;
 
   bool _enableCluster;
   // NOTE(deyukong):
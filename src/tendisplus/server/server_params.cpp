@@ -107,6 +107,14 @@ bool compressTypeParamCheck(const string& val) {
   return false;
 }
 
+bool binlogCompressParamCheck(const string& val) {
+  auto v = toLower(val);
+  if (v == "lz4" || v == "none") {
+    return true;
+  }
+  return false;
+}
+
 bool executorThreadNumCheck(const std::string& val) {
   auto num = std::strtoull(val.c_str(), nullptr, 10);
   if (!getGlobalServer()) {
@@ -301,6 +309,14 @@ ServerParams::ServerParams() {
   REGISTER_VARS(delCntIndexMgr);
   REGISTER_VARS(delJobCntIndexMgr);
   REGISTER_VARS(pauseTimeIndexMgr);
+  REGISTER_VARS_DIFF_NAME("expire-batch-max-keys", expireBatchMaxKeys);
+  REGISTER_VARS_DIFF_NAME("lazyfree-threads", lazyfreeThreads);
+  REGISTER_VARS_DIFF_NAME("lazyfree-queue-max-keys", lazyfreeQueueMaxKeys);
+  REGISTER_VARS_DIFF_NAME("lazyfree-del-min-subkeys", lazyfreeDelMinSubKeys);
+  REGISTER_VARS_DIFF_NAME("lazyfree-batch-subkeys", lazyfreeBatchSubKeys);
+  REGISTER_VARS_DIFF_NAME("lazyfree-batch-pause-ms", lazyfreeBatchPauseMs);
+  REGISTER_VARS_DIFF_NAME("rdbimport-threads", rdbImportThreads);
+  REGISTER_VARS_DIFF_NAME("rdbimport-buffer-mb", rdbImportBufferMB);
 
   REGISTER_VARS_DIFF_NAME("proto-max-bulk-len", protoMaxBulkLen);
   REGISTER_VARS_DIFF_NAME("databases", dbNum);
@@ -344,6 +360,17 @@ ServerParams::ServerParams() {
   REGISTER_VARS(binlogFileSizeMB);
   REGISTER_VARS(binlogFileSecs);
   REGISTER_VARS(binlogDelRange);
+  REGISTER_VARS_DIFF_NAME("binlog-archive", binlogArchive);
+  REGISTER_VARS_FULL("binlog-archive-block-kb", binlogArchiveBlockKB,
+    NULL, NULL, 4, 65536, false)
+  REGISTER_VARS_FULL("binlog-archive-compress",
+                     binlogArchiveCompress,
+                     binlogCompressParamCheck,
+                     removeQuotesAndToLower,
+                     -1,
+                     -1,
+                     false);
+  REGISTER_VARS_DIFF_NAME_DYNAMIC("backup-checksum", backupChecksum);
 
   REGISTER_VARS_ALLOW_DYNAMIC_SET(keysDefaultLimit);
   REGISTER_VARS_ALLOW_DYNAMIC_SET(lockWaitTimeOut);
@@ -354,6 +381,16 @@ ServerParams::ServerParams() {
   REGISTER_VARS_DIFF_NAME_DYNAMIC("rocks.disable_wal", rocksDisableWAL);
   REGISTER_VARS_DIFF_NAME_DYNAMIC("rocks.flush_log_at_trx_commit",
                                   rocksFlushLogAtTrxCommit);
+  REGISTER_VARS_DIFF_NAME_DYNAMIC("rocks.group_commit_max_txns",
+                                  rocksGroupCommitMaxTxns);
+  REGISTER_VARS_DIFF_NAME_DYNAMIC("rocks.group_commit_window_us",
+                                  rocksGroupCommitWindowUs);
+  REGISTER_VARS_DIFF_NAME_DYNAMIC("write-stall-control", writeStallControl);
+  REGISTER_VARS_DIFF_NAME_DYNAMIC("write-stall-delay-us", writeStallDelayUs);
+  REGISTER_VARS_DIFF_NAME_DYNAMIC("write-stall-timeout-ms",
+                                  writeStallTimeoutMs);
+  REGISTER_VARS_DIFF_NAME_DYNAMIC("write-stall-check-interval-ms",
+                                  writeStallCheckIntervalMs);
   REGISTER_VARS_DIFF_NAME("rocks.wal_dir", rocksWALDir);
 
   REGISTER_VARS_FULL("rocks.compress_type",
@@ -398,12 +435,36 @@ ServerParams::ServerParams() {
                                   snapShotRetryCnt);
   REGISTER_VARS_DIFF_NAME_DYNAMIC("binlog-send-batch", bingLogSendBatch);
   REGISTER_VARS_DIFF_NAME_DYNAMIC("binlog-send-bytes", bingLogSendBytes);
+  REGISTER_VARS_DIFF_NAME("binlog-send-window", binlogSendWindow);
+  REGISTER_VARS_FULL("binlog-compress",
+                     binlogCompress,
+                     binlogCompressParamCheck,
+                     removeQuotesAndToLower,
+                     -1,
+                     -1,
+                     true);
+  REGISTER_VARS_FULL("repl-apply-threads", replApplyThreads,
+    NULL, NULL, 1, 64, false)
+  REGISTER_VARS_FULL("repl-apply-batch", replApplyBatch,
+    NULL, NULL, 1, 10000, true)
+  REGISTER_VARS_FULL("binlog-cache-mb", binlogCacheMB,
+    NULL, NULL, 0, 1024, true)
+  REGISTER_VARS_FULL("fullsync-streams", fullSyncStreams,
+    NULL, NULL, 0, 64, true)
+  REGISTER_VARS_FULL("fullsync-keep-secs", fullSyncKeepSecs,
+    NULL, NULL, 0, 86400, true)
   REGISTER_VARS_DIFF_NAME_DYNAMIC("cluster-migration-barrier",
                                   clusterMigrationBarrier);
   REGISTER_VARS_DIFF_NAME_DYNAMIC("cluster-slave-validity-factor",
                                   clusterSlaveValidityFactor);
   REGISTER_VARS_DIFF_NAME_DYNAMIC("binlog-using-defaultCF",
                                   binlogUsingDefaultCF);
+  REGISTER_VARS_DIFF_NAME("skiplist-cache-max-nodes", skiplistCacheMaxNodes);
+  REGISTER_VARS_DIFF_NAME("skiplist-cache-min-count", skiplistCacheMinCount);
+  REGISTER_VARS_DIFF_NAME("kv-piece-threshold", kvPieceThreshold);
+  REGISTER_VARS_DIFF_NAME("kv-piece-size", kvPieceSize);
+  REGISTER_VARS_DIFF_NAME("kv-merge-write", kvMergeWrite);
+  REGISTER_VARS_DIFF_NAME("hll-card-cache-max-keys", hllCardCacheMaxKeys);
 }
 
 ServerParams::~ServerParams() {
@@ -374,6 +374,21 @@ class ServerParams {
   uint32_t delCntIndexMgr = 10000;
   uint32_t delJobCntIndexMgr = 1;
   uint32_t pauseTimeIndexMgr = 10;
+  // max keys deleted in one transaction by the index manager
+  uint32_t expireBatchMaxKeys = 256;
+  // the threads freeing big keys in background, see LazyFreeManager
+  uint32_t lazyfreeThreads = 2;
+  // max keys queued for each store, the caller deletes the key by itself
+  // if the queue is full
+  uint32_t lazyfreeQueueMaxKeys = 1024;
+  // DEL frees the keys of so many subkeys in background, 0 means never
+  uint32_t lazyfreeDelMinSubKeys = 2048;
+  uint32_t lazyfreeBatchSubKeys = 1024;
+  uint32_t lazyfreeBatchPauseMs = 1;
+  // RDBIMPORT parses the files and builds the sst files of the stores
+  // with so many threads, each sorts so many records in memory
+  uint32_t rdbImportThreads = 4;
+  uint32_t rdbImportBufferMB = 64;
 
   uint32_t protoMaxBulkLen = CONFIG_DEFAULT_PROTO_MAX_BULK_LEN;
   uint32_t dbNum = CONFIG_DEFAULT_DBNUM;
@@ -408,8 +423,30 @@ class ServerParams {
   uint32_t binlogFileSizeMB = 64;
   uint32_t binlogFileSecs = 20 * 60;
   uint32_t binlogDelRange = 1;
+  // the binlogs recycled are saved into the indexed archive files instead
+  // of the flat dump files, see BinlogArchiveWriter
+  bool binlogArchive = false;
+  uint32_t binlogArchiveBlockKB = 256;
+  // lz4 or none, the compression of the archive blocks
+  string binlogArchiveCompress = "lz4";
+  // the files of BACKUP_CKPT backups are checksummed, and checked by
+  // restorebackup. It reads all the files of a backup. BACKUP_CKPT_INC
+  // backups always checksum the files they copy, and keep the checksums
+  // of the base backups, so turn it on for the first backup of a chain.
+  bool backupChecksum = false;
 
   uint32_t keysDefaultLimit = 100;
+  // cache of the upper-level nodes of big zsets, 0 to disable
+  uint32_t skiplistCacheMaxNodes = 131072;
+  uint32_t skiplistCacheMinCount = 1024;
+  // strings bigger than it are stored in pieces, 0 to disable
+  uint32_t kvPieceThreshold = 0;
+  uint32_t kvPieceSize = 65536;
+  // INCRBY/DECRBY/APPEND/HINCRBY of existing values write merge operands
+  // instead of the new values, see GetSetGeneral::runMerge()
+  bool kvMergeWrite = false;
+  // cardinality cache of the hlls counted by PFCOUNT, 0 to disable
+  uint32_t hllCardCacheMaxKeys = 65536;
   uint32_t lockWaitTimeOut = 3600;
 
   // parameter for rocksdb
@@ -420,11 +457,46 @@ class ServerParams {
   // WriteOptions
   bool rocksDisableWAL = false;
   bool rocksFlushLogAtTrxCommit = false;
+  // with rocksFlushLogAtTrxCommit, the WAL is synced once for a group of
+  // so many txns, 0 to sync for each txn, see WalGroupSyncer
+  uint32_t rocksGroupCommitMaxTxns = 0;
+  // the time a group waits for more txns to join
+  uint32_t rocksGroupCommitWindowUs = 100;
+  // the writes of a store stalled by rocksdb are parked before locking
+  // the keys, see WriteStallMonitor
+  bool writeStallControl = false;
+  // the interval of the writes admitted if the store is slowed down
+  uint32_t writeStallDelayUs = 100;
+  // a write parked so long fails with -TRYAGAIN
+  uint32_t writeStallTimeoutMs = 1000;
+  // the stall signals of a store are sampled at most once in the interval
+  uint32_t writeStallCheckIntervalMs = 100;
   bool level0Compress = false;
   bool level1Compress = false;
 
   uint32_t bingLogSendBatch = 256;
   uint32_t bingLogSendBytes = 16 * 1024 * 1024;
+  // the binlog batches sent to a slave without waiting for the acks,
+  // the slaves should support the acked binlog id if it is more than 1
+  uint32_t binlogSendWindow = 1;
+  // lz4 or none, the compression asked for by a slave or a migrating
+  // source for the binlog batches it receives or sends
+  string binlogCompress = "none";
+  // the lanes applying the binlogs of a store on slaves, 1 to apply them
+  // one by one, see BinlogApplier
+  uint32_t replApplyThreads = 1;
+  // the binlogs in a row of an apply lane are written by one txn, at most
+  // so many of them
+  uint32_t replApplyBatch = 1;
+  // the data connections of a full sync on slaves. 0 for the old protocol
+  // which can't resume, see ReplManager::slaveStartFullsync
+  uint32_t fullSyncStreams = 0;
+  // the backup of a failed full sync is kept so long for the slave to
+  // resume from it
+  uint32_t fullSyncKeepSecs = 600;
+  // the binlogs committed lately of each store kept in memory, so that
+  // the slaves and the migrate senders share them, 0 to disable
+  uint32_t binlogCacheMB = 0;
 
   uint32_t migrateSenderThreadnum = 4;
   uint32_t migrateReceiveThreadnum = 4;
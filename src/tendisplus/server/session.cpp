@@ -108,6 +108,11 @@ const std::vector<std::string>& Session::getArgs() const {
   return _args;
 }
 
+void Session::swapArgs(std::vector<std::string>* args) {
+  _args.swap(*args);
+  _ctx->setArgsBrief(_args);
+}
+
 ServerEntry* Session::getServerEntry() const {
   return _server;
 }
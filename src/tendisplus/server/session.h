@@ -32,6 +32,8 @@ class Session : public std::enable_shared_from_this<Session> {
   uint64_t id() const;
   virtual Status setResponse(const std::string& s) = 0;
   const std::vector<std::string>& getArgs() const;
+  // for the commands run by other commands, such as EXEC
+  void swapArgs(std::vector<std::string>* args);
   Status processExtendProtocol();
   SessionCtx* getCtx() const;
   ServerEntry* getServerEntry() const;
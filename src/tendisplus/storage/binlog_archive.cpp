@@ -0,0 +1,468 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include "tendisplus/storage/binlog_archive.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "glog/logging.h"
+#include "util/crc32c.h"
+#include "tendisplus/storage/varint.h"
+#include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/portable.h"
+
+namespace tendisplus {
+
+namespace {
+constexpr uint32_t BLOCK_MAGIC = 0x424c4b33;  // BLK3
+constexpr uint8_t FLAG_LZ4 = 1;
+constexpr size_t BLOCK_HEADER_LEN = 4 + 1 + 4 + 4 + 4 + 8 * 4;
+constexpr size_t INDEX_ENTRY_LEN = 8 + 4 + 8 * 4;
+constexpr char INDEX_MAGIC[] = "BLINDEX3";
+constexpr size_t INDEX_MAGIC_LEN = sizeof(INDEX_MAGIC) - 1;
+constexpr size_t FOOTER_LEN = 8 + 4 + INDEX_MAGIC_LEN;
+
+void encodeBlock(std::string* out, const BinlogArchiveBlock& b) {
+  char buf[INDEX_ENTRY_LEN];
+  size_t n = 0;
+  n += int64Encode(buf + n, b.offset);
+  n += int32Encode(buf + n, b.count);
+  n += int64Encode(buf + n, b.firstId);
+  n += int64Encode(buf + n, b.lastId);
+  n += int64Encode(buf + n, b.minTs);
+  n += int64Encode(buf + n, b.maxTs);
+  out->append(buf, n);
+}
+
+BinlogArchiveBlock decodeBlock(const char* p) {
+  BinlogArchiveBlock b;
+  b.offset = int64Decode(p);
+  b.count = int32Decode(p + 8);
+  b.firstId = int64Decode(p + 12);
+  b.lastId = int64Decode(p + 20);
+  b.minTs = int64Decode(p + 28);
+  b.maxTs = int64Decode(p + 36);
+  return b;
+}
+}  // namespace
+
+BinlogArchiveWriter::BinlogArchiveWriter(const std::string& path,
+                                         uint32_t storeId,
+                                         size_t blockSize,
+                                         bool lz4)
+  : _path(path),
+    _storeId(storeId),
+    _blockSize(blockSize),
+    _lz4(lz4),
+    _finished(false),
+    _offset(0),
+    _committedOffset(0),
+    _committedBlocks(0) {}
+
+BinlogArchiveWriter::~BinlogArchiveWriter() {
+  if (_out.is_open() && !_finished) {
+    auto s = finish();
+    if (!s.ok()) {
+      LOG(ERROR) << "finish binlog archive:" << _path
+                 << " failed:" << s.toString();
+    }
+  }
+}
+
+Status BinlogArchiveWriter::open() {
+  _out.open(_path, std::ios::out | std::ios::trunc | std::ios::binary);
+  if (!_out.is_open()) {
+    LOG(ERROR) << "open binlog archive:" << _path << " failed";
+    return {ErrorCodes::ERR_INTERNAL, "open binlog archive failed"};
+  }
+  std::string hdr(BINLOG_HEADER_V3);
+  char buf[sizeof(uint32_t)];
+  hdr.append(buf, int32Encode(buf, _storeId));
+  _out.write(hdr.data(), hdr.size());
+  if (!_out.good()) {
+    LOG(ERROR) << "write binlog archive:" << _path << " failed";
+    return {ErrorCodes::ERR_INTERNAL, "write binlog archive failed"};
+  }
+  _offset = hdr.size();
+  _committedOffset = _offset;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status BinlogArchiveWriter::append(uint64_t binlogId,
+                                   uint64_t ts,
+                                   const std::string& key,
+                                   const std::string& value) {
+  INVARIANT_D(!_finished);
+  if (_cur.count == 0) {
+    _cur.firstId = binlogId;
+    _cur.minTs = ts;
+    _cur.maxTs = ts;
+  }
+  INVARIANT_D(_cur.count == 0 || binlogId > _cur.lastId);
+  _cur.count++;
+  _cur.lastId = binlogId;
+  _cur.minTs = std::min(_cur.minTs, ts);
+  _cur.maxTs = std::max(_cur.maxTs, ts);
+
+  char buf[sizeof(uint32_t)];
+  _data.append(buf, int32Encode(buf, key.size()));
+  _data.append(key);
+  _data.append(buf, int32Encode(buf, value.size()));
+  _data.append(value);
+  if (_data.size() >= _blockSize) {
+    return writeBlock();
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status BinlogArchiveWriter::writeBlock() {
+  if (_cur.count == 0) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  uint8_t flags = 0;
+  std::string lz4;
+  if (_lz4) {
+    lz4 = Binlog::compress(_data);
+    if (lz4.size() < _data.size()) {
+      flags |= FLAG_LZ4;
+    }
+  }
+  const std::string& data = (flags & FLAG_LZ4) ? lz4 : _data;
+
+  char hdr[BLOCK_HEADER_LEN];
+  size_t n = 0;
+  n += int32Encode(hdr + n, BLOCK_MAGIC);
+  hdr[n++] = static_cast<char>(flags);
+  n += int32Encode(hdr + n, _cur.count);
+  n += int32Encode(hdr + n, data.size());
+  n += int32Encode(hdr + n, rocksdb::crc32c::Value(data.data(), data.size()));
+  n += int64Encode(hdr + n, _cur.firstId);
+  n += int64Encode(hdr + n, _cur.lastId);
+  n += int64Encode(hdr + n, _cur.minTs);
+  n += int64Encode(hdr + n, _cur.maxTs);
+  INVARIANT_D(n == BLOCK_HEADER_LEN);
+
+  _out.write(hdr, n);
+  _out.write(data.data(), data.size());
+  if (!_out.good()) {
+    LOG(ERROR) << "write binlog archive:" << _path << " failed";
+    return {ErrorCodes::ERR_INTERNAL, "write binlog archive failed"};
+  }
+  _cur.offset = _offset;
+  _blocks.push_back(_cur);
+  _offset += n + data.size();
+  _cur = BinlogArchiveBlock();
+  _data.clear();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status BinlogArchiveWriter::flush() {
+  auto s = writeBlock();
+  if (!s.ok()) {
+    return s;
+  }
+  _out.flush();
+  if (!_out.good()) {
+    LOG(ERROR) << "flush binlog archive:" << _path << " failed";
+    return {ErrorCodes::ERR_INTERNAL, "flush binlog archive failed"};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+void BinlogArchiveWriter::commit() {
+  INVARIANT_D(_cur.count == 0);
+  _committedOffset = _offset;
+  _committedBlocks = _blocks.size();
+}
+
+Status BinlogArchiveWriter::rollback() {
+  INVARIANT_D(!_finished);
+  _cur = BinlogArchiveBlock();
+  _data.clear();
+  _blocks.resize(_committedBlocks);
+  _offset = _committedOffset;
+
+  // the file may be broken by a failed write, reopen it after truncated
+  _out.close();
+  std::error_code ec;
+  filesystem::resize_file(_path, _committedOffset, ec);
+  if (ec) {
+    LOG(ERROR) << "truncate binlog archive:" << _path
+               << " failed:" << ec.message();
+    return {ErrorCodes::ERR_INTERNAL, "truncate binlog archive failed"};
+  }
+  _out.open(_path, std::ios::out | std::ios::app | std::ios::binary);
+  if (!_out.is_open()) {
+    LOG(ERROR) << "open binlog archive:" << _path << " failed";
+    return {ErrorCodes::ERR_INTERNAL, "open binlog archive failed"};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status BinlogArchiveWriter::finish() {
+  if (_finished) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  _finished = true;
+  auto s = writeBlock();
+  if (!s.ok()) {
+    return s;
+  }
+  std::string index;
+  for (const auto& b : _blocks) {
+    encodeBlock(&index, b);
+  }
+  char buf[sizeof(uint64_t)];
+  index.append(buf, int64Encode(buf, _offset));
+  index.append(buf, int32Encode(buf, _blocks.size()));
+  index.append(INDEX_MAGIC, INDEX_MAGIC_LEN);
+  _out.write(index.data(), index.size());
+  _out.close();
+  if (!_out.good()) {
+    LOG(ERROR) << "write binlog archive index:" << _path << " failed";
+    return {ErrorCodes::ERR_INTERNAL, "write binlog archive failed"};
+  }
+  _offset += index.size();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+BinlogArchiveReader::BinlogArchiveReader(const std::string& path)
+  : _path(path),
+    _storeId(0),
+    _indexed(false),
+    _base(nullptr),
+    _size(0),
+    _mapped(false),
+    _cur(0),
+    _loaded(false),
+    _blockData(nullptr),
+    _blockLen(0),
+    _blockPos(0),
+    _seekId(0),
+    _seekTs(0) {}
+
+BinlogArchiveReader::~BinlogArchiveReader() {
+#ifndef _WIN32
+  if (_mapped) {
+    munmap(const_cast<char*>(_base), _size);
+  }
+#endif
+}
+
+bool BinlogArchiveReader::isArchive(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::string hdr(strlen(BINLOG_HEADER_V3), '\0');
+  in.read(&hdr[0], hdr.size());
+  return in.good() && hdr == BINLOG_HEADER_V3;
+}
+
+Status BinlogArchiveReader::open() {
+  INVARIANT_D(_base == nullptr);
+#ifndef _WIN32
+  int fd = ::open(_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "open binlog archive:" << _path
+               << " failed:" << strerror(errno);
+    return {ErrorCodes::ERR_INTERNAL, "open binlog archive failed"};
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return {ErrorCodes::ERR_INTERNAL, "stat binlog archive failed"};
+  }
+  _size = st.st_size;
+  if (_size > 0) {
+    void* p = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      LOG(ERROR) << "mmap binlog archive:" << _path
+                 << " failed:" << strerror(errno);
+      return {ErrorCodes::ERR_INTERNAL, "mmap binlog archive failed"};
+    }
+    madvise(p, _size, MADV_SEQUENTIAL);
+    _base = static_cast<const char*>(p);
+    _mapped = true;
+  }
+  ::close(fd);
+#else
+  std::ifstream in(_path, std::ios::binary);
+  if (!in.is_open()) {
+    return {ErrorCodes::ERR_INTERNAL, "open binlog archive failed"};
+  }
+  _buf.assign(std::istreambuf_iterator<char>(in),
+              std::istreambuf_iterator<char>());
+  _base = _buf.data();
+  _size = _buf.size();
+#endif
+  if (_size < BINLOG_HEADER_V3_LEN ||
+      memcmp(_base, BINLOG_HEADER_V3, strlen(BINLOG_HEADER_V3)) != 0) {
+    return {ErrorCodes::ERR_DECODE, "invalid binlog archive header"};
+  }
+  _storeId = int32Decode(_base + strlen(BINLOG_HEADER_V3));
+  return loadIndex();
+}
+
+Status BinlogArchiveReader::loadIndex() {
+  size_t end = _size;
+  if (_size >= BINLOG_HEADER_V3_LEN + FOOTER_LEN &&
+      memcmp(_base + _size - INDEX_MAGIC_LEN, INDEX_MAGIC, INDEX_MAGIC_LEN) ==
+        0) {
+    const char* footer = _base + _size - FOOTER_LEN;
+    uint64_t indexOffset = int64Decode(footer);
+    uint32_t count = int32Decode(footer + 8);
+    if (indexOffset >= BINLOG_HEADER_V3_LEN &&
+        indexOffset + count * INDEX_ENTRY_LEN + FOOTER_LEN == _size) {
+      for (uint32_t i = 0; i < count; ++i) {
+        _blocks.push_back(
+          decodeBlock(_base + indexOffset + i * INDEX_ENTRY_LEN));
+      }
+      _indexed = true;
+      return {ErrorCodes::ERR_OK, ""};
+    }
+    end = indexOffset < _size ? indexOffset : _size;
+  }
+
+  // NOTE(tendis): the last block may be written partly, it is ignored
+  // like the last binlog of a V2 dump file written partly.
+  size_t pos = BINLOG_HEADER_V3_LEN;
+  while (pos + BLOCK_HEADER_LEN <= end) {
+    const char* p = _base + pos;
+    if (int32Decode(p) != BLOCK_MAGIC) {
+      break;
+    }
+    uint64_t dataLen = int32Decode(p + 9);
+    if (pos + BLOCK_HEADER_LEN + dataLen > end) {
+      break;
+    }
+    BinlogArchiveBlock b;
+    b.offset = pos;
+    b.count = int32Decode(p + 5);
+    b.firstId = int64Decode(p + 17);
+    b.lastId = int64Decode(p + 25);
+    b.minTs = int64Decode(p + 33);
+    b.maxTs = int64Decode(p + 41);
+    _blocks.push_back(b);
+    pos += BLOCK_HEADER_LEN + dataLen;
+  }
+  if (pos != end) {
+    LOG(WARNING) << "binlog archive:" << _path << " ignore "
+                 << end - pos << " bytes from " << pos;
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status BinlogArchiveReader::loadBlock(size_t i) {
+  const auto& b = _blocks[i];
+  if (b.offset + BLOCK_HEADER_LEN > _size) {
+    return {ErrorCodes::ERR_DECODE, "invalid binlog archive block"};
+  }
+  const char* p = _base + b.offset;
+  uint8_t flags = static_cast<uint8_t>(p[4]);
+  uint64_t dataLen = int32Decode(p + 9);
+  uint32_t crc = int32Decode(p + 13);
+  if (int32Decode(p) != BLOCK_MAGIC ||
+      b.offset + BLOCK_HEADER_LEN + dataLen > _size) {
+    return {ErrorCodes::ERR_DECODE, "invalid binlog archive block"};
+  }
+  const char* data = p + BLOCK_HEADER_LEN;
+  if (rocksdb::crc32c::Value(data, dataLen) != crc) {
+    LOG(ERROR) << "binlog archive:" << _path << " block at " << b.offset
+               << " crc mismatch";
+    return {ErrorCodes::ERR_DECODE, "binlog archive block crc mismatch"};
+  }
+  if (flags & FLAG_LZ4) {
+    auto raw = Binlog::uncompress(std::string(data, dataLen));
+    if (!raw.ok()) {
+      return raw.status();
+    }
+    _blockBuf = std::move(raw.value());
+    _blockData = _blockBuf.data();
+    _blockLen = _blockBuf.size();
+  } else {
+    _blockData = data;
+    _blockLen = dataLen;
+  }
+  _blockPos = 0;
+  _loaded = true;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+void BinlogArchiveReader::seek(uint64_t binlogId) {
+  auto it = std::lower_bound(
+    _blocks.begin(),
+    _blocks.end(),
+    binlogId,
+    [](const BinlogArchiveBlock& b, uint64_t id) { return b.lastId < id; });
+  _cur = it - _blocks.begin();
+  _loaded = false;
+  _seekId = binlogId;
+  _seekTs = 0;
+}
+
+void BinlogArchiveReader::seekTimestamp(uint64_t ts) {
+  _cur = _blocks.size();
+  for (size_t i = 0; i < _blocks.size(); ++i) {
+    if (_blocks[i].maxTs >= ts) {
+      _cur = i;
+      break;
+    }
+  }
+  _loaded = false;
+  _seekId = 0;
+  _seekTs = ts;
+}
+
+Expected<ReplLogRawV2> BinlogArchiveReader::next() {
+  while (true) {
+    if (_cur >= _blocks.size()) {
+      return {ErrorCodes::ERR_EXHAUST, ""};
+    }
+    if (!_loaded) {
+      auto s = loadBlock(_cur);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+    if (_blockPos >= _blockLen) {
+      _cur++;
+      _loaded = false;
+      continue;
+    }
+
+    std::string kv[2];
+    for (auto& str : kv) {
+      if (_blockPos + sizeof(uint32_t) > _blockLen) {
+        return {ErrorCodes::ERR_DECODE, "invalid binlog archive data"};
+      }
+      size_t len = int32Decode(_blockData + _blockPos);
+      _blockPos += sizeof(uint32_t);
+      if (_blockPos + len > _blockLen) {
+        return {ErrorCodes::ERR_DECODE, "invalid binlog archive data"};
+      }
+      str.assign(_blockData + _blockPos, len);
+      _blockPos += len;
+    }
+    ReplLogRawV2 log(std::move(kv[0]), std::move(kv[1]));
+    if (_seekId && log.getBinlogId() < _seekId) {
+      continue;
+    }
+    if (_seekTs && log.getTimestamp() < _seekTs) {
+      continue;
+    }
+    _seekId = 0;
+    _seekTs = 0;
+    return std::move(log);
+  }
+}
+
+}  // namespace tendisplus
@@ -0,0 +1,154 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_STORAGE_BINLOG_ARCHIVE_H_
+#define SRC_TENDISPLUS_STORAGE_BINLOG_ARCHIVE_H_
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "tendisplus/storage/record.h"
+#include "tendisplus/utils/status.h"
+
+namespace tendisplus {
+
+#define BINLOG_HEADER_V3 "BINLOG_V3\r\n"
+#define BINLOG_HEADER_V3_LEN (strlen(BINLOG_HEADER_V3) + sizeof(uint32_t))
+
+// The binlogs recycled of a store are archived in blocks when
+// binlog-archive is on, so that finding the binlog of a timestamp, or
+// replaying a window, doesn't scan the whole dump files. Each block has a
+// header of the binlog ids and the timestamps in it, and the headers are
+// also written as the index at the end of a file when it's finished. A
+// file not finished, like the one being written or left by a crash, is
+// indexed by the block headers.
+//   file:   BINLOG_HEADER_V3 storeId(4) block... [index footer]
+//   block:  magic(4) flags(1) count(4) dataLen(4) crc32c(4)
+//           firstId(8) lastId(8) minTs(8) maxTs(8) data(dataLen)
+//   data:   keyLen(4) key valueLen(4) value..., like the V2 dump files,
+//           compressed by Binlog::compress() if flags has FLAG_LZ4
+//   index:  offset(8) count(4) firstId(8) lastId(8) minTs(8) maxTs(8)...
+//   footer: indexOffset(8) blockCount(4) INDEX_MAGIC(8)
+struct BinlogArchiveBlock {
+  uint64_t offset = 0;
+  uint32_t count = 0;
+  uint64_t firstId = 0;
+  uint64_t lastId = 0;
+  // the timestamps of binlogs are not strictly in binlog id order
+  uint64_t minTs = 0;
+  uint64_t maxTs = 0;
+};
+
+class BinlogArchiveWriter {
+ public:
+  BinlogArchiveWriter(const std::string& path,
+                      uint32_t storeId,
+                      size_t blockSize,
+                      bool lz4);
+  BinlogArchiveWriter(const BinlogArchiveWriter&) = delete;
+  BinlogArchiveWriter(BinlogArchiveWriter&&) = delete;
+  ~BinlogArchiveWriter();
+  Status open();
+  // the binlogs are appended in binlog id order, a block is written when
+  // blockSize bytes of them are buffered
+  Status append(uint64_t binlogId,
+                uint64_t ts,
+                const std::string& key,
+                const std::string& value);
+  // write the binlogs buffered as a block, and flush the file. The
+  // binlogs appended should be flushed before they are deleted.
+  Status flush();
+  // flush, then write the index and close the file
+  Status finish();
+  // the blocks written are kept, after the binlogs in them are deleted
+  void commit();
+  // drop the binlogs not committed, and truncate the file to the last
+  // block committed, so that they are archived again in the same file
+  Status rollback();
+  // the last binlog id committed, 0 if none
+  uint64_t committedId() const {
+    return _committedBlocks ? _blocks[_committedBlocks - 1].lastId : 0;
+  }
+  const std::string& path() const {
+    return _path;
+  }
+  // the bytes of the file, the binlogs buffered not included
+  uint64_t size() const {
+    return _offset;
+  }
+
+ private:
+  Status writeBlock();
+
+  const std::string _path;
+  const uint32_t _storeId;
+  const size_t _blockSize;
+  const bool _lz4;
+  std::ofstream _out;
+  bool _finished;
+  uint64_t _offset;
+  uint64_t _committedOffset;
+  size_t _committedBlocks;
+  std::string _data;
+  BinlogArchiveBlock _cur;
+  std::vector<BinlogArchiveBlock> _blocks;
+};
+
+// BinlogArchiveReader reads an archive file by mmap, or into memory where
+// mmap is not available. The binlogs are read in binlog id order from
+// the position seeked to, a block is checked by crc32c when it is read.
+class BinlogArchiveReader {
+ public:
+  explicit BinlogArchiveReader(const std::string& path);
+  BinlogArchiveReader(const BinlogArchiveReader&) = delete;
+  BinlogArchiveReader(BinlogArchiveReader&&) = delete;
+  ~BinlogArchiveReader();
+  Status open();
+  uint32_t storeId() const {
+    return _storeId;
+  }
+  // false if the index is rebuilt from the block headers
+  bool indexed() const {
+    return _indexed;
+  }
+  const std::vector<BinlogArchiveBlock>& blocks() const {
+    return _blocks;
+  }
+  // the first binlog not less than binlogId is read next
+  void seek(uint64_t binlogId);
+  // the first binlog of the timestamp not less than ts is read next
+  void seekTimestamp(uint64_t ts);
+  // ERR_EXHAUST after the last binlog
+  Expected<ReplLogRawV2> next();
+
+  static bool isArchive(const std::string& path);
+
+ private:
+  Status loadIndex();
+  Status loadBlock(size_t i);
+
+  const std::string _path;
+  uint32_t _storeId;
+  bool _indexed;
+  const char* _base;
+  size_t _size;
+  bool _mapped;
+  std::string _buf;
+  std::vector<BinlogArchiveBlock> _blocks;
+  // the block being read, its data uncompressed lives in _blockBuf
+  size_t _cur;
+  bool _loaded;
+  const char* _blockData;
+  size_t _blockLen;
+  size_t _blockPos;
+  std::string _blockBuf;
+  uint64_t _seekId;
+  uint64_t _seekTs;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_STORAGE_BINLOG_ARCHIVE_H_
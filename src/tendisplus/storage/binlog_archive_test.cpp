@@ -0,0 +1,190 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "tendisplus/storage/binlog_archive.h"
+#include "tendisplus/storage/record.h"
+
+namespace tendisplus {
+
+static const uint64_t kBaseTs = 1600000000000;
+
+static std::string genBinlogValue(uint64_t id) {
+  std::vector<ReplLogValueEntryV2> vec;
+  vec.emplace_back(ReplOp::REPL_OP_SET,
+                   kBaseTs + id * 10,
+                   "key_" + std::to_string(id),
+                   std::string(id % 128, 'v'));
+  auto rv = ReplLogValueV2(
+    id, ReplFlag::REPL_GROUP_MID, id, kBaseTs + id * 10, 0, "set", nullptr, 0);
+  return rv.encode(vec);
+}
+
+// the file is finished when the writer is destroyed
+static std::unique_ptr<BinlogArchiveWriter> writeArchive(
+  const std::string& path, uint64_t count, bool lz4, bool finish) {
+  auto writer = std::make_unique<BinlogArchiveWriter>(path, 3, 4096, lz4);
+  EXPECT_TRUE(writer->open().ok());
+  for (uint64_t id = 1; id <= count; id++) {
+    auto s = writer->append(
+      id, kBaseTs + id * 10, ReplLogKeyV2(id).encode(), genBinlogValue(id));
+    EXPECT_TRUE(s.ok());
+  }
+  if (finish) {
+    EXPECT_TRUE(writer->finish().ok());
+  } else {
+    EXPECT_TRUE(writer->flush().ok());
+  }
+  return writer;
+}
+
+static std::string readFile(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+static void writeFile(const std::string& path, const std::string& data) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.size());
+}
+
+static void checkArchive(BinlogArchiveReader* reader, uint64_t count) {
+  EXPECT_EQ(reader->storeId(), 3U);
+  EXPECT_GT(reader->blocks().size(), 1U);
+  EXPECT_EQ(reader->blocks().front().firstId, 1U);
+  EXPECT_EQ(reader->blocks().back().lastId, count);
+
+  for (uint64_t id = 1; id <= count; id++) {
+    auto log = reader->next();
+    EXPECT_TRUE(log.ok());
+    EXPECT_EQ(log.value().getBinlogId(), id);
+    EXPECT_EQ(log.value().getReplLogValue(), genBinlogValue(id));
+  }
+  EXPECT_EQ(reader->next().status().code(), ErrorCodes::ERR_EXHAUST);
+
+  reader->seek(count / 2);
+  EXPECT_EQ(reader->next().value().getBinlogId(), count / 2);
+  reader->seekTimestamp(kBaseTs + 700 * 10 - 5);
+  EXPECT_EQ(reader->next().value().getBinlogId(), 700U);
+  EXPECT_EQ(reader->next().value().getBinlogId(), 701U);
+  reader->seek(0);
+  EXPECT_EQ(reader->next().value().getBinlogId(), 1U);
+  reader->seek(count + 1);
+  EXPECT_EQ(reader->next().status().code(), ErrorCodes::ERR_EXHAUST);
+  reader->seekTimestamp(kBaseTs + count * 10 + 1);
+  EXPECT_EQ(reader->next().status().code(), ErrorCodes::ERR_EXHAUST);
+}
+
+TEST(BinlogArchive, Common) {
+  std::string path = "binlog_archive_test.log";
+  for (bool lz4 : {false, true}) {
+    for (bool finish : {false, true}) {
+      auto writer = writeArchive(path, 1000, lz4, finish);
+      EXPECT_TRUE(BinlogArchiveReader::isArchive(path));
+
+      BinlogArchiveReader reader(path);
+      EXPECT_TRUE(reader.open().ok());
+      EXPECT_EQ(reader.indexed(), finish);
+      checkArchive(&reader, 1000);
+    }
+  }
+  std::remove(path.c_str());
+}
+
+TEST(BinlogArchive, Rollback) {
+  std::string path = "binlog_archive_test.log";
+  auto append = [](BinlogArchiveWriter* writer, uint64_t from, uint64_t to) {
+    for (uint64_t id = from; id <= to; id++) {
+      auto s = writer->append(
+        id, kBaseTs + id * 10, ReplLogKeyV2(id).encode(), genBinlogValue(id));
+      EXPECT_TRUE(s.ok());
+    }
+  };
+  {
+    BinlogArchiveWriter writer(path, 3, 4096, true);
+    EXPECT_TRUE(writer.open().ok());
+    // nothing committed
+    append(&writer, 1, 100);
+    EXPECT_TRUE(writer.rollback().ok());
+    EXPECT_EQ(writer.committedId(), 0U);
+
+    append(&writer, 1, 500);
+    EXPECT_TRUE(writer.flush().ok());
+    writer.commit();
+    EXPECT_EQ(writer.committedId(), 500U);
+    uint64_t size = writer.size();
+
+    // the blocks written and the binlogs buffered are both dropped
+    append(&writer, 501, 800);
+    EXPECT_TRUE(writer.flush().ok());
+    append(&writer, 801, 900);
+    EXPECT_GT(writer.size(), size);
+    EXPECT_TRUE(writer.rollback().ok());
+    EXPECT_EQ(writer.committedId(), 500U);
+    EXPECT_EQ(writer.size(), size);
+    EXPECT_EQ(readFile(path).size(), size);
+
+    append(&writer, 501, 1000);
+    EXPECT_TRUE(writer.finish().ok());
+  }
+
+  // each binlog is archived once
+  BinlogArchiveReader reader(path);
+  EXPECT_TRUE(reader.open().ok());
+  EXPECT_TRUE(reader.indexed());
+  checkArchive(&reader, 1000);
+  std::remove(path.c_str());
+}
+
+TEST(BinlogArchive, Broken) {
+  std::string path = "binlog_archive_test.log";
+  writeArchive(path, 1000, true, true);
+  std::string data = readFile(path);
+  uint64_t lastOffset = 0;
+  {
+    BinlogArchiveReader reader(path);
+    EXPECT_TRUE(reader.open().ok());
+    lastOffset = reader.blocks().back().offset;
+  }
+
+  // the last block written partly is ignored, without the index
+  writeFile(path, data.substr(0, lastOffset + 20));
+  {
+    BinlogArchiveReader reader(path);
+    EXPECT_TRUE(reader.open().ok());
+    EXPECT_FALSE(reader.indexed());
+    uint64_t lastId = reader.blocks().back().lastId;
+    EXPECT_LT(lastId, 1000U);
+    uint64_t count = 0;
+    while (reader.next().ok()) {
+      count++;
+    }
+    EXPECT_EQ(count, lastId);
+  }
+
+  // a block changed fails the crc check
+  data[lastOffset - 1] ^= 0x1;
+  writeFile(path, data);
+  {
+    BinlogArchiveReader reader(path);
+    EXPECT_TRUE(reader.open().ok());
+    EXPECT_TRUE(reader.indexed());
+    reader.seek(reader.blocks()[reader.blocks().size() - 2].firstId);
+    EXPECT_EQ(reader.next().status().code(), ErrorCodes::ERR_DECODE);
+  }
+
+  // not an archive
+  writeFile(path, "BINLOG_V2\r\n");
+  EXPECT_FALSE(BinlogArchiveReader::isArchive(path));
+  std::remove(path.c_str());
+}
+
+}  // namespace tendisplus
@@ -0,0 +1,101 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include "tendisplus/storage/binlog_cache.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace tendisplus {
+
+BinlogTailCache::BinlogTailCache()
+  : _bytes(0), _begin(1), _end(0), _hits(0), _misses(0) {}
+
+void BinlogTailCache::add(uint64_t aliveId, std::vector<Entry>&& binlogs) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  _pending[aliveId] = std::move(binlogs);
+}
+
+void BinlogTailCache::publish(uint64_t aliveId,
+                              bool committed,
+                              size_t maxBytes) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  std::vector<Entry> binlogs;
+  auto it = _pending.find(aliveId);
+  if (it != _pending.end()) {
+    binlogs = std::move(it->second);
+    _pending.erase(it);
+  }
+  if (!committed) {
+    binlogs.clear();
+  }
+  uint64_t first = binlogs.empty() ? aliveId : binlogs.front().id;
+  // NOTE(tendis): the binlogs published are in order, except the holes
+  // filled on a slave. And a binlog committed without added is unknown.
+  if (maxBytes == 0 || first <= _end || (committed && binlogs.empty())) {
+    resetInLock(std::max(_end, aliveId));
+    return;
+  }
+
+  if (_begin > _end) {
+    _begin = first;
+  }
+  for (auto& e : binlogs) {
+    _bytes += e.key.size() + e.value.size();
+    _ring.push_back(std::move(e));
+  }
+  _end = aliveId;
+  while (_bytes > maxBytes && !_ring.empty()) {
+    const auto& e = _ring.front();
+    _bytes -= e.key.size() + e.value.size();
+    _begin = e.id + 1;
+    _ring.pop_front();
+  }
+}
+
+BinlogTailCache::Result BinlogTailCache::get(uint64_t id,
+                                             std::string* key,
+                                             std::string* value) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  if (id < _begin || id > _end) {
+    _misses.fetch_add(1, std::memory_order_relaxed);
+    return Result::MISS;
+  }
+  _hits.fetch_add(1, std::memory_order_relaxed);
+  auto it = std::lower_bound(
+    _ring.begin(), _ring.end(), id, [](const Entry& e, uint64_t id) {
+      return e.id < id;
+    });
+  if (it == _ring.end() || it->id != id) {
+    return Result::HOLE;
+  }
+  *key = it->key;
+  *value = it->value;
+  return Result::HIT;
+}
+
+void BinlogTailCache::clear() {
+  std::lock_guard<std::mutex> lk(_mutex);
+  _pending.clear();
+  resetInLock(0);
+}
+
+size_t BinlogTailCache::bytes() const {
+  std::lock_guard<std::mutex> lk(_mutex);
+  return _bytes;
+}
+
+size_t BinlogTailCache::count() const {
+  std::lock_guard<std::mutex> lk(_mutex);
+  return _ring.size();
+}
+
+void BinlogTailCache::resetInLock(uint64_t end) {
+  _ring.clear();
+  _bytes = 0;
+  _begin = end + 1;
+  _end = end;
+}
+
+}  // namespace tendisplus
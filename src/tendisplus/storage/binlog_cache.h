@@ -0,0 +1,76 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_STORAGE_BINLOG_CACHE_H_
+#define SRC_TENDISPLUS_STORAGE_BINLOG_CACHE_H_
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>  // NOLINT
+#include <string>
+#include <vector>
+
+namespace tendisplus {
+
+// BinlogTailCache keeps the raw binlogs committed lately of a store in
+// memory, so that the pushers of the slaves and the migrate senders read
+// them once from the binlog column family, see binlog-cache-mb.
+// The binlogs of a txn are added when it is committed, and published in
+// binlog id order when they become visible. The cache covers the binlog
+// ids in [_begin, _end], a binlog id there but not in the cache is a
+// hole. The oldest binlogs are evicted beyond maxBytes, and the cache is
+// restarted after the binlogs out of order, such as the holes filled on a
+// slave.
+class BinlogTailCache {
+ public:
+  enum class Result {
+    HIT = 0,
+    // no binlog of the id
+    HOLE = 1,
+    // not covered, read the binlog column family
+    MISS = 2,
+  };
+
+  struct Entry {
+    uint64_t id;
+    std::string key;
+    std::string value;
+  };
+
+  BinlogTailCache();
+  BinlogTailCache(const BinlogTailCache&) = delete;
+  BinlogTailCache(BinlogTailCache&&) = delete;
+  // the binlogs of a committed txn, the last one is alive in the store
+  void add(uint64_t aliveId, std::vector<Entry>&& binlogs);
+  // the alive binlog is visible if committed, or aborted
+  void publish(uint64_t aliveId, bool committed, size_t maxBytes);
+  Result get(uint64_t id, std::string* key, std::string* value);
+  void clear();
+
+  uint64_t hits() const {
+    return _hits.load(std::memory_order_relaxed);
+  }
+  uint64_t misses() const {
+    return _misses.load(std::memory_order_relaxed);
+  }
+  size_t bytes() const;
+  size_t count() const;
+
+ private:
+  void resetInLock(uint64_t end);
+
+  mutable std::mutex _mutex;
+  std::deque<Entry> _ring;
+  std::map<uint64_t, std::vector<Entry>> _pending;
+  size_t _bytes;
+  uint64_t _begin;
+  uint64_t _end;
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_STORAGE_BINLOG_CACHE_H_
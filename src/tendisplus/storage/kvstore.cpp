@@ -3,7 +3,11 @@
 // project for additional information.
 
 #include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
 #include "glog/logging.h"
+#include "util/crc32c.h"
 #include "tendisplus/storage/kvstore.h"
 #include "tendisplus/utils/portable.h"
 #include "tendisplus/utils/time.h"
@@ -13,7 +17,12 @@
 
 namespace tendisplus {
 RepllogCursorV2::RepllogCursorV2(Transaction* txn, uint64_t begin, uint64_t end)
-  : _txn(txn), _baseCursor(nullptr), _start(begin), _cur(begin), _end(end) {}
+  : _txn(txn),
+    _baseCursor(nullptr),
+    _cache(nullptr),
+    _start(begin),
+    _cur(begin),
+    _end(end) {}
 
 Status RepllogCursorV2::seekToLast() {
   if (_cur == Transaction::TXNID_UNINITED) {
@@ -153,6 +162,18 @@ Expected<ReplLogRawV2> RepllogCursorV2::next() {
   }
 
   while (_cur <= _end) {
+    if (_cache) {
+      std::string key;
+      std::string value;
+      auto r = _cache->get(_cur, &key, &value);
+      if (r == BinlogTailCache::Result::HIT) {
+        _cur++;
+        return ReplLogRawV2(std::move(key), std::move(value));
+      } else if (r == BinlogTailCache::Result::HOLE) {
+        _cur++;
+        continue;
+      }
+    }
     ReplLogKeyV2 key(_cur);
     auto keyStr = key.encode();
     auto eval = _txn->getKV(keyStr);
@@ -519,6 +540,23 @@ std::ofstream* KVStore::createBinlogFile(const std::string& name,
   return fs;
 }
 
+Expected<uint32_t> fileChecksum(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    return {ErrorCodes::ERR_INTERNAL, "open file failed:" + path};
+  }
+  std::vector<char> buf(1024 * 1024);
+  uint32_t crc = 0;
+  while (in) {
+    in.read(buf.data(), buf.size());
+    crc = rocksdb::crc32c::Extend(crc, buf.data(), in.gcount());
+  }
+  if (in.bad()) {
+    return {ErrorCodes::ERR_INTERNAL, "read file failed:" + path};
+  }
+  return crc;
+}
+
 BackupInfo::BackupInfo()
   : _binlogPos(Transaction::TXNID_UNINITED),
     _backupMode(0),
@@ -538,6 +576,38 @@ void BackupInfo::addFile(const std::string& file, uint64_t size) {
   _fileList[file] = size;
 }
 
+const std::map<std::string, uint64_t>& BackupInfo::getRefFileList() const {
+  return _refFileList;
+}
+
+void BackupInfo::addRefFile(const std::string& file, uint64_t size) {
+  _refFileList[file] = size;
+}
+
+const std::map<std::string, uint32_t>& BackupInfo::getChecksums() const {
+  return _checksums;
+}
+
+void BackupInfo::setChecksum(const std::string& file, uint32_t crc) {
+  _checksums[file] = crc;
+}
+
+void BackupInfo::setBaseDir(const std::string& dir) {
+  _baseDir = dir;
+}
+
+const std::string& BackupInfo::getBaseDir() const {
+  return _baseDir;
+}
+
+void BackupInfo::setDbIdentity(const std::string& id) {
+  _dbIdentity = id;
+}
+
+const std::string& BackupInfo::getDbIdentity() const {
+  return _dbIdentity;
+}
+
 void BackupInfo::setBinlogPos(uint64_t pos) {
   _binlogPos = pos;
 }
@@ -575,4 +645,162 @@ uint64_t BackupInfo::getStartTimeSec() const {
 uint64_t BackupInfo::getEndTimeSec() const {
   return _endTimeSec;
 }
+
+NestedTxn::NestedTxn(Transaction* txn) : _txn(txn) {}
+
+Expected<uint64_t> NestedTxn::commit() {
+  return _txn->getTxnId();
+}
+
+Status NestedTxn::rollback() {
+  auto s = _txn->rollbackToSavePoint();
+  _txn->setSavePoint();
+  return s;
+}
+
+std::unique_ptr<Cursor> NestedTxn::createCursor(
+  ColumnFamilyNumber cf, const std::string* iterate_upper_bound) {
+  return _txn->createCursor(cf, iterate_upper_bound);
+}
+
+Status NestedTxn::flushall() {
+  return _txn->flushall();
+}
+
+Status NestedTxn::migrate(const std::string& logKey,
+                          const std::string& logValue) {
+  return _txn->migrate(logKey, logValue);
+}
+
+std::unique_ptr<RepllogCursorV2> NestedTxn::createRepllogCursorV2(
+  uint64_t begin, bool ignoreReadBarrier) {
+  return _txn->createRepllogCursorV2(begin, ignoreReadBarrier);
+}
+
+Status NestedTxn::applyBinlog(const ReplLogValueEntryV2& logEntry) {
+  return _txn->applyBinlog(logEntry);
+}
+
+Status NestedTxn::setBinlogKV(uint64_t binlogId,
+                              const std::string& logKey,
+                              const std::string& logValue) {
+  return _txn->setBinlogKV(binlogId, logKey, logValue);
+}
+
+Status NestedTxn::setBinlogKV(const std::string& logKey,
+                              const std::string& logValue) {
+  return _txn->setBinlogKV(logKey, logValue);
+}
+
+Status NestedTxn::delBinlog(const ReplLogRawV2& log) {
+  return _txn->delBinlog(log);
+}
+
+uint64_t NestedTxn::getBinlogId() const {
+  return _txn->getBinlogId();
+}
+
+void NestedTxn::setBinlogId(uint64_t binlogId) {
+  _txn->setBinlogId(binlogId);
+}
+
+uint32_t NestedTxn::getChunkId() const {
+  return _txn->getChunkId();
+}
+
+std::string NestedTxn::getKVStoreId() const {
+  return _txn->getKVStoreId();
+}
+
+void NestedTxn::setChunkId(uint32_t chunkId) {
+  _txn->setChunkId(chunkId);
+}
+
+void NestedTxn::SetSnapshot() {
+  _txn->SetSnapshot();
+}
+
+void NestedTxn::setSavePoint() {
+  _txn->setSavePoint();
+}
+
+Status NestedTxn::rollbackToSavePoint() {
+  return _txn->rollbackToSavePoint();
+}
+
+void NestedTxn::setBulkWrite(bool bulk) {
+  _txn->setBulkWrite(bulk);
+}
+
+std::unique_ptr<TTLIndexCursor> NestedTxn::createTTLIndexCursor(
+  std::uint64_t until) {
+  return _txn->createTTLIndexCursor(until);
+}
+
+std::unique_ptr<SlotCursor> NestedTxn::createSlotCursor(uint32_t slot) {
+  return _txn->createSlotCursor(slot);
+}
+
+std::unique_ptr<SlotsCursor> NestedTxn::createSlotsCursor(uint32_t start,
+                                                          uint32_t end) {
+  return _txn->createSlotsCursor(start, end);
+}
+
+std::unique_ptr<VersionMetaCursor> NestedTxn::createVersionMetaCursor() {
+  return _txn->createVersionMetaCursor();
+}
+
+std::unique_ptr<BasicDataCursor> NestedTxn::createDataCursor() {
+  return _txn->createDataCursor();
+}
+
+std::unique_ptr<AllDataCursor> NestedTxn::createAllDataCursor() {
+  return _txn->createAllDataCursor();
+}
+
+std::unique_ptr<BinlogCursor> NestedTxn::createBinlogCursor() {
+  return _txn->createBinlogCursor();
+}
+
+Expected<std::string> NestedTxn::getKV(const std::string& key) {
+  return _txn->getKV(key);
+}
+
+Status NestedTxn::setKV(const std::string& key,
+                        const std::string& val,
+                        const uint64_t ts) {
+  return _txn->setKV(key, val, ts);
+}
+
+Status NestedTxn::delKV(const std::string& key, const uint64_t ts) {
+  return _txn->delKV(key, ts);
+}
+
+Status NestedTxn::mergeKV(const std::string& key,
+                          const std::string& operand,
+                          const uint64_t ts) {
+  return _txn->mergeKV(key, operand, ts);
+}
+
+Status NestedTxn::addDeleteRangeBinlog(const std::string& begin,
+                                       const std::string& end) {
+  return _txn->addDeleteRangeBinlog(begin, end);
+}
+
+uint64_t NestedTxn::getBinlogTime() {
+  return _txn->getBinlogTime();
+}
+
+void NestedTxn::setBinlogTime(uint64_t timestamp) {
+  _txn->setBinlogTime(timestamp);
+}
+
+bool NestedTxn::isReplOnly() const {
+  return _txn->isReplOnly();
+}
+
+uint64_t NestedTxn::getTxnId() const {
+  return _txn->getTxnId();
+}
+
 }  // namespace tendisplus
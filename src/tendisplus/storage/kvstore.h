@@ -21,6 +21,7 @@
 #include "rapidjson/stringbuffer.h"
 #include "rocksdb/db.h"
 #include "tendisplus/utils/status.h"
+#include "tendisplus/storage/binlog_cache.h"
 #include "tendisplus/storage/record.h"
 #include "tendisplus/server/session.h"
 
@@ -28,6 +29,7 @@
 
 namespace tendisplus {
 
+class BinlogArchiveWriter;
 class KVStore;
 class Record;
 class ReplLogValueEntryV2;
@@ -70,6 +72,10 @@ class RepllogCursorV2 {
   // NOTE(vinchen): in range of [begin, end], be careful both close interval
   RepllogCursorV2(Transaction* txn, uint64_t begin, uint64_t end);
   ~RepllogCursorV2() = default;
+  // next() reads the binlogs in the cache first if set
+  void setCache(BinlogTailCache* cache) {
+    _cache = cache;
+  }
   Expected<ReplLogRawV2> next();
   Expected<ReplLogV2> nextV2();
   Status seekToLast();
@@ -81,6 +87,7 @@ class RepllogCursorV2 {
  protected:
   Transaction* _txn;
   std::unique_ptr<Cursor> _baseCursor;
+  BinlogTailCache* _cache;
 
  private:
   uint64_t _start;
@@ -223,6 +230,15 @@ class Transaction {
   virtual std::string getKVStoreId() const = 0;
   virtual void setChunkId(uint32_t chunkId) = 0;
   virtual void SetSnapshot() = 0;
+  // rollbackToSavePoint() undoes the writes (and binlogs) after the last
+  // setSavePoint(), and pops the savepoint.
+  virtual void setSavePoint() = 0;
+  virtual Status rollbackToSavePoint() = 0;
+  // in bulk write mode, the writes skip the conflict checking and the row
+  // locks of rocksdb, they are only put in the indexed write batch of the
+  // transaction. The caller must hold the key locks (LOCK_X) of all the
+  // keys written.
+  virtual void setBulkWrite(bool bulk) = 0;
 
   virtual std::unique_ptr<TTLIndexCursor> createTTLIndexCursor(
     std::uint64_t until) = 0;
@@ -239,6 +255,14 @@ class Transaction {
                        const std::string& val,
                        const uint64_t ts = 0) = 0;
   virtual Status delKV(const std::string& key, const uint64_t ts = 0) = 0;
+  // write a merge operand of key, it is applied to the value by the merge
+  // operator of the store, see rcd_util::applyOperand(). The operand is
+  // not tracked for conflicts, the caller must hold the key lock.
+  // NOTE(tendis): reading the key in the same transaction after that
+  // fails with MergeInProgress.
+  virtual Status mergeKV(const std::string& key,
+                         const std::string& operand,
+                         const uint64_t ts = 0) = 0;
   virtual Status addDeleteRangeBinlog(const std::string& begin,
                                       const std::string& end) = 0;
   virtual uint64_t getBinlogTime() = 0;
@@ -261,11 +285,89 @@ class Transaction {
   static constexpr uint32_t CHUNKID_DEL_RANGE = 0xFFFFFFFB;
 };
 
+// NestedTxn runs in a transaction owned by others, such as the one of
+// EXEC. commit() does nothing, the writes are committed with the outer
+// transaction. The owner sets a savepoint before each command, and
+// rollback() undoes the writes of the current command only.
+class NestedTxn : public Transaction {
+ public:
+  explicit NestedTxn(Transaction* txn);
+  NestedTxn(const NestedTxn&) = delete;
+  NestedTxn(NestedTxn&&) = delete;
+  virtual ~NestedTxn() = default;
+  Expected<uint64_t> commit() final;
+  Status rollback() final;
+  std::unique_ptr<Cursor> createCursor(
+    ColumnFamilyNumber cf, const std::string* iterate_upper_bound) final;
+  Status flushall() final;
+  Status migrate(const std::string& logKey, const std::string& logValue) final;
+  std::unique_ptr<RepllogCursorV2> createRepllogCursorV2(
+    uint64_t begin, bool ignoreReadBarrier) final;
+  Status applyBinlog(const ReplLogValueEntryV2& logEntry) final;
+  Status setBinlogKV(uint64_t binlogId,
+                     const std::string& logKey,
+                     const std::string& logValue) final;
+  Status setBinlogKV(const std::string& logKey,
+                     const std::string& logValue) final;
+  Status delBinlog(const ReplLogRawV2& log) final;
+  uint64_t getBinlogId() const final;
+  void setBinlogId(uint64_t binlogId) final;
+  uint32_t getChunkId() const final;
+  std::string getKVStoreId() const final;
+  void setChunkId(uint32_t chunkId) final;
+  void SetSnapshot() final;
+  void setSavePoint() final;
+  Status rollbackToSavePoint() final;
+  void setBulkWrite(bool bulk) final;
+
+  std::unique_ptr<TTLIndexCursor> createTTLIndexCursor(
+    std::uint64_t until) final;
+  std::unique_ptr<SlotCursor> createSlotCursor(uint32_t slot) final;
+  std::unique_ptr<SlotsCursor> createSlotsCursor(uint32_t start,
+                                                 uint32_t end) final;
+  std::unique_ptr<VersionMetaCursor> createVersionMetaCursor() final;
+  std::unique_ptr<BasicDataCursor> createDataCursor() final;
+  std::unique_ptr<AllDataCursor> createAllDataCursor() final;
+  std::unique_ptr<BinlogCursor> createBinlogCursor() final;
+
+  Expected<std::string> getKV(const std::string& key) final;
+  Status setKV(const std::string& key,
+               const std::string& val,
+               const uint64_t ts = 0) final;
+  Status delKV(const std::string& key, const uint64_t ts = 0) final;
+  Status mergeKV(const std::string& key,
+                 const std::string& operand,
+                 const uint64_t ts = 0) final;
+  Status addDeleteRangeBinlog(const std::string& begin,
+                              const std::string& end) final;
+  uint64_t getBinlogTime() final;
+  void setBinlogTime(uint64_t timestamp) final;
+  bool isReplOnly() const final;
+  uint64_t getTxnId() const final;
+
+ private:
+  // NOTE(tendis): not owned by me
+  Transaction* _txn;
+};
+
+// the crc32c of a file
+Expected<uint32_t> fileChecksum(const std::string& path);
+
 class BackupInfo {
  public:
   BackupInfo();
   const std::map<std::string, uint64_t>& getFileList() const;
   void setFileList(const std::map<std::string, uint64_t>&);
+  // the files of an incremental backup which live in the base backups,
+  // name <-> size
+  const std::map<std::string, uint64_t>& getRefFileList() const;
+  void addRefFile(const std::string& file, uint64_t size);
+  const std::map<std::string, uint32_t>& getChecksums() const;
+  void setChecksum(const std::string& file, uint32_t crc);
+  void setBaseDir(const std::string& dir);
+  const std::string& getBaseDir() const;
+  void setDbIdentity(const std::string& id);
+  const std::string& getDbIdentity() const;
   void setBinlogPos(uint64_t);
   void setBackupMode(uint8_t);
   void setStartTimeSec(uint64_t);
@@ -280,6 +382,10 @@ class BackupInfo {
 
  private:
   std::map<std::string, uint64_t> _fileList;
+  std::map<std::string, uint64_t> _refFileList;
+  std::map<std::string, uint32_t> _checksums;
+  std::string _baseDir;
+  std::string _dbIdentity;
   uint64_t _binlogPos;
   uint8_t _backupMode;
   uint64_t _startTimeSec;
@@ -295,6 +401,10 @@ class BinlogObserver {
 struct KVStoreStat {
   std::atomic<uint64_t> compactFilterCount;
   std::atomic<uint64_t> compactKvExpiredCount;
+  // subkeys of expired or deleted keys dropped by compaction
+  std::atomic<uint64_t> compactSubKeyExpiredCount;
+  // stale ttl indexes dropped by compaction
+  std::atomic<uint64_t> compactTtlIndexStaleCount;
   // number of request when store is paused
   std::atomic<uint64_t> pausedErrorCount;
   // number of request when store is destroyed
@@ -320,7 +430,14 @@ class KVStore {
  public:
   enum class StoreMode { READ_WRITE = 0, REPLICATE_ONLY = 1, STORE_NONE = 2 };
 
-  enum class BackupMode { BACKUP_COPY, BACKUP_CKPT, BACKUP_CKPT_INTER };
+  // BACKUP_CKPT_INC is a checkpoint without the sst files of a base
+  // backup, which is a BACKUP_CKPT or another BACKUP_CKPT_INC
+  enum class BackupMode {
+    BACKUP_COPY,
+    BACKUP_CKPT,
+    BACKUP_CKPT_INTER,
+    BACKUP_CKPT_INC
+  };
 
 
   explicit KVStore(const std::string& id, const std::string& path);
@@ -348,10 +465,20 @@ class KVStore {
                        const std::string& val,
                        Transaction* txn) = 0;
   virtual Status delKV(const RecordKey& key, Transaction* txn) = 0;
+  virtual Status mergeKV(const RecordKey& key,
+                         const std::string& operand,
+                         Transaction* txn) = 0;
   // [begin, end)
   virtual Status deleteRange(const std::string& begin,
                              const std::string& end) = 0;
   virtual Status deleteRangeBinlog(uint64_t begin, uint64_t end) = 0;
+  // ingest the sst files built offline, the files are moved into the
+  // store. binlogFiles hold the binlogs [firstBinlogId, firstBinlogId +
+  // binlogCnt), they must follow the binlogs of the store.
+  virtual Status ingestFiles(const std::vector<std::string>& dataFiles,
+                             const std::vector<std::string>& binlogFiles,
+                             uint64_t firstBinlogId,
+                             uint64_t binlogCnt) = 0;
 
   virtual Status assignBinlogIdIfNeeded(Transaction* txn) = 0;
   virtual void setNextBinlogSeq(uint64_t binlogId, Transaction* txn) = 0;
@@ -363,6 +490,7 @@ class KVStore {
                                                           uint64_t save,
                                                           Transaction* txn,
                                                           std::ofstream* fs,
+                                                          BinlogArchiveWriter*,
                                                           int64_t maxWritelen,
                                                           bool tailSlave) = 0;
   virtual Expected<uint64_t> getBinlogCnt(Transaction* txn) const = 0;
@@ -394,6 +522,13 @@ class KVStore {
   virtual std::string getBgError() const = 0;
   virtual Status recoveryFromBgError() = 0;
   virtual void resetStatistics() = 0;
+  // whether a write can go on now. *slotUs is the time in us from which
+  // the write may go on, got by its last try, 0 for the first one. It
+  // fails with ERR_WRITE_STALL if the store is stalled by rocksdb, and
+  // *slotUs is set to the time to try again.
+  virtual Status admitWrite(uint64_t* slotUs) = 0;
+  // the throttle state and counters of the writes, for INFO writestall
+  virtual std::string getWriteStallInfo() = 0;
 
   virtual Expected<VersionMeta> getVersionMeta() = 0;
   virtual Expected<VersionMeta> getVersionMeta(const std::string& name) = 0;
@@ -404,6 +539,10 @@ class KVStore {
   virtual Status setMode(StoreMode mode) = 0;
   virtual KVStore::StoreMode getMode() = 0;
   virtual uint64_t getHighestBinlogId() const = 0;
+  // the binlogs committed lately, nullptr if not supported
+  virtual BinlogTailCache* getBinlogCache() {
+    return nullptr;
+  }
 
   // return the greatest commitId
   virtual Expected<uint64_t> restart(
@@ -414,10 +553,12 @@ class KVStore {
   virtual Expected<uint64_t> flush(Session* sess, uint64_t nextBinlogid) = 0;
 
   // backup related apis, allows only one backup at a time
-  // backup and return the filename<->filesize pair
+  // backup and return the filename<->filesize pair, baseDir is the base
+  // backup of BACKUP_CKPT_INC
   virtual Expected<BackupInfo> backup(const std::string&,
                                       BackupMode,
-                                      BinlogVersion) = 0;
+                                      BinlogVersion,
+                                      const std::string& baseDir = "") = 0;
   virtual Expected<std::string> restoreBackup(const std::string& dir) = 0;
   virtual Expected<BackupInfo> getBackupMeta(const std::string& dir) = 0;
   virtual Status releaseBackup() = 0;
@@ -0,0 +1,378 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include "glog/logging.h"
+#include "tendisplus/storage/pieced_kv.h"
+#include "tendisplus/storage/varint.h"
+#include "tendisplus/utils/bitops.h"
+#include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/redis_port.h"
+
+namespace tendisplus {
+
+std::atomic<uint32_t> PiecedKV::_threshold(0);
+std::atomic<uint32_t> PiecedKV::_pieceSizeConfig(64 * 1024);
+
+PiecedKV::PiecedKV(const RecordKey& mk, const RecordValue& meta, PStore store)
+  : _mk(mk),
+    _meta(meta),
+    _store(store),
+    _pieceSize(meta.getPieceSize()),
+    _size(meta.getTotalSize()) {
+  INVARIANT_D(rcd_util::isPiecedKV(meta));
+  INVARIANT_D(_pieceSize > 0);
+}
+
+void PiecedKV::setConfig(uint32_t threshold, uint32_t pieceSize) {
+  _threshold.store(threshold, std::memory_order_relaxed);
+  if (pieceSize > 0) {
+    _pieceSizeConfig.store(pieceSize, std::memory_order_relaxed);
+  }
+}
+
+bool PiecedKV::enabled() {
+  return _threshold.load(std::memory_order_relaxed) > 0;
+}
+
+bool PiecedKV::needPieces(uint64_t size) {
+  auto threshold = _threshold.load(std::memory_order_relaxed);
+  return threshold > 0 && size > threshold;
+}
+
+uint32_t PiecedKV::getPieceSizeConfig() {
+  return _pieceSizeConfig.load(std::memory_order_relaxed);
+}
+
+Status PiecedKV::set(PStore store,
+                     const RecordKey& mk,
+                     const RecordValue& rv,
+                     Transaction* txn) {
+  INVARIANT_D(rv.getRecordType() == RecordType::RT_KV);
+  INVARIANT_D(!rcd_util::isPiecedKV(rv));
+  uint64_t pieceSize = getPieceSizeConfig();
+  const std::string& value = rv.getValue();
+
+  RecordValue meta("",
+                   RecordType::RT_KV,
+                   rv.getVersionEP(),
+                   rv.getTtl(),
+                   rv.getCas(),
+                   rv.getVersion(),
+                   pieceSize);
+  meta.setTotalSize(value.size());
+  PiecedKV pkv(mk, meta, store);
+  std::string summary;
+  for (uint64_t idx = 0; idx * pieceSize < value.size(); idx++) {
+    RecordValue piece(value.substr(idx * pieceSize, pieceSize),
+                      RecordType::RT_KV_PIECE,
+                      -1);
+    auto s = store->setKV(pkv.pieceKey(idx), piece, txn);
+    if (!s.ok()) {
+      return s;
+    }
+
+    char buf[sizeof(uint32_t)];
+    int32Encode(buf,
+                bitops::popCount(piece.getValue().data(),
+                                 piece.getValue().size()));
+    summary.append(buf, sizeof(buf));
+    if ((idx + 1) % SUMMARY_PAGES == 0 ||
+        (idx + 1) * pieceSize >= value.size()) {
+      RecordValue rv(std::move(summary), RecordType::RT_KV_PIECE, -1);
+      s = store->setKV(pkv.summaryKey(idx / SUMMARY_PAGES), rv, txn);
+      if (!s.ok()) {
+        return s;
+      }
+      summary.clear();
+    }
+  }
+  return store->setKV(mk, meta, txn);
+}
+
+Status PiecedKV::load(PStore store,
+                      const RecordKey& mk,
+                      RecordValue* rv,
+                      Transaction* txn) {
+  if (!rcd_util::isPiecedKV(*rv)) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  PiecedKV pkv(mk, *rv, store);
+  auto eval = pkv.read(0, pkv.getSize(), txn);
+  if (!eval.ok()) {
+    return eval.status();
+  }
+  *rv = RecordValue(std::move(eval.value()),
+                    RecordType::RT_KV,
+                    rv->getVersionEP(),
+                    rv->getTtl(),
+                    rv->getCas(),
+                    rv->getVersion());
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+RecordKey PiecedKV::pieceKey(uint64_t idx) const {
+  return RecordKey(_mk.getChunkId(),
+                   _mk.getDbId(),
+                   RecordType::RT_KV_PIECE,
+                   _mk.getPrimaryKey(),
+                   std::to_string(idx));
+}
+
+Expected<std::string> PiecedKV::getPiece(uint64_t idx,
+                                         Transaction* txn) const {
+  auto eval = _store->getKV(pieceKey(idx), txn);
+  if (eval.status().code() == ErrorCodes::ERR_NOTFOUND) {
+    LOG(ERROR) << "piece " << idx << " of " << _mk.getPrimaryKey()
+               << " not found, size:" << _size;
+    return {ErrorCodes::ERR_INTERNAL, "pieced string corrupted"};
+  } else if (!eval.ok()) {
+    return eval.status();
+  }
+  return eval.value().getValue();
+}
+
+Expected<std::string> PiecedKV::read(uint64_t offset,
+                                     uint64_t len,
+                                     Transaction* txn) const {
+  std::string result;
+  if (offset >= _size || len == 0) {
+    return result;
+  }
+  uint64_t end = offset + std::min(len, _size - offset);
+  result.reserve(end - offset);
+  for (uint64_t idx = offset / _pieceSize; idx * _pieceSize < end; idx++) {
+    auto epiece = getPiece(idx, txn);
+    if (!epiece.ok()) {
+      return epiece.status();
+    }
+    const std::string& piece = epiece.value();
+    uint64_t pieceBegin = idx * _pieceSize;
+    uint64_t from = std::max(offset, pieceBegin) - pieceBegin;
+    uint64_t to = std::min(end, pieceBegin + _pieceSize) - pieceBegin;
+    if (to > piece.size()) {
+      return {ErrorCodes::ERR_INTERNAL, "pieced string corrupted"};
+    }
+    result.append(piece, from, to - from);
+  }
+  return result;
+}
+
+Status PiecedKV::write(uint64_t offset,
+                       const std::string& data,
+                       Transaction* txn) {
+  if (data.empty()) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  uint64_t end = offset + data.size();
+  uint64_t newSize = std::max(_size, end);
+  // the pieces between the old end and offset are filled with zero, so
+  // that every piece below the size always exists.
+  uint64_t first = std::min(offset, _size) / _pieceSize;
+  std::vector<std::pair<uint64_t, uint32_t>> counts;
+  for (uint64_t idx = first; idx * _pieceSize < end; idx++) {
+    uint64_t pieceBegin = idx * _pieceSize;
+    uint64_t pieceEnd = std::min(newSize, pieceBegin + _pieceSize);
+    std::string piece;
+    if (pieceBegin < _size) {
+      auto epiece = getPiece(idx, txn);
+      if (!epiece.ok()) {
+        return epiece.status();
+      }
+      piece = std::move(epiece.value());
+    }
+    piece.resize(pieceEnd - pieceBegin, 0);
+
+    uint64_t from = std::max(offset, pieceBegin);
+    uint64_t to = std::min(end, pieceEnd);
+    if (from < to) {
+      piece.replace(
+        from - pieceBegin, to - from, data, from - offset, to - from);
+    }
+    counts.emplace_back(idx, bitops::popCount(piece.data(), piece.size()));
+    RecordValue rv(std::move(piece), RecordType::RT_KV_PIECE, -1);
+    auto s = _store->setKV(pieceKey(idx), rv, txn);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  _size = newSize;
+  return updateSummary(counts, txn);
+}
+
+Status PiecedKV::save(Transaction* txn, uint64_t versionEP) {
+  _meta.setVersionEP(versionEP);
+  _meta.setTotalSize(_size);
+  return _store->setKV(_mk, _meta, txn);
+}
+
+RecordKey PiecedKV::summaryKey(uint64_t block) const {
+  return RecordKey(_mk.getChunkId(),
+                   _mk.getDbId(),
+                   RecordType::RT_KV_PIECE,
+                   _mk.getPrimaryKey(),
+                   "c" + std::to_string(block));
+}
+
+Expected<std::string> PiecedKV::getSummary(uint64_t block,
+                                           Transaction* txn) const {
+  auto eval = _store->getKV(summaryKey(block), txn);
+  if (eval.ok()) {
+    return eval.value().getValue();
+  } else if (eval.status().code() != ErrorCodes::ERR_NOTFOUND) {
+    return eval.status();
+  }
+
+  std::string summary;
+  for (uint64_t idx = block * SUMMARY_PAGES;
+       idx < (block + 1) * SUMMARY_PAGES && idx * _pieceSize < _size;
+       idx++) {
+    auto epiece = getPiece(idx, txn);
+    if (!epiece.ok()) {
+      return epiece.status();
+    }
+    char buf[sizeof(uint32_t)];
+    int32Encode(buf,
+                bitops::popCount(epiece.value().data(),
+                                 epiece.value().size()));
+    summary.append(buf, sizeof(buf));
+  }
+  return summary;
+}
+
+Status PiecedKV::updateSummary(
+  const std::vector<std::pair<uint64_t, uint32_t>>& counts,
+  Transaction* txn) {
+  size_t i = 0;
+  while (i < counts.size()) {
+    uint64_t block = counts[i].first / SUMMARY_PAGES;
+    auto esummary = getSummary(block, txn);
+    if (!esummary.ok()) {
+      return esummary.status();
+    }
+    std::string summary = std::move(esummary.value());
+    for (; i < counts.size() && counts[i].first / SUMMARY_PAGES == block;
+         i++) {
+      size_t pos = (counts[i].first % SUMMARY_PAGES) * sizeof(uint32_t);
+      if (summary.size() < pos + sizeof(uint32_t)) {
+        summary.resize(pos + sizeof(uint32_t), 0);
+      }
+      int32Encode(&summary[pos], counts[i].second);
+    }
+    RecordValue rv(std::move(summary), RecordType::RT_KV_PIECE, -1);
+    auto s = _store->setKV(summaryKey(block), rv, txn);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Expected<uint64_t> PiecedKV::bitCount(uint64_t start,
+                                      uint64_t end,
+                                      Transaction* txn) const {
+  if (_size == 0) {
+    return 0;
+  }
+  end = std::min(end, _size - 1);
+  uint64_t bits = 0;
+  if (start > end) {
+    return bits;
+  }
+  std::string summary;
+  uint64_t summaryBlock = -1;
+  for (uint64_t idx = start / _pieceSize; idx * _pieceSize <= end; idx++) {
+    uint64_t pieceBegin = idx * _pieceSize;
+    uint64_t pieceLast = std::min(pieceBegin + _pieceSize, _size) - 1;
+    uint64_t from = std::max(start, pieceBegin);
+    uint64_t to = std::min(end, pieceLast);
+    if (from == pieceBegin && to == pieceLast) {
+      // the whole page, use the summary
+      if (summaryBlock != idx / SUMMARY_PAGES) {
+        auto esummary = getSummary(idx / SUMMARY_PAGES, txn);
+        if (!esummary.ok()) {
+          return esummary.status();
+        }
+        summary = std::move(esummary.value());
+        summaryBlock = idx / SUMMARY_PAGES;
+      }
+      size_t pos = (idx % SUMMARY_PAGES) * sizeof(uint32_t);
+      if (summary.size() < pos + sizeof(uint32_t)) {
+        return {ErrorCodes::ERR_INTERNAL, "pieced string corrupted"};
+      }
+      bits += int32Decode(summary.data() + pos);
+      continue;
+    }
+    auto epiece = getPiece(idx, txn);
+    if (!epiece.ok()) {
+      return epiece.status();
+    }
+    if (to - pieceBegin >= epiece.value().size()) {
+      return {ErrorCodes::ERR_INTERNAL, "pieced string corrupted"};
+    }
+    bits += bitops::popCount(epiece.value().data() + from - pieceBegin,
+                             to - from + 1);
+  }
+  return bits;
+}
+
+Expected<int64_t> PiecedKV::bitPos(uint64_t start,
+                                   uint64_t end,
+                                   uint32_t bit,
+                                   Transaction* txn) const {
+  int64_t notFound = bit ? -1 : static_cast<int64_t>(end - start + 1) * 8;
+  if (_size == 0) {
+    return notFound;
+  }
+  end = std::min(end, _size - 1);
+  if (start > end) {
+    return notFound;
+  }
+  std::string summary;
+  uint64_t summaryBlock = -1;
+  for (uint64_t idx = start / _pieceSize; idx * _pieceSize <= end; idx++) {
+    uint64_t pieceBegin = idx * _pieceSize;
+    uint64_t pieceLast = std::min(pieceBegin + _pieceSize, _size) - 1;
+    uint64_t from = std::max(start, pieceBegin);
+    uint64_t to = std::min(end, pieceLast);
+    if (from == pieceBegin && to == pieceLast) {
+      // skip the page without the bit by the summary
+      if (summaryBlock != idx / SUMMARY_PAGES) {
+        auto esummary = getSummary(idx / SUMMARY_PAGES, txn);
+        if (!esummary.ok()) {
+          return esummary.status();
+        }
+        summary = std::move(esummary.value());
+        summaryBlock = idx / SUMMARY_PAGES;
+      }
+      size_t pos = (idx % SUMMARY_PAGES) * sizeof(uint32_t);
+      if (summary.size() < pos + sizeof(uint32_t)) {
+        return {ErrorCodes::ERR_INTERNAL, "pieced string corrupted"};
+      }
+      uint64_t cnt = int32Decode(summary.data() + pos);
+      if ((bit && cnt == 0) ||
+          (!bit && cnt == (pieceLast - pieceBegin + 1) * 8)) {
+        continue;
+      }
+    }
+    auto epiece = getPiece(idx, txn);
+    if (!epiece.ok()) {
+      return epiece.status();
+    }
+    if (to - pieceBegin >= epiece.value().size()) {
+      return {ErrorCodes::ERR_INTERNAL, "pieced string corrupted"};
+    }
+    int64_t len = to - from + 1;
+    int64_t r = redis_port::bitPos(
+      epiece.value().data() + from - pieceBegin, len, bit);
+    if ((bit && r != -1) || (!bit && r < len * 8)) {
+      return static_cast<int64_t>(from - start) * 8 + r;
+    }
+  }
+  return notFound;
+}
+
+}  // namespace tendisplus
@@ -0,0 +1,106 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_STORAGE_PIECED_KV_H_
+#define SRC_TENDISPLUS_STORAGE_PIECED_KV_H_
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+#include "tendisplus/storage/record.h"
+#include "tendisplus/storage/kvstore.h"
+
+namespace tendisplus {
+
+// PiecedKV stores a big string as fixed-size pieces. The meta is a RT_KV
+// record with an empty user value, PIECESIZE and TOTALSIZE set. Piece i
+// holds [i * pieceSize, (i + 1) * pieceSize) of the value and is stored
+// as a RT_KV_PIECE subkey with SK = i. Only the last piece may be shorter.
+// APPEND/SETRANGE/SETBIT/GETRANGE/GETBIT only touch the pieces covering
+// the requested range, so a small update of a big string writes (and
+// replicates) a few pieces instead of the whole value.
+// For bitmaps, the pieces are the pages. The popcount of every page is
+// kept in summary subkeys (SK = "c" + block), one for SUMMARY_PAGES pages,
+// so that BITCOUNT/BITPOS over a range mostly read the summaries.
+class PiecedKV {
+ public:
+  // meta must be a pieced RT_KV value of mk
+  PiecedKV(const RecordKey& mk, const RecordValue& meta, PStore store);
+
+  // threshold == 0 disables pieced strings for new values, the existing
+  // pieced strings are still readable.
+  static void setConfig(uint32_t threshold, uint32_t pieceSize);
+  static bool enabled();
+  // whether a string of the size should be stored in pieces
+  static bool needPieces(uint64_t size);
+  static uint32_t getPieceSizeConfig();
+
+  // write rv (a plain RT_KV value) into pieces. The old pieces of mk
+  // should have been deleted by caller.
+  static Status set(PStore store,
+                    const RecordKey& mk,
+                    const RecordValue& rv,
+                    Transaction* txn);
+  // load the whole value of a pieced rv, rv becomes a plain RT_KV value
+  static Status load(PStore store,
+                     const RecordKey& mk,
+                     RecordValue* rv,
+                     Transaction* txn);
+
+  uint64_t getSize() const {
+    return _size;
+  }
+  const RecordValue& getMeta() const {
+    return _meta;
+  }
+  RecordKey pieceKey(uint64_t idx) const;
+  // read [offset, offset + len) of the value, it is truncated by the size
+  Expected<std::string> read(uint64_t offset,
+                             uint64_t len,
+                             Transaction* txn) const;
+  // overwrite [offset, offset + data.size()) of the value, the gap between
+  // the old size and offset is filled with zero.
+  Status write(uint64_t offset, const std::string& data, Transaction* txn);
+  // update the meta, it should be called after write()
+  Status save(Transaction* txn, uint64_t versionEP);
+
+  // number of bits set in [start, end] bytes of the value
+  Expected<uint64_t> bitCount(uint64_t start,
+                              uint64_t end,
+                              Transaction* txn) const;
+  // position of the first bit in [start, end] bytes, relative to start.
+  // same as redis_port::bitPos(), if not found, return -1 for bit 1 and
+  // (end - start + 1) * 8 for bit 0.
+  Expected<int64_t> bitPos(uint64_t start,
+                           uint64_t end,
+                           uint32_t bit,
+                           Transaction* txn) const;
+
+  static constexpr uint64_t SUMMARY_PAGES = 1024;
+
+ private:
+  Expected<std::string> getPiece(uint64_t idx, Transaction* txn) const;
+  RecordKey summaryKey(uint64_t block) const;
+  // the popcount of the pages in the block, 4 bytes for each page.
+  // it is rebuilt from the pages if not found.
+  Expected<std::string> getSummary(uint64_t block, Transaction* txn) const;
+  // counts is {page index, popcount}, sorted by page index
+  Status updateSummary(
+    const std::vector<std::pair<uint64_t, uint32_t>>& counts,
+    Transaction* txn);
+
+  static std::atomic<uint32_t> _threshold;
+  static std::atomic<uint32_t> _pieceSizeConfig;
+
+  const RecordKey _mk;
+  RecordValue _meta;
+  PStore _store;
+  const uint64_t _pieceSize;
+  uint64_t _size;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_STORAGE_PIECED_KV_H_
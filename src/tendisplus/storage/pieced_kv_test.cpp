@@ -0,0 +1,180 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <fstream>
+#include <string>
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "tendisplus/utils/status.h"
+#include "tendisplus/utils/scopeguard.h"
+#include "tendisplus/utils/portable.h"
+#include "tendisplus/utils/redis_port.h"
+#include "tendisplus/storage/pieced_kv.h"
+#include "tendisplus/storage/kvstore.h"
+#include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/server/server_params.h"
+
+namespace tendisplus {
+
+std::shared_ptr<ServerParams> genParams() {
+  const auto guard = MakeGuard([] { remove("a.cfg"); });
+  std::ofstream myfile;
+  myfile.open("a.cfg");
+  myfile << "bind 127.0.0.1\n";
+  myfile << "port 8903\n";
+  myfile << "loglevel debug\n";
+  myfile << "logdir ./log\n";
+  myfile << "storage rocks\n";
+  myfile << "dir ./db\n";
+  myfile << "rocks.blockcachemb 64\n";
+  myfile.close();
+  auto cfg = std::make_shared<ServerParams>();
+  auto s = cfg->parseFile("a.cfg");
+  EXPECT_EQ(s.ok(), true) << s.toString();
+  return cfg;
+}
+
+TEST(PiecedKV, Common) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    PiecedKV::setConfig(0, 64 * 1024);
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto store = std::shared_ptr<KVStore>(new RocksKVStore("0", cfg, blockCache));
+
+  PiecedKV::setConfig(100, 16);
+  EXPECT_TRUE(PiecedKV::enabled());
+  EXPECT_FALSE(PiecedKV::needPieces(100));
+  EXPECT_TRUE(PiecedKV::needPieces(101));
+
+  std::string value;
+  for (uint32_t i = 0; i < 150; i++) {
+    value.push_back('a' + i % 26);
+  }
+  RecordKey mk(0, 0, RecordType::RT_KV, "big", "");
+  RecordValue rv(value, RecordType::RT_KV, -1, 0);
+
+  auto eTxn = store->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  auto txn = eTxn.value().get();
+  EXPECT_TRUE(PiecedKV::set(store, mk, rv, txn).ok());
+
+  auto emeta = store->getKV(mk, txn);
+  EXPECT_TRUE(emeta.ok());
+  EXPECT_TRUE(rcd_util::isPiecedKV(emeta.value()));
+  EXPECT_EQ(emeta.value().getPieceSize(), 16U);
+  EXPECT_EQ(emeta.value().getTotalSize(), 150U);
+  EXPECT_EQ(rcd_util::getSubKeyCount(mk, emeta.value()).value(), 10U);
+
+  PiecedKV pkv(mk, emeta.value(), store);
+  EXPECT_EQ(pkv.read(0, 150, txn).value(), value);
+  EXPECT_EQ(pkv.read(10, 30, txn).value(), value.substr(10, 30));
+  EXPECT_EQ(pkv.read(140, 100, txn).value(), value.substr(140));
+  EXPECT_EQ(pkv.read(150, 1, txn).value(), "");
+
+  // overwrite across pieces
+  std::string data(20, 'x');
+  EXPECT_TRUE(pkv.write(30, data, txn).ok());
+  value.replace(30, 20, data);
+  // write after the end, the gap is zero filled
+  EXPECT_TRUE(pkv.write(200, "tail", txn).ok());
+  value.resize(200, 0);
+  value.append("tail");
+  EXPECT_EQ(pkv.getSize(), value.size());
+  EXPECT_TRUE(pkv.save(txn, 7).ok());
+
+  emeta = store->getKV(mk, txn);
+  EXPECT_TRUE(emeta.ok());
+  EXPECT_EQ(emeta.value().getTotalSize(), value.size());
+  EXPECT_EQ(emeta.value().getVersionEP(), 7U);
+  for (uint64_t i = 0; i * 16 < value.size(); i++) {
+    EXPECT_TRUE(store->getKV(pkv.pieceKey(i), txn).ok());
+  }
+
+  RecordValue loaded = emeta.value();
+  EXPECT_TRUE(PiecedKV::load(store, mk, &loaded, txn).ok());
+  EXPECT_FALSE(rcd_util::isPiecedKV(loaded));
+  EXPECT_EQ(loaded.getValue(), value);
+  EXPECT_EQ(loaded.getVersionEP(), 7U);
+  EXPECT_TRUE(eTxn.value()->commit().ok());
+}
+
+TEST(PiecedKV, Bitmap) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    PiecedKV::setConfig(0, 64 * 1024);
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto store = std::shared_ptr<KVStore>(new RocksKVStore("0", cfg, blockCache));
+
+  // 16 bytes pages, more than one summary block
+  PiecedKV::setConfig(100, 16);
+  uint64_t size = 16 * PiecedKV::SUMMARY_PAGES * 2 + 100;
+  std::string value(size, 0);
+  for (uint64_t i = 0; i < size; i += 7) {
+    value[i] = static_cast<char>(i * 31);
+  }
+  RecordKey mk(0, 0, RecordType::RT_KV, "bitmap", "");
+  RecordValue rv(value, RecordType::RT_KV, -1, 0);
+
+  auto eTxn = store->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  auto txn = eTxn.value().get();
+  EXPECT_TRUE(PiecedKV::set(store, mk, rv, txn).ok());
+  auto emeta = store->getKV(mk, txn);
+  EXPECT_TRUE(emeta.ok());
+
+  auto check = [&](PiecedKV* pkv, uint64_t start, uint64_t end) {
+    auto cnt = pkv->bitCount(start, end, txn);
+    EXPECT_TRUE(cnt.ok());
+    EXPECT_EQ(cnt.value(),
+              redis_port::popCount(value.data() + start, end - start + 1));
+    for (uint32_t bit = 0; bit < 2; bit++) {
+      auto pos = pkv->bitPos(start, end, bit, txn);
+      EXPECT_TRUE(pos.ok());
+      EXPECT_EQ(
+        pos.value(),
+        redis_port::bitPos(value.data() + start, end - start + 1, bit));
+    }
+  };
+
+  PiecedKV pkv(mk, emeta.value(), store);
+  check(&pkv, 0, size - 1);
+  check(&pkv, 3, 5);
+  check(&pkv, 17, size - 20);
+  check(&pkv, 16 * PiecedKV::SUMMARY_PAGES - 5, 16 * PiecedKV::SUMMARY_PAGES);
+
+  // the summaries follow the writes
+  std::string ones(40, static_cast<char>(0xff));
+  EXPECT_TRUE(pkv.write(1000, ones, txn).ok());
+  value.replace(1000, ones.size(), ones);
+  std::string zeros(16 * PiecedKV::SUMMARY_PAGES, 0);
+  EXPECT_TRUE(pkv.write(0, zeros, txn).ok());
+  value.replace(0, zeros.size(), zeros);
+  EXPECT_TRUE(pkv.save(txn, 0).ok());
+  check(&pkv, 0, size - 1);
+  check(&pkv, 0, zeros.size() - 1);
+  check(&pkv, 990, size - 1);
+
+  // the summaries are rebuilt if missing
+  emeta = store->getKV(mk, txn);
+  EXPECT_TRUE(emeta.ok());
+  RecordKey sk(0, 0, RecordType::RT_KV_PIECE, "bitmap", "c1");
+  EXPECT_TRUE(store->delKV(sk, txn).ok());
+  PiecedKV pkv2(mk, emeta.value(), store);
+  check(&pkv2, 0, size - 1);
+  EXPECT_TRUE(eTxn.value()->commit().ok());
+}
+
+}  // namespace tendisplus
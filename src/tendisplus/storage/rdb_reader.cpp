@@ -0,0 +1,680 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include "tendisplus/storage/rdb_reader.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+#include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/string.h"
+
+namespace tendisplus {
+
+namespace {
+
+constexpr uint8_t RDB_TYPE_STRING = 0;
+constexpr uint8_t RDB_TYPE_LIST = 1;
+constexpr uint8_t RDB_TYPE_SET = 2;
+constexpr uint8_t RDB_TYPE_ZSET = 3;
+constexpr uint8_t RDB_TYPE_HASH = 4;
+constexpr uint8_t RDB_TYPE_ZSET_2 = 5;
+constexpr uint8_t RDB_TYPE_LIST_ZIPLIST = 10;
+constexpr uint8_t RDB_TYPE_SET_INTSET = 11;
+constexpr uint8_t RDB_TYPE_ZSET_ZIPLIST = 12;
+constexpr uint8_t RDB_TYPE_HASH_ZIPLIST = 13;
+constexpr uint8_t RDB_TYPE_LIST_QUICKLIST = 14;
+constexpr uint8_t RDB_TYPE_HASH_LISTPACK = 16;
+constexpr uint8_t RDB_TYPE_ZSET_LISTPACK = 17;
+constexpr uint8_t RDB_TYPE_LIST_QUICKLIST_2 = 18;
+constexpr uint8_t RDB_TYPE_SET_LISTPACK = 20;
+
+constexpr uint8_t RDB_OPCODE_SLOT_INFO = 0xF4;
+constexpr uint8_t RDB_OPCODE_FUNCTION2 = 0xF5;
+constexpr uint8_t RDB_OPCODE_FUNCTION_PRE_GA = 0xF6;
+constexpr uint8_t RDB_OPCODE_MODULE_AUX = 0xF7;
+constexpr uint8_t RDB_OPCODE_IDLE = 0xF8;
+constexpr uint8_t RDB_OPCODE_FREQ = 0xF9;
+constexpr uint8_t RDB_OPCODE_AUX = 0xFA;
+constexpr uint8_t RDB_OPCODE_RESIZEDB = 0xFB;
+constexpr uint8_t RDB_OPCODE_EXPIRETIME_MS = 0xFC;
+constexpr uint8_t RDB_OPCODE_EXPIRETIME = 0xFD;
+constexpr uint8_t RDB_OPCODE_SELECTDB = 0xFE;
+constexpr uint8_t RDB_OPCODE_EOF = 0xFF;
+
+constexpr uint8_t RDB_ENC_INT8 = 0;
+constexpr uint8_t RDB_ENC_INT16 = 1;
+constexpr uint8_t RDB_ENC_INT32 = 2;
+constexpr uint8_t RDB_ENC_LZF = 3;
+
+constexpr uint8_t QUICKLIST_NODE_CONTAINER_PLAIN = 1;
+
+Status errDecode(const std::string& msg) {
+  return {ErrorCodes::ERR_DECODE, "invalid rdb: " + msg};
+}
+
+// little endian, sign extended
+int64_t decodeIntLE(const unsigned char* p, size_t len) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < len; i++) {
+    v |= static_cast<uint64_t>(p[i]) << (i * 8);
+  }
+  if (len < 8 && (v & (1ULL << (len * 8 - 1)))) {
+    v |= ~0ULL << (len * 8);
+  }
+  return static_cast<int64_t>(v);
+}
+
+}  // namespace
+
+namespace rdb_util {
+
+Expected<double> str2Score(const std::string& s) {
+  if (s == "inf" || s == "+inf") {
+    return std::numeric_limits<double>::infinity();
+  } else if (s == "-inf") {
+    return -std::numeric_limits<double>::infinity();
+  }
+  char* end = nullptr;
+  double d = strtod(s.c_str(), &end);
+  if (s.empty() || end != s.c_str() + s.size() || std::isnan(d)) {
+    return errDecode("bad score " + s);
+  }
+  return d;
+}
+
+Expected<std::vector<std::string>> decodeZiplist(const std::string& zl) {
+  // <zlbytes:4><zltail:4><zllen:2><entry>...<0xff>
+  auto p = reinterpret_cast<const unsigned char*>(zl.data());
+  size_t size = zl.size();
+  size_t pos = 10;
+  std::vector<std::string> result;
+  while (true) {
+    if (pos >= size) {
+      return errDecode("ziplist without end");
+    }
+    if (p[pos] == 0xff) {
+      break;
+    }
+    // prevlen
+    pos += (p[pos] < 254) ? 1 : 5;
+    if (pos >= size) {
+      return errDecode("ziplist entry truncated");
+    }
+    uint8_t enc = p[pos];
+    size_t slen = 0;
+    size_t ilen = 0;
+    int64_t ival = 0;
+    switch (enc >> 6) {
+      case 0:
+        slen = enc & 0x3f;
+        pos += 1;
+        break;
+      case 1:
+        if (pos + 2 > size) {
+          return errDecode("ziplist entry truncated");
+        }
+        slen = ((enc & 0x3f) << 8) | p[pos + 1];
+        pos += 2;
+        break;
+      case 2:
+        if (pos + 5 > size) {
+          return errDecode("ziplist entry truncated");
+        }
+        slen = (static_cast<size_t>(p[pos + 1]) << 24) |
+          (static_cast<size_t>(p[pos + 2]) << 16) |
+          (static_cast<size_t>(p[pos + 3]) << 8) | p[pos + 4];
+        pos += 5;
+        break;
+      default:
+        pos += 1;
+        if (enc == 0xc0) {
+          ilen = 2;
+        } else if (enc == 0xd0) {
+          ilen = 4;
+        } else if (enc == 0xe0) {
+          ilen = 8;
+        } else if (enc == 0xf0) {
+          ilen = 3;
+        } else if (enc == 0xfe) {
+          ilen = 1;
+        } else if (enc >= 0xf1 && enc <= 0xfd) {
+          ival = (enc & 0x0f) - 1;
+        } else {
+          return errDecode("bad ziplist encoding");
+        }
+        break;
+    }
+    if (pos + slen + ilen > size) {
+      return errDecode("ziplist entry truncated");
+    }
+    if (enc >> 6 != 3) {
+      result.emplace_back(zl.data() + pos, slen);
+      pos += slen;
+    } else {
+      if (ilen) {
+        ival = decodeIntLE(p + pos, ilen);
+        pos += ilen;
+      }
+      result.emplace_back(std::to_string(ival));
+    }
+  }
+  return result;
+}
+
+Expected<std::vector<std::string>> decodeListpack(const std::string& lp) {
+  // <total bytes:4><num elements:2><entry>...<0xff>, each entry is
+  // <encoding><data><backlen>
+  auto p = reinterpret_cast<const unsigned char*>(lp.data());
+  size_t size = lp.size();
+  size_t pos = 6;
+  std::vector<std::string> result;
+  while (true) {
+    if (pos >= size) {
+      return errDecode("listpack without end");
+    }
+    uint8_t enc = p[pos];
+    if (enc == 0xff) {
+      break;
+    }
+    size_t hlen = 1;
+    size_t slen = 0;
+    size_t ilen = 0;
+    int64_t ival = 0;
+    bool isStr = false;
+    if ((enc & 0x80) == 0) {
+      ival = enc & 0x7f;
+    } else if ((enc & 0xc0) == 0x80) {
+      isStr = true;
+      slen = enc & 0x3f;
+    } else if ((enc & 0xe0) == 0xc0) {
+      if (pos + 2 > size) {
+        return errDecode("listpack entry truncated");
+      }
+      hlen = 2;
+      ival = ((enc & 0x1f) << 8) | p[pos + 1];
+      if (ival >= (1 << 12)) {
+        ival -= (1 << 13);
+      }
+    } else if ((enc & 0xf0) == 0xe0) {
+      if (pos + 2 > size) {
+        return errDecode("listpack entry truncated");
+      }
+      isStr = true;
+      hlen = 2;
+      slen = ((enc & 0x0f) << 8) | p[pos + 1];
+    } else if (enc == 0xf0) {
+      if (pos + 5 > size) {
+        return errDecode("listpack entry truncated");
+      }
+      isStr = true;
+      hlen = 5;
+      slen = static_cast<size_t>(decodeIntLE(p + pos + 1, 4) & 0xffffffff);
+    } else if (enc >= 0xf1 && enc <= 0xf4) {
+      static const size_t intLens[] = {2, 3, 4, 8};
+      ilen = intLens[enc - 0xf1];
+    } else {
+      return errDecode("bad listpack encoding");
+    }
+    size_t entryLen = hlen + slen + ilen;
+    if (pos + entryLen > size) {
+      return errDecode("listpack entry truncated");
+    }
+    if (isStr) {
+      result.emplace_back(lp.data() + pos + hlen, slen);
+    } else {
+      if (ilen) {
+        ival = decodeIntLE(p + pos + hlen, ilen);
+      }
+      result.emplace_back(std::to_string(ival));
+    }
+    pos += entryLen;
+    // backlen
+    if (entryLen <= 127) {
+      pos += 1;
+    } else if (entryLen < 16383) {
+      pos += 2;
+    } else if (entryLen < 2097151) {
+      pos += 3;
+    } else if (entryLen < 268435455) {
+      pos += 4;
+    } else {
+      pos += 5;
+    }
+  }
+  return result;
+}
+
+Expected<std::vector<std::string>> decodeIntset(const std::string& is) {
+  // <encoding:4><length:4><contents>, little endian
+  if (is.size() < 8) {
+    return errDecode("intset truncated");
+  }
+  auto p = reinterpret_cast<const unsigned char*>(is.data());
+  size_t enc = static_cast<size_t>(decodeIntLE(p, 4));
+  size_t len = static_cast<size_t>(decodeIntLE(p + 4, 4) & 0xffffffff);
+  if ((enc != 2 && enc != 4 && enc != 8) || 8 + enc * len > is.size()) {
+    return errDecode("bad intset");
+  }
+  std::vector<std::string> result;
+  result.reserve(len);
+  for (size_t i = 0; i < len; i++) {
+    result.emplace_back(std::to_string(decodeIntLE(p + 8 + i * enc, enc)));
+  }
+  return result;
+}
+
+}  // namespace rdb_util
+
+RdbReader::RdbReader(const std::string& path)
+  : _path(path), _version(0), _pos(0), _dbId(0) {}
+
+Status RdbReader::open() {
+  _in.open(_path, std::ios::binary);
+  if (!_in.is_open()) {
+    return {ErrorCodes::ERR_INTERNAL, "open " + _path + " failed"};
+  }
+  char magic[9];
+  auto s = readBytes(magic, sizeof(magic));
+  if (!s.ok()) {
+    return s;
+  }
+  if (std::string(magic, 5) != "REDIS") {
+    return errDecode("bad magic");
+  }
+  auto ever = ::tendisplus::stoul(std::string(magic + 5, 4));
+  if (!ever.ok() || ever.value() < 1 || ever.value() > RDB_VERSION_MAX) {
+    return errDecode("unsupported version " + std::string(magic + 5, 4));
+  }
+  _version = static_cast<uint32_t>(ever.value());
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status RdbReader::readBytes(void* buf, size_t len) {
+  if (len == 0) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  _in.read(reinterpret_cast<char*>(buf), len);
+  if (static_cast<size_t>(_in.gcount()) != len) {
+    return errDecode("unexpected end of " + _path);
+  }
+  _pos += len;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Expected<uint8_t> RdbReader::readByte() {
+  uint8_t c = 0;
+  auto s = readBytes(&c, 1);
+  if (!s.ok()) {
+    return s;
+  }
+  return c;
+}
+
+Expected<uint64_t> RdbReader::readUint(size_t len) {
+  unsigned char buf[8];
+  INVARIANT_D(len <= sizeof(buf));
+  auto s = readBytes(buf, len);
+  if (!s.ok()) {
+    return s;
+  }
+  return static_cast<uint64_t>(decodeIntLE(buf, len)) &
+    (len == 8 ? ~0ULL : ((1ULL << (len * 8)) - 1));
+}
+
+Expected<uint64_t> RdbReader::readLen(bool* encoded) {
+  if (encoded) {
+    *encoded = false;
+  }
+  auto eb = readByte();
+  if (!eb.ok()) {
+    return eb.status();
+  }
+  uint8_t b = eb.value();
+  switch (b >> 6) {
+    case 0:
+      return b & 0x3f;
+    case 1: {
+      auto next = readByte();
+      if (!next.ok()) {
+        return next.status();
+      }
+      return ((b & 0x3f) << 8) | next.value();
+    }
+    case 2: {
+      if (b != 0x80 && b != 0x81) {
+        return errDecode("bad length");
+      }
+      size_t n = (b == 0x80) ? 4 : 8;
+      unsigned char buf[8];
+      auto s = readBytes(buf, n);
+      if (!s.ok()) {
+        return s;
+      }
+      // big endian
+      uint64_t v = 0;
+      for (size_t i = 0; i < n; i++) {
+        v = (v << 8) | buf[i];
+      }
+      return v;
+    }
+    default:
+      if (!encoded) {
+        return errDecode("unexpected encoded length");
+      }
+      *encoded = true;
+      return b & 0x3f;
+  }
+}
+
+Expected<std::string> RdbReader::readString() {
+  bool encoded = false;
+  auto elen = readLen(&encoded);
+  if (!elen.ok()) {
+    return elen.status();
+  }
+  if (!encoded) {
+    std::string s(elen.value(), '\0');
+    auto st = readBytes(&s[0], s.size());
+    if (!st.ok()) {
+      return st;
+    }
+    return s;
+  }
+  switch (elen.value()) {
+    case RDB_ENC_INT8:
+    case RDB_ENC_INT16:
+    case RDB_ENC_INT32: {
+      size_t n = 1 << elen.value();
+      unsigned char buf[4];
+      auto st = readBytes(buf, n);
+      if (!st.ok()) {
+        return st;
+      }
+      return std::to_string(decodeIntLE(buf, n));
+    }
+    case RDB_ENC_LZF: {
+      auto clen = readLen();
+      if (!clen.ok()) {
+        return clen.status();
+      }
+      auto len = readLen();
+      if (!len.ok()) {
+        return len.status();
+      }
+      std::string c(clen.value(), '\0');
+      auto st = readBytes(&c[0], c.size());
+      if (!st.ok()) {
+        return st;
+      }
+      std::string s(len.value(), '\0');
+      if (len.value() > 0 &&
+          redis_port::lzf_decompress(
+            c.data(), c.size(), &s[0], s.size()) != s.size()) {
+        return errDecode("lzf decompress failed");
+      }
+      return s;
+    }
+    default:
+      return errDecode("unknown string encoding");
+  }
+}
+
+Expected<double> RdbReader::readStrDouble() {
+  auto elen = readByte();
+  if (!elen.ok()) {
+    return elen.status();
+  }
+  switch (elen.value()) {
+    case 253:
+      return std::numeric_limits<double>::quiet_NaN();
+    case 254:
+      return std::numeric_limits<double>::infinity();
+    case 255:
+      return -std::numeric_limits<double>::infinity();
+    default: {
+      std::string s(elen.value(), '\0');
+      auto st = readBytes(&s[0], s.size());
+      if (!st.ok()) {
+        return st;
+      }
+      return rdb_util::str2Score(s);
+    }
+  }
+}
+
+Expected<double> RdbReader::readBinaryDouble() {
+  auto ev = readUint(8);
+  if (!ev.ok()) {
+    return ev.status();
+  }
+  uint64_t v = ev.value();
+  double d;
+  static_assert(sizeof(d) == sizeof(v), "unexpected double size");
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+#define RDB_ASSIGN(var, expr)      \
+  auto var##_exp = (expr);         \
+  if (!var##_exp.ok()) {           \
+    return var##_exp.status();     \
+  }                                \
+  auto var = std::move(var##_exp.value());
+
+Status RdbReader::readObject(uint8_t type, RdbObject* obj) {
+  switch (type) {
+    case RDB_TYPE_STRING: {
+      obj->type = RdbObjectType::RDB_OBJ_STRING;
+      RDB_ASSIGN(v, readString());
+      obj->value = std::move(v);
+      break;
+    }
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET: {
+      obj->type = (type == RDB_TYPE_LIST) ? RdbObjectType::RDB_OBJ_LIST
+                                          : RdbObjectType::RDB_OBJ_SET;
+      RDB_ASSIGN(len, readLen());
+      for (uint64_t i = 0; i < len; i++) {
+        RDB_ASSIGN(ele, readString());
+        obj->elements.emplace_back(std::move(ele));
+      }
+      break;
+    }
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2: {
+      obj->type = RdbObjectType::RDB_OBJ_ZSET;
+      RDB_ASSIGN(len, readLen());
+      for (uint64_t i = 0; i < len; i++) {
+        RDB_ASSIGN(member, readString());
+        auto score =
+          (type == RDB_TYPE_ZSET) ? readStrDouble() : readBinaryDouble();
+        if (!score.ok()) {
+          return score.status();
+        }
+        if (std::isnan(score.value())) {
+          return errDecode("zset score is nan");
+        }
+        obj->scores.emplace_back(std::move(member), score.value());
+      }
+      break;
+    }
+    case RDB_TYPE_HASH: {
+      obj->type = RdbObjectType::RDB_OBJ_HASH;
+      RDB_ASSIGN(len, readLen());
+      for (uint64_t i = 0; i < len; i++) {
+        RDB_ASSIGN(field, readString());
+        RDB_ASSIGN(value, readString());
+        obj->fields.emplace_back(std::move(field), std::move(value));
+      }
+      break;
+    }
+    case RDB_TYPE_LIST_ZIPLIST: {
+      obj->type = RdbObjectType::RDB_OBJ_LIST;
+      RDB_ASSIGN(zl, readString());
+      RDB_ASSIGN(eles, rdb_util::decodeZiplist(zl));
+      obj->elements = std::move(eles);
+      break;
+    }
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_SET_LISTPACK: {
+      obj->type = RdbObjectType::RDB_OBJ_SET;
+      RDB_ASSIGN(raw, readString());
+      auto eles = (type == RDB_TYPE_SET_INTSET)
+        ? rdb_util::decodeIntset(raw)
+        : rdb_util::decodeListpack(raw);
+      if (!eles.ok()) {
+        return eles.status();
+      }
+      obj->elements = std::move(eles.value());
+      break;
+    }
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_HASH_LISTPACK: {
+      RDB_ASSIGN(raw, readString());
+      bool isZiplist =
+        (type == RDB_TYPE_ZSET_ZIPLIST || type == RDB_TYPE_HASH_ZIPLIST);
+      auto eles = isZiplist ? rdb_util::decodeZiplist(raw)
+                            : rdb_util::decodeListpack(raw);
+      if (!eles.ok()) {
+        return eles.status();
+      }
+      auto& v = eles.value();
+      if (v.size() % 2 != 0) {
+        return errDecode("odd number of entries");
+      }
+      bool isZset =
+        (type == RDB_TYPE_ZSET_ZIPLIST || type == RDB_TYPE_ZSET_LISTPACK);
+      obj->type =
+        isZset ? RdbObjectType::RDB_OBJ_ZSET : RdbObjectType::RDB_OBJ_HASH;
+      for (size_t i = 0; i < v.size(); i += 2) {
+        if (isZset) {
+          RDB_ASSIGN(score, rdb_util::str2Score(v[i + 1]));
+          obj->scores.emplace_back(std::move(v[i]), score);
+        } else {
+          obj->fields.emplace_back(std::move(v[i]), std::move(v[i + 1]));
+        }
+      }
+      break;
+    }
+    case RDB_TYPE_LIST_QUICKLIST:
+    case RDB_TYPE_LIST_QUICKLIST_2: {
+      obj->type = RdbObjectType::RDB_OBJ_LIST;
+      RDB_ASSIGN(len, readLen());
+      for (uint64_t i = 0; i < len; i++) {
+        uint64_t container = 0;
+        if (type == RDB_TYPE_LIST_QUICKLIST_2) {
+          RDB_ASSIGN(c, readLen());
+          container = c;
+        }
+        RDB_ASSIGN(raw, readString());
+        if (container == QUICKLIST_NODE_CONTAINER_PLAIN) {
+          obj->elements.emplace_back(std::move(raw));
+          continue;
+        }
+        auto eles = (type == RDB_TYPE_LIST_QUICKLIST)
+          ? rdb_util::decodeZiplist(raw)
+          : rdb_util::decodeListpack(raw);
+        if (!eles.ok()) {
+          return eles.status();
+        }
+        for (auto& e : eles.value()) {
+          obj->elements.emplace_back(std::move(e));
+        }
+      }
+      break;
+    }
+    default:
+      return {ErrorCodes::ERR_INTERNAL,
+              "unsupported rdb object type " + std::to_string(type)};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Expected<RdbObject> RdbReader::next() {
+  RdbObject obj;
+  while (true) {
+    RDB_ASSIGN(type, readByte());
+    switch (type) {
+      case RDB_OPCODE_EXPIRETIME: {
+        RDB_ASSIGN(sec, readUint(4));
+        obj.expireMs = sec * 1000;
+        continue;
+      }
+      case RDB_OPCODE_EXPIRETIME_MS: {
+        RDB_ASSIGN(ms, readUint(8));
+        obj.expireMs = ms;
+        continue;
+      }
+      case RDB_OPCODE_IDLE: {
+        RDB_ASSIGN(idle, readLen());
+        (void)idle;
+        continue;
+      }
+      case RDB_OPCODE_FREQ: {
+        RDB_ASSIGN(freq, readByte());
+        (void)freq;
+        continue;
+      }
+      case RDB_OPCODE_SELECTDB: {
+        RDB_ASSIGN(db, readLen());
+        _dbId = static_cast<uint32_t>(db);
+        continue;
+      }
+      case RDB_OPCODE_RESIZEDB: {
+        RDB_ASSIGN(dbSize, readLen());
+        RDB_ASSIGN(expiresSize, readLen());
+        (void)dbSize;
+        (void)expiresSize;
+        continue;
+      }
+      case RDB_OPCODE_SLOT_INFO: {
+        for (int i = 0; i < 3; i++) {
+          RDB_ASSIGN(info, readLen());
+          (void)info;
+        }
+        continue;
+      }
+      case RDB_OPCODE_AUX: {
+        RDB_ASSIGN(auxKey, readString());
+        RDB_ASSIGN(auxVal, readString());
+        (void)auxKey;
+        (void)auxVal;
+        continue;
+      }
+      case RDB_OPCODE_FUNCTION2: {
+        // the functions are not keys, skip them
+        RDB_ASSIGN(code, readString());
+        (void)code;
+        continue;
+      }
+      case RDB_OPCODE_FUNCTION_PRE_GA:
+      case RDB_OPCODE_MODULE_AUX:
+        return {ErrorCodes::ERR_INTERNAL,
+                "unsupported rdb opcode " + std::to_string(type)};
+      case RDB_OPCODE_EOF:
+        return {ErrorCodes::ERR_EXHAUST, ""};
+      default:
+        break;
+    }
+    obj.dbId = _dbId;
+    RDB_ASSIGN(key, readString());
+    obj.key = std::move(key);
+    auto s = readObject(type, &obj);
+    if (!s.ok()) {
+      return s;
+    }
+    return obj;
+  }
+}
+
+#undef RDB_ASSIGN
+
+}  // namespace tendisplus
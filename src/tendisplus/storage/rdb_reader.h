@@ -0,0 +1,91 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_STORAGE_RDB_READER_H_
+#define SRC_TENDISPLUS_STORAGE_RDB_READER_H_
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "tendisplus/utils/status.h"
+
+namespace tendisplus {
+
+enum class RdbObjectType : uint8_t {
+  RDB_OBJ_STRING = 0,
+  RDB_OBJ_LIST,
+  RDB_OBJ_SET,
+  RDB_OBJ_ZSET,
+  RDB_OBJ_HASH,
+};
+
+// a key of the rdb file, decoded from any of its encodings
+struct RdbObject {
+  uint32_t dbId = 0;
+  std::string key;
+  // absolute unix time in milliseconds, 0 for no expire
+  uint64_t expireMs = 0;
+  RdbObjectType type = RdbObjectType::RDB_OBJ_STRING;
+  // RDB_OBJ_STRING
+  std::string value;
+  // RDB_OBJ_LIST in order, RDB_OBJ_SET
+  std::vector<std::string> elements;
+  // RDB_OBJ_HASH {field, value}
+  std::vector<std::pair<std::string, std::string>> fields;
+  // RDB_OBJ_ZSET {member, score}
+  std::vector<std::pair<std::string, double>> scores;
+};
+
+// RdbReader reads the keys of a redis rdb file one by one, the file is
+// never loaded as a whole. The plain, ziplist, intset, quicklist and
+// listpack encodings of rdb version 1 to 12 are supported, the files
+// with modules, streams or zipmaps are rejected.
+// NOTE(tendis): the checksum at the end of the file is not verified.
+class RdbReader {
+ public:
+  explicit RdbReader(const std::string& path);
+  // check the magic and the version
+  Status open();
+  // ERR_EXHAUST at the end of the file
+  Expected<RdbObject> next();
+  uint32_t getVersion() const {
+    return _version;
+  }
+  // bytes read so far
+  uint64_t getPos() const {
+    return _pos;
+  }
+
+  static constexpr uint32_t RDB_VERSION_MAX = 12;
+
+ private:
+  Status readBytes(void* buf, size_t len);
+  Expected<uint8_t> readByte();
+  Expected<uint64_t> readUint(size_t len);
+  // encoded is set if it is an int/lzf encoded string
+  Expected<uint64_t> readLen(bool* encoded = nullptr);
+  Expected<std::string> readString();
+  Expected<double> readStrDouble();
+  Expected<double> readBinaryDouble();
+  Status readObject(uint8_t type, RdbObject* obj);
+
+  const std::string _path;
+  std::ifstream _in;
+  uint32_t _version;
+  uint64_t _pos;
+  uint32_t _dbId;
+};
+
+namespace rdb_util {
+// decode the entries of an encoded value, in order
+Expected<std::vector<std::string>> decodeZiplist(const std::string& zl);
+Expected<std::vector<std::string>> decodeListpack(const std::string& lp);
+Expected<std::vector<std::string>> decodeIntset(const std::string& is);
+Expected<double> str2Score(const std::string& s);
+}  // namespace rdb_util
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_STORAGE_RDB_READER_H_
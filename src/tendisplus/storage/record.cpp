@@ -2,6 +2,7 @@
 // Please refer to the license text that comes with this tendis open source
 // project for additional information.
 
+#include <climits>
 #include <type_traits>
 #include <utility>
 #include <memory>
@@ -18,6 +19,7 @@
 #include "tendisplus/utils/status.h"
 #include "tendisplus/utils/string.h"
 #include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/redis_port.h"
 
 namespace tendisplus {
 
@@ -60,6 +62,7 @@ bool isRealEleType(RecordType keyType, RecordType valueType) {
         return true;
       }
     case RecordType::RT_ZSET_S_ELE:
+    case RecordType::RT_KV_PIECE:
     case RecordType::RT_BINLOG:
     case RecordType::RT_TTL_INDEX:
     case RecordType::RT_META:  // For ts/revision
@@ -97,6 +100,8 @@ uint8_t rt2Char(RecordType t) {
       return 'c';
     case RecordType::RT_ZSET_S_ELE:
       return 'z';
+    case RecordType::RT_KV_PIECE:
+      return 'p';
     case RecordType::RT_TTL_INDEX:
       return std::numeric_limits<uint8_t>::max() - 1;
     // it's convinent (for seek) to have BINLOG to pos
@@ -117,6 +122,7 @@ uint8_t rt2Char(RecordType t) {
 std::string rt2Str(RecordType t) {
   switch (t) {
     case RecordType::RT_KV:
+    case RecordType::RT_KV_PIECE:
       return "STRING";
 
     case RecordType::RT_LIST_META:
@@ -168,6 +174,8 @@ RecordType char2Rt(uint8_t t) {
       return RecordType::RT_ZSET_S_ELE;
     case 'c':
       return RecordType::RT_ZSET_H_ELE;
+    case 'p':
+      return RecordType::RT_KV_PIECE;
     case std::numeric_limits<uint8_t>::max() - 1:
       return RecordType::RT_TTL_INDEX;
     case std::numeric_limits<uint8_t>::max():
@@ -726,11 +734,12 @@ std::string RecordValue::encode() const {
     // pieceSize
     // why +1? same as CAS
     offset += varintEncodeBuf(ptr + offset, size - offset, _pieceSize + 1);
-    INVARIANT_D(_pieceSize == (uint64_t)-1);
+    INVARIANT_D(_pieceSize == (uint64_t)-1 ||
+                (_type == RecordType::RT_KV && _value.empty()));
 
     // totalSize
     offset += varintEncodeBuf(ptr + offset, size - offset, _totalSize + 1);
-    INVARIANT_D(_totalSize == (uint64_t)-1);
+    INVARIANT_D(_totalSize == (uint64_t)-1 || _pieceSize != (uint64_t)-1);
   } else {
     // NOTE(vinchen) : for none DATA META value, the below members is
     // useless. They will take 6 bytes, and always be 0
@@ -818,7 +827,7 @@ Expected<RecordValue> RecordValue::decode(const std::string& value) {
     }
     offset += expt.value().second;
     pieceSize = expt.value().first - 1;
-    INVARIANT_D(pieceSize == (uint64_t)-1);
+    INVARIANT_D(pieceSize == (uint64_t)-1 || typeForMeta == RecordType::RT_KV);
 
     // totalSize
     expt = varintDecodeFwd(valueCstr + offset, value.size() - offset);
@@ -827,7 +836,7 @@ Expected<RecordValue> RecordValue::decode(const std::string& value) {
     }
     offset += expt.value().second;
     totalSize = expt.value().first - 1;
-    INVARIANT_D(totalSize == (uint64_t)-1);
+    INVARIANT_D(totalSize == (uint64_t)-1 || pieceSize != (uint64_t)-1);
 
     if (offset > value.size()) {
       std::stringstream ss;
@@ -841,8 +850,10 @@ Expected<RecordValue> RecordValue::decode(const std::string& value) {
   if (value.size() > offset) {
     rawValue = std::string(value.c_str() + offset, value.size() - offset);
   }
-  return RecordValue(
+  RecordValue rv(
     std::move(rawValue), typeForMeta, versionEP, ttl, cas, version, pieceSize);
+  rv.setTotalSize(totalSize);
+  return std::move(rv);
 }
 
 Expected<bool> RecordValue::validate(const std::string& value,
@@ -903,11 +914,14 @@ Expected<bool> RecordValue::validate(const std::string& value,
   }
   offset += expt.value().second;
   uint64_t totalSize = expt.value().first - 1;
-  if (pieceSize < totalSize) {
-    return {ErrorCodes::ERR_DECODE, "invalid pieceSize"};
-  }
-
-  if (totalSize != value.size() - offset && totalSize != (uint64_t)-1) {
+  if (pieceSize != (uint64_t)-1) {
+    // a pieced RT_KV keeps its value in RT_KV_PIECE subkeys
+    if (typeForMeta != RecordType::RT_KV || pieceSize == 0 ||
+        offset != value.size()) {
+      return {ErrorCodes::ERR_DECODE, "invalid pieceSize"};
+    }
+  } else if (totalSize != value.size() - offset &&
+             totalSize != (uint64_t)-1) {
     return {ErrorCodes::ERR_DECODE, "invalid totalSize"};
   }
 
@@ -1005,6 +1019,27 @@ RecordType RecordValue::decodeType(const char* value, size_t size) {
   return char2Rt(value[RecordValue::TYPE_OFFSET]);
 }
 
+uint64_t RecordValue::decodePieceSize(const char* value, size_t size) {
+  const uint8_t* valueCstr = reinterpret_cast<const uint8_t*>(value);
+  size_t offset = RecordValue::TTL_OFFSET;
+
+  // ttl, version, versionEP, CAS, pieceSize
+  for (int i = 0; i < 5; i++) {
+    if (offset >= size) {
+      return -1;
+    }
+    auto expt = varintDecodeFwd(valueCstr + offset, size - offset);
+    if (!expt.ok()) {
+      return -1;
+    }
+    offset += expt.value().second;
+    if (i == 4) {
+      return expt.value().first - 1;
+    }
+  }
+  return -1;
+}
+
 size_t RecordValue::minSize() {
   // 7 elements in header
   return 7;
@@ -1549,12 +1584,33 @@ TTLIndex& TTLIndex::operator=(const TTLIndex& o) {
   _type = o.getType();
   _priKey = o.getPriKey();
   _dbId = o.getDbId();
+  _legacy = o.isLegacy();
   return *this;
 }
 
 const std::string TTLIndex::ttlIndex() const {
   std::string ttlIdx;
 
+  INVARIANT_D(isDataMetaType(_type));
+  if (!_legacy) {
+    uint64_t bucket = _ttl / BUCKET_MS;
+    uint16_t slot = redis_port::keyHashSlot(_priKey.c_str(), _priKey.size());
+    ttlIdx.push_back(static_cast<char>(LAYOUT_BUCKET));
+    for (size_t i = 0; i < sizeof(bucket); ++i) {
+      ttlIdx.push_back(
+        static_cast<char>((bucket >> ((sizeof(bucket) - i - 1) * 8)) & 0xff));
+    }
+    ttlIdx.push_back(static_cast<char>((slot >> 8) & 0xff));
+    ttlIdx.push_back(static_cast<char>(slot & 0xff));
+    for (size_t i = 0; i < sizeof(_dbId); ++i) {
+      ttlIdx.push_back(
+        static_cast<char>((_dbId >> ((sizeof(_dbId) - i - 1) * 8)) & 0xff));
+    }
+    ttlIdx.push_back(rt2Char(_type));
+    ttlIdx.append(_priKey);
+    return ttlIdx;
+  }
+
   for (size_t i = 0; i < sizeof(_ttl); ++i) {
     ttlIdx.push_back(
       static_cast<char>((_ttl >> ((sizeof(_ttl) - i - 1) * 8)) & 0xff));
@@ -1565,7 +1621,6 @@ const std::string TTLIndex::ttlIndex() const {
       static_cast<char>((_dbId >> ((sizeof(_dbId) - i - 1) * 8)) & 0xff));
   }
 
-  INVARIANT_D(isDataMetaType(_type));
   ttlIdx.push_back(rt2Char(_type));
   ttlIdx.append(_priKey);
 
@@ -1624,14 +1679,50 @@ Expected<TTLIndex> TTLIndex::decode(const RecordKey& rk) {
     return {ErrorCodes::ERR_DECODE, "Invalid keylen"};
   }
 
-  uint64_t ttl = decodeTTL(index);
-  uint32_t dbId = decodeDBId(index);
-  RecordType type = decodeType(index);
-  std::string priKey = decodePriKey(index);
+  if (static_cast<uint8_t>(index[0]) != LAYOUT_BUCKET) {
+    uint64_t ttl = decodeTTL(index);
+    uint32_t dbId = decodeDBId(index);
+    RecordType type = decodeType(index);
+    std::string priKey = decodePriKey(index);
 
+    INVARIANT_D(type != RecordType::RT_DATA_META);
+
+    TTLIndex ret(priKey, type, dbId, ttl);
+    ret._legacy = true;
+    return ret;
+  }
+
+  // layout + bucket + slot + dbid + type
+  constexpr size_t headLen = 1 + sizeof(uint64_t) + sizeof(uint16_t) +
+    sizeof(uint32_t) + sizeof(uint8_t);
+  if (index.size() < headLen) {
+    return {ErrorCodes::ERR_DECODE, "Invalid keylen"};
+  }
+  size_t offset = 1;
+  uint64_t bucket = 0;
+  for (size_t i = 0; i < sizeof(bucket); ++i) {
+    bucket = (bucket << 8) | static_cast<uint8_t>(index[offset++]);
+  }
+  // skip the slot, it is the hash of the key
+  offset += sizeof(uint16_t);
+  uint32_t dbId = 0;
+  for (size_t i = 0; i < sizeof(dbId); ++i) {
+    dbId = (dbId << 8) | static_cast<uint8_t>(index[offset++]);
+  }
+  RecordType type = char2Rt(index[offset++]);
   INVARIANT_D(type != RecordType::RT_DATA_META);
 
-  return TTLIndex(priKey, type, dbId, ttl);
+  return TTLIndex(
+    index.substr(offset), type, dbId, (bucket + 1) * BUCKET_MS - 1);
+}
+
+const std::string& TTLIndex::prefixBucket() {
+  static std::string s = []() {
+    std::string result = RecordKey::prefixTTLIndex();
+    result.push_back(static_cast<char>(LAYOUT_BUCKET));
+    return result;
+  }();
+  return s;
 }
 
 Expected<VersionMeta> VersionMeta::decode(const RecordKey& rk,
@@ -1667,6 +1758,10 @@ Expected<uint64_t> getSubKeyCount(const RecordKey& key,
   INVARIANT_D(key.getRecordType() == RecordType::RT_DATA_META);
   switch (val.getRecordType()) {
     case RecordType::RT_KV: {
+      if (isPiecedKV(val)) {
+        return (val.getTotalSize() + val.getPieceSize() - 1) /
+          val.getPieceSize();
+      }
       return 1;
     }
     case RecordType::RT_HASH_META: {
@@ -1703,6 +1798,15 @@ Expected<uint64_t> getSubKeyCount(const RecordKey& key,
   }
 }
 
+bool isPiecedKV(const RecordValue& val) {
+  return val.getRecordType() == RecordType::RT_KV &&
+    val.getPieceSize() != (uint64_t)-1;
+}
+
+bool needTTLIndex(const RecordValue& val) {
+  return val.getRecordType() != RecordType::RT_KV || isPiecedKV(val);
+}
+
 std::string makeInvalidErrStr(RecordType type,
                               const std::string& key,
                               uint64_t metaCnt,
@@ -1710,5 +1814,82 @@ std::string makeInvalidErrStr(RecordType type,
   return "Invalid " + rt2Str(type) + ":" + key + ", meta number is " +
     std::to_string(metaCnt) + ", element number is " + std::to_string(eleCnt);
 }
+
+static constexpr char OPERAND_INCR = 'i';
+static constexpr char OPERAND_APPEND = 'a';
+
+std::string makeIncrOperand(int64_t incr) {
+  return OPERAND_INCR + std::to_string(incr);
+}
+
+std::string makeAppendOperand(const std::string& data) {
+  return OPERAND_APPEND + data;
+}
+
+static bool addInt64(int64_t a, int64_t b, int64_t* sum) {
+  if ((b < 0 && a < 0 && b < (LLONG_MIN - a)) ||
+      (b > 0 && a > 0 && b > (LLONG_MAX - a))) {
+    return false;
+  }
+  *sum = a + b;
+  return true;
+}
+
+bool applyOperand(const std::string& operand, std::string* value) {
+  if (operand.empty()) {
+    return false;
+  }
+  switch (operand[0]) {
+    case OPERAND_INCR: {
+      auto incr = ::tendisplus::stoll(operand.substr(1));
+      if (!incr.ok()) {
+        return false;
+      }
+      int64_t old = 0;
+      if (!value->empty()) {
+        auto eold = ::tendisplus::stoll(*value);
+        if (!eold.ok()) {
+          return false;
+        }
+        old = eold.value();
+      }
+      int64_t sum = 0;
+      if (!addInt64(old, incr.value(), &sum)) {
+        return false;
+      }
+      *value = std::to_string(sum);
+      return true;
+    }
+    case OPERAND_APPEND:
+      value->append(operand, 1, std::string::npos);
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool combineOperands(const std::string& left,
+                     const std::string& right,
+                     std::string* result) {
+  if (left.empty() || right.empty() || left[0] != right[0]) {
+    return false;
+  }
+  if (left[0] == OPERAND_APPEND) {
+    *result = left;
+    result->append(right, 1, std::string::npos);
+    return true;
+  }
+  if (left[0] != OPERAND_INCR) {
+    return false;
+  }
+  auto l = ::tendisplus::stoll(left.substr(1));
+  auto r = ::tendisplus::stoll(right.substr(1));
+  int64_t sum = 0;
+  if (!l.ok() || !r.ok() || !addInt64(l.value(), r.value(), &sum)) {
+    return false;
+  }
+  *result = makeIncrOperand(sum);
+  return true;
+}
 }  // namespace rcd_util
 }  // namespace tendisplus
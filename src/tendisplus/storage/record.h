@@ -54,6 +54,7 @@ enum class RecordType {
   RT_BINLOG,     /* For binlog in RecordKey and RecordValue  */
   RT_TTL_INDEX,  /* For ttl index  in RecordKey and RecordValue  */
   RT_DATA_META,  /* For key type in RecordKey */
+  RT_KV_PIECE,   /* For big string subkey type in RecordKey and RecordValue */
 };
 
 uint8_t rt2Char(RecordType t);
@@ -85,9 +86,12 @@ bool isRealEleType(RecordType keyType, RecordType valueType);
 // VERSION is a varint64, for multi-version. Reversed, always 0
 // VERSIONEP is a varint64, for extended protocol. Reversed, always 0
 // CAS is a varint64, for cas cmd
-// PIECESIZE is a varint64, for very big value. Reversed, always 0
-// TOTALSIZE is varint64. Now it is always == UserValue.size().
-// UserValue is string.
+// PIECESIZE is a varint64, for very big value. It is 0 except for a big
+//   RT_KV stored in pieces, see PiecedKV.
+// TOTALSIZE is varint64. It is 0 except for a big RT_KV stored in
+//   pieces, where it is the whole size of the value.
+// UserValue is string. It is empty for a big RT_KV stored in pieces, the
+//   value is stored in RT_KV_PIECE subkeys, the SK is the piece index.
 // ********************************************************************
 
 class RecordKey {
@@ -237,6 +241,9 @@ class RecordValue {
   uint64_t getTotalSize() const {
     return _totalSize;
   }
+  void setTotalSize(uint64_t size) {
+    _totalSize = size;
+  }
   std::string encode() const;
   static Expected<RecordValue> decode(const std::string& value);
   static Expected<size_t> decodeHdrSize(const std::string& value);
@@ -245,6 +252,7 @@ class RecordValue {
                                  RecordType type = RecordType::RT_INVALID);
   static uint64_t decodeTtl(const char* value, size_t size);
   static RecordType decodeType(const char* value, size_t size);
+  static uint64_t decodePieceSize(const char* value, size_t size);
   static size_t minSize();
   bool operator==(const RecordValue& other) const;
 
@@ -262,14 +270,13 @@ class RecordValue {
   uint64_t _versionEP;
   // cas
   int64_t _cas;
-  // For very big values, it may split into multi pieces;  reversed
-  uint64_t _pieceSize;
-  // if (_pieceSize > _totalSize)
-  //      _valus.size() == _totalSize
+  // For very big RT_KV values, it may split into multi pieces.
+  // if (_pieceSize == -1)
+  //      _value is the whole value
   // else
-  //      _totalSize > _values.size()
-  // TODO(vinchen) it would be useful for append and bitmap
-  // the whole value size, maybe > _value.size()
+  //      _value is empty, the value is stored in RT_KV_PIECE subkeys
+  uint64_t _pieceSize;
+  // the whole value size of a pieced RT_KV, -1 for others
   uint64_t _totalSize;
   std::string _value;
 };
@@ -308,6 +315,7 @@ enum class ReplOp : std::uint8_t {
   REPL_OP_STMT = 3,  // statement
   REPL_OP_SPEC = 4,  // special
   REPL_OP_DEL_RANGE = 5,
+  REPL_OP_MERGE = 6,  // the value is a merge operand, see mergeKV()
 };
 
 class ReplLogKeyV2 {
@@ -528,9 +536,16 @@ class Binlog {
   static size_t writeRepllogRaw(std::stringstream& s,
                                 const ReplLogRawV2& repllog);
   static size_t decodeHeader(const char* str, size_t size);
+  // a compressed batch is VERSION_LZ4, the varint size of the batch, and
+  // the lz4 block of the whole batch (header included)
+  static bool isCompressed(const std::string& batch);
+  static std::string compress(const std::string& batch);
+  // the batch not compressed is returned as it is
+  static Expected<std::string> uncompress(const std::string& batch);
 
   static constexpr size_t HEADERSIZE = 1;
   static constexpr uint8_t VERSION = 2;
+  static constexpr uint8_t VERSION_LZ4 = 3;
   static constexpr uint8_t INVALID_VERSION = (uint8_t)-1;
 
  private:
@@ -720,6 +735,12 @@ enum class IndexType : std::uint8_t {
 uint8_t it2Char(IndexType t);
 IndexType char2It(uint8_t t);
 
+// The ttl indexes are grouped by time buckets of BUCKET_MS, and by slot
+// in a bucket: LAYOUT_BUCKET + bucket + slot + dbid + type + key, where
+// bucket is ttl / BUCKET_MS. So a ttl refreshed in the same bucket keeps
+// its index record, and the expirer reads the due buckets in order.
+// The indexes written before are ttl + dbid + type + key, they are still
+// read and deleted, but never written (see isLegacy()).
 class TTLIndex {
  public:
   TTLIndex() = default;
@@ -744,6 +765,9 @@ class TTLIndex {
 
   std::string encode() const;
   static Expected<TTLIndex> decode(const RecordKey& rk);
+  // the first key of the bucketed layout, the legacy indexes are before
+  // it and start from RecordKey::prefixTTLIndex()
+  static const std::string& prefixBucket();
 
   std::string getPriKey() const {
     return _priKey;
@@ -754,19 +778,29 @@ class TTLIndex {
   std::uint32_t getDbId() const {
     return _dbId;
   }
+  // for a decoded bucketed index, it is the last ms of the bucket
   std::uint64_t getTTL() const {
     return _ttl;
   }
+  bool isLegacy() const {
+    return _legacy;
+  }
 
  private:
   std::string _priKey;
   RecordType _type;
   uint32_t _dbId;
   uint64_t _ttl;
+  // the index is in the layout before buckets
+  bool _legacy = false;
 
  public:
   static constexpr uint32_t CHUNKID = TTLINDEX_DBID;
   static constexpr uint32_t DBID = TTLINDEX_CHUNKID;
+  static constexpr uint64_t BUCKET_MS = 1000;
+  // the first byte of a legacy index is the highest byte of the ttl,
+  // which is always 0
+  static constexpr uint8_t LAYOUT_BUCKET = 1;
 };
 
 class VersionMeta {
@@ -820,16 +854,38 @@ class VersionMeta {
   std::string _name;
   static constexpr uint32_t DBID = VERSIONMETA_DBID;
   static constexpr uint32_t CHUNKID = VERSIONMETA_CHUNKID;
+  // the version is the first binlog id a slave must have applied for an
+  // incr-sync, the slaves before it need a full sync
+  static constexpr const char* FULLSYNC_BARRIER = "fullsync_barrier";
 };
 
 namespace rcd_util {
 Expected<uint64_t> getSubKeyCount(const RecordKey& key, const RecordValue& val);
+// whether val is a big RT_KV stored in RT_KV_PIECE subkeys
+bool isPiecedKV(const RecordValue& val);
+// whether the key of val needs a ttl index when it has a ttl. Plain RT_KV
+// is deleted by the compaction filter directly.
+bool needTTLIndex(const RecordValue& val);
 
 std::string makeInvalidErrStr(RecordType type,
                               const std::string& key,
                               uint64_t metaCnt,
                               uint64_t eleCnt);
 
+// the merge operands of plain RT_KV and RT_HASH_ELE values, they are
+// written by mergeKV() and applied to the user value only, the type, the
+// ttl and the versions of the record are kept.
+std::string makeIncrOperand(int64_t incr);
+std::string makeAppendOperand(const std::string& data);
+// return false if the operand can not be applied, such as an increment
+// of a value which is not an integer, or an overflow.
+bool applyOperand(const std::string& operand, std::string* value);
+// combine left and the later right into *result, return false if they
+// are of different kinds.
+bool combineOperands(const std::string& left,
+                     const std::string& right,
+                     std::string* result);
+
 }  // namespace rcd_util
 }  // namespace tendisplus
 
@@ -3,6 +3,7 @@
 // project for additional information.
 
 #include <time.h>
+#include <climits>
 #include <cstdlib>
 #include <string>
 #include <vector>
@@ -26,7 +27,7 @@ int genRand() {
 }
 
 RecordType randomType() {
-  switch ((genRand() % 13)) {
+  switch ((genRand() % 14)) {
     case 0:
       return RecordType::RT_META;
     case 1:
@@ -53,6 +54,8 @@ RecordType randomType() {
       return RecordType::RT_TTL_INDEX;
     case 12:
       return RecordType::RT_BINLOG;
+    case 13:
+      return RecordType::RT_KV_PIECE;
     default:
       return RecordType::RT_INVALID;
   }
@@ -196,6 +199,76 @@ TEST(Record, Common) {
   }
 }
 
+TEST(Record, PiecedKV) {
+  auto rk = RecordKey(0, 0, RecordType::RT_DATA_META, "pk", "");
+  auto rv = RecordValue("", RecordType::RT_KV, 10, 100, 5, 0, 1024);
+  rv.setTotalSize(1024 * 3 + 1);
+  EXPECT_TRUE(rcd_util::isPiecedKV(rv));
+  EXPECT_TRUE(rcd_util::needTTLIndex(rv));
+  EXPECT_EQ(rcd_util::getSubKeyCount(rk, rv).value(), 4U);
+
+  auto encoded = rv.encode();
+  EXPECT_TRUE(RecordValue::validate(encoded).ok());
+  EXPECT_EQ(RecordValue::decodePieceSize(encoded.c_str(), encoded.size()),
+            1024U);
+  auto erv = RecordValue::decode(encoded);
+  EXPECT_TRUE(erv.ok());
+  EXPECT_EQ(erv.value(), rv);
+  EXPECT_EQ(erv.value().getTotalSize(), 1024 * 3 + 1);
+
+  // a pieced value can't carry the user value in the meta
+  auto bad = RecordValue("", RecordType::RT_KV, 10, 100, 5, 0, 1024).encode();
+  bad.push_back('a');
+  EXPECT_FALSE(RecordValue::validate(bad).ok());
+
+  auto plain = RecordValue("abc", RecordType::RT_KV, 10);
+  encoded = plain.encode();
+  EXPECT_FALSE(rcd_util::isPiecedKV(plain));
+  EXPECT_FALSE(rcd_util::needTTLIndex(plain));
+  EXPECT_EQ(RecordValue::decodePieceSize(encoded.c_str(), encoded.size()),
+            (uint64_t)-1);
+
+  auto pk = RecordKey(0, 0, RecordType::RT_KV_PIECE, "pk", "3");
+  auto epk = RecordKey::decode(pk.encode());
+  EXPECT_TRUE(epk.ok());
+  EXPECT_EQ(epk.value().getRecordType(), RecordType::RT_KV_PIECE);
+  EXPECT_EQ(epk.value().getSecondaryKey(), "3");
+}
+
+TEST(Record, MergeOperand) {
+  std::string value = "10";
+  EXPECT_TRUE(rcd_util::applyOperand(rcd_util::makeIncrOperand(-15), &value));
+  EXPECT_EQ(value, "-5");
+  EXPECT_TRUE(rcd_util::applyOperand(rcd_util::makeAppendOperand("ab"),
+                                     &value));
+  EXPECT_EQ(value, "-5ab");
+  EXPECT_FALSE(rcd_util::applyOperand(rcd_util::makeIncrOperand(1), &value));
+  EXPECT_EQ(value, "-5ab");
+
+  value = std::to_string(LLONG_MAX);
+  EXPECT_FALSE(rcd_util::applyOperand(rcd_util::makeIncrOperand(1), &value));
+  EXPECT_FALSE(rcd_util::applyOperand("", &value));
+
+  std::string result;
+  EXPECT_TRUE(rcd_util::combineOperands(
+    rcd_util::makeIncrOperand(3), rcd_util::makeIncrOperand(-5), &result));
+  EXPECT_EQ(result, rcd_util::makeIncrOperand(-2));
+  EXPECT_TRUE(rcd_util::combineOperands(rcd_util::makeAppendOperand("a"),
+                                        rcd_util::makeAppendOperand("b"),
+                                        &result));
+  EXPECT_EQ(result, rcd_util::makeAppendOperand("ab"));
+  EXPECT_FALSE(rcd_util::combineOperands(
+    rcd_util::makeIncrOperand(3), rcd_util::makeAppendOperand("a"), &result));
+  EXPECT_FALSE(rcd_util::combineOperands(rcd_util::makeIncrOperand(LLONG_MAX),
+                                         rcd_util::makeIncrOperand(1),
+                                         &result));
+
+  // an increment overflowing is not applied
+  value = std::to_string(LLONG_MAX - 1);
+  EXPECT_FALSE(rcd_util::applyOperand(rcd_util::makeIncrOperand(2), &value));
+  EXPECT_EQ(value, std::to_string(LLONG_MAX - 1));
+}
+
 TEST(ReplRecordV2, Prefix) {
   uint64_t binlogid =
     (uint64_t)genRand() + std::numeric_limits<uint32_t>::max();
@@ -329,6 +402,48 @@ TEST(ReplRecordV2, Common) {
   }
 }
 
+TEST(ReplRecordV2, Compress) {
+  BinlogWriter writer(1024 * 1024, 100);
+  std::vector<std::string> values;
+  for (uint64_t id = 1; id <= 100; id++) {
+    std::vector<ReplLogValueEntryV2> vec;
+    vec.emplace_back(ReplOp::REPL_OP_SET,
+                     msSinceEpoch(),
+                     "key_" + std::to_string(id),
+                     std::string(genRand() % 256, 'v'));
+    auto flag = ReplFlag::REPL_GROUP_MID;
+    auto rv =
+      ReplLogValueV2(id, flag, id, msSinceEpoch(), 0, "set", nullptr, 0);
+    values.emplace_back(rv.encode(vec));
+    writer.writeRepllogRaw(
+      ReplLogRawV2(ReplLogKeyV2(id).encode(), values.back()));
+  }
+  std::string raw = writer.getBinlogStr();
+  EXPECT_FALSE(Binlog::isCompressed(raw));
+  auto same = Binlog::uncompress(raw);
+  EXPECT_TRUE(same.ok());
+  EXPECT_EQ(same.value(), raw);
+
+  std::string lz4 = Binlog::compress(raw);
+  EXPECT_TRUE(Binlog::isCompressed(lz4));
+  EXPECT_LT(lz4.size(), raw.size());
+  auto eRaw = Binlog::uncompress(lz4);
+  EXPECT_TRUE(eRaw.ok()) << eRaw.status().toString();
+  EXPECT_EQ(eRaw.value(), raw);
+
+  BinlogReader reader(eRaw.value());
+  for (uint64_t id = 1; id <= 100; id++) {
+    auto eLog = reader.next();
+    EXPECT_TRUE(eLog.ok());
+    EXPECT_EQ(eLog.value().getBinlogId(), id);
+    EXPECT_EQ(eLog.value().getReplLogValue(), values[id - 1]);
+  }
+  EXPECT_EQ(reader.next().status().code(), ErrorCodes::ERR_EXHAUST);
+
+  // a broken batch fails, not overflows
+  EXPECT_FALSE(Binlog::uncompress(lz4.substr(0, lz4.size() / 2)).ok());
+}
+
 TEST(TTLIndex, Prefix) {
   auto rlk = TTLIndex("abc", RecordType::RT_KV, 0, 10);
   RecordKey rk(TTLIndex::CHUNKID,
@@ -359,6 +474,53 @@ TEST(TTLIndex, Prefix) {
   EXPECT_EQ(prefix[8], '\x00');
 }
 
+TEST(TTLIndex, Bucket) {
+  TTLIndex idx1("abc", RecordType::RT_HASH_META, 3, 10 * 1000 + 1);
+  TTLIndex idx2("abc", RecordType::RT_HASH_META, 3, 10 * 1000 + 999);
+  TTLIndex idx3("abc", RecordType::RT_HASH_META, 3, 11 * 1000);
+  // the same bucket, the same index
+  EXPECT_EQ(idx1.encode(), idx2.encode());
+  EXPECT_NE(idx1.encode(), idx3.encode());
+  EXPECT_LT(idx1.encode(), idx3.encode());
+  EXPECT_EQ(idx1.encode().compare(0,
+                                  TTLIndex::prefixBucket().size(),
+                                  TTLIndex::prefixBucket()),
+            0);
+
+  auto rk = RecordKey::decode(idx2.encode());
+  EXPECT_TRUE(rk.ok());
+  auto decoded = TTLIndex::decode(rk.value());
+  EXPECT_TRUE(decoded.ok());
+  EXPECT_FALSE(decoded.value().isLegacy());
+  EXPECT_EQ(decoded.value().getPriKey(), "abc");
+  EXPECT_EQ(decoded.value().getType(), RecordType::RT_HASH_META);
+  EXPECT_EQ(decoded.value().getDbId(), 3U);
+  EXPECT_EQ(decoded.value().getTTL(), 10 * 1000 + 999U);
+  EXPECT_EQ(decoded.value().encode(), idx1.encode());
+
+  // the legacy layout: ttl + dbid + type + key
+  std::string legacy(sizeof(uint64_t), 0);
+  legacy[6] = 0x27;
+  legacy[7] = 0x11;
+  legacy.append(std::string("\x00\x00\x00\x03", 4));
+  legacy.push_back(rt2Char(RecordType::RT_HASH_META));
+  legacy.append("abc");
+  RecordKey legacyRk(TTLIndex::CHUNKID,
+                     TTLIndex::DBID,
+                     RecordType::RT_TTL_INDEX,
+                     legacy,
+                     "");
+  decoded = TTLIndex::decode(legacyRk);
+  EXPECT_TRUE(decoded.ok());
+  EXPECT_TRUE(decoded.value().isLegacy());
+  EXPECT_EQ(decoded.value().getTTL(), 10 * 1000 + 1U);
+  EXPECT_EQ(decoded.value().getDbId(), 3U);
+  EXPECT_EQ(decoded.value().getPriKey(), "abc");
+  EXPECT_EQ(decoded.value().encode(), legacyRk.encode());
+  // the legacy indexes are before the bucketed ones
+  EXPECT_LT(legacyRk.encode(), TTLIndex::prefixBucket());
+}
+
 TEST(ZSl, Common) {
   srand(time(NULL));
 #ifdef _WIN32
@@ -8,6 +8,7 @@
 #include <vector>
 #include <limits>
 #include "glog/logging.h"
+#include "lz4.h"
 #include "tendisplus/storage/varint.h"
 #include "tendisplus/storage/record.h"
 #include "tendisplus/utils/status.h"
@@ -532,6 +533,52 @@ size_t Binlog::decodeHeader(const char* str, size_t size) {
   return Binlog::HEADERSIZE;
 }
 
+bool Binlog::isCompressed(const std::string& batch) {
+  return batch.size() > 0 && batch[0] == Binlog::VERSION_LZ4;
+}
+
+std::string Binlog::compress(const std::string& batch) {
+  INVARIANT_D(batch.size() <= LZ4_MAX_INPUT_SIZE);
+  std::string out;
+  out.push_back(Binlog::VERSION_LZ4);
+  out.append(varintEncodeStr(batch.size()));
+  size_t hdr = out.size();
+  out.resize(hdr + LZ4_compressBound(batch.size()));
+  int n = LZ4_compress_default(batch.data(),
+                               &out[hdr],
+                               static_cast<int>(batch.size()),
+                               static_cast<int>(out.size() - hdr));
+  INVARIANT(n > 0);
+  out.resize(hdr + n);
+  return out;
+}
+
+Expected<std::string> Binlog::uncompress(const std::string& batch) {
+  if (!isCompressed(batch)) {
+    return batch;
+  }
+  auto eSize = varintDecodeFwd(
+    reinterpret_cast<const uint8_t*>(batch.data()) + 1, batch.size() - 1);
+  if (!eSize.ok()) {
+    return eSize.status();
+  }
+  size_t rawSize = eSize.value().first;
+  size_t hdr = 1 + eSize.value().second;
+  if (rawSize > LZ4_MAX_INPUT_SIZE) {
+    return {ErrorCodes::ERR_DECODE, "invalid lz4 binlog size"};
+  }
+  std::string out;
+  out.resize(rawSize);
+  int n = LZ4_decompress_safe(batch.data() + hdr,
+                              &out[0],
+                              static_cast<int>(batch.size() - hdr),
+                              static_cast<int>(rawSize));
+  if (n < 0 || static_cast<size_t>(n) != rawSize) {
+    return {ErrorCodes::ERR_DECODE, "invalid lz4 binlog"};
+  }
+  return out;
+}
+
 size_t Binlog::writeRepllogRaw(std::stringstream& ss,
                                const ReplLogRawV2& repllog) {
   size_t size = 0;
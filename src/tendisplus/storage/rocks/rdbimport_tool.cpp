@@ -0,0 +1,106 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rocksdb/cache.h"
+#include "tendisplus/server/server_params.h"
+#include "tendisplus/storage/record.h"
+#include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/storage/rocks/rocks_rdbimporter.h"
+#include "tendisplus/utils/param_manager.h"
+#include "tendisplus/utils/string.h"
+#include "tendisplus/utils/time.h"
+
+namespace tendisplus {
+
+// import the rdb files into the stores of a stopped tendisplus
+Status importRdb(const ParamManager& pm) {
+  auto cfg = std::make_shared<ServerParams>();
+  auto s = cfg->parseFile(pm.getString("conf"));
+  if (!s.ok()) {
+    return s;
+  }
+
+  RdbImportOptions opts;
+  opts.files = stringSplit(pm.getString("files"), ",");
+  if (opts.files.empty()) {
+    return {ErrorCodes::ERR_PARSEOPT, "no rdb file"};
+  }
+  opts.genBinlog = pm.getString("mode", "fullsync") == "binlog";
+  opts.dbNum = cfg->dbNum;
+  opts.tmpDir = pm.getString("tmpdir", cfg->dumpPath + "/rdbimport");
+  opts.threads = pm.getUint64("threads", cfg->rdbImportThreads);
+  opts.bufferBytes = pm.getUint64("buffer-mb", cfg->rdbImportBufferMB) << 20;
+  uint64_t start = pm.getUint64("slot-start", 0);
+  uint64_t end = pm.getUint64("slot-end", CLUSTER_SLOTS - 1);
+  if (start > end || end >= CLUSTER_SLOTS) {
+    return {ErrorCodes::ERR_PARSEOPT, "invalid slots range"};
+  }
+  opts.slots.reset();
+  for (auto i = start; i <= end; ++i) {
+    opts.slots.set(i);
+  }
+
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 6);
+  std::vector<PStore> stores;
+  for (uint32_t i = 0; i < cfg->kvStoreCount; ++i) {
+    stores.emplace_back(
+      std::make_shared<RocksKVStore>(std::to_string(i), cfg, blockCache));
+  }
+
+  RdbSstImporter importer(stores, opts);
+  s = importer.build();
+  if (!s.ok()) {
+    return s;
+  }
+  for (uint32_t i = 0; i < stores.size(); ++i) {
+    s = importer.ingest(i);
+    if (!s.ok()) {
+      return s;
+    }
+    if (opts.genBinlog) {
+      continue;
+    }
+    // the barrier is loaded by ReplManager after restart, the slaves
+    // before it are refused by INCRSYNC and turn to full sync.
+    s = stores[i]->setVersionMeta(VersionMeta::FULLSYNC_BARRIER,
+                                  msSinceEpoch(),
+                                  stores[i]->getNextBinlogSeq());
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  std::cout << importer.getStatInfo() << std::endl;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+}  // namespace tendisplus
+
+void usage() {
+  std::cerr << "rdbimport_tool --conf=tendisplus.conf --files=a.rdb,b.rdb"
+            << " --mode=fullsync|binlog --slot-start=0 --slot-end=16383"
+            << " --tmpdir=./dump/rdbimport --threads=4 --buffer-mb=64"
+            << std::endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    usage();
+    return 0;
+  }
+  tendisplus::ParamManager pm;
+  pm.init(argc, argv);
+
+  auto s = tendisplus::importRdb(pm);
+  if (s.ok()) {
+    return 0;
+  }
+  std::cerr << s.toString() << std::endl;
+  return 1;
+}
@@ -0,0 +1,74 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <string>
+#include "glog/logging.h"
+#include "tendisplus/storage/rocks/rocks_kvmergeoperator.h"
+#include "tendisplus/storage/record.h"
+
+namespace tendisplus {
+
+bool KVMergeOperator::FullMergeV2(const MergeOperationInput& merge_in,
+                                  MergeOperationOutput* merge_out) const {
+  RecordType keyType =
+    RecordKey::decodeType(merge_in.key.data(), merge_in.key.size());
+  RecordType type = keyType == RecordType::RT_DATA_META
+    ? RecordType::RT_KV
+    : keyType;
+  std::string value;
+  uint64_t versionEP = -1;
+  // an expired RT_KV, it is deleted by the next read or compaction
+  uint64_t ttl = type == RecordType::RT_KV ? 1 : 0;
+  int64_t cas = -1;
+  uint64_t version = 0;
+  uint64_t pieceSize = -1;
+  if (merge_in.existing_value != nullptr) {
+    auto erv = RecordValue::decode(merge_in.existing_value->ToString());
+    if (!erv.ok()) {
+      LOG(ERROR) << "merge to a bad value:" << erv.status().toString();
+      return false;
+    }
+    const auto& rv = erv.value();
+    if (rcd_util::isPiecedKV(rv)) {
+      // never merged, see GetSetGeneral::runMerge()
+      LOG(ERROR) << "merge to a pieced value";
+      return false;
+    }
+    value = rv.getValue();
+    type = rv.getRecordType();
+    versionEP = rv.getVersionEP();
+    ttl = rv.getTtl();
+    cas = rv.getCas();
+    version = rv.getVersion();
+    pieceSize = rv.getPieceSize();
+  }
+
+  // NOTE(tendis): the operands are checked by the writers with the key
+  // locked, see GetSetGeneral::runMerge(). One can't be applied only if
+  // the value is broken, the merge fails then and the read or the
+  // compaction of the key returns the error, the operand is never
+  // dropped silently.
+  for (const auto& operand : merge_in.operand_list) {
+    if (!rcd_util::applyOperand(operand.ToString(), &value)) {
+      LOG(ERROR) << "merge operand can't be applied:"
+                 << operand.ToString(true);
+      return false;
+    }
+  }
+  merge_out->new_value =
+    RecordValue(std::move(value), type, versionEP, ttl, cas, version, pieceSize)
+      .encode();
+  return true;
+}
+
+bool KVMergeOperator::PartialMerge(const Slice& key,
+                                   const Slice& left_operand,
+                                   const Slice& right_operand,
+                                   std::string* new_value,
+                                   Logger* logger) const {
+  return rcd_util::combineOperands(
+    left_operand.ToString(), right_operand.ToString(), new_value);
+}
+
+}  // namespace tendisplus
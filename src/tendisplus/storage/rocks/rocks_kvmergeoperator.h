@@ -0,0 +1,42 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_KVMERGEOPERATOR_H_
+#define SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_KVMERGEOPERATOR_H_
+
+#include <string>
+#include "rocksdb/merge_operator.h"
+
+namespace tendisplus {
+using rocksdb::Logger;
+using rocksdb::MergeOperator;
+using rocksdb::Slice;
+
+// KVMergeOperator applies the operands of rcd_util::makeIncrOperand() and
+// rcd_util::makeAppendOperand() to an encoded RecordValue. The type, the
+// ttl and the versions of the record are kept.
+// An operand which can't be applied is dropped instead of failing the
+// reads, the writers have checked it on their snapshot already.
+// If the value is missing, it has been dropped by the compaction filter
+// after expiring, then a RT_KV is merged into an expired one, and the
+// subkey is dropped later as an orphan.
+class KVMergeOperator : public MergeOperator {
+ public:
+  const char* Name() const override {
+    return "KVMergeOperator";
+  }
+
+  bool FullMergeV2(const MergeOperationInput& merge_in,
+                   MergeOperationOutput* merge_out) const override;
+
+  bool PartialMerge(const Slice& key,
+                    const Slice& left_operand,
+                    const Slice& right_operand,
+                    std::string* new_value,
+                    Logger* logger) const override;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_KVMERGEOPERATOR_H_
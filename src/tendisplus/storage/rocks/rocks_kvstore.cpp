@@ -11,6 +11,9 @@
 #include <list>
 #include <limits>
 #include <algorithm>
+#include <cstdlib>
+#include <chrono>  // NOLINT
+#include <thread>  // NOLINT
 
 #include "glog/logging.h"
 #include "rapidjson/prettywriter.h"
@@ -30,6 +33,8 @@
 #include "rocksdb/perf_context.h"
 
 #include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/storage/binlog_archive.h"
+#include "tendisplus/storage/rocks/rocks_kvmergeoperator.h"
 #include "tendisplus/storage/rocks/rocks_kvttlcompactfilter.h"
 #include "tendisplus/utils/sync_point.h"
 #include "tendisplus/utils/scopeguard.h"
@@ -39,6 +44,7 @@
 #include "tendisplus/server/session.h"
 #include "tendisplus/server/server_entry.h"
 #include "tendisplus/storage/varint.h"
+#include "tendisplus/storage/skiplist.h"
 
 namespace tendisplus {
 
@@ -127,6 +133,8 @@ RocksTxn::RocksTxn(RocksKVStore* store,
     _txn(nullptr),
     _store(store),
     _done(false),
+    _bulkWrite(false),
+    _groupSync(false),
     _replOnly(replOnly),
     _logOb(ob),
     _session(sess) {}
@@ -292,13 +300,16 @@ Expected<uint64_t> RocksTxn::commit() {
 
     binlogTxnId = _txnId;
     // put binlog into binlog_column_family
-    auto s = _txn->Put(_store->getBinlogColumnFamilyHandle(),
-                       key.encode(),
-                       val.encode(_replLogValues));
+    std::string keyStr = key.encode();
+    std::string valStr = val.encode(_replLogValues);
+    auto s = _txn->Put(_store->getBinlogColumnFamilyHandle(), keyStr, valStr);
     if (!s.ok()) {
       binlogTxnId = Transaction::TXNID_UNINITED;
       return {ErrorCodes::ERR_INTERNAL, s.ToString()};
     }
+    // it overwrites the one by setBinlogKV() if any
+    _cacheBinlogs.clear();
+    addCacheBinlog(_binlogId, std::move(keyStr), std::move(valStr));
   }
   if (isReplOnly() && _binlogId != Transaction::TXNID_UNINITED) {
     // NOTE(vinchen): for slave, binlog form master store directly
@@ -309,6 +320,18 @@ Expected<uint64_t> RocksTxn::commit() {
   TEST_SYNC_POINT("RocksTxn::commit()::2");
   auto s = _txn->Commit();
   if (s.ok()) {
+    if (!_cacheBinlogs.empty()) {
+      // published when visible, see RocksKVStore::popCommittedBinlogsInLock
+      _store->getBinlogCache()->add(_binlogId, std::move(_cacheBinlogs));
+    }
+    if (_groupSync) {
+      // NOTE(tendis): markCommitted() in guard is after the sync, so the
+      // binlog is not sent to the slaves before it is durable.
+      auto ss = _store->groupSyncWAL();
+      if (!ss.ok()) {
+        return ss;
+      }
+    }
     return _txnId;
   } else {
     binlogTxnId = Transaction::TXNID_UNINITED;
@@ -344,6 +367,31 @@ uint64_t RocksTxn::getTxnId() const {
   return _txnId;
 }
 
+void RocksTxn::setSavePoint() {
+  INVARIANT_D(!_done && _txn != nullptr);
+  _txn->SetSavePoint();
+  _savePoints.emplace_back(_replLogValues.size(), _chunkId);
+}
+
+Status RocksTxn::rollbackToSavePoint() {
+  INVARIANT_D(!_done && _txn != nullptr);
+  if (_savePoints.empty()) {
+    return {ErrorCodes::ERR_INTERNAL, "no savepoint"};
+  }
+  auto s = _txn->RollbackToSavePoint();
+  if (!s.ok()) {
+    return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+  }
+  const auto& point = _savePoints.back();
+  _replLogValues.erase(_replLogValues.begin() + point.first,
+                       _replLogValues.end());
+  // the binlog cache restarts from the binlogs of the txn
+  _cacheBinlogs.clear();
+  _chunkId = point.second;
+  _savePoints.pop_back();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
 std::string RocksTxn::getKVStoreId() const {
   return _store->dbId();
 }
@@ -389,7 +437,9 @@ Status RocksTxn::setKV(const std::string& key,
 
   RESET_PERFCONTEXT();
   // put data into default column family
-  auto s = _txn->Put(key, val);
+  // NOTE(tendis): in bulk write mode, the keys are locked by the server
+  // layer already, the untracked writes save the lock tracking of rocksdb
+  auto s = _bulkWrite ? _txn->PutUntracked(key, val) : _txn->Put(key, val);
   if (!s.ok()) {
     return {ErrorCodes::ERR_INTERNAL, s.ToString()};
   }
@@ -425,6 +475,8 @@ Status RocksTxn::delKV(const std::string& key, const uint64_t ts) {
   rocksdb::Status s;
   if (RecordKey::decodeType(key) == RecordType::RT_BINLOG) {
     s = _txn->Delete(_store->getBinlogColumnFamilyHandle(), key);
+  } else if (_bulkWrite) {
+    s = _txn->DeleteUntracked(key);
   } else {
     s = _txn->Delete(key);
   }
@@ -455,6 +507,33 @@ Status RocksTxn::delKV(const std::string& key, const uint64_t ts) {
   return {ErrorCodes::ERR_OK, ""};
 }
 
+Status RocksTxn::mergeKV(const std::string& key,
+                         const std::string& operand,
+                         const uint64_t ts) {
+  if (_replOnly) {
+    return {ErrorCodes::ERR_INTERNAL, "txn is replOnly"};
+  }
+
+  RESET_PERFCONTEXT();
+  // NOTE(tendis): the writers of the operands hold the key lock in
+  // LOCK_X, the operands of a key are applied in the order of the
+  // commits, so they are not tracked.
+  auto s = _txn->MergeUntracked(key, operand);
+  if (!s.ok()) {
+    return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+  }
+
+  if (_store->enableRepllog()) {
+    INVARIANT_D(_store->dbId() != CATALOG_NAME);
+    setChunkId(RecordKey::decodeChunkId(key));
+    // the slaves apply the operand, not the merged value
+    ReplLogValueEntryV2 logVal(
+      ReplOp::REPL_OP_MERGE, ts ? ts : msSinceEpoch(), key, operand);
+    _replLogValues.emplace_back(std::move(logVal));
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
 Status RocksTxn::addDeleteRangeBinlog(const std::string& begin,
                                       const std::string& end) {
   if (_replOnly) {
@@ -520,6 +599,25 @@ Status RocksTxn::migrate(const std::string& logKey, const std::string& logVal) {
   return {ErrorCodes::ERR_OK, ""};
 }
 
+void RocksTxn::invalidateSkipListCache(const std::string& key) {
+  auto& shared = SkipListCache::getInstance();
+  if (shared.empty()) {
+    return;
+  }
+  auto type = RecordKey::decodeType(key);
+  if (type != RecordType::RT_DATA_META && type != RecordType::RT_ZSET_S_ELE) {
+    return;
+  }
+  auto rk = RecordKey::decode(key);
+  if (!rk.ok()) {
+    return;
+  }
+  shared.invalidate(SkipListCache::makeKey(_store->dbId(),
+                                           rk.value().getChunkId(),
+                                           rk.value().getDbId(),
+                                           rk.value().getPrimaryKey()));
+}
+
 Status RocksTxn::applyBinlog(const ReplLogValueEntryV2& logEntry) {
   if (!_replOnly) {
     return {ErrorCodes::ERR_INTERNAL, "txn is not replOnly or migrationOnly"};
@@ -532,6 +630,7 @@ Status RocksTxn::applyBinlog(const ReplLogValueEntryV2& logEntry) {
       if (!s.ok()) {
         return {ErrorCodes::ERR_INTERNAL, s.ToString()};
       }
+      invalidateSkipListCache(logEntry.getOpKey());
       break;
     }
     case ReplOp::REPL_OP_DEL: {
@@ -539,6 +638,7 @@ Status RocksTxn::applyBinlog(const ReplLogValueEntryV2& logEntry) {
       if (!s.ok()) {
         return {ErrorCodes::ERR_INTERNAL, s.ToString()};
       }
+      invalidateSkipListCache(logEntry.getOpKey());
       break;
     }
     case ReplOp::REPL_OP_STMT: {
@@ -557,6 +657,13 @@ Status RocksTxn::applyBinlog(const ReplLogValueEntryV2& logEntry) {
       }
       break;
     }
+    case ReplOp::REPL_OP_MERGE: {
+      auto s = _txn->Merge(logEntry.getOpKey(), logEntry.getOpValue());
+      if (!s.ok()) {
+        return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+      }
+      break;
+    }
     default:
       INVARIANT_D(0);
       return {ErrorCodes::ERR_DECODE, "not a valid binlog"};
@@ -583,6 +690,7 @@ Status RocksTxn::setBinlogKV(uint64_t binlogId,
   if (!s.ok()) {
     return {ErrorCodes::ERR_INTERNAL, s.ToString()};
   }
+  addCacheBinlog(binlogId, logKey, logValue);
 
   return {ErrorCodes::ERR_OK, ""};
 }
@@ -604,14 +712,24 @@ Status RocksTxn::setBinlogKV(const std::string& key, const std::string& value) {
   // TODO(takenliu) when migrating, binlog and set key value, how to set
   // VersionEP ???
 
-  auto s = _txn->Put(
-    _store->getBinlogColumnFamilyHandle(), logkey.value().encode(), value);
+  std::string keyStr = logkey.value().encode();
+  auto s = _txn->Put(_store->getBinlogColumnFamilyHandle(), keyStr, value);
   if (!s.ok()) {
     return {ErrorCodes::ERR_INTERNAL, s.ToString()};
   }
+  addCacheBinlog(_binlogId, std::move(keyStr), value);
   return {ErrorCodes::ERR_OK, ""};
 }
 
+void RocksTxn::addCacheBinlog(uint64_t binlogId,
+                              std::string key,
+                              std::string value) {
+  if (_store->getCfg()->binlogCacheMB == 0) {
+    return;
+  }
+  _cacheBinlogs.push_back({binlogId, std::move(key), std::move(value)});
+}
+
 Status RocksTxn::delBinlog(const ReplLogRawV2& log) {
   RESET_PERFCONTEXT();
   auto s =
@@ -628,7 +746,7 @@ uint64_t RocksTxn::getBinlogId() const {
 }
 
 void RocksTxn::setBinlogId(uint64_t binlogId) {
-  INVARIANT_D(_binlogId == Transaction::TXNID_UNINITED);
+  INVARIANT_D(_binlogId == Transaction::TXNID_UNINITED || _replOnly);
   _binlogId = binlogId;
 }
 
@@ -675,7 +793,8 @@ void RocksOptTxn::ensureTxn() {
   }
   rocksdb::WriteOptions writeOpts;
   writeOpts.disableWAL = _store->getCfg()->rocksDisableWAL;
-  writeOpts.sync = _store->getCfg()->rocksFlushLogAtTrxCommit;
+  _groupSync = _store->groupCommitEnabled();
+  writeOpts.sync = _store->getCfg()->rocksFlushLogAtTrxCommit && !_groupSync;
 
   rocksdb::OptimisticTransactionOptions txnOpts;
 
@@ -727,7 +846,8 @@ void RocksPesTxn::ensureTxn() {
   }
   rocksdb::WriteOptions writeOpts;
   writeOpts.disableWAL = _store->getCfg()->rocksDisableWAL;
-  writeOpts.sync = _store->getCfg()->rocksFlushLogAtTrxCommit;
+  _groupSync = _store->groupCommitEnabled();
+  writeOpts.sync = _store->getCfg()->rocksFlushLogAtTrxCommit && !_groupSync;
 
   rocksdb::TransactionOptions txnOpts;
 
@@ -1101,6 +1221,10 @@ rocksdb::Options RocksKVStore::options() {
       new KVTtlCompactionFilterFactory(this));
   }
 
+  // NOTE(tendis): always set, the operands written in the merge write
+  // mode, or received from the master, must be readable after it is off.
+  options.merge_operator = std::make_shared<KVMergeOperator>();
+
   // background listener
   auto listener = std::make_shared<BackgroundErrorListener>(_env);
   options.listeners.push_back(listener);
@@ -1181,6 +1305,10 @@ Status RocksKVStore::stop() {
             "it's upperlayer's duty to guarantee no pinning txns alive"};
   }
   _isRunning = false;
+  _binlogCache.clear();
+  // the holes are found by BinlogApplier::recoverPos() after restarted
+  _replHoles.clear();
+  _highestCommitted = 0;
 
   for (auto* h : _cfHandles) {
     delete h;
@@ -1223,6 +1351,13 @@ Status RocksKVStore::setMode(StoreMode mode) {
       // in REPLICATE_ONLY mode, the binlog is same as the sync-source's
       // when changing from REPLICATE_ONLY to READ_WRITE mode, we shrink
       // _nextTxnSeq so that binlog's wont' be duplicated.
+      // the holes of the old master are never filled
+      if (!_replHoles.empty()) {
+        LOG(WARNING) << "store:" << dbId() << " binlogs missing from:"
+                     << *_replHoles.begin();
+        _replHoles.clear();
+        _highestVisible = std::max(_highestVisible, _highestCommitted);
+      }
       if (_nextTxnSeq <= _highestVisible) {
         _nextTxnSeq = _highestVisible + 1;
       }
@@ -1332,6 +1467,7 @@ Expected<TruncateBinlogResult> RocksKVStore::truncateBinlogV2(
   uint64_t save,
   Transaction* txn,
   std::ofstream* fs,
+  BinlogArchiveWriter* archive,
   int64_t maxWritelen,
   bool tailSlave) {
   // DLOG(INFO) << "truncateBinlogV2 dbid:" << dbId()
@@ -1350,6 +1486,8 @@ Expected<TruncateBinlogResult> RocksKVStore::truncateBinlogV2(
 #endif
   uint64_t nextStart;
   uint64_t nextSave;
+  // the binlogs in [start, rangeEnd) are deleted after they are archived
+  uint64_t rangeEnd = start;
   auto cursor = txn->createRepllogCursorV2(save);
   nextStart = start;
   nextSave = save;
@@ -1376,12 +1514,29 @@ Expected<TruncateBinlogResult> RocksKVStore::truncateBinlogV2(
     }
 
     size++;
-    if (fs) {
+    if (fs || archive) {
       if ((int64_t)written >= maxWritelen) {
         break;
       }
       // save binlog
-      int len = saveBinlogV2(fs, explog.value());
+      int64_t len = 0;
+      if (archive) {
+        // NOTE(tendis): the txn isn't committed if failed, and the
+        // archive is rolled back to the last block committed, so that the
+        // binlogs are archived again in the same file.
+        const auto& log = explog.value();
+        auto s = archive->append(explog.value().getBinlogId(),
+                                 ts,
+                                 log.getReplLogKey(),
+                                 log.getReplLogValue());
+        if (!s.ok()) {
+          return s;
+        }
+        len = log.getReplLogKey().size() + log.getReplLogValue().size() +
+          2 * sizeof(uint32_t);
+      } else {
+        len = saveBinlogV2(fs, explog.value());
+      }
       if (len < 0) {
         LOG(ERROR) << "saveBinlogV2 failed, break.";
         // NOTE(takenliu): maybe write part of explog, so the binlog file's last
@@ -1409,13 +1564,38 @@ Expected<TruncateBinlogResult> RocksKVStore::truncateBinlogV2(
       DLOG(INFO) << "truncateBinlogV2 dbid:" << dbId() << " delete:" << start
                  << " to " << explog.value().getBinlogId()
                  << " time:" << (cur_ts - ts) / 1000 << " sec ago.";
-      auto s = deleteRangeBinlog(start, nextSave);
+      if (archive) {
+        rangeEnd = nextSave;
+      } else {
+        auto s = deleteRangeBinlog(start, nextSave);
+        if (!s.ok()) {
+          LOG(ERROR) << "deleteRangeBinlog error:" << s.toString();
+          return s;
+        }
+      }
+      deleten += nextSave - nextStart;
+      nextStart = nextSave;
+    }
+  }
+
+  // NOTE(tendis): the binlogs archived should be on the disk before they
+  // are deleted, by the txn committed or by deleteRangeBinlog() which
+  // isn't in the txn. The archive is committed after the range deleted,
+  // or it can't be rolled back if the txn fails later.
+  if (archive) {
+    auto s = archive->flush();
+    if (!s.ok()) {
+      return s;
+    }
+    if (rangeEnd > start) {
+      TEST_SYNC_POINT_CALLBACK("RocksKVStore::truncateBinlogV2::deleteRange",
+                               &rangeEnd);
+      s = deleteRangeBinlog(start, rangeEnd);
       if (!s.ok()) {
         LOG(ERROR) << "deleteRangeBinlog error:" << s.toString();
         return s;
       }
-      deleten += nextSave - nextStart;
-      nextStart = nextSave;
+      archive->commit();
     }
   }
 
@@ -1592,6 +1772,8 @@ Expected<uint64_t> RocksKVStore::restart(bool restore,
               << " nextBinlogSeq:" << nextBinlogSeq
               << " highestVisible:" << highestVisible;
     INVARIANT_D(nextBinlogSeq != Transaction::TXNID_UNINITED);
+    // the data may be flushed or replaced by a backup
+    SkipListCache::getInstance().invalidateStore(dbId());
 
     // NOTE(vinchen): if stateMode is STORE_NONE, the store no need
     // to open in rocksdb layer.
@@ -1794,6 +1976,281 @@ Expected<uint64_t> RocksKVStore::restart(bool restore,
   return maxCommitId;
 }
 
+WalGroupSyncer::WalGroupSyncer()
+  : _requested(0),
+    _synced(0),
+    _syncing(false),
+    _failedFrom(0),
+    _failedTo(0),
+    _groups(0),
+    _txns(0),
+    _syncMicros(0),
+    _waitMicros(0) {
+  for (auto& cnt : _groupSizes) {
+    cnt = 0;
+  }
+}
+
+Status WalGroupSyncer::sync(rocksdb::DB* db,
+                            uint32_t windowUs,
+                            uint32_t maxTxns) {
+  auto start = nsSinceEpoch();
+  std::unique_lock<std::mutex> lk(_mutex);
+  uint64_t ticket = ++_requested;
+  if (_syncing && _requested - _synced >= maxTxns) {
+    _joinCv.notify_one();
+  }
+  while (_synced < ticket) {
+    if (_syncing) {
+      _syncCv.wait(lk);
+      continue;
+    }
+    // the leader of a new group
+    _syncing = true;
+    if (windowUs > 0 && _requested - _synced < maxTxns) {
+      _joinCv.wait_for(lk, std::chrono::microseconds(windowUs), [&] {
+        return _requested - _synced >= maxTxns;
+      });
+    }
+    uint64_t from = _synced;
+    uint64_t to = _requested;
+    lk.unlock();
+    auto syncStart = nsSinceEpoch();
+    auto s = db->SyncWAL();
+    auto syncEnd = nsSinceEpoch();
+    lk.lock();
+    if (!s.ok()) {
+      LOG(ERROR) << "group sync wal failed:" << s.ToString();
+      _failedFrom = from;
+      _failedTo = to;
+      _failedStatus = s.ToString();
+    }
+    _synced = to;
+    _syncing = false;
+    _syncCv.notify_all();
+
+    uint64_t size = to - from;
+    TEST_SYNC_POINT_CALLBACK("WalGroupSyncer::sync::group", &size);
+    size_t bucket = 0;
+    while (bucket + 1 < GROUP_SIZE_BUCKETS && (1ULL << bucket) < size) {
+      bucket++;
+    }
+    _groupSizes[bucket].fetch_add(1, std::memory_order_relaxed);
+    _groups.fetch_add(1, std::memory_order_relaxed);
+    _txns.fetch_add(size, std::memory_order_relaxed);
+    _syncMicros.fetch_add((syncEnd - syncStart) / 1000,
+                          std::memory_order_relaxed);
+  }
+  bool failed = ticket > _failedFrom && ticket <= _failedTo;
+  std::string failedStatus = failed ? _failedStatus : "";
+  lk.unlock();
+
+  _waitMicros.fetch_add((nsSinceEpoch() - start) / 1000,
+                        std::memory_order_relaxed);
+  if (failed) {
+    return {ErrorCodes::ERR_INTERNAL, failedStatus};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+void WalGroupSyncer::appendJSONStat(
+  rapidjson::PrettyWriter<rapidjson::StringBuffer>& w) const {
+  w.Key("groups");
+  w.Uint64(_groups.load(std::memory_order_relaxed));
+  w.Key("txns");
+  w.Uint64(_txns.load(std::memory_order_relaxed));
+  w.Key("sync_micros");
+  w.Uint64(_syncMicros.load(std::memory_order_relaxed));
+  w.Key("wait_micros");
+  w.Uint64(_waitMicros.load(std::memory_order_relaxed));
+  w.Key("group_size");
+  w.StartObject();
+  for (size_t i = 0; i < GROUP_SIZE_BUCKETS; i++) {
+    std::string key = i + 1 < GROUP_SIZE_BUCKETS
+      ? "le_" + std::to_string(1ULL << i)
+      : "gt_" + std::to_string(1ULL << (i - 1));
+    w.Key(key.c_str());
+    w.Uint64(_groupSizes[i].load(std::memory_order_relaxed));
+  }
+  w.EndObject();
+}
+
+WriteStallMonitor::WriteStallMonitor()
+  : _lastCheckMs(0),
+    _state(State::NORMAL),
+    _immMemtables(0),
+    _l0Files(0),
+    _pendingCompactionBytes(0),
+    _nextDelayedUs(0),
+    _delayedWrites(0),
+    _stalledTries(0) {}
+
+const char* WriteStallMonitor::stateName(State state) {
+  switch (state) {
+    case State::NORMAL:
+      return "normal";
+    case State::DELAYED:
+      return "delayed";
+    case State::STOPPED:
+      return "stopped";
+  }
+  return "unknown";
+}
+
+void WriteStallMonitor::refresh(
+  rocksdb::DB* db, const std::vector<rocksdb::ColumnFamilyHandle*>& cfs) {
+  State state = State::NORMAL;
+  uint64_t imm = 0;
+  uint64_t l0Files = 0;
+  uint64_t pending = 0;
+  for (auto cf : cfs) {
+    uint64_t cfImm = 0;
+    uint64_t cfPending = 0;
+    std::string cfL0;
+    db->GetIntProperty(
+      cf, rocksdb::DB::Properties::kNumImmutableMemTable, &cfImm);
+    db->GetIntProperty(
+      cf, rocksdb::DB::Properties::kEstimatePendingCompactionBytes, &cfPending);
+    db->GetProperty(
+      cf, rocksdb::DB::Properties::kNumFilesAtLevelPrefix + "0", &cfL0);
+    uint64_t cfL0Files = std::strtoull(cfL0.c_str(), nullptr, 10);
+
+    // NOTE(tendis): the same conditions as rocksdb, except that the
+    // compaction triggers are checked even if auto compaction is disabled,
+    // the L0 files pile up anyway.
+    auto opts = db->GetOptions(cf);
+    uint64_t maxMemtables = opts.max_write_buffer_number;
+    State cfState = State::NORMAL;
+    if (cfImm >= maxMemtables ||
+        cfL0Files >= static_cast<uint64_t>(opts.level0_stop_writes_trigger) ||
+        (opts.hard_pending_compaction_bytes_limit > 0 &&
+         cfPending >= opts.hard_pending_compaction_bytes_limit)) {
+      cfState = State::STOPPED;
+    } else if ((maxMemtables > 3 && cfImm >= maxMemtables - 1) ||
+               (opts.level0_slowdown_writes_trigger >= 0 &&
+                cfL0Files >=
+                  static_cast<uint64_t>(opts.level0_slowdown_writes_trigger)) ||
+               (opts.soft_pending_compaction_bytes_limit > 0 &&
+                cfPending >= opts.soft_pending_compaction_bytes_limit)) {
+      cfState = State::DELAYED;
+    }
+    if (cf == cfs.front() || cfState > state) {
+      state = cfState;
+      imm = cfImm;
+      l0Files = cfL0Files;
+      pending = cfPending;
+    }
+  }
+  uint64_t stopped = 0;
+  if (db->GetIntProperty(rocksdb::DB::Properties::kIsWriteStopped,
+                         &stopped) &&
+      stopped) {
+    state = State::STOPPED;
+  }
+  TEST_SYNC_POINT_CALLBACK("WriteStallMonitor::refresh", &state);
+
+  _immMemtables.store(imm, std::memory_order_relaxed);
+  _l0Files.store(l0Files, std::memory_order_relaxed);
+  _pendingCompactionBytes.store(pending, std::memory_order_relaxed);
+  auto old = _state.exchange(state, std::memory_order_relaxed);
+  if (old != state) {
+    LOG(INFO) << "write stall state changes from " << stateName(old)
+              << " to " << stateName(state) << ", imm_memtables:" << imm
+              << " l0_files:" << l0Files
+              << " pending_compaction_bytes:" << pending;
+  }
+}
+
+WriteStallMonitor::State WriteStallMonitor::getState(
+  rocksdb::DB* db,
+  const std::vector<rocksdb::ColumnFamilyHandle*>& cfs,
+  uint32_t intervalMs) {
+  uint64_t now = msSinceEpoch();
+  if (now - _lastCheckMs.load(std::memory_order_relaxed) >= intervalMs) {
+    // only one caller samples the signals, the others use the last state
+    std::unique_lock<std::mutex> lk(_mutex, std::try_to_lock);
+    if (lk.owns_lock() &&
+        now - _lastCheckMs.load(std::memory_order_relaxed) >= intervalMs) {
+      refresh(db, cfs);
+      _lastCheckMs.store(now, std::memory_order_relaxed);
+    }
+  }
+  return _state.load(std::memory_order_relaxed);
+}
+
+Status WriteStallMonitor::admit(
+  rocksdb::DB* db,
+  const std::vector<rocksdb::ColumnFamilyHandle*>& cfs,
+  const ServerParams& cfg,
+  uint64_t* slotUs) {
+  if (!cfg.writeStallControl) {
+    *slotUs = 0;
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  auto state = getState(db, cfs, cfg.writeStallCheckIntervalMs);
+  if (state == State::NORMAL) {
+    *slotUs = 0;
+    return {ErrorCodes::ERR_OK, ""};
+  }
+
+  // NOTE(tendis): the writes never wait here, it would block the worker
+  // thread as the commit in rocksdb does. A write of a DELAYED store takes
+  // the next free slot, one per write-stall-delay-us, and is tried again
+  // at the time of it. A write of a STOPPED store is tried again after
+  // the stall signals are sampled again.
+  uint64_t now = nsSinceEpoch() / 1000;
+  if (state == State::DELAYED) {
+    if (*slotUs == 0) {
+      uint64_t next = _nextDelayedUs.load(std::memory_order_relaxed);
+      uint64_t slot = 0;
+      do {
+        slot = std::max(now, next);
+      } while (!_nextDelayedUs.compare_exchange_weak(
+        next, slot + cfg.writeStallDelayUs, std::memory_order_relaxed));
+      *slotUs = slot;
+    }
+    if (now >= *slotUs) {
+      *slotUs = 0;
+      _delayedWrites.fetch_add(1, std::memory_order_relaxed);
+      return {ErrorCodes::ERR_OK, ""};
+    }
+  } else {
+    *slotUs = now +
+      std::max(static_cast<uint64_t>(cfg.writeStallCheckIntervalMs) * 1000,
+               static_cast<uint64_t>(cfg.writeStallDelayUs));
+  }
+  _stalledTries.fetch_add(1, std::memory_order_relaxed);
+  return {ErrorCodes::ERR_WRITE_STALL, ""};
+}
+
+std::string WriteStallMonitor::getInfo() const {
+  std::stringstream ss;
+  ss << "state=" << stateName(_state.load(std::memory_order_relaxed))
+     << ",imm_memtables=" << _immMemtables.load(std::memory_order_relaxed)
+     << ",l0_files=" << _l0Files.load(std::memory_order_relaxed)
+     << ",pending_compaction_bytes="
+     << _pendingCompactionBytes.load(std::memory_order_relaxed)
+     << ",delayed_writes=" << _delayedWrites.load(std::memory_order_relaxed)
+     << ",stalled_tries=" << _stalledTries.load(std::memory_order_relaxed);
+  return ss.str();
+}
+
+void WriteStallMonitor::appendJSONStat(
+  rapidjson::PrettyWriter<rapidjson::StringBuffer>& w) const {
+  w.Key("state");
+  w.String(stateName(_state.load(std::memory_order_relaxed)));
+  w.Key("imm_memtables");
+  w.Uint64(_immMemtables.load(std::memory_order_relaxed));
+  w.Key("l0_files");
+  w.Uint64(_l0Files.load(std::memory_order_relaxed));
+  w.Key("pending_compaction_bytes");
+  w.Uint64(_pendingCompactionBytes.load(std::memory_order_relaxed));
+  w.Key("delayed_writes");
+  w.Uint64(_delayedWrites.load(std::memory_order_relaxed));
+  w.Key("stalled_tries");
+  w.Uint64(_stalledTries.load(std::memory_order_relaxed));
+}
+
 RocksKVStore::RocksKVStore(const std::string& id,
                            const std::shared_ptr<ServerParams>& cfg,
                            std::shared_ptr<rocksdb::Cache> blockCache,
@@ -1815,6 +2272,7 @@ RocksKVStore::RocksKVStore(const std::string& id,
     _stats(rocksdb::CreateDBStatistics()),
     _blockCache(blockCache),
     _nextTxnSeq(0),
+    _highestCommitted(0),
     _highestVisible(Transaction::TXNID_UNINITED),
     _logOb(nullptr),
     _env(std::make_shared<RocksdbEnv>()) {
@@ -1850,12 +2308,91 @@ Status RocksKVStore::releaseBackup() {
   }
 }
 
+static constexpr size_t kMaxBackupChain = 1024;
+
+// check the sizes of the files restored to path, and the checksums if the
+// backup is taken with backup-checksum
+static Status verifyBackupFiles(const std::string& path,
+                                const BackupInfo& backup) {
+  const auto& checksums = backup.getChecksums();
+  for (const auto& files : {backup.getFileList(), backup.getRefFileList()}) {
+    for (const auto& kv : files) {
+      std::string file = path + "/" + kv.first;
+      std::error_code ec;
+      auto size = filesystem::file_size(file, ec);
+      if (ec || size != kv.second) {
+        return {ErrorCodes::ERR_INTERNAL, "file size not match:" + file};
+      }
+      auto it = checksums.find(kv.first);
+      if (it == checksums.end()) {
+        continue;
+      }
+      auto crc = fileChecksum(file);
+      if (!crc.ok()) {
+        return crc.status();
+      }
+      if (crc.value() != it->second) {
+        return {ErrorCodes::ERR_INTERNAL, "file checksum not match:" + file};
+      }
+    }
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+// the path of target relative to dir, so that the backups can be moved
+// together. It's absolute if they are not in the same root.
+static std::string relativePath(const std::string& target,
+                                const std::string& dir) {
+  auto split = [](const std::string& p) {
+    std::vector<std::string> parts;
+    for (const auto& part : filesystem::absolute(p)) {
+      auto str = part.string();
+      if (str.empty() || str == ".") {
+        continue;
+      } else if (str == ".." && parts.size() > 1) {
+        parts.pop_back();
+      } else {
+        parts.push_back(str);
+      }
+    }
+    return parts;
+  };
+  auto to = split(target);
+  auto from = split(dir);
+  size_t n = 0;
+  while (n < to.size() && n < from.size() && to[n] == from[n]) {
+    n++;
+  }
+  if (n == 0) {
+    return filesystem::absolute(target).string();
+  }
+  filesystem::path rel;
+  for (size_t i = n; i < from.size(); i++) {
+    rel /= "..";
+  }
+  for (size_t i = n; i < to.size(); i++) {
+    rel /= to[i];
+  }
+  return rel.empty() ? "." : rel.string();
+}
+
+// the base dir in the backup meta of dir, the backups of old versions
+// have the absolute path
+static std::string resolveBaseDir(const std::string& dir,
+                                  const std::string& baseDir) {
+  if (filesystem::path(baseDir).is_absolute()) {
+    return baseDir;
+  }
+  return (filesystem::path(dir) / baseDir).string();
+}
+
 // this function guarantees that:
 // If backup failed, there should be no remaining dirs left to clean,
 // and the _hasBackup flag set to false
 Expected<BackupInfo> RocksKVStore::backup(const std::string& dir,
                                           KVStore::BackupMode mode,
-                                          BinlogVersion binlogVersion) {
+                                          BinlogVersion binlogVersion,
+                                          const std::string& baseDir) {
   bool succ = false;
   auto guard = MakeGuard([this, &dir, &succ]() {
     if (succ) {
@@ -1887,6 +2424,9 @@ Expected<BackupInfo> RocksKVStore::backup(const std::string& dir,
       return {ErrorCodes::ERR_INTERNAL,
               "BACKUP_CKPT|BACKUP_COPY cant equal dftBackupDir:" + dir};
     }
+    if (mode == KVStore::BackupMode::BACKUP_CKPT_INC && baseDir.empty()) {
+      return {ErrorCodes::ERR_INTERNAL, "BACKUP_CKPT_INC needs base dir"};
+    }
   }
 
   // NOTE(deyukong): we should get highVisible before making a ckpt
@@ -1898,7 +2438,8 @@ Expected<BackupInfo> RocksKVStore::backup(const std::string& dir,
   result.setBinlogPos(highVisible);
   result.setStartTimeSec(sinceEpoch());
   if (mode == KVStore::BackupMode::BACKUP_CKPT ||
-      mode == KVStore::BackupMode::BACKUP_CKPT_INTER) {
+      mode == KVStore::BackupMode::BACKUP_CKPT_INTER ||
+      mode == KVStore::BackupMode::BACKUP_CKPT_INC) {
     rocksdb::Checkpoint* checkpoint = nullptr;
     auto guard = MakeGuard([this, checkpoint]() {
       if (checkpoint) {
@@ -1949,6 +2490,28 @@ Expected<BackupInfo> RocksKVStore::backup(const std::string& dir,
     return {ErrorCodes::ERR_INTERNAL, ex.what()};
   }
   result.setFileList(flist);
+  // NOTE(tendis): the file list is saved for the backups of users, but
+  // not BACKUP_CKPT_INTER. Taking the checksums reads the files, so a
+  // BACKUP_CKPT takes them only with backup-checksum. A BACKUP_CKPT_INC
+  // always takes them for the files it copies, and reuses the ones of
+  // the base backups for the files it refers to.
+  if (mode == KVStore::BackupMode::BACKUP_CKPT ||
+      mode == KVStore::BackupMode::BACKUP_CKPT_INC) {
+    std::string identity;
+    auto s = getBaseDB()->GetDbIdentity(identity);
+    if (!s.ok()) {
+      return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+    }
+    result.setDbIdentity(identity);
+    bool checksum = _cfg->backupChecksum ||
+      mode == KVStore::BackupMode::BACKUP_CKPT_INC;
+    auto ds = diffCkpt(dir, baseDir, checksum, &result);
+    if (!ds.ok()) {
+      std::error_code ec;
+      filesystem::remove_all(dir, ec);
+      return ds;
+    }
+  }
   result.setEndTimeSec(sinceEpoch());
   result.setBackupMode((uint32_t)mode);
   result.setBinlogVersion(binlogVersion);
@@ -1960,6 +2523,76 @@ Expected<BackupInfo> RocksKVStore::backup(const std::string& dir,
   return result;
 }
 
+Status RocksKVStore::diffCkpt(const std::string& dir,
+                              const std::string& baseDir,
+                              bool checksum,
+                              BackupInfo* result) {
+  // the sst files are immutable and named uniquely in a db, so an sst file
+  // of the same name and size in the base backup is the same file
+  std::map<std::string, uint64_t> baseSst;
+  std::map<std::string, uint32_t> baseChecksums;
+  if (!baseDir.empty()) {
+    auto base = getBackupMeta(baseDir);
+    if (!base.ok()) {
+      return base.status();
+    }
+    uint32_t mode = base.value().getBackupMode();
+    if (mode != (uint32_t)KVStore::BackupMode::BACKUP_CKPT &&
+        mode != (uint32_t)KVStore::BackupMode::BACKUP_CKPT_INC) {
+      return {ErrorCodes::ERR_INTERNAL, "invalid base backup:" + baseDir};
+    }
+    if (base.value().getDbIdentity() != result->getDbIdentity()) {
+      return {ErrorCodes::ERR_INTERNAL, "base backup of other db:" + baseDir};
+    }
+    const auto& checksums = base.value().getChecksums();
+    for (const auto& files :
+         {base.value().getFileList(), base.value().getRefFileList()}) {
+      for (const auto& kv : files) {
+        auto name = filesystem::path(kv.first).filename().string();
+        baseSst[name] = kv.second;
+        auto it = checksums.find(kv.first);
+        if (it != checksums.end()) {
+          baseChecksums[name] = it->second;
+        }
+      }
+    }
+    result->setBaseDir(relativePath(baseDir, dir));
+  }
+
+  std::map<std::string, uint64_t> flist;
+  try {
+    for (const auto& kv : result->getFileList()) {
+      auto name = filesystem::path(kv.first).filename();
+      auto it = baseSst.find(name.string());
+      if (name.extension() == ".sst" && it != baseSst.end() &&
+          it->second == kv.second) {
+        filesystem::remove(dir + "/" + kv.first);
+        result->addRefFile(kv.first, kv.second);
+        auto crc = baseChecksums.find(name.string());
+        if (crc != baseChecksums.end()) {
+          result->setChecksum(kv.first, crc->second);
+        }
+        continue;
+      }
+      flist[kv.first] = kv.second;
+      if (!checksum) {
+        continue;
+      }
+      auto crc = fileChecksum(dir + "/" + kv.first);
+      if (!crc.ok()) {
+        return crc.status();
+      }
+      result->setChecksum(kv.first, crc.value());
+    }
+  } catch (const std::exception& ex) {
+    return {ErrorCodes::ERR_INTERNAL, ex.what()};
+  }
+  result->setFileList(flist);
+  LOG(INFO) << "backup dir:" << dir << " files:" << flist.size()
+            << " files in base backups:" << result->getRefFileList().size();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
 Expected<std::string> RocksKVStore::saveBackupMeta(const std::string& dir,
                                                    BackupInfo* backup) {
   rapidjson::StringBuffer sb;
@@ -1977,6 +2610,37 @@ Expected<std::string> RocksKVStore::saveBackupMeta(const std::string& dir,
   writer.Uint64(backup->getEndTimeSec() - backup->getStartTimeSec());
   writer.Key("binlogVersion");
   writer.Uint64((uint64_t)backup->getBinlogVersion());
+  if (!backup->getDbIdentity().empty()) {
+    writer.Key("dbIdentity");
+    writer.String(backup->getDbIdentity().c_str());
+  }
+  if (!backup->getBaseDir().empty()) {
+    writer.Key("baseDir");
+    writer.String(backup->getBaseDir().c_str());
+  }
+  // the files of the BACKUP_CKPT and BACKUP_CKPT_INC backups
+  if (!backup->getDbIdentity().empty()) {
+    writer.Key("files");
+    writer.StartObject();
+    for (const auto& files :
+         {backup->getFileList(), backup->getRefFileList()}) {
+      for (const auto& kv : files) {
+        writer.Key(kv.first.c_str());
+        writer.StartObject();
+        writer.Key("size");
+        writer.Uint64(kv.second);
+        auto it = backup->getChecksums().find(kv.first);
+        if (it != backup->getChecksums().end()) {
+          writer.Key("crc32c");
+          writer.Uint(it->second);
+        }
+        writer.Key("ref");
+        writer.Bool(backup->getRefFileList().count(kv.first) > 0);
+        writer.EndObject();
+      }
+    }
+    writer.EndObject();
+  }
   writer.EndObject();
   string data = sb.GetString();
 
@@ -2053,6 +2717,43 @@ Expected<BackupInfo> RocksKVStore::getBackupMeta(const std::string& dir) {
       } else {
         return {ErrorCodes::ERR_PARSEOPT, "Invalid backup meta"};
       }
+    } else if (o.name == "dbIdentity") {
+      if (o.value.IsString()) {
+        bkInfo.setDbIdentity(o.value.GetString());
+      } else {
+        return {ErrorCodes::ERR_PARSEOPT, "Invalid backup meta"};
+      }
+    } else if (o.name == "baseDir") {
+      if (o.value.IsString()) {
+        bkInfo.setBaseDir(o.value.GetString());
+      } else {
+        return {ErrorCodes::ERR_PARSEOPT, "Invalid backup meta"};
+      }
+    } else if (o.name == "files") {
+      if (!o.value.IsObject()) {
+        return {ErrorCodes::ERR_PARSEOPT, "Invalid backup meta"};
+      }
+      for (auto& f : o.value.GetObject()) {
+        if (!f.value.IsObject() || !f.value.HasMember("size") ||
+            !f.value["size"].IsUint64() || !f.value.HasMember("ref") ||
+            !f.value["ref"].IsBool()) {
+          return {ErrorCodes::ERR_PARSEOPT, "Invalid backup meta"};
+        }
+        std::string name = f.name.GetString();
+        if (f.value["ref"].GetBool()) {
+          bkInfo.addRefFile(name, f.value["size"].GetUint64());
+        } else {
+          bkInfo.addFile(name, f.value["size"].GetUint64());
+        }
+        // backup-checksum off
+        if (!f.value.HasMember("crc32c")) {
+          continue;
+        }
+        if (!f.value["crc32c"].IsUint()) {
+          return {ErrorCodes::ERR_PARSEOPT, "Invalid backup meta"};
+        }
+        bkInfo.setChecksum(name, f.value["crc32c"].GetUint());
+      }
     }
   }
   return bkInfo;
@@ -2066,7 +2767,20 @@ Expected<std::string> RocksKVStore::restoreBackup(const std::string& dir) {
 
   uint32_t mode = backup_meta.value().getBackupMode();
   if (mode == (uint32_t)KVStore::BackupMode::BACKUP_CKPT) {
-    return copyCkpt(dir);
+    auto ret = copyCkpt(dir);
+    if (!ret.ok()) {
+      return ret;
+    }
+    // the backups of old versions have no file list
+    auto s = verifyBackupFiles(dbPath() + "/" + dbId(), backup_meta.value());
+    if (!s.ok()) {
+      std::error_code ec;
+      filesystem::remove_all(dbPath() + "/" + dbId(), ec);
+      return s;
+    }
+    return ret;
+  } else if (mode == (uint32_t)KVStore::BackupMode::BACKUP_CKPT_INC) {
+    return assembleCkpt(dir, backup_meta.value());
   } else if (mode == (uint32_t)KVStore::BackupMode::BACKUP_COPY) {
     return loadCopy(dir);
   }
@@ -2117,12 +2831,91 @@ Expected<std::string> RocksKVStore::copyCkpt(const std::string& dir) {
   return std::string("ok");
 }
 
+Expected<std::string> RocksKVStore::assembleCkpt(const std::string& dir,
+                                                 const BackupInfo& backup) {
+  // the chain of base backups, from the nearest one
+  std::vector<std::pair<std::string, BackupInfo>> chain;
+  const auto& first = backup.getBaseDir();
+  std::string baseDir = first.empty() ? "" : resolveBaseDir(dir, first);
+  while (!baseDir.empty()) {
+    if (chain.size() >= kMaxBackupChain) {
+      return {ErrorCodes::ERR_INTERNAL, "backup chain too long:" + dir};
+    }
+    auto base = getBackupMeta(baseDir);
+    if (!base.ok()) {
+      return base.status();
+    }
+    if (base.value().getDbIdentity() != backup.getDbIdentity()) {
+      return {ErrorCodes::ERR_INTERNAL, "base backup of other db:" + baseDir};
+    }
+    chain.emplace_back(baseDir, std::move(base.value()));
+    const auto& next = chain.back().second.getBaseDir();
+    baseDir = next.empty() ? "" : resolveBaseDir(baseDir, next);
+  }
+
+  auto ret = copyCkpt(dir);
+  if (!ret.ok()) {
+    return ret;
+  }
+  const std::string path = dbPath() + "/" + dbId();
+  bool succ = false;
+  auto guard = MakeGuard([&path, &succ]() {
+    if (!succ) {
+      std::error_code ec;
+      filesystem::remove_all(path, ec);
+    }
+  });
+
+  try {
+    for (const auto& ref : backup.getRefFileList()) {
+      auto name = filesystem::path(ref.first).filename().string();
+      std::string src;
+      for (const auto& base : chain) {
+        for (const auto& kv : base.second.getFileList()) {
+          if (filesystem::path(kv.first).filename().string() == name) {
+            src = base.first + "/" + kv.first;
+            break;
+          }
+        }
+        if (!src.empty()) {
+          break;
+        }
+      }
+      if (src.empty()) {
+        return {ErrorCodes::ERR_NOTFOUND,
+                "file not found in base backups:" + ref.first};
+      }
+      filesystem::copy_file(src, path + "/" + ref.first);
+    }
+  } catch (std::exception& ex) {
+    LOG(WARNING) << "dbId:" << dbId() << "restore exception" << ex.what();
+    return {ErrorCodes::ERR_INTERNAL, ex.what()};
+  }
+
+  auto s = verifyBackupFiles(path, backup);
+  if (!s.ok()) {
+    return s;
+  }
+  succ = true;
+  LOG(INFO) << "assembleCkpt sucess. dbpath:" << path << " backup path:" << dir
+            << " base backups:" << chain.size();
+  return std::string("ok");
+}
+
 Expected<std::unique_ptr<Transaction>> RocksKVStore::createTransaction(
   Session* sess) {
   std::lock_guard<std::mutex> lk(_mutex);
   if (!_isRunning) {
     return {ErrorCodes::ERR_INTERNAL, "db stopped!"};
   }
+  if (sess) {
+    // NOTE(tendis): the commands queued by MULTI run in the transaction
+    // of EXEC, see execCommand
+    auto txn = sess->getCtx()->getExecTxn(dbId());
+    if (txn) {
+      return std::unique_ptr<Transaction>(new NestedTxn(txn));
+    }
+  }
   uint64_t txnId = _nextTxnSeq++;
   bool replOnly = (_mode == KVStore::StoreMode::REPLICATE_ONLY);
 #ifndef NO_VERSIONEP
@@ -2166,13 +2959,22 @@ void RocksKVStore::setNextBinlogSeq(uint64_t binlogId, Transaction* txn) {
   std::lock_guard<std::mutex> lk(_mutex);
   INVARIANT_D(txn->isReplOnly());
 
-  _nextBinlogSeq = binlogId + 1;
+  // NOTE(tendis): the binlogs below may be applied again to fill the holes,
+  // see BinlogApplier::recoverPos()
+  _nextBinlogSeq = std::max(_nextBinlogSeq, binlogId + 1);
 
+  auto it = _aliveTxns.find(txn->getTxnId());
+  INVARIANT_D(it != _aliveTxns.end() && !it->second.first);
+  if (it->second.second != Transaction::TXNID_UNINITED) {
+    // NOTE(tendis): a txn applying a group of binlogs keeps only the last
+    // one alive, no binlog is between them, the ones before are committed
+    // with it. see BinlogApplier::addTask()
+    INVARIANT_D(it->second.second < binlogId);
+    _aliveBinlogs.erase(it->second.second);
+  }
   txn->setBinlogId(binlogId);
   INVARIANT_D(_aliveBinlogs.find(binlogId) == _aliveBinlogs.end());
   _aliveBinlogs.insert({binlogId, {false, txn->getTxnId()}});
-  auto it = _aliveTxns.find(txn->getTxnId());
-  INVARIANT_D(it != _aliveTxns.end() && !it->second.first);
 
   it->second.second = binlogId;
 }
@@ -2196,7 +2998,39 @@ uint64_t RocksKVStore::getNextBinlogSeq() const {
 }
 
 rocksdb::DB* RocksKVStore::getBaseDB() const {
-  return _optdb.get() ? _optdb->GetBaseDB() : _pesdb->GetBaseDB();
+  if (_optdb.get()) {
+    return _optdb->GetBaseDB();
+  }
+  // NOTE(tendis): it is nullptr before the db is opened, the compaction
+  // filter may be created while opening the db.
+  return _pesdb.get() ? _pesdb->GetBaseDB() : nullptr;
+}
+
+bool RocksKVStore::groupCommitEnabled() const {
+  return _cfg->rocksFlushLogAtTrxCommit && !_cfg->rocksDisableWAL &&
+    _cfg->rocksGroupCommitMaxTxns > 0;
+}
+
+Status RocksKVStore::groupSyncWAL() {
+  return _walSyncer.sync(getBaseDB(),
+                         _cfg->rocksGroupCommitWindowUs,
+                         _cfg->rocksGroupCommitMaxTxns);
+}
+
+Status RocksKVStore::admitWrite(uint64_t* slotUs) {
+  if (!_isRunning) {
+    *slotUs = 0;
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  return _stallMonitor.admit(getBaseDB(), _cfHandles, *_cfg, slotUs);
+}
+
+std::string RocksKVStore::getWriteStallInfo() {
+  if (_isRunning) {
+    _stallMonitor.getState(
+      getBaseDB(), _cfHandles, _cfg->writeStallCheckIntervalMs);
+  }
+  return _stallMonitor.getInfo();
 }
 
 void RocksKVStore::addUnCommitedTxnInLock(uint64_t txnId) {
@@ -2244,18 +3078,36 @@ void RocksKVStore::markCommittedInLock(uint64_t txnId, uint64_t binlogTxnId) {
     i->second.first = true;
     i->second.second = binlogTxnId;
     if (i == _aliveBinlogs.begin()) {
-      while (i != _aliveBinlogs.end()) {
-        if (!i->second.first) {
-          break;
-        }
+      popCommittedBinlogsInLock();
+    }
+  }
+}
 
-        if (i->second.second != Transaction::TXNID_UNINITED) {
-          _highestVisible = i->first;
-          INVARIANT_D(_highestVisible <= _nextBinlogSeq);
-        }
-        i = _aliveBinlogs.erase(i);
+void RocksKVStore::popCommittedBinlogsInLock() {
+  size_t cacheBytes = static_cast<size_t>(_cfg->binlogCacheMB) << 20;
+  auto i = _aliveBinlogs.begin();
+  while (i != _aliveBinlogs.end()) {
+    if (!i->second.first) {
+      break;
+    }
+
+    bool committed = i->second.second != Transaction::TXNID_UNINITED;
+    if (committed) {
+      _replHoles.erase(i->first);
+      _highestCommitted = std::max(_highestCommitted, i->first);
+      uint64_t visible = _highestCommitted;
+      if (!_replHoles.empty()) {
+        visible = std::min(visible, *_replHoles.begin() - 1);
       }
+      _highestVisible = std::max(_highestVisible, visible);
+      INVARIANT_D(_highestVisible <= _nextBinlogSeq);
+    } else if (_mode == KVStore::StoreMode::REPLICATE_ONLY) {
+      // NOTE(tendis): a binlog of the master failed to apply, the binlogs
+      // after it are not visible until it's applied again
+      _replHoles.insert(i->first);
     }
+    _binlogCache.publish(i->first, committed, cacheBytes);
+    i = _aliveBinlogs.erase(i);
   }
 }
 
@@ -2310,6 +3162,13 @@ Status RocksKVStore::delKV(const RecordKey& key, Transaction* txn) {
   return txn->delKV(key.encode());
 }
 
+Status RocksKVStore::mergeKV(const RecordKey& key,
+                             const std::string& operand,
+                             Transaction* txn) {
+  INVARIANT_D(txn->getKVStoreId() == dbId());
+  return txn->mergeKV(key.encode(), operand);
+}
+
 Status RocksKVStore::deleteRange(const std::string& begin,
                                  const std::string& end) {
   // NOTE(takenliu) be care of db::DeleteRange and add binlog are not atomic
@@ -2350,6 +3209,9 @@ Status RocksKVStore::deleteRangeWithoutBinlog(
     LOG(ERROR) << "deleteRange failed:" << s.ToString();
     return {ErrorCodes::ERR_INTERNAL, s.ToString()};
   }
+  if (column_family == getDataColumnFamilyHandle()) {
+    SkipListCache::getInstance().invalidateStore(dbId());
+  }
   return {ErrorCodes::ERR_OK, ""};
 }
 
@@ -2362,6 +3224,72 @@ Status RocksKVStore::deleteRangeBinlog(uint64_t begin, uint64_t end) {
     getBinlogColumnFamilyHandle(), beginKeyStr, endKeyStr);
 }
 
+Status RocksKVStore::ingestFiles(const std::vector<std::string>& dataFiles,
+                                 const std::vector<std::string>& binlogFiles,
+                                 uint64_t firstBinlogId,
+                                 uint64_t binlogCnt) {
+  uint64_t lastBinlogId = firstBinlogId + binlogCnt - 1;
+  {
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (!_isRunning) {
+      return {ErrorCodes::ERR_INTERNAL, "db stopped!"};
+    }
+    if (binlogCnt > 0) {
+      if (_nextBinlogSeq != firstBinlogId) {
+        return {ErrorCodes::ERR_INTERNAL,
+                "binlogs written since the files were built, next binlog:" +
+                  std::to_string(_nextBinlogSeq) +
+                  ",expected:" + std::to_string(firstBinlogId)};
+      }
+      // NOTE(tendis): the binlog ids are reserved, and the last one is
+      // alive until the files are ingested, so that _highestVisible does
+      // not pass the binlogs before they are readable.
+      _nextBinlogSeq = lastBinlogId + 1;
+      _aliveBinlogs.insert(
+        {lastBinlogId, {false, Transaction::TXNID_UNINITED}});
+    }
+  }
+
+  rocksdb::IngestExternalFileOptions opts;
+  opts.move_files = true;
+  rocksdb::DB* db = getBaseDB();
+  rocksdb::Status s;
+  if (!dataFiles.empty()) {
+    s = db->IngestExternalFile(getDataColumnFamilyHandle(), dataFiles, opts);
+    SkipListCache::getInstance().invalidateStore(dbId());
+  }
+  // NOTE(tendis): rocksdb 5.13 can't ingest the files of two column
+  // families atomically. If the binlogs fail, the data is visible without
+  // binlogs, the slaves of the store need a full sync.
+  if (s.ok() && !binlogFiles.empty()) {
+    s = db->IngestExternalFile(
+      getBinlogColumnFamilyHandle(), binlogFiles, opts);
+    if (!s.ok() && !dataFiles.empty()) {
+      LOG(ERROR) << "store:" << dbId()
+                 << " data ingested without binlogs:" << s.ToString();
+    }
+  }
+
+  if (binlogCnt > 0) {
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto i = _aliveBinlogs.find(lastBinlogId);
+    INVARIANT_D(i != _aliveBinlogs.end());
+    i->second.first = true;
+    i->second.second = s.ok() ? lastBinlogId : Transaction::TXNID_UNINITED;
+    if (i == _aliveBinlogs.begin()) {
+      popCommittedBinlogsInLock();
+    }
+  }
+  if (!s.ok()) {
+    LOG(ERROR) << "store:" << dbId() << " ingest failed:" << s.ToString();
+    return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+  }
+  LOG(INFO) << "store:" << dbId() << " ingest " << dataFiles.size()
+            << " data files, " << binlogFiles.size()
+            << " binlog files, binlogs:" << binlogCnt;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
 void RocksKVStore::initRocksProperties() {
   _rocksIntProperties = {
     {"rocksdb.num-immutable-mem-table", "num_immutable_mem_table"},
@@ -2613,16 +3541,38 @@ void RocksKVStore::appendJSONStat(
     w.Key("high_visible");
     w.Uint64(_highestVisible);
   }
+  w.Key("binlog_cache_count");
+  w.Uint64(_binlogCache.count());
+  w.Key("binlog_cache_bytes");
+  w.Uint64(_binlogCache.bytes());
+  w.Key("binlog_cache_hits");
+  w.Uint64(_binlogCache.hits());
+  w.Key("binlog_cache_misses");
+  w.Uint64(_binlogCache.misses());
 
   w.Key("compact_filter_count");
   w.Uint64(stat.compactFilterCount.load(std::memory_order_relaxed));
   w.Key("compact_kvexpired_count");
   w.Uint64(stat.compactKvExpiredCount.load(std::memory_order_relaxed));
+  w.Key("compact_subkey_expired_count");
+  w.Uint64(stat.compactSubKeyExpiredCount.load(std::memory_order_relaxed));
+  w.Key("compact_ttlindex_stale_count");
+  w.Uint64(stat.compactTtlIndexStaleCount.load(std::memory_order_relaxed));
   w.Key("paused_error_count");
   w.Uint64(stat.pausedErrorCount.load(std::memory_order_relaxed));
   w.Key("destroyed_error_count");
   w.Uint64(stat.destroyedErrorCount.load(std::memory_order_relaxed));
 
+  w.Key("group_commit");
+  w.StartObject();
+  _walSyncer.appendJSONStat(w);
+  w.EndObject();
+
+  w.Key("write_stall");
+  w.StartObject();
+  _stallMonitor.appendJSONStat(w);
+  w.EndObject();
+
   w.Key("rocksdb");
   w.StartObject();
   if (_isRunning) {
@@ -5,6 +5,9 @@
 #ifndef SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_KVSTORE_H_
 #define SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_KVSTORE_H_
 
+#include <array>
+#include <atomic>
+#include <condition_variable>  // NOLINT
 #include <memory>
 #include <string>
 #include <iostream>
@@ -29,6 +32,7 @@ namespace tendisplus {
 class RocksKVStore;
 class RocksdbEnv;
 class BackgroundErrorListener;
+class KVTtlCompactionFilterFactory;
 
 class RocksTxn : public Transaction {
  public:
@@ -68,6 +72,9 @@ class RocksTxn : public Transaction {
                const std::string& val,
                const uint64_t ts = 0) final;
   Status delKV(const std::string& key, const uint64_t ts = 0) final;
+  Status mergeKV(const std::string& key,
+                 const std::string& operand,
+                 const uint64_t ts = 0) final;
   Status addDeleteRangeBinlog(const std::string& begin,
                               const std::string& end) final;
 #ifdef BINLOG_V1
@@ -100,12 +107,20 @@ class RocksTxn : public Transaction {
     return _replOnly;
   }
   std::string getKVStoreId() const;
+  void setSavePoint() final;
+  Status rollbackToSavePoint() final;
+  void setBulkWrite(bool bulk) final {
+    _bulkWrite = bulk;
+  }
   const std::unique_ptr<rocksdb::Transaction>& getRocksdbTxn() const {
     return _txn;
   }
 
  protected:
   virtual void ensureTxn() {}
+  void addCacheBinlog(uint64_t binlogId, std::string key, std::string value);
+  // drop the cached skiplist nodes of the zset the key belongs to
+  void invalidateSkipListCache(const std::string& key);
 
   uint64_t _txnId;
   uint64_t _binlogId;
@@ -124,9 +139,17 @@ class RocksTxn : public Transaction {
 #else
   std::vector<ReplLogValueEntryV2> _replLogValues;
 #endif
+  // {binlog count, chunkId} of the savepoints
+  std::vector<std::pair<size_t, uint32_t>> _savePoints;
+  // the binlogs written, added to the binlog cache of the store if
+  // committed, see binlog-cache-mb
+  std::vector<BinlogTailCache::Entry> _cacheBinlogs;
 
   // if rollback/commit has been explicitly called
   bool _done;
+  bool _bulkWrite;
+  // the WAL is synced by the WalGroupSyncer of the store after commit
+  bool _groupSync;
 
   bool _replOnly;
 
@@ -189,6 +212,100 @@ class RocksKVCursor : public Cursor {
   std::unique_ptr<rocksdb::Iterator> _it;
 };
 
+// WalGroupSyncer syncs the WAL for a group of transactions at once.
+// With rocks.flush_log_at_trx_commit on and rocks.group_commit_max_txns
+// set, the transactions commit with WriteOptions.sync off, and call
+// sync() before replying. The first caller is the leader of a group, it
+// waits at most rocks.group_commit_window_us for max_txns callers to
+// join, then syncs the WAL once for all of them, the others wait for it.
+// The callers joining during a sync form the next group.
+// The binlog is visible to the slaves (_highestVisible) after the sync,
+// since markCommitted() is called after sync() returns. The writes are
+// visible to the readers at commit, like WriteOptions.sync off.
+class WalGroupSyncer {
+ public:
+  WalGroupSyncer();
+  // return after the WAL written before the call is synced
+  Status sync(rocksdb::DB* db, uint32_t windowUs, uint32_t maxTxns);
+  void appendJSONStat(
+    rapidjson::PrettyWriter<rapidjson::StringBuffer>& w) const;
+
+  // the group size histogram has buckets of [1], [2], [3, 4], [5, 8]
+  // ... [2^(N-2) + 1, inf)
+  static constexpr size_t GROUP_SIZE_BUCKETS = 8;
+
+ private:
+  std::mutex _mutex;
+  // the leader waits for the group to be full
+  std::condition_variable _joinCv;
+  // the others wait for the sync
+  std::condition_variable _syncCv;
+  // the tickets of the callers, (_synced, _requested] are waiting
+  uint64_t _requested;
+  uint64_t _synced;
+  bool _syncing;
+  // the tickets of the last group failed to sync
+  uint64_t _failedFrom;
+  uint64_t _failedTo;
+  std::string _failedStatus;
+
+  std::atomic<uint64_t> _groups;
+  std::atomic<uint64_t> _txns;
+  std::atomic<uint64_t> _syncMicros;
+  // from the call of sync() to return, summed over the txns
+  std::atomic<uint64_t> _waitMicros;
+  std::array<std::atomic<uint64_t>, GROUP_SIZE_BUCKETS> _groupSizes;
+};
+
+// WriteStallMonitor is the admission control of the writes of a store.
+// When rocksdb stalls the writes, the workers block in commit with the
+// keys locked. So the stall signals of the store (unflushed memtables,
+// L0 files and pending compaction bytes) are sampled at most once per
+// write-stall-check-interval-ms, and compared with the triggers of the
+// options like rocksdb's GetWriteStallConditionAndCause(). Before locking
+// the keys, a DELAYED store gives the writes slots one per
+// write-stall-delay-us in order, and a STOPPED store admits none. A write
+// not admitted is parked by its session and tried again at its slot, off
+// the worker thread, it fails with -TRYAGAIN only after
+// write-stall-timeout-ms, see NetSession::parkReq(). Reads are never
+// throttled.
+class WriteStallMonitor {
+ public:
+  enum class State : uint32_t { NORMAL = 0, DELAYED = 1, STOPPED = 2 };
+
+  WriteStallMonitor();
+  State getState(rocksdb::DB* db,
+                 const std::vector<rocksdb::ColumnFamilyHandle*>& cfs,
+                 uint32_t intervalMs);
+  Status admit(rocksdb::DB* db,
+               const std::vector<rocksdb::ColumnFamilyHandle*>& cfs,
+               const ServerParams& cfg,
+               uint64_t* slotUs);
+  std::string getInfo() const;
+  void appendJSONStat(
+    rapidjson::PrettyWriter<rapidjson::StringBuffer>& w) const;
+  static const char* stateName(State state);
+
+ private:
+  void refresh(rocksdb::DB* db,
+               const std::vector<rocksdb::ColumnFamilyHandle*>& cfs);
+
+  std::mutex _mutex;
+  std::atomic<uint64_t> _lastCheckMs;
+  std::atomic<State> _state;
+  // the signals of the column family stalled most at the last check
+  std::atomic<uint64_t> _immMemtables;
+  std::atomic<uint64_t> _l0Files;
+  std::atomic<uint64_t> _pendingCompactionBytes;
+
+  // the time in us of the next free slot of a DELAYED store
+  std::atomic<uint64_t> _nextDelayedUs;
+  // the writes admitted by a DELAYED store
+  std::atomic<uint64_t> _delayedWrites;
+  // the tries of the writes failed with ERR_WRITE_STALL
+  std::atomic<uint64_t> _stalledTries;
+};
+
 typedef struct sstMetaData {
   uint64_t size = 0;
   uint64_t num_entries = 0;
@@ -228,12 +345,19 @@ class RocksKVStore : public KVStore {
                const std::string& val,
                Transaction* txn) final;
   Status delKV(const RecordKey& key, Transaction* txn) final;
+  Status mergeKV(const RecordKey& key,
+                 const std::string& operand,
+                 Transaction* txn) final;
   // [begin, end)
   Status deleteRange(const std::string& begin, const std::string& end) final;
   Status deleteRangeWithoutBinlog(rocksdb::ColumnFamilyHandle* column_family,
                                   const std::string& begin,
                                   const std::string& end);
   Status deleteRangeBinlog(uint64_t begin, uint64_t end);
+  Status ingestFiles(const std::vector<std::string>& dataFiles,
+                     const std::vector<std::string>& binlogFiles,
+                     uint64_t firstBinlogId,
+                     uint64_t binlogCnt) final;
 
 #ifdef BINLOG_V1
   Status applyBinlog(const std::list<ReplLog>& txnLog, Transaction* txn) final;
@@ -249,6 +373,7 @@ class RocksKVStore : public KVStore {
                                                   uint64_t save,
                                                   Transaction* txn,
                                                   std::ofstream* fs,
+                                                  BinlogArchiveWriter* archive,
                                                   int64_t maxWritelen,
                                                   bool tailSlave) final;
   int64_t saveBinlogV2(std::ofstream* fs, const ReplLogRawV2& log);
@@ -296,7 +421,8 @@ class RocksKVStore : public KVStore {
 
   Expected<BackupInfo> backup(const std::string&,
                               KVStore::BackupMode,
-                              BinlogVersion binlogVersion) final;
+                              BinlogVersion binlogVersion,
+                              const std::string& baseDir = "") final;
   Expected<std::string> restoreBackup(const std::string& dir) final;
   Expected<BackupInfo> getBackupMeta(const std::string& dir) final;
 
@@ -311,6 +437,9 @@ class RocksKVStore : public KVStore {
   rocksdb::TransactionDB* getUnderlayerPesDB();
 
   uint64_t getHighestBinlogId() const final;
+  BinlogTailCache* getBinlogCache() final {
+    return &_binlogCache;
+  }
 
   // NOTE(deyukong): this api is only for debug
   std::set<uint64_t> getUncommittedTxns() const;
@@ -326,12 +455,17 @@ class RocksKVStore : public KVStore {
   std::string getBgError() const override;
   Status recoveryFromBgError() override;
   void resetStatistics();
+  Status admitWrite(uint64_t* slotUs) final;
+  std::string getWriteStallInfo() final;
 
   Expected<VersionMeta> getVersionMeta() override;
   Expected<VersionMeta> getVersionMeta(const std::string& name) override;
   Status setVersionMeta(const std::string& name,
                         uint64_t ts,
                         uint64_t version) override;
+  // whether the txns created now sync the WAL by the WalGroupSyncer
+  bool groupCommitEnabled() const;
+  Status groupSyncWAL();
   rocksdb::ColumnFamilyHandle* getDataColumnFamilyHandle() {
     return _cfHandles[0];
   }
@@ -344,9 +478,14 @@ class RocksKVStore : public KVStore {
   }
 
  private:
+  // the compaction filter reads the metas by getBaseDB()
+  friend class KVTtlCompactionFilterFactory;
   rocksdb::DB* getBaseDB() const;
   void addUnCommitedTxnInLock(uint64_t txnId);
   void markCommittedInLock(uint64_t txnId, uint64_t binlogTxnId);
+  // erase the committed binlogs at the head of _aliveBinlogs, and push
+  // _highestVisible forward
+  void popCommittedBinlogsInLock();
   rocksdb::Options options();
   Expected<bool> deleteBinlog(uint64_t start);
   void initRocksProperties();
@@ -354,6 +493,17 @@ class RocksKVStore : public KVStore {
                                        BackupInfo* result);
   Expected<std::string> loadCopy(const std::string& dir);
   Expected<std::string> copyCkpt(const std::string& dir);
+  // drop the sst files of the checkpoint in dir which are in the backup
+  // of baseDir, with the checksums recorded by it, and take the checksums
+  // of the files left if checksum is true
+  Status diffCkpt(const std::string& dir,
+                  const std::string& baseDir,
+                  bool checksum,
+                  BackupInfo* result);
+  // copy the checkpoint of an incremental backup, and the files it refers
+  // to from the chain of base backups
+  Expected<std::string> assembleCkpt(const std::string& dir,
+                                     const BackupInfo& backup);
 
  private:
   mutable std::mutex _mutex;
@@ -403,18 +553,28 @@ class RocksKVStore : public KVStore {
   // binlogIds follows it, and push _highestVisible forward.
   // <binlogId, <commit_or_not, txnId>>
   std::map<uint64_t, std::pair<bool, uint64_t>> _aliveBinlogs;
+  // the binlogs rolled back on a slave, they are synced and applied again,
+  // see BinlogApplier. _highestVisible doesn't go past them, the binlogs
+  // committed after them are visible when they are filled.
+  std::set<uint64_t> _replHoles;
+  // the largest binlog committed, visible or not
+  uint64_t _highestCommitted;
 #endif
 
   // NOTE(deyukong): _highestVisible is the largest committed binlog
   // before _aliveTxns.begin()
   // TOD0(vinchen) : make it actomic?
   uint64_t _highestVisible;  // low water level for binlog id
+  // the binlogs visible lately, for the cursors of the pushers
+  BinlogTailCache _binlogCache;
 
   std::shared_ptr<BinlogObserver> _logOb;
   std::shared_ptr<RocksdbEnv> _env;
   std::map<std::string, std::string> _rocksIntProperties;
   std::map<std::string, std::string> _rocksStringProperties;
   std::vector<rocksdb::ColumnFamilyHandle*> _cfHandles;
+  WalGroupSyncer _walSyncer;
+  WriteStallMonitor _stallMonitor;
 };
 
 class RocksdbEnv {
@@ -2,10 +2,13 @@
 // Please refer to the license text that comes with this tendis open source
 // project for additional information.
 
+#include <algorithm>
 #include <fstream>
 #include <utility>
 #include <limits>
+#include <mutex>  // NOLINT
 #include <thread>  // NOLINT
+#include <tuple>
 
 #include "glog/logging.h"
 #include "gtest/gtest.h"
@@ -20,8 +23,13 @@
 #include "tendisplus/utils/scopeguard.h"
 #include "tendisplus/utils/portable.h"
 #include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/redis_port.h"
 #include "tendisplus/storage/rocks/rocks_kvstore.h"
 #include "tendisplus/storage/kvstore.h"
+#include "tendisplus/storage/binlog_archive.h"
+#include "tendisplus/replication/binlog_applier.h"
+#include "tendisplus/replication/repl_util.h"
+#include "tendisplus/server/server_entry.h"
 #include "tendisplus/server/server_params.h"
 #include "tendisplus/utils/sync_point.h"
 #include "tendisplus/utils/time.h"
@@ -94,10 +102,12 @@ std::string randomStr(size_t s, bool maybeEmpty) {
   return std::string(reinterpret_cast<const char*>(v.data()), v.size());
 }
 
+// eleCount counts the subkeys written, they have no meta
 size_t genData(RocksKVStore* kvstore,
                uint32_t count,
                uint64_t ttl,
-               bool allDiff) {
+               bool allDiff,
+               size_t* eleCount = nullptr) {
   size_t kvCount = 0;
   srand((unsigned int)time(NULL));
 
@@ -113,6 +123,9 @@ size_t genData(RocksKVStore* kvstore,
       kvCount++;
     } else if (!isDataMetaType(type)) {
       this_ttl = 0;
+      if (type == RecordType::RT_LIST_ELE && eleCount) {
+        (*eleCount)++;
+      }
     }
     std::string pk;
     if (allDiff) {
@@ -782,6 +795,141 @@ TEST(RocksKVStore, BackupCkpt) {
   testMaxBinlogId(kvstore);
 }
 
+TEST(RocksKVStore, BackupCkptInc) {
+  auto cfg = genParams();
+  cfg->backupChecksum = true;
+  std::vector<string> dirs = {"backups/full", "backups/inc1", "backups/inc2"};
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  EXPECT_TRUE(filesystem::create_directory("backups"));
+
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    filesystem::remove_all("./backups");
+    filesystem::remove_all("./backups_moved");
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto kvstore = std::make_unique<RocksKVStore>("0", cfg, blockCache);
+  auto binlogversion = cfg->binlogUsingDefaultCF
+    ? BinlogVersion::BINLOG_VERSION_1
+    : BinlogVersion::BINLOG_VERSION_2;
+
+  std::vector<string> keys = {"a", "b", "c"};
+  uint64_t lastCommitId = 0;
+  for (size_t i = 0; i < dirs.size(); i++) {
+    auto eTxn = kvstore->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    std::unique_ptr<Transaction> txn = std::move(eTxn.value());
+    Status s = kvstore->setKV(
+      Record(RecordKey(0, 0, RecordType::RT_KV, keys[i], ""),
+             RecordValue("txn1", RecordType::RT_KV, -1)),
+      txn.get());
+    EXPECT_TRUE(s.ok());
+    Expected<uint64_t> exptCommitId = txn->commit();
+    EXPECT_TRUE(exptCommitId.ok());
+    lastCommitId = exptCommitId.value();
+
+    auto mode = i == 0 ? KVStore::BackupMode::BACKUP_CKPT
+                       : KVStore::BackupMode::BACKUP_CKPT_INC;
+    auto baseDir = i == 0 ? "" : dirs[i - 1];
+    auto expBk = kvstore->backup(dirs[i], mode, binlogversion, baseDir);
+    EXPECT_TRUE(expBk.ok()) << expBk.status().toString();
+    EXPECT_FALSE(expBk.value().getChecksums().empty());
+    if (i > 0) {
+      // the sst files of the base backups are not copied
+      EXPECT_EQ(expBk.value().getBaseDir(), "../" + dirs[i - 1].substr(8));
+      EXPECT_FALSE(expBk.value().getRefFileList().empty());
+      for (const auto& kv : expBk.value().getRefFileList()) {
+        EXPECT_FALSE(filesystem::exists(dirs[i] + "/" + kv.first));
+      }
+    }
+  }
+
+  // no base backup
+  auto expBk = kvstore->backup(
+    "backups/inc3", KVStore::BackupMode::BACKUP_CKPT_INC, binlogversion);
+  EXPECT_FALSE(expBk.ok());
+  EXPECT_FALSE(filesystem::exists("backups/inc3"));
+
+  // without backup-checksum, an incremental backup still checksums the
+  // files it copies, and keeps the checksums of the base backups
+  cfg->backupChecksum = false;
+  expBk = kvstore->backup(
+    "backups/inc3", KVStore::BackupMode::BACKUP_CKPT_INC, binlogversion,
+    dirs.back());
+  EXPECT_TRUE(expBk.ok()) << expBk.status().toString();
+  auto meta = kvstore->getBackupMeta("backups/inc3");
+  EXPECT_TRUE(meta.ok());
+  EXPECT_FALSE(meta.value().getFileList().empty());
+  EXPECT_FALSE(meta.value().getRefFileList().empty());
+  for (const auto& files :
+       {meta.value().getFileList(), meta.value().getRefFileList()}) {
+    for (const auto& kv : files) {
+      EXPECT_EQ(meta.value().getChecksums().count(kv.first), 1U) << kv.first;
+    }
+  }
+  filesystem::remove_all("backups/inc3");
+
+  // a full backup has no checksums without it, the sizes are still saved
+  expBk = kvstore->backup(
+    "backups/full2", KVStore::BackupMode::BACKUP_CKPT, binlogversion);
+  EXPECT_TRUE(expBk.ok()) << expBk.status().toString();
+  meta = kvstore->getBackupMeta("backups/full2");
+  EXPECT_TRUE(meta.ok());
+  EXPECT_TRUE(meta.value().getChecksums().empty());
+  EXPECT_FALSE(meta.value().getFileList().empty());
+  filesystem::remove_all("backups/full2");
+
+  // the base backups are found relative to the backup after moved
+  filesystem::rename("backups", "backups_moved");
+  for (auto& dir : dirs) {
+    dir = "backups_moved/" + dir.substr(8);
+  }
+
+  Status s = kvstore->stop();
+  EXPECT_TRUE(s.ok());
+  s = kvstore->clear();
+  EXPECT_TRUE(s.ok());
+
+  Expected<std::string> ret = kvstore->restoreBackup(dirs.back());
+  EXPECT_TRUE(ret.ok()) << ret.status().toString();
+
+  Expected<uint64_t> exptCommitId = kvstore->restart(false);
+  EXPECT_TRUE(exptCommitId.ok()) << exptCommitId.status().toString();
+  EXPECT_EQ(exptCommitId.value(), lastCommitId);
+
+  auto eTxn = kvstore->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  std::unique_ptr<Transaction> txn = std::move(eTxn.value());
+  for (const auto& key : keys) {
+    Expected<RecordValue> e =
+      kvstore->getKV(RecordKey(0, 0, RecordType::RT_KV, key, ""), txn.get());
+    EXPECT_TRUE(e.ok());
+  }
+  txn.reset();
+
+  // a file of the base backups changed fails the verification
+  meta = kvstore->getBackupMeta(dirs[0]);
+  EXPECT_TRUE(meta.ok());
+  for (const auto& kv : meta.value().getFileList()) {
+    if (filesystem::path(kv.first).extension() == ".sst") {
+      std::fstream f(dirs[0] + "/" + kv.first,
+                     std::ios::in | std::ios::out | std::ios::binary);
+      f.seekp(0);
+      f.put('x');
+    }
+  }
+  s = kvstore->stop();
+  EXPECT_TRUE(s.ok());
+  s = kvstore->clear();
+  EXPECT_TRUE(s.ok());
+  ret = kvstore->restoreBackup(dirs.back());
+  EXPECT_FALSE(ret.ok());
+  EXPECT_FALSE(filesystem::exists(kvstore->dbPath() + "/" + kvstore->dbId()));
+}
+
 TEST(RocksKVStore, BackupCopy) {
   auto cfg = genParams();
   string backup_dir = "backup";
@@ -996,6 +1144,644 @@ uint64_t getBinlogCount(Transaction* txn) {
   return cnt;
 }
 
+void bulkWriteRoutine(RocksKVStore* kvstore) {
+  auto eTxn1 = kvstore->createTransaction(nullptr);
+  auto eTxn2 = kvstore->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn1.ok());
+  EXPECT_TRUE(eTxn2.ok());
+  std::unique_ptr<Transaction> txn1 = std::move(eTxn1.value());
+  std::unique_ptr<Transaction> txn2 = std::move(eTxn2.value());
+
+  RecordKey rk(0, 0, RecordType::RT_KV, "a", "");
+  // the bulk writes are neither locked nor checked for conflicts, the
+  // keys are locked by the server layer
+  txn1->setBulkWrite(true);
+  Status s = kvstore->setKV(
+    Record(rk, RecordValue("txn1", RecordType::RT_KV, -1)), txn1.get());
+  EXPECT_TRUE(s.ok());
+  s = kvstore->setKV(
+    Record(rk, RecordValue("txn2", RecordType::RT_KV, -1)), txn2.get());
+  EXPECT_TRUE(s.ok());
+  EXPECT_TRUE(txn2->commit().ok());
+
+  // the writes after a savepoint can be rolled back
+  RecordKey rk1(0, 0, RecordType::RT_KV, "b", "");
+  txn1->setSavePoint();
+  s = kvstore->setKV(
+    Record(rk1, RecordValue("txn1", RecordType::RT_KV, -1)), txn1.get());
+  EXPECT_TRUE(s.ok());
+  EXPECT_TRUE(kvstore->getKV(rk1, txn1.get()).ok());
+  EXPECT_TRUE(txn1->rollbackToSavePoint().ok());
+  EXPECT_EQ(kvstore->getKV(rk1, txn1.get()).status().code(),
+            ErrorCodes::ERR_NOTFOUND);
+  EXPECT_EQ(kvstore->getKV(rk, txn1.get()).value(),
+            RecordValue("txn1", RecordType::RT_KV, -1));
+  EXPECT_TRUE(txn1->commit().ok());
+
+  auto eTxn3 = kvstore->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn3.ok());
+  EXPECT_EQ(kvstore->getKV(rk, eTxn3.value().get()).value(),
+            RecordValue("txn1", RecordType::RT_KV, -1));
+  EXPECT_EQ(kvstore->getKV(rk1, eTxn3.value().get()).status().code(),
+            ErrorCodes::ERR_NOTFOUND);
+  // one binlog for each transaction, without the writes rolled back
+  EXPECT_EQ(getBinlogCount(eTxn3.value().get()), 2u);
+}
+
+TEST(RocksKVStore, OptBulkWrite) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto kvstore = std::make_unique<RocksKVStore>("0",
+                                                cfg,
+                                                blockCache,
+                                                true,
+                                                KVStore::StoreMode::READ_WRITE,
+                                                RocksKVStore::TxnMode::TXN_OPT);
+  bulkWriteRoutine(kvstore.get());
+}
+
+TEST(RocksKVStore, PesBulkWrite) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto kvstore = std::make_unique<RocksKVStore>("0",
+                                                cfg,
+                                                blockCache,
+                                                true,
+                                                KVStore::StoreMode::READ_WRITE,
+                                                RocksKVStore::TxnMode::TXN_PES);
+  bulkWriteRoutine(kvstore.get());
+}
+
+TEST(RocksKVStore, GroupCommit) {
+  auto cfg = genParams();
+  cfg->rocksFlushLogAtTrxCommit = true;
+  cfg->rocksGroupCommitMaxTxns = 4;
+  cfg->rocksGroupCommitWindowUs = 100000;
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto kvstore = std::make_unique<RocksKVStore>("0",
+                                                cfg,
+                                                blockCache,
+                                                true,
+                                                KVStore::StoreMode::READ_WRITE,
+                                                RocksKVStore::TxnMode::TXN_PES);
+  EXPECT_TRUE(kvstore->groupCommitEnabled());
+
+  std::atomic<uint64_t> groups(0);
+  std::atomic<uint64_t> txns(0);
+  SyncPoint::GetInstance()->EnableProcessing();
+  SyncPoint::GetInstance()->SetCallBack(
+    "WalGroupSyncer::sync::group", [&](void* arg) {
+      groups++;
+      txns += *reinterpret_cast<uint64_t*>(arg);
+    });
+
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < 4; i++) {
+    threads.emplace_back([&kvstore, i]() {
+      for (uint32_t j = 0; j < 25; j++) {
+        auto eTxn = kvstore->createTransaction(nullptr);
+        EXPECT_TRUE(eTxn.ok());
+        RecordKey rk(
+          0, 0, RecordType::RT_KV, std::to_string(i * 100 + j), "");
+        auto s = kvstore->setKV(
+          Record(rk, RecordValue("v", RecordType::RT_KV, -1)),
+          eTxn.value().get());
+        EXPECT_TRUE(s.ok());
+        EXPECT_TRUE(eTxn.value()->commit().ok());
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(txns.load(), 100U);
+  EXPECT_LT(groups.load(), 100U);
+  // all the binlogs are visible after the syncs
+  EXPECT_EQ(kvstore->getHighestBinlogId() + 1, kvstore->getNextBinlogSeq());
+}
+
+// apply the binlogs on a slave store, group of them by one txn
+void applyBinlogGroups(RocksKVStore* store,
+                       const std::vector<ReplLogRawV2>& logs,
+                       size_t group) {
+  for (size_t i = 0; i < logs.size(); i += group) {
+    auto eTxn = store->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    auto txn = std::move(eTxn.value());
+    EXPECT_TRUE(txn->isReplOnly());
+    for (size_t j = i; j < std::min(i + group, logs.size()); j++) {
+      auto key = ReplLogKeyV2::decode(logs[j].getReplLogKey());
+      auto value = ReplLogValueV2::decode(logs[j].getReplLogValue());
+      EXPECT_TRUE(key.ok() && value.ok());
+      size_t offset = value.value().getHdrSize();
+      auto data = value.value().getData();
+      size_t dataSize = value.value().getDataSize();
+      while (offset < dataSize) {
+        size_t size = 0;
+        auto entry = ReplLogValueEntryV2::decode(
+          (const char*)data + offset, dataSize - offset, &size);
+        EXPECT_TRUE(entry.ok());
+        offset += size;
+        EXPECT_TRUE(txn->applyBinlog(entry.value()).ok());
+      }
+      auto s = txn->setBinlogKV(key.value().getBinlogId(),
+                                logs[j].getReplLogKey(),
+                                logs[j].getReplLogValue());
+      EXPECT_TRUE(s.ok());
+    }
+    EXPECT_TRUE(txn->commit().ok());
+  }
+}
+
+TEST(RocksKVStore, ApplyBinlogGroup) {
+  auto cfg = genParams();
+  cfg->replApplyBatch = 3;
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto master = std::make_unique<RocksKVStore>("0",
+                                               cfg,
+                                               blockCache,
+                                               true,
+                                               KVStore::StoreMode::READ_WRITE,
+                                               RocksKVStore::TxnMode::TXN_PES);
+  auto slave =
+    std::make_shared<RocksKVStore>("1",
+                                   cfg,
+                                   blockCache,
+                                   true,
+                                   KVStore::StoreMode::REPLICATE_ONLY,
+                                   RocksKVStore::TxnMode::TXN_PES);
+  auto svr = std::make_shared<ServerEntry>(cfg);
+  BinlogApplier applier(svr.get(), 2);
+  EXPECT_TRUE(applier.startup(2).ok());
+  const auto applierGuard = MakeGuard([&applier] { applier.stop(); });
+
+  // two keys of different lanes, see BinlogApplier::prepare()
+  std::string a = "a";
+  std::string b;
+  for (int i = 0; b.empty(); i++) {
+    std::string key = "b" + std::to_string(i);
+    if (std::hash<std::string>()(key) % 2 != std::hash<std::string>()(a) % 2) {
+      b = key;
+    }
+  }
+  // a binlog for each txn, writing the keys
+  std::vector<std::vector<std::string>> txns = {
+    {a}, {a}, {a}, {a}, {b}, {b}, {a, b}, {a}, {a}};
+  for (size_t i = 0; i < txns.size(); i++) {
+    auto eTxn = master->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    for (const auto& key : txns[i]) {
+      RecordKey rk(0, 0, RecordType::RT_KV, key, "");
+      auto s = master->setKV(
+        Record(rk, RecordValue(std::to_string(i), RecordType::RT_KV, -1)),
+        eTxn.value().get());
+      EXPECT_TRUE(s.ok());
+    }
+    EXPECT_TRUE(eTxn.value()->commit().ok());
+  }
+  std::vector<ReplLogRawV2> logs;
+  {
+    auto eTxn = master->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    auto cursor = eTxn.value()->createRepllogCursorV2(1);
+    while (true) {
+      auto log = cursor->next();
+      if (log.status().code() == ErrorCodes::ERR_EXHAUST) {
+        break;
+      }
+      EXPECT_TRUE(log.ok());
+      logs.emplace_back(std::move(log.value()));
+    }
+  }
+  ASSERT_EQ(logs.size(), txns.size());
+  uint64_t firstId = logs.front().getBinlogId();
+
+  // the txns committed by the applier, with their first and last binlog
+  std::mutex mutex;
+  std::vector<std::pair<uint64_t, uint64_t>> applied;
+  SyncPoint::GetInstance()->SetCallBack(
+    "BinlogApplier::applyTask", [&](void* arg) {
+      auto point =
+        reinterpret_cast<std::tuple<uint64_t, uint64_t, Status>*>(arg);
+      std::lock_guard<std::mutex> lk(mutex);
+      applied.emplace_back(std::get<0>(*point), std::get<1>(*point));
+    });
+  SyncPoint::GetInstance()->EnableProcessing();
+  const auto syncGuard = MakeGuard([] {
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+  });
+
+  // group the binlogs the same as BinlogApplier::apply(), the tasks of
+  // each segment are checked before it's drained
+  std::vector<std::vector<std::tuple<uint64_t, uint64_t, size_t, bool>>>
+    segments;
+  std::vector<BinlogApplier::PTask> segment;
+  BinlogResult result;
+  auto drain = [&]() {
+    if (segment.empty()) {
+      return;
+    }
+    segments.emplace_back();
+    for (const auto& task : segment) {
+      EXPECT_EQ(task->binlogs, task->binlogId - task->firstId + 1);
+      segments.back().emplace_back(
+        task->firstId - firstId, task->binlogId - firstId, task->lane,
+        task->barrier);
+    }
+    EXPECT_TRUE(applier.drain(&segment, &result).ok());
+    EXPECT_TRUE(segment.empty());
+  };
+  for (auto& log : logs) {
+    bool barrier = false;
+    auto task = applier.prepare(&log, &barrier);
+    EXPECT_TRUE(task.ok());
+    if (barrier) {
+      drain();
+    }
+    auto s =
+      applier.addTask(nullptr, slave, &log, std::move(task.value()), &segment);
+    EXPECT_TRUE(s.ok());
+    if (barrier) {
+      drain();
+    }
+  }
+  drain();
+
+  // the binlogs in a row of a lane are grouped, at most repl-apply-batch
+  // of them, the one writing the keys of both lanes is applied alone
+  size_t laneA = std::hash<std::string>()(a) % 2;
+  size_t laneB = 1 - laneA;
+  ASSERT_EQ(segments.size(), 3U);
+  ASSERT_EQ(segments[0].size(), 3U);
+  EXPECT_EQ(segments[0][0], std::make_tuple(0U, 2U, laneA, false));
+  EXPECT_EQ(segments[0][1], std::make_tuple(3U, 3U, laneA, false));
+  EXPECT_EQ(segments[0][2], std::make_tuple(4U, 5U, laneB, false));
+  ASSERT_EQ(segments[1].size(), 1U);
+  EXPECT_EQ(std::get<0>(segments[1][0]), 6U);
+  EXPECT_EQ(std::get<1>(segments[1][0]), 6U);
+  EXPECT_TRUE(std::get<3>(segments[1][0]));
+  ASSERT_EQ(segments[2].size(), 1U);
+  EXPECT_EQ(segments[2][0], std::make_tuple(7U, 8U, laneA, false));
+
+  // a txn is committed for each group
+  std::sort(applied.begin(), applied.end());
+  std::vector<std::pair<uint64_t, uint64_t>> groups = {
+    {0, 2}, {3, 3}, {4, 5}, {6, 6}, {7, 8}};
+  ASSERT_EQ(applied.size(), groups.size());
+  for (size_t i = 0; i < groups.size(); i++) {
+    EXPECT_EQ(applied[i].first, firstId + groups[i].first);
+    EXPECT_EQ(applied[i].second, firstId + groups[i].second);
+  }
+  EXPECT_EQ(result.binlogId, logs.back().getBinlogId());
+  EXPECT_EQ(applier.appliedBinlogs(), logs.size());
+  EXPECT_EQ(applier.appliedTxns(), groups.size());
+
+  // the binlogs are all visible and kept as the master's, and the keys
+  // have the values of the last txns writing them
+  EXPECT_EQ(slave->getHighestBinlogId(), logs.back().getBinlogId());
+  EXPECT_EQ(slave->getNextBinlogSeq(), logs.back().getBinlogId() + 1);
+  auto eTxn = slave->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  auto cursor = eTxn.value()->createRepllogCursorV2(1);
+  for (const auto& log : logs) {
+    auto v = cursor->next();
+    EXPECT_TRUE(v.ok());
+    EXPECT_EQ(v.value().getReplLogKey(), log.getReplLogKey());
+    EXPECT_EQ(v.value().getReplLogValue(), log.getReplLogValue());
+  }
+  EXPECT_EQ(cursor->next().status().code(), ErrorCodes::ERR_EXHAUST);
+  for (const auto& kv : {std::make_pair(a, "8"), std::make_pair(b, "6")}) {
+    RecordKey rk(0, 0, RecordType::RT_KV, kv.first, "");
+    auto v = slave->getKV(rk, eTxn.value().get());
+    EXPECT_TRUE(v.ok());
+    EXPECT_EQ(v.value().getValue(), kv.second);
+  }
+
+  // the throughput of the applier, with groups of 1 and 64 binlogs
+  SyncPoint::GetInstance()->DisableProcessing();
+  const size_t count = 5000;
+  for (size_t i = 0; i < count; i++) {
+    auto eTxn = master->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    RecordKey rk(0, 0, RecordType::RT_KV, std::to_string(i % 100), "");
+    auto s = master->setKV(
+      Record(rk, RecordValue(std::to_string(i), RecordType::RT_KV, -1)),
+      eTxn.value().get());
+    EXPECT_TRUE(s.ok());
+    EXPECT_TRUE(eTxn.value()->commit().ok());
+  }
+  logs.clear();
+  {
+    auto eTxn = master->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    auto cursor = eTxn.value()->createRepllogCursorV2(1);
+    while (true) {
+      auto log = cursor->next();
+      if (log.status().code() == ErrorCodes::ERR_EXHAUST) {
+        break;
+      }
+      EXPECT_TRUE(log.ok());
+      logs.emplace_back(std::move(log.value()));
+    }
+  }
+  ASSERT_EQ(logs.size(), txns.size() + count);
+  uint64_t lastId = master->getHighestBinlogId();
+
+  for (uint32_t group : {1, 64}) {
+    cfg->replApplyBatch = group;
+    auto store = std::make_shared<RocksKVStore>(
+      std::to_string(group + 1),
+      cfg,
+      blockCache,
+      true,
+      KVStore::StoreMode::REPLICATE_ONLY,
+      RocksKVStore::TxnMode::TXN_PES);
+    // a single lane, the binlogs are grouped in the order of their ids
+    BinlogApplier groupApplier(svr.get(), 1);
+    EXPECT_TRUE(groupApplier.startup(1).ok());
+    const auto groupGuard =
+      MakeGuard([&groupApplier] { groupApplier.stop(); });
+
+    uint64_t start = nsSinceEpoch();
+    std::vector<BinlogApplier::PTask> tasks;
+    for (auto& log : logs) {
+      bool barrier = false;
+      auto task = groupApplier.prepare(&log, &barrier);
+      EXPECT_TRUE(task.ok());
+      if (barrier && !tasks.empty()) {
+        EXPECT_TRUE(groupApplier.drain(&tasks, &result).ok());
+      }
+      auto s = groupApplier.addTask(
+        nullptr, store, &log, std::move(task.value()), &tasks);
+      EXPECT_TRUE(s.ok());
+      if (barrier || tasks.size() >= 1024) {
+        EXPECT_TRUE(groupApplier.drain(&tasks, &result).ok());
+      }
+    }
+    if (!tasks.empty()) {
+      EXPECT_TRUE(groupApplier.drain(&tasks, &result).ok());
+    }
+    uint64_t ns = std::max(nsSinceEpoch() - start, static_cast<uint64_t>(1));
+    LOG(INFO) << "apply binlogs by groups of " << group << ": "
+              << logs.size() * 1000000000ULL / ns << " binlogs/s, "
+              << groupApplier.appliedTxns() << " txns";
+
+    EXPECT_EQ(groupApplier.appliedBinlogs(), logs.size());
+    EXPECT_LE(groupApplier.appliedTxns(),
+              (logs.size() + group - 1) / group + 1);
+    EXPECT_EQ(store->getHighestBinlogId(), lastId);
+    EXPECT_EQ(store->getNextBinlogSeq(), lastId + 1);
+    auto eTxn = store->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    RecordKey rk(
+      0, 0, RecordType::RT_KV, std::to_string((count - 1) % 100), "");
+    auto v = store->getKV(rk, eTxn.value().get());
+    EXPECT_TRUE(v.ok());
+    EXPECT_EQ(v.value().getValue(), std::to_string(count - 1));
+  }
+}
+
+TEST(BinlogTailCache, Common) {
+  auto entry = [](uint64_t id) {
+    return BinlogTailCache::Entry{
+      id, "k" + std::to_string(id), std::string(100, 'v')};
+  };
+  using Result = BinlogTailCache::Result;
+  BinlogTailCache cache;
+  std::string k, v;
+  EXPECT_EQ(cache.get(1, &k, &v), Result::MISS);
+
+  // 1 committed, 2 aborted, 3 and 4 committed by one txn
+  cache.add(1, {entry(1)});
+  cache.publish(1, true, 1024);
+  cache.publish(2, false, 1024);
+  cache.add(4, {entry(3), entry(4)});
+  cache.publish(4, true, 1024);
+  EXPECT_EQ(cache.get(1, &k, &v), Result::HIT);
+  EXPECT_EQ(cache.get(2, &k, &v), Result::HOLE);
+  EXPECT_EQ(cache.get(3, &k, &v), Result::HIT);
+  EXPECT_EQ(k, "k3");
+  EXPECT_EQ(cache.get(4, &k, &v), Result::HIT);
+  EXPECT_EQ(cache.get(5, &k, &v), Result::MISS);
+  EXPECT_EQ(cache.count(), 3U);
+
+  // a binlog committed but unknown restarts it
+  cache.publish(5, true, 1024);
+  EXPECT_EQ(cache.get(4, &k, &v), Result::MISS);
+  EXPECT_EQ(cache.get(5, &k, &v), Result::MISS);
+  EXPECT_EQ(cache.count(), 0U);
+
+  // the oldest ones are evicted
+  for (uint64_t id = 6; id <= 20; id++) {
+    cache.add(id, {entry(id)});
+    cache.publish(id, true, 350);
+  }
+  EXPECT_EQ(cache.count(), 3U);
+  EXPECT_EQ(cache.get(17, &k, &v), Result::MISS);
+  EXPECT_EQ(cache.get(18, &k, &v), Result::HIT);
+
+  // the binlogs out of order restart it too
+  cache.add(10, {entry(10)});
+  cache.publish(10, true, 350);
+  EXPECT_EQ(cache.get(20, &k, &v), Result::MISS);
+  EXPECT_EQ(cache.count(), 0U);
+}
+
+TEST(RocksKVStore, BinlogTailCache) {
+  auto cfg = genParams();
+  cfg->binlogCacheMB = 1;
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto master = std::make_unique<RocksKVStore>("0", cfg, blockCache);
+  const size_t count = 1000;
+  for (size_t i = 0; i < count; i++) {
+    auto eTxn = master->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    RecordKey rk(0, 0, RecordType::RT_KV, std::to_string(i), "");
+    auto s = master->setKV(
+      Record(rk, RecordValue(std::to_string(i), RecordType::RT_KV, -1)),
+      eTxn.value().get());
+    EXPECT_TRUE(s.ok());
+    EXPECT_TRUE(eTxn.value()->commit().ok());
+  }
+
+  // the cursor reads the same binlogs with or without the cache
+  auto readAll = [](RocksKVStore* store, bool useCache) {
+    std::vector<ReplLogRawV2> logs;
+    auto eTxn = store->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    auto cursor = eTxn.value()->createRepllogCursorV2(1);
+    if (useCache) {
+      cursor->setCache(store->getBinlogCache());
+    }
+    while (true) {
+      auto log = cursor->next();
+      if (log.status().code() == ErrorCodes::ERR_EXHAUST) {
+        break;
+      }
+      EXPECT_TRUE(log.ok());
+      logs.emplace_back(std::move(log.value()));
+    }
+    return logs;
+  };
+  auto logs = readAll(master.get(), false);
+  auto cached = readAll(master.get(), true);
+  EXPECT_EQ(logs.size(), count);
+  EXPECT_EQ(cached.size(), count);
+  for (size_t i = 0; i < count; i++) {
+    EXPECT_EQ(logs[i].getReplLogKey(), cached[i].getReplLogKey());
+    EXPECT_EQ(logs[i].getReplLogValue(), cached[i].getReplLogValue());
+  }
+  EXPECT_EQ(master->getBinlogCache()->count(), count);
+  EXPECT_EQ(master->getBinlogCache()->hits(), count);
+
+  // the binlogs applied by groups on a slave are cached too
+  auto slave =
+    std::make_unique<RocksKVStore>("1",
+                                   cfg,
+                                   blockCache,
+                                   true,
+                                   KVStore::StoreMode::REPLICATE_ONLY,
+                                   RocksKVStore::TxnMode::TXN_PES);
+  applyBinlogGroups(slave.get(), logs, 16);
+  EXPECT_EQ(slave->getBinlogCache()->count(), count);
+  cached = readAll(slave.get(), true);
+  EXPECT_EQ(cached.size(), count);
+  EXPECT_EQ(slave->getBinlogCache()->misses(), 0U);
+  for (size_t i = 0; i < count; i++) {
+    EXPECT_EQ(logs[i].getReplLogValue(), cached[i].getReplLogValue());
+  }
+
+  // the cache is dropped with the store stopped
+  EXPECT_TRUE(master->stop().ok());
+  EXPECT_EQ(master->getBinlogCache()->count(), 0U);
+}
+
+TEST(RocksKVStore, WriteStall) {
+  auto cfg = genParams();
+  cfg->writeStallControl = true;
+  cfg->writeStallDelayUs = 100000;
+  cfg->writeStallCheckIntervalMs = 0;
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto kvstore = std::make_unique<RocksKVStore>("0",
+                                                cfg,
+                                                blockCache,
+                                                true,
+                                                KVStore::StoreMode::READ_WRITE,
+                                                RocksKVStore::TxnMode::TXN_PES);
+  uint64_t slot = 0;
+  EXPECT_TRUE(kvstore->admitWrite(&slot).ok());
+  EXPECT_EQ(slot, 0U);
+  EXPECT_NE(kvstore->getWriteStallInfo().find("state=normal"),
+            std::string::npos);
+
+  using State = WriteStallMonitor::State;
+  std::atomic<State> forced(State::NORMAL);
+  SyncPoint::GetInstance()->EnableProcessing();
+  SyncPoint::GetInstance()->SetCallBack(
+    "WriteStallMonitor::refresh",
+    [&](void* arg) { *reinterpret_cast<State*>(arg) = forced.load(); });
+
+  // the writes take the slots one per interval in order, the ones not
+  // admitted now fail at once with the time of their slots
+  forced = State::DELAYED;
+  EXPECT_TRUE(kvstore->admitWrite(&slot).ok());
+  auto start = msSinceEpoch();
+  uint64_t slot1 = 0;
+  auto s = kvstore->admitWrite(&slot1);
+  EXPECT_EQ(s.code(), ErrorCodes::ERR_WRITE_STALL);
+  EXPECT_EQ(s.toString().find("-TRYAGAIN"), 0U);
+  EXPECT_GT(slot1, start * 1000);
+  uint64_t slot2 = 0;
+  s = kvstore->admitWrite(&slot2);
+  EXPECT_EQ(s.code(), ErrorCodes::ERR_WRITE_STALL);
+  EXPECT_EQ(slot2, slot1 + 100000);
+  // tried again before the slot, it is kept
+  uint64_t kept = slot1;
+  s = kvstore->admitWrite(&slot1);
+  EXPECT_EQ(s.code(), ErrorCodes::ERR_WRITE_STALL);
+  EXPECT_EQ(slot1, kept);
+  EXPECT_LT(msSinceEpoch() - start, 100U);
+  auto info = kvstore->getWriteStallInfo();
+  EXPECT_NE(info.find("state=delayed"), std::string::npos);
+  EXPECT_NE(info.find("delayed_writes=1"), std::string::npos);
+  EXPECT_NE(info.find("stalled_tries=3"), std::string::npos);
+  // admitted at the slot
+  std::this_thread::sleep_for(std::chrono::milliseconds(110));
+  EXPECT_TRUE(kvstore->admitWrite(&slot1).ok());
+  EXPECT_EQ(slot1, 0U);
+
+  // no write at all, they are tried again after the signals are sampled
+  forced = State::STOPPED;
+  start = msSinceEpoch();
+  for (int i = 0; i < 10; i++) {
+    s = kvstore->admitWrite(&slot2);
+    EXPECT_EQ(s.code(), ErrorCodes::ERR_WRITE_STALL);
+    EXPECT_GE(slot2, start * 1000 + 100000);
+  }
+  EXPECT_LT(msSinceEpoch() - start, 100U);
+  info = kvstore->getWriteStallInfo();
+  EXPECT_NE(info.find("state=stopped"), std::string::npos);
+  EXPECT_NE(info.find("delayed_writes=2"), std::string::npos);
+  EXPECT_NE(info.find("stalled_tries=13"), std::string::npos);
+
+  // admitted once the store recovers
+  forced = State::NORMAL;
+  EXPECT_TRUE(kvstore->admitWrite(&slot2).ok());
+  EXPECT_EQ(slot2, 0U);
+
+  // disabled
+  forced = State::STOPPED;
+  cfg->writeStallControl = false;
+  EXPECT_TRUE(kvstore->admitWrite(&slot).ok());
+}
+
 TEST(RocksKVStore, PesTruncateBinlog) {
   auto cfg = genParams();
   EXPECT_TRUE(filesystem::create_directory("db"));
@@ -1074,8 +1860,14 @@ TEST(RocksKVStore, PesTruncateBinlog) {
     uint64_t written = 0;
     uint64_t deleten = 0;
     // TODO(takenliu): save binlog
-    auto s = kvstore->truncateBinlogV2(
-      firstBinlog, firstBinlog, firstBinlog, txn1.get(), nullptr, 0, false);
+    auto s = kvstore->truncateBinlogV2(firstBinlog,
+                                       firstBinlog,
+                                       firstBinlog,
+                                       txn1.get(),
+                                       nullptr,
+                                       nullptr,
+                                       0,
+                                       false);
     EXPECT_TRUE(s.ok());
     ts = s.value().timestamp;
     written = s.value().written;
@@ -1173,6 +1965,7 @@ TEST(RocksKVStore, PesTruncateBinlog) {
                                          firstBinlog,
                                          txn2.get(),
                                          nullptr,
+                                         nullptr,
                                          0,
                                          false);
       EXPECT_TRUE(s.ok());
@@ -1212,6 +2005,91 @@ TEST(RocksKVStore, PesTruncateBinlog) {
   testMaxBinlogId(kvstore);
 }
 
+TEST(RocksKVStore, TruncateBinlogArchive) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const std::string path = "truncate_binlog_archive.log";
+  const auto guard = MakeGuard([&path] {
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    filesystem::remove(path);
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  cfg->minBinlogKeepSec = 0;
+  cfg->binlogDelRange = 10;
+  auto kvstore = std::make_unique<RocksKVStore>("0",
+                                                cfg,
+                                                blockCache,
+                                                true,
+                                                KVStore::StoreMode::READ_WRITE,
+                                                RocksKVStore::TxnMode::TXN_PES);
+
+  LocalSessionGuard sg(nullptr);
+  for (int i = 0; i < 105; i++) {
+    auto eTxn = kvstore->createTransaction(sg.getSession());
+    EXPECT_TRUE(eTxn.ok());
+    RecordKey rk(0, 1, RecordType::RT_KV, std::to_string(i), "");
+    RecordValue rv("v", RecordType::RT_KV, -1);
+    EXPECT_TRUE(kvstore->setKV(rk, rv, eTxn.value().get()).ok());
+    EXPECT_TRUE(eTxn.value()->commit().ok());
+  }
+  uint64_t first = 0;
+  {
+    auto eTxn = kvstore->createTransaction(sg.getSession());
+    EXPECT_TRUE(eTxn.ok());
+    first = RepllogCursorV2::getMinBinlogId(eTxn.value().get()).value();
+  }
+
+  // the binlogs buffered by the archive are on the disk before the range
+  // of them is deleted
+  BinlogArchiveWriter archive(path, 0, 1024 * 1024, false);
+  EXPECT_TRUE(archive.open().ok());
+  uint64_t deleteRange = 0;
+  SyncPoint::GetInstance()->EnableProcessing();
+  SyncPoint::GetInstance()->SetCallBack(
+    "RocksKVStore::truncateBinlogV2::deleteRange", [&](void* arg) {
+      deleteRange = *static_cast<uint64_t*>(arg);
+      BinlogArchiveReader reader(path);
+      EXPECT_TRUE(reader.open().ok());
+      EXPECT_FALSE(reader.blocks().empty());
+      EXPECT_GE(reader.blocks().back().lastId + 1, deleteRange);
+    });
+
+  auto eTxn = kvstore->createTransaction(sg.getSession());
+  EXPECT_TRUE(eTxn.ok());
+  auto txn = std::move(eTxn.value());
+  auto s = kvstore->truncateBinlogV2(
+    first, first + 100, first, txn.get(), nullptr, &archive, 1 << 30, false);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(deleteRange, first + 100);
+  EXPECT_EQ(s.value().newStart, first + 100);
+  EXPECT_EQ(s.value().newSave, first + 101);
+  EXPECT_EQ(s.value().deleten, 100U);
+  // committed with the range deleted, the txn doesn't delete binlogs
+  EXPECT_EQ(archive.committedId(), first + 100);
+  EXPECT_TRUE(txn->commit().ok());
+  EXPECT_TRUE(archive.finish().ok());
+
+  {
+    auto eTxn = kvstore->createTransaction(sg.getSession());
+    EXPECT_TRUE(eTxn.ok());
+    auto min = RepllogCursorV2::getMinBinlogId(eTxn.value().get());
+    EXPECT_EQ(min.value(), first + 100);
+  }
+  BinlogArchiveReader reader(path);
+  EXPECT_TRUE(reader.open().ok());
+  for (uint64_t id = first; id <= first + 100; id++) {
+    auto log = reader.next();
+    EXPECT_TRUE(log.ok());
+    EXPECT_EQ(log.value().getBinlogId(), id);
+  }
+  EXPECT_EQ(reader.next().status().code(), ErrorCodes::ERR_EXHAUST);
+}
+
 TEST(RocksKVStore, Compaction) {
   auto cfg = genParams();
   EXPECT_TRUE(filesystem::create_directory("db"));
@@ -1251,12 +2129,22 @@ TEST(RocksKVStore, Compaction) {
       totalExpired = *tmp;
     });
 
+  uint64_t totalSubKeyExpired = 0;
+  SyncPoint::GetInstance()->SetCallBack(
+    "InspectSubKeyExpiredCount", [&](void* arg) mutable {
+      uint64_t* tmp = reinterpret_cast<uint64_t*>(arg);
+      totalSubKeyExpired = *tmp;
+    });
+
   uint32_t waitSec = 10;
-  // if we want to check the totalFilter, all data should be different
-  genData(kvstore.get(), 1000, 0, true);
-  size_t kvCount = genData(kvstore.get(), 1000, msSinceEpoch(), true);
-  size_t kvCount2 =
-    genData(kvstore.get(), 1000, msSinceEpoch() + waitSec * 1000, true);
+  // if we want to check the totalFilter, all data should be different.
+  // the subkeys have no meta, they are dropped by the first compaction.
+  size_t eleCount = 0;
+  genData(kvstore.get(), 1000, 0, true, &eleCount);
+  size_t kvCount =
+    genData(kvstore.get(), 1000, msSinceEpoch(), true, &eleCount);
+  size_t kvCount2 = genData(
+    kvstore.get(), 1000, msSinceEpoch() + waitSec * 1000, true, &eleCount);
 
   std::this_thread::sleep_for(std::chrono::seconds(1));
   // compact data in the default column family
@@ -1271,6 +2159,7 @@ TEST(RocksKVStore, Compaction) {
     EXPECT_EQ(totalFilter, 3000);
   }
   EXPECT_EQ(totalExpired, kvCount);
+  EXPECT_EQ(totalSubKeyExpired, eleCount);
 
   std::this_thread::sleep_for(std::chrono::seconds(waitSec));
 
@@ -1280,13 +2169,198 @@ TEST(RocksKVStore, Compaction) {
   EXPECT_TRUE(hasCalled);
 
   if (cfg->binlogUsingDefaultCF == true) {
-    EXPECT_EQ(totalFilter, 3000 * 2 - kvCount);
+    EXPECT_EQ(totalFilter, 3000 * 2 - kvCount - eleCount);
   } else {
-    EXPECT_EQ(totalFilter, 3000 - kvCount);
+    EXPECT_EQ(totalFilter, 3000 - kvCount - eleCount);
   }
   EXPECT_EQ(totalExpired, kvCount2);
+  EXPECT_EQ(totalSubKeyExpired, 0U);
 
   testMaxBinlogId(kvstore);
 }
 
+TEST(RocksKVStore, CompactionSubKeys) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto kvstore = std::make_unique<RocksKVStore>("0",
+                                                cfg,
+                                                blockCache,
+                                                true,
+                                                KVStore::StoreMode::READ_WRITE,
+                                                RocksKVStore::TxnMode::TXN_PES);
+
+  SyncPoint::GetInstance()->EnableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  uint64_t subKeyExpired = 0;
+  SyncPoint::GetInstance()->SetCallBack(
+    "InspectSubKeyExpiredCount", [&](void* arg) mutable {
+      subKeyExpired += *reinterpret_cast<uint64_t*>(arg);
+    });
+  uint64_t ttlIndexStale = 0;
+  SyncPoint::GetInstance()->SetCallBack(
+    "InspectTtlIndexStaleCount", [&](void* arg) mutable {
+      ttlIndexStale += *reinterpret_cast<uint64_t*>(arg);
+    });
+
+  auto slot = [](const std::string& key) {
+    return redis_port::keyHashSlot(key.c_str(), key.size());
+  };
+  uint64_t now = msSinceEpoch();
+  uint64_t aliveTtl = now + 3600 * 1000;
+  auto eTxn = kvstore->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  auto txn = eTxn.value().get();
+  auto setHash = [&](const std::string& key, uint64_t ttl) {
+    RecordKey mk(slot(key), 0, RecordType::RT_HASH_META, key, "");
+    RecordValue mv("", RecordType::RT_HASH_META, -1, ttl);
+    EXPECT_TRUE(kvstore->setKV(mk, mv, txn).ok());
+    for (auto field : {"f1", "f2"}) {
+      RecordKey sk(slot(key), 0, RecordType::RT_HASH_ELE, key, field);
+      RecordValue sv("v", RecordType::RT_HASH_ELE, -1);
+      EXPECT_TRUE(kvstore->setKV(sk, sv, txn).ok());
+    }
+    if (ttl > 0) {
+      TTLIndex index(key, RecordType::RT_HASH_META, 0, ttl);
+      EXPECT_TRUE(txn->setKV(index.encode(), "").ok());
+    }
+  };
+  setHash("alive", aliveTtl);
+  setHash("expired", now - 1000);
+  setHash("deleted", 0);
+  // a subkey of another type, the ttl indexes of a missing key and of
+  // an old ttl
+  RecordKey setEle(slot("alive"), 0, RecordType::RT_SET_ELE, "alive", "m");
+  RecordValue setVal("", RecordType::RT_SET_ELE, -1);
+  EXPECT_TRUE(kvstore->setKV(setEle, setVal, txn).ok());
+  TTLIndex staleIndex1("nokey", RecordType::RT_HASH_META, 0, now);
+  EXPECT_TRUE(txn->setKV(staleIndex1.encode(), "").ok());
+  TTLIndex staleIndex2("alive", RecordType::RT_HASH_META, 0, now);
+  EXPECT_TRUE(txn->setKV(staleIndex2.encode(), "").ok());
+  RecordKey deletedMeta(
+    slot("deleted"), 0, RecordType::RT_HASH_META, "deleted", "");
+  EXPECT_TRUE(kvstore->delKV(deletedMeta, txn).ok());
+  EXPECT_TRUE(eTxn.value()->commit().ok());
+
+  auto status = kvstore->compactRange(
+    ColumnFamilyNumber::ColumnFamily_Default, nullptr, nullptr);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(subKeyExpired, 5U);
+  EXPECT_EQ(ttlIndexStale, 2U);
+
+  eTxn = kvstore->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  txn = eTxn.value().get();
+  for (auto key : {"alive", "expired", "deleted"}) {
+    RecordKey sk(slot(key), 0, RecordType::RT_HASH_ELE, key, "f1");
+    EXPECT_EQ(kvstore->getKV(sk, txn).ok(), std::string(key) == "alive");
+  }
+  EXPECT_FALSE(kvstore->getKV(setEle, txn).ok());
+  // the meta of an expired key is deleted by the IndexManager
+  RecordKey expiredMeta(
+    slot("expired"), 0, RecordType::RT_HASH_META, "expired", "");
+  EXPECT_TRUE(kvstore->getKV(expiredMeta, txn).ok());
+  TTLIndex aliveIndex("alive", RecordType::RT_HASH_META, 0, aliveTtl);
+  EXPECT_TRUE(txn->getKV(aliveIndex.encode()).ok());
+  EXPECT_FALSE(txn->getKV(staleIndex1.encode()).ok());
+  EXPECT_FALSE(txn->getKV(staleIndex2.encode()).ok());
+}
+
+TEST(RocksKVStore, CompactionNoTime) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    SyncPoint::GetInstance()->DisableProcessing();
+    SyncPoint::GetInstance()->ClearAllCallBacks();
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto kvstore = std::make_unique<RocksKVStore>("0",
+                                                cfg,
+                                                blockCache,
+                                                true,
+                                                KVStore::StoreMode::READ_WRITE,
+                                                RocksKVStore::TxnMode::TXN_PES);
+
+  SyncPoint::GetInstance()->EnableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  uint64_t dropped = 0;
+  for (auto name : {"InspectKvTtlExpiredCount",
+                    "InspectSubKeyExpiredCount",
+                    "InspectTtlIndexStaleCount"}) {
+    SyncPoint::GetInstance()->SetCallBack(name, [&](void* arg) mutable {
+      dropped += *reinterpret_cast<uint64_t*>(arg);
+    });
+  }
+
+  auto slot = [](const std::string& key) {
+    return redis_port::keyHashSlot(key.c_str(), key.size());
+  };
+  uint64_t now = msSinceEpoch();
+  std::vector<RecordKey> keys;
+  std::vector<std::string> indexes;
+  auto eTxn = kvstore->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  auto txn = eTxn.value().get();
+  auto setKey = [&](const std::string& key,
+                    RecordType type,
+                    RecordType eleType,
+                    uint64_t ttl) {
+    RecordKey mk(slot(key), 0, type, key, "");
+    RecordValue mv("", type, -1, ttl);
+    EXPECT_TRUE(kvstore->setKV(mk, mv, txn).ok());
+    keys.push_back(mk);
+    for (auto field : {"f1", "f2"}) {
+      RecordKey sk(slot(key), 0, eleType, key, field);
+      RecordValue sv("v", eleType, -1);
+      EXPECT_TRUE(kvstore->setKV(sk, sv, txn).ok());
+      keys.push_back(sk);
+    }
+    TTLIndex index(key, type, 0, ttl);
+    EXPECT_TRUE(txn->setKV(index.encode(), "").ok());
+    indexes.push_back(index.encode());
+  };
+  // expired and alive, by the time of the master
+  for (uint64_t ttl : {now - 1000, now + 3600 * 1000}) {
+    auto suffix = std::to_string(ttl);
+    setKey("hash" + suffix,
+           RecordType::RT_HASH_META,
+           RecordType::RT_HASH_ELE,
+           ttl);
+    setKey(
+      "set" + suffix, RecordType::RT_SET_META, RecordType::RT_SET_ELE, ttl);
+  }
+  EXPECT_TRUE(eTxn.value()->commit().ok());
+  eTxn.value().reset();
+
+  // a slave which has not applied a binlog yet, the time is 0
+  EXPECT_TRUE(kvstore->setMode(KVStore::StoreMode::REPLICATE_ONLY).ok());
+  EXPECT_EQ(kvstore->getCurrentTime(), 0U);
+  auto status = kvstore->compactRange(
+    ColumnFamilyNumber::ColumnFamily_Default, nullptr, nullptr);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(dropped, 0U);
+
+  eTxn = kvstore->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  txn = eTxn.value().get();
+  for (const auto& key : keys) {
+    EXPECT_TRUE(txn->getKV(key.encode()).ok()) << key.getPrimaryKey();
+  }
+  for (const auto& index : indexes) {
+    EXPECT_TRUE(txn->getKV(index).ok());
+  }
+}
+
 }  // namespace tendisplus
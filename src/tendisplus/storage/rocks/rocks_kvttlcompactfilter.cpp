@@ -4,30 +4,53 @@
 
 #include <string>
 #include <memory>
-#include <limits>
+#include <unordered_map>
 #include "rocksdb/compaction_filter.h"
 #include "tendisplus/storage/rocks/rocks_kvttlcompactfilter.h"
 #include "tendisplus/storage/record.h"
 #include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/redis_port.h"
 #include "tendisplus/utils/time.h"
 #include "tendisplus/utils/sync_point.h"
 #include "glog/logging.h"
 
 namespace tendisplus {
+// Besides the expired RT_KV, the filter drops:
+// 1. the subkeys whose meta is expired, missing, or of another type.
+//    They can't be read any more, the meta of an expired collection is
+//    still deleted by the IndexManager, which writes the binlog.
+// 2. the RT_TTL_INDEX whose meta is missing or has another ttl.
+// The metas are read from the db, and cached in the filter. A meta
+// found expired or missing never comes back to the subkeys being
+// compacted: a new key with the same name is written after deleting
+// the old subkeys, so its subkeys are newer than the compaction.
+// Masters and slaves compact independently. It is safe because the
+// slave time is the binlog time, which is behind the master. A slave
+// which has not applied a binlog yet has no time, nothing is dropped.
 class KVTtlCompactionFilter : public CompactionFilter {
  public:
-  explicit KVTtlCompactionFilter(KVStore* store, uint64_t current_time)
-    : _store(store), _currentTime(current_time) {}
+  KVTtlCompactionFilter(KVStore* store,
+                        rocksdb::DB* db,
+                        uint64_t current_time)
+    : _store(store), _db(db), _currentTime(current_time) {}
 
   ~KVTtlCompactionFilter() override {
     TEST_SYNC_POINT_CALLBACK("InspectKvTtlExpiredCount", &_expiredCount);
     TEST_SYNC_POINT_CALLBACK("InspectKvTtlFilterCount", &_filterCount);
+    TEST_SYNC_POINT_CALLBACK("InspectSubKeyExpiredCount",
+                             &_subKeyExpiredCount);
+    TEST_SYNC_POINT_CALLBACK("InspectTtlIndexStaleCount",
+                             &_ttlIndexStaleCount);
 
     // do something statistics here
     _store->stat.compactFilterCount.fetch_add(_filterCount,
                                               std::memory_order_relaxed);
     _store->stat.compactKvExpiredCount.fetch_add(_expiredCount,
                                                  std::memory_order_relaxed);
+    _store->stat.compactSubKeyExpiredCount.fetch_add(
+      _subKeyExpiredCount, std::memory_order_relaxed);
+    _store->stat.compactTtlIndexStaleCount.fetch_add(
+      _ttlIndexStaleCount, std::memory_order_relaxed);
   }
 
   const char* Name() const override {
@@ -43,6 +66,9 @@ class KVTtlCompactionFilter : public CompactionFilter {
     RecordType vt;
     uint64_t ttl;
     _filterCount++;
+    if (_currentTime == 0) {
+      return false;
+    }
     switch (type) {
       case RecordType::RT_DATA_META:
         vt =
@@ -50,7 +76,12 @@ class KVTtlCompactionFilter : public CompactionFilter {
         if (vt == RecordType::RT_KV) {
           ttl = RecordValue::decodeTtl(existing_value.data(),
                                        existing_value.size());
-          if (ttl > 0 && ttl < _currentTime) {
+          // NOTE(tendis): a big RT_KV stored in pieces is deleted by the
+          // ttl index, otherwise the pieces would be left.
+          if (ttl > 0 && ttl < _currentTime &&
+              RecordValue::decodePieceSize(existing_value.data(),
+                                           existing_value.size()) ==
+                (uint64_t)-1) {
             // Expired
             _expiredCount++;
             _expiredSize += key.size() + existing_value.size();
@@ -59,6 +90,24 @@ class KVTtlCompactionFilter : public CompactionFilter {
           }
         }
         break;
+      case RecordType::RT_HASH_ELE:
+      case RecordType::RT_SET_ELE:
+      case RecordType::RT_LIST_ELE:
+      case RecordType::RT_ZSET_H_ELE:
+      case RecordType::RT_ZSET_S_ELE:
+      case RecordType::RT_KV_PIECE:
+        if (isOrphanSubKey(type, key)) {
+          _subKeyExpiredCount++;
+          _expiredSize += key.size() + existing_value.size();
+          return true;
+        }
+        break;
+      case RecordType::RT_TTL_INDEX:
+        if (isStaleTTLIndex(key)) {
+          _ttlIndexStaleCount++;
+          return true;
+        }
+        break;
       case RecordType::RT_INVALID:
         // TODO(vinchen): make sure
         INVARIANT_D(0);
@@ -70,8 +119,130 @@ class KVTtlCompactionFilter : public CompactionFilter {
   }
 
  private:
+  struct MetaInfo {
+    bool found;
+    RecordType type;
+    uint64_t ttl;
+    bool pieced;
+  };
+
+  // the metas are mostly looked up in order, the cache is dropped
+  // when it is full.
+  static constexpr size_t MAX_CACHED_METAS = 4096;
+
+  // meta of the RT_DATA_META key mk, found is false if it is missing or
+  // it can't be read
+  Expected<MetaInfo> getMeta(const RecordKey& mk) const {
+    std::string key = mk.encode();
+    auto it = _metaCache.find(key);
+    if (it != _metaCache.end()) {
+      return it->second;
+    }
+    std::string value;
+    auto s = _db->Get(rocksdb::ReadOptions(), key, &value);
+    MetaInfo info = {false, RecordType::RT_INVALID, 0, false};
+    if (s.ok()) {
+      info.found = true;
+      info.type = RecordValue::decodeType(value.data(), value.size());
+      info.ttl = RecordValue::decodeTtl(value.data(), value.size());
+      info.pieced = info.type == RecordType::RT_KV &&
+        RecordValue::decodePieceSize(value.data(), value.size()) !=
+          (uint64_t)-1;
+    } else if (!s.IsNotFound()) {
+      // keep the data if the meta can't be read
+      return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+    }
+    if (_metaCache.size() >= MAX_CACHED_METAS) {
+      _metaCache.clear();
+    }
+    _metaCache.emplace(std::move(key), info);
+    return info;
+  }
+
+  bool isExpired(const MetaInfo& info) const {
+    return info.ttl > 0 && info.ttl < _currentTime;
+  }
+
+  bool isOrphanSubKey(RecordType type, const rocksdb::Slice& key) const {
+    if (!_db) {
+      return false;
+    }
+    auto rk = RecordKey::decode(key.ToString());
+    if (!rk.ok()) {
+      return false;
+    }
+    RecordKey mk(rk.value().getChunkId(),
+                 rk.value().getDbId(),
+                 RecordType::RT_DATA_META,
+                 rk.value().getPrimaryKey(),
+                 "");
+    auto meta = getMeta(mk);
+    if (!meta.ok()) {
+      return false;
+    }
+    const MetaInfo& info = meta.value();
+    if (!info.found || isExpired(info)) {
+      return true;
+    }
+    switch (type) {
+      case RecordType::RT_HASH_ELE:
+        return info.type != RecordType::RT_HASH_META;
+      case RecordType::RT_SET_ELE:
+        return info.type != RecordType::RT_SET_META;
+      case RecordType::RT_LIST_ELE:
+        return info.type != RecordType::RT_LIST_META;
+      case RecordType::RT_ZSET_H_ELE:
+      case RecordType::RT_ZSET_S_ELE:
+        return info.type != RecordType::RT_ZSET_META;
+      case RecordType::RT_KV_PIECE:
+        return !info.pieced;
+      default:
+        return false;
+    }
+  }
+
+  bool isStaleTTLIndex(const rocksdb::Slice& key) const {
+    if (!_db) {
+      return false;
+    }
+    auto rk = RecordKey::decode(key.ToString());
+    if (!rk.ok()) {
+      return false;
+    }
+    auto index = TTLIndex::decode(rk.value());
+    if (!index.ok()) {
+      return false;
+    }
+    const std::string priKey = index.value().getPriKey();
+    // the chunk id is the slot of the key, see getDbWithKeyLock()
+    uint32_t chunkId = redis_port::keyHashSlot(priKey.c_str(), priKey.size());
+    RecordKey mk(chunkId,
+                 index.value().getDbId(),
+                 RecordType::RT_DATA_META,
+                 priKey,
+                 "");
+    auto meta = getMeta(mk);
+    if (!meta.ok()) {
+      return false;
+    }
+    if (!meta.value().found) {
+      return true;
+    }
+    if (index.value().isLegacy()) {
+      return meta.value().ttl != index.value().getTTL();
+    }
+    // a bucketed index stands for all the ttl of its bucket
+    TTLIndex current(priKey,
+                     index.value().getType(),
+                     index.value().getDbId(),
+                     meta.value().ttl);
+    return current.encode() != key.ToString();
+  }
+
   KVStore* _store;
-  // millisecond, same as ttl in the record
+  // the db being compacted, to read the metas
+  rocksdb::DB* _db;
+  // millisecond, same as ttl in the record, 0 if unknown
   const uint64_t _currentTime;
   // It is safe to not using std::atomic since the compaction filter,
   // created from a compaction filter factory, will not be called
@@ -79,6 +250,9 @@ class KVTtlCompactionFilter : public CompactionFilter {
   mutable uint64_t _expiredCount = 0;
   mutable uint64_t _expiredSize = 0;
   mutable uint64_t _filterCount = 0;
+  mutable uint64_t _subKeyExpiredCount = 0;
+  mutable uint64_t _ttlIndexStaleCount = 0;
+  mutable std::unordered_map<std::string, MetaInfo> _metaCache;
 };
 
 std::unique_ptr<CompactionFilter>
@@ -92,11 +266,10 @@ KVTtlCompactionFilterFactory::CreateCompactionFilter(
 
   if (currentTs == 0) {
     LOG(WARNING) << "The currentTs is 0, the kvttlcompaction would do nothing";
-    currentTs = std::numeric_limits<uint64_t>::max();
   }
 
   return std::unique_ptr<CompactionFilter>(
-    new KVTtlCompactionFilter(_store, currentTs));
+    new KVTtlCompactionFilter(_store, _store->getBaseDB(), currentTs));
 }
 
 }  // namespace tendisplus
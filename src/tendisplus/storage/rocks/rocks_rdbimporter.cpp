@@ -0,0 +1,820 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include "tendisplus/storage/rocks/rocks_rdbimporter.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <queue>
+#include <sstream>
+#include <thread>  // NOLINT
+
+#include "glog/logging.h"
+#include "rocksdb/env.h"
+#include "rocksdb/utilities/transaction_db.h"
+#include "tendisplus/network/session_ctx.h"
+#include "tendisplus/storage/pieced_kv.h"
+#include "tendisplus/storage/record.h"
+#include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/storage/skiplist.h"
+#include "tendisplus/storage/varint.h"
+#include "tendisplus/utils/invariant.h"
+#include "tendisplus/utils/portable.h"
+#include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/time.h"
+
+namespace tendisplus {
+
+namespace {
+
+// the first subkey of the list elements, same as RESTORE
+constexpr uint64_t LIST_INITSEQ = 9223372036854775807ULL / 2ULL;
+
+Status notSupported() {
+  return {ErrorCodes::ERR_INTERNAL, "not supported by rdb import"};
+}
+
+// ImportTxn collects the records written for one key, so that the
+// records of zsets and pieced strings are built by SkipList and PiecedKV
+// as the commands do. It never touches rocksdb.
+class ImportTxn : public Transaction {
+ public:
+  explicit ImportTxn(const std::string& storeId) : _storeId(storeId) {}
+  ImportTxn(const ImportTxn&) = delete;
+  ImportTxn(ImportTxn&&) = delete;
+  virtual ~ImportTxn() = default;
+
+  std::map<std::string, std::string>* records() {
+    return &_records;
+  }
+
+  Expected<uint64_t> commit() final {
+    return notSupported();
+  }
+  Status rollback() final {
+    _records.clear();
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  std::unique_ptr<Cursor> createCursor(
+    ColumnFamilyNumber cf, const std::string* iterate_upper_bound) final {
+    return nullptr;
+  }
+  Status flushall() final {
+    return notSupported();
+  }
+  Status migrate(const std::string& logKey,
+                 const std::string& logValue) final {
+    return notSupported();
+  }
+  std::unique_ptr<RepllogCursorV2> createRepllogCursorV2(
+    uint64_t begin, bool ignoreReadBarrier) final {
+    return nullptr;
+  }
+  Status applyBinlog(const ReplLogValueEntryV2& logEntry) final {
+    return notSupported();
+  }
+  Status setBinlogKV(uint64_t binlogId,
+                     const std::string& logKey,
+                     const std::string& logValue) final {
+    return notSupported();
+  }
+  Status setBinlogKV(const std::string& logKey,
+                     const std::string& logValue) final {
+    return notSupported();
+  }
+  Status delBinlog(const ReplLogRawV2& log) final {
+    return notSupported();
+  }
+  uint64_t getBinlogId() const final {
+    return Transaction::TXNID_UNINITED;
+  }
+  void setBinlogId(uint64_t binlogId) final {}
+  uint32_t getChunkId() const final {
+    return Transaction::CHUNKID_UNINITED;
+  }
+  std::string getKVStoreId() const final {
+    return _storeId;
+  }
+  void setChunkId(uint32_t chunkId) final {}
+  void SetSnapshot() final {}
+  void setSavePoint() final {}
+  Status rollbackToSavePoint() final {
+    return notSupported();
+  }
+  void setBulkWrite(bool bulk) final {}
+
+  std::unique_ptr<TTLIndexCursor> createTTLIndexCursor(
+    std::uint64_t until) final {
+    return nullptr;
+  }
+  std::unique_ptr<SlotCursor> createSlotCursor(uint32_t slot) final {
+    return nullptr;
+  }
+  std::unique_ptr<SlotsCursor> createSlotsCursor(uint32_t start,
+                                                 uint32_t end) final {
+    return nullptr;
+  }
+  std::unique_ptr<VersionMetaCursor> createVersionMetaCursor() final {
+    return nullptr;
+  }
+  std::unique_ptr<BasicDataCursor> createDataCursor() final {
+    return nullptr;
+  }
+  std::unique_ptr<AllDataCursor> createAllDataCursor() final {
+    return nullptr;
+  }
+  std::unique_ptr<BinlogCursor> createBinlogCursor() final {
+    return nullptr;
+  }
+
+  Expected<std::string> getKV(const std::string& key) final {
+    auto it = _records.find(key);
+    if (it == _records.end()) {
+      return {ErrorCodes::ERR_NOTFOUND, ""};
+    }
+    return it->second;
+  }
+  Status setKV(const std::string& key,
+               const std::string& val,
+               const uint64_t ts = 0) final {
+    _records[key] = val;
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  Status delKV(const std::string& key, const uint64_t ts = 0) final {
+    _records.erase(key);
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  Status mergeKV(const std::string& key,
+                 const std::string& operand,
+                 const uint64_t ts = 0) final {
+    return notSupported();
+  }
+  Status addDeleteRangeBinlog(const std::string& begin,
+                              const std::string& end) final {
+    return notSupported();
+  }
+  uint64_t getBinlogTime() final {
+    return 0;
+  }
+  void setBinlogTime(uint64_t timestamp) final {}
+  bool isReplOnly() const final {
+    return false;
+  }
+  uint64_t getTxnId() const final {
+    return Transaction::TXNID_UNINITED;
+  }
+
+ private:
+  const std::string _storeId;
+  std::map<std::string, std::string> _records;
+};
+
+// a run is a sorted file of <klen:4><key><vlen:4><val>
+Status writeRecord(std::ofstream* out,
+                   const std::string& key,
+                   const std::string& val) {
+  char buf[4];
+  int32Encode(buf, static_cast<uint32_t>(key.size()));
+  out->write(buf, sizeof(buf));
+  out->write(key.data(), key.size());
+  int32Encode(buf, static_cast<uint32_t>(val.size()));
+  out->write(buf, sizeof(buf));
+  out->write(val.data(), val.size());
+  if (!out->good()) {
+    return {ErrorCodes::ERR_INTERNAL, "write run failed"};
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+class RunReader {
+ public:
+  explicit RunReader(const std::string& path)
+    : _in(path, std::ios::binary) {}
+
+  // false at the end of the run
+  Expected<bool> next() {
+    char buf[4];
+    _in.read(buf, sizeof(buf));
+    if (_in.gcount() == 0 && _in.eof()) {
+      return false;
+    }
+    if (_in.gcount() != sizeof(buf)) {
+      return {ErrorCodes::ERR_DECODE, "run truncated"};
+    }
+    _key.resize(int32Decode(buf));
+    _in.read(&_key[0], _key.size());
+    _in.read(buf, sizeof(buf));
+    if (!_in.good()) {
+      return {ErrorCodes::ERR_DECODE, "run truncated"};
+    }
+    _val.resize(int32Decode(buf));
+    _in.read(&_val[0], _val.size());
+    if (static_cast<size_t>(_in.gcount()) != _val.size()) {
+      return {ErrorCodes::ERR_DECODE, "run truncated"};
+    }
+    return true;
+  }
+  const std::string& key() const {
+    return _key;
+  }
+  const std::string& val() const {
+    return _val;
+  }
+
+ private:
+  std::ifstream _in;
+  std::string _key;
+  std::string _val;
+};
+
+}  // namespace
+
+struct RdbSstImporter::StoreBuild {
+  uint32_t storeId = 0;
+  PStore store;
+  std::string dir;
+  rocksdb::Options dataOptions;
+  rocksdb::Options binlogOptions;
+  rocksdb::ColumnFamilyHandle* dataCf = nullptr;
+  rocksdb::ColumnFamilyHandle* binlogCf = nullptr;
+  std::unique_ptr<ImportTxn> txn;
+
+  std::vector<std::pair<std::string, std::string>> buffer;
+  uint64_t bufferBytes = 0;
+  std::vector<std::string> runs;
+
+  std::vector<std::string> dataFiles;
+  std::unique_ptr<rocksdb::SstFileWriter> dataWriter;
+  std::vector<std::string> binlogFiles;
+  std::unique_ptr<rocksdb::SstFileWriter> binlogWriter;
+  uint64_t firstBinlogId = Transaction::TXNID_UNINITED;
+  uint64_t binlogCnt = 0;
+};
+
+RdbSstImporter::RdbSstImporter(const std::vector<PStore>& stores,
+                               const RdbImportOptions& opts)
+  : _stores(stores),
+    _opts(opts),
+    _status({ErrorCodes::ERR_OK, ""}),
+    _hasError(false),
+    _keys(0),
+    _expiredKeys(0),
+    _skippedKeys(0),
+    _records(0),
+    _binlogs(0),
+    _readBytes(0) {
+  for (uint32_t i = 0; i < _stores.size(); i++) {
+    _builds.emplace_back(std::make_unique<StoreBuild>());
+    _builds.back()->storeId = i;
+    _builds.back()->store = _stores[i];
+  }
+  for (uint32_t i = 0; i < std::max(_opts.threads, 1u); i++) {
+    _workers.emplace_back(std::make_unique<Worker>());
+  }
+}
+
+RdbSstImporter::~RdbSstImporter() {
+  cleanup();
+}
+
+void RdbSstImporter::setError(const Status& s) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  if (_status.ok()) {
+    _status = s;
+  }
+  _hasError.store(true, std::memory_order_relaxed);
+}
+
+Status RdbSstImporter::initStore(StoreBuild* sb) {
+  auto rocks = dynamic_cast<RocksKVStore*>(sb->store.get());
+  if (rocks == nullptr || rocks->getUnderlayerPesDB() == nullptr) {
+    return {ErrorCodes::ERR_INTERNAL,
+            "store " + sb->store->dbId() + " is not a pessimistic rocks store"};
+  }
+  if (!sb->store->isEmpty(true)) {
+    return {ErrorCodes::ERR_INTERNAL,
+            "store " + sb->store->dbId() + " is not empty"};
+  }
+  sb->dir = _opts.tmpDir + "/" + std::to_string(sb->storeId) + "/";
+  std::error_code ec;
+  filesystem::remove_all(sb->dir, ec);
+  if (!filesystem::create_directories(sb->dir, ec)) {
+    return {ErrorCodes::ERR_INTERNAL,
+            "create dir " + sb->dir + " failed:" + ec.message()};
+  }
+  auto db = rocks->getUnderlayerPesDB();
+  sb->dataCf = rocks->getDataColumnFamilyHandle();
+  sb->binlogCf = rocks->getBinlogColumnFamilyHandle();
+  sb->dataOptions = db->GetOptions(sb->dataCf);
+  sb->binlogOptions = db->GetOptions(sb->binlogCf);
+  sb->txn = std::make_unique<ImportTxn>(sb->store->dbId());
+  sb->firstBinlogId = sb->store->getNextBinlogSeq();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status RdbSstImporter::build() {
+  if (_stores.empty() || _opts.files.empty()) {
+    return {ErrorCodes::ERR_INTERNAL, "no store or no file"};
+  }
+  for (auto& sb : _builds) {
+    auto s = initStore(sb.get());
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  LOG(INFO) << "rdb import begins, files:" << _opts.files.size()
+            << ",stores:" << _stores.size()
+            << ",genBinlog:" << _opts.genBinlog;
+
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < _workers.size(); i++) {
+    workers.emplace_back([this, i]() { workRoutine(i); });
+  }
+  std::vector<std::thread> readers;
+  for (const auto& file : _opts.files) {
+    readers.emplace_back([this, file]() { readRoutine(file); });
+  }
+  for (auto& t : readers) {
+    t.join();
+  }
+  for (auto& w : _workers) {
+    std::lock_guard<std::mutex> lk(w->mutex);
+    w->closed = true;
+    w->cv.notify_all();
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  std::lock_guard<std::mutex> lk(_mutex);
+  if (!_status.ok()) {
+    LOG(ERROR) << "rdb import build failed:" << _status.toString();
+    return _status;
+  }
+  LOG(INFO) << "rdb import build done, " << getStatInfo();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+void RdbSstImporter::readRoutine(const std::string& file) {
+  RdbReader reader(file);
+  auto s = reader.open();
+  if (!s.ok()) {
+    setError(s);
+    return;
+  }
+  uint64_t lastPos = 0;
+  while (!hasError()) {
+    auto eobj = reader.next();
+    _readBytes += reader.getPos() - lastPos;
+    lastPos = reader.getPos();
+    if (eobj.status().code() == ErrorCodes::ERR_EXHAUST) {
+      LOG(INFO) << "rdb import read " << file << " done";
+      return;
+    } else if (!eobj.ok()) {
+      setError({eobj.status().code(),
+                file + ":" + eobj.status().toString()});
+      return;
+    }
+    auto& obj = eobj.value();
+    if (obj.dbId >= _opts.dbNum) {
+      setError({ErrorCodes::ERR_INTERNAL,
+                "db " + std::to_string(obj.dbId) + " out of range"});
+      return;
+    }
+    if (obj.expireMs > 0 && obj.expireMs <= msSinceEpoch()) {
+      _expiredKeys++;
+      continue;
+    }
+    uint32_t chunkId =
+      redis_port::keyHashSlot(obj.key.c_str(), obj.key.size());
+    if (!_opts.slots.test(chunkId)) {
+      _skippedKeys++;
+      continue;
+    }
+    uint32_t storeId = chunkId % _stores.size();
+    auto& w = _workers[storeId % _workers.size()];
+    std::unique_lock<std::mutex> lk(w->mutex);
+    w->cv.wait(lk, [this, &w]() {
+      return w->tasks.size() < WORKER_QUEUE_MAX || hasError();
+    });
+    w->tasks.push_back({storeId, chunkId, std::move(obj)});
+    w->cv.notify_all();
+  }
+}
+
+void RdbSstImporter::workRoutine(uint32_t workerId) {
+  auto& w = _workers[workerId];
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lk(w->mutex);
+      w->cv.wait(lk, [&w]() { return !w->tasks.empty() || w->closed; });
+      if (w->tasks.empty()) {
+        break;
+      }
+      task = std::move(w->tasks.front());
+      w->tasks.pop_front();
+      w->cv.notify_all();
+    }
+    if (hasError()) {
+      continue;
+    }
+    auto s = addObject(_builds[task.storeId].get(), task.chunkId, task.obj);
+    if (!s.ok()) {
+      setError(s);
+    }
+  }
+  if (hasError()) {
+    return;
+  }
+  for (uint32_t i = workerId; i < _builds.size(); i += _workers.size()) {
+    auto s = finishStore(_builds[i].get());
+    if (!s.ok()) {
+      setError(s);
+      return;
+    }
+  }
+}
+
+Status RdbSstImporter::addObject(StoreBuild* sb,
+                                 uint32_t chunkId,
+                                 const RdbObject& obj) {
+  PStore store = sb->store;
+  ImportTxn* txn = sb->txn.get();
+  txn->records()->clear();
+  uint64_t ttl = obj.expireMs;
+  RecordType metaType = RecordType::RT_KV;
+  // the ttl index is needed for the keys other than plain strings, see
+  // rcd_util::needTTLIndex()
+  bool needTTLIndex = true;
+  Status s;
+
+  switch (obj.type) {
+    case RdbObjectType::RDB_OBJ_STRING: {
+      RecordKey rk(chunkId, obj.dbId, RecordType::RT_KV, obj.key, "");
+      RecordValue rv(obj.value, RecordType::RT_KV, -1, ttl);
+      if (PiecedKV::needPieces(obj.value.size())) {
+        s = PiecedKV::set(store, rk, rv, txn);
+      } else {
+        s = store->setKV(rk, rv, txn);
+        needTTLIndex = false;
+      }
+      break;
+    }
+    case RdbObjectType::RDB_OBJ_LIST: {
+      metaType = RecordType::RT_LIST_META;
+      uint64_t tail = LIST_INITSEQ;
+      for (const auto& ele : obj.elements) {
+        RecordKey rk(chunkId,
+                     obj.dbId,
+                     RecordType::RT_LIST_ELE,
+                     obj.key,
+                     std::to_string(tail++));
+        s = store->setKV(
+          rk, RecordValue(ele, RecordType::RT_LIST_ELE, -1), txn);
+        if (!s.ok()) {
+          return s;
+        }
+      }
+      ListMetaValue lm(LIST_INITSEQ, tail);
+      RecordKey mk(chunkId, obj.dbId, RecordType::RT_LIST_META, obj.key, "");
+      s = store->setKV(
+        mk, RecordValue(lm.encode(), RecordType::RT_LIST_META, -1, ttl), txn);
+      break;
+    }
+    case RdbObjectType::RDB_OBJ_SET: {
+      metaType = RecordType::RT_SET_META;
+      for (const auto& ele : obj.elements) {
+        RecordKey rk(chunkId, obj.dbId, RecordType::RT_SET_ELE, obj.key, ele);
+        s = store->setKV(rk, RecordValue("", RecordType::RT_SET_ELE, -1), txn);
+        if (!s.ok()) {
+          return s;
+        }
+      }
+      SetMetaValue sm;
+      sm.setCount(obj.elements.size());
+      RecordKey mk(chunkId, obj.dbId, RecordType::RT_SET_META, obj.key, "");
+      s = store->setKV(
+        mk, RecordValue(sm.encode(), RecordType::RT_SET_META, -1, ttl), txn);
+      break;
+    }
+    case RdbObjectType::RDB_OBJ_HASH: {
+      metaType = RecordType::RT_HASH_META;
+      for (const auto& kv : obj.fields) {
+        RecordKey rk(
+          chunkId, obj.dbId, RecordType::RT_HASH_ELE, obj.key, kv.first);
+        s = store->setKV(
+          rk, RecordValue(kv.second, RecordType::RT_HASH_ELE, -1), txn);
+        if (!s.ok()) {
+          return s;
+        }
+      }
+      HashMetaValue hm;
+      hm.setCount(obj.fields.size());
+      RecordKey mk(chunkId, obj.dbId, RecordType::RT_HASH_META, obj.key, "");
+      s = store->setKV(
+        mk, RecordValue(hm.encode(), RecordType::RT_HASH_META, -1, ttl), txn);
+      break;
+    }
+    case RdbObjectType::RDB_OBJ_ZSET: {
+      // same as a new zset of ZADD, see genericZadd()
+      metaType = RecordType::RT_ZSET_META;
+      RecordKey mk(chunkId, obj.dbId, RecordType::RT_ZSET_META, obj.key, "");
+      ZSlMetaValue meta(1, 1, 0);
+      RecordValue metaRv(meta.encode(), RecordType::RT_ZSET_META, -1, ttl);
+      RecordKey headRk(chunkId,
+                       obj.dbId,
+                       RecordType::RT_ZSET_S_ELE,
+                       obj.key,
+                       std::to_string(ZSlMetaValue::HEAD_ID));
+      s = store->setKV(
+        headRk,
+        RecordValue(ZSlEleValue().encode(), RecordType::RT_ZSET_S_ELE, -1),
+        txn);
+      if (!s.ok()) {
+        return s;
+      }
+      SkipList sl(chunkId, obj.dbId, obj.key, meta, store);
+      for (const auto& v : obj.scores) {
+        s = sl.insert(v.second, v.first, txn);
+        if (!s.ok()) {
+          return s;
+        }
+        RecordKey rk(
+          chunkId, obj.dbId, RecordType::RT_ZSET_H_ELE, obj.key, v.first);
+        s = store->setKV(rk, RecordValue(v.second, RecordType::RT_ZSET_H_ELE),
+                         txn);
+        if (!s.ok()) {
+          return s;
+        }
+      }
+      s = sl.save(txn, metaRv, -1);
+      break;
+    }
+    default:
+      INVARIANT_D(0);
+      return {ErrorCodes::ERR_INTERNAL, "invalid object type"};
+  }
+  if (!s.ok()) {
+    return s;
+  }
+
+  if (ttl > 0 && needTTLIndex) {
+    TTLIndex ictx(obj.key, metaType, obj.dbId, ttl);
+    s = txn->setKV(ictx.encode(),
+                   RecordValue(RecordType::RT_TTL_INDEX).encode());
+    if (!s.ok()) {
+      return s;
+    }
+  }
+
+  auto records = txn->records();
+  if (_opts.genBinlog) {
+    s = addBinlog(sb, chunkId, *records);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  for (auto& kv : *records) {
+    sb->bufferBytes += kv.first.size() + kv.second.size();
+    sb->buffer.emplace_back(kv.first, std::move(kv.second));
+  }
+  _records += records->size();
+  _keys++;
+  records->clear();
+  if (sb->bufferBytes >= _opts.bufferBytes) {
+    return spill(sb);
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status RdbSstImporter::addBinlog(
+  StoreBuild* sb,
+  uint32_t chunkId,
+  const std::map<std::string, std::string>& records) {
+  if (!sb->binlogWriter) {
+    sb->binlogWriter = std::make_unique<rocksdb::SstFileWriter>(
+      rocksdb::EnvOptions(), sb->binlogOptions, sb->binlogCf);
+    std::string file =
+      sb->dir + "binlog_" + std::to_string(sb->binlogFiles.size()) + ".sst";
+    auto s = sb->binlogWriter->Open(file);
+    if (!s.ok()) {
+      return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+    }
+    sb->binlogFiles.push_back(file);
+  }
+
+  uint64_t ts = msSinceEpoch();
+  uint64_t binlogId = sb->firstBinlogId + sb->binlogCnt;
+  std::vector<ReplLogValueEntryV2> entries;
+  entries.reserve(records.size());
+  for (const auto& kv : records) {
+    entries.emplace_back(ReplOp::REPL_OP_SET, ts, kv.first, kv.second);
+  }
+  uint16_t flag = static_cast<uint16_t>(ReplFlag::REPL_GROUP_START) |
+    static_cast<uint16_t>(ReplFlag::REPL_GROUP_END);
+  ReplLogKeyV2 key(binlogId);
+  ReplLogValueV2 val(chunkId,
+                     static_cast<ReplFlag>(flag),
+                     binlogId,
+                     ts,
+                     SessionCtx::VERSIONEP_UNINITED,
+                     "restore",
+                     nullptr,
+                     0);
+  auto s = sb->binlogWriter->Put(key.encode(), val.encode(entries));
+  if (!s.ok()) {
+    return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+  }
+  sb->binlogCnt++;
+  _binlogs++;
+
+  if (sb->binlogWriter->FileSize() >= _opts.sstFileBytes) {
+    s = sb->binlogWriter->Finish();
+    sb->binlogWriter.reset();
+    if (!s.ok()) {
+      return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+    }
+  }
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status RdbSstImporter::spill(StoreBuild* sb) {
+  if (sb->buffer.empty()) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  std::sort(sb->buffer.begin(), sb->buffer.end());
+  std::string file = sb->dir + "run_" + std::to_string(sb->runs.size());
+  std::ofstream out(file, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    return {ErrorCodes::ERR_INTERNAL, "open " + file + " failed"};
+  }
+  for (const auto& kv : sb->buffer) {
+    auto s = writeRecord(&out, kv.first, kv.second);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  out.close();
+  sb->runs.push_back(file);
+  sb->buffer.clear();
+  sb->bufferBytes = 0;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status RdbSstImporter::finishStore(StoreBuild* sb) {
+  if (sb->binlogWriter) {
+    auto s = sb->binlogWriter->Finish();
+    sb->binlogWriter.reset();
+    if (!s.ok()) {
+      return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+    }
+  }
+
+  std::string lastKey;
+  bool first = true;
+  auto put = [this, sb, &lastKey, &first](const std::string& key,
+                                          const std::string& val) -> Status {
+    if (!first && key <= lastKey) {
+      auto ek = RecordKey::decode(key);
+      return {ErrorCodes::ERR_INTERNAL,
+              "duplicate key:" +
+                (ek.ok() ? ek.value().getPrimaryKey() : std::string())};
+    }
+    first = false;
+    lastKey = key;
+    if (!sb->dataWriter) {
+      sb->dataWriter = std::make_unique<rocksdb::SstFileWriter>(
+        rocksdb::EnvOptions(), sb->dataOptions, sb->dataCf);
+      std::string file =
+        sb->dir + "data_" + std::to_string(sb->dataFiles.size()) + ".sst";
+      auto s = sb->dataWriter->Open(file);
+      if (!s.ok()) {
+        return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+      }
+      sb->dataFiles.push_back(file);
+    }
+    auto s = sb->dataWriter->Put(key, val);
+    if (!s.ok()) {
+      return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+    }
+    if (sb->dataWriter->FileSize() >= _opts.sstFileBytes) {
+      s = sb->dataWriter->Finish();
+      sb->dataWriter.reset();
+      if (!s.ok()) {
+        return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+      }
+    }
+    return {ErrorCodes::ERR_OK, ""};
+  };
+
+  if (sb->runs.empty()) {
+    std::sort(sb->buffer.begin(), sb->buffer.end());
+    for (const auto& kv : sb->buffer) {
+      auto s = put(kv.first, kv.second);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+    sb->buffer.clear();
+    sb->bufferBytes = 0;
+  } else {
+    auto s = spill(sb);
+    if (!s.ok()) {
+      return s;
+    }
+    // k-way merge of the runs
+    std::vector<std::unique_ptr<RunReader>> readers;
+    auto cmp = [&readers](size_t a, size_t b) {
+      return readers[a]->key() > readers[b]->key();
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> heap(cmp);
+    for (const auto& run : sb->runs) {
+      readers.emplace_back(std::make_unique<RunReader>(run));
+      auto more = readers.back()->next();
+      if (!more.ok()) {
+        return more.status();
+      }
+      if (more.value()) {
+        heap.push(readers.size() - 1);
+      }
+    }
+    while (!heap.empty()) {
+      size_t i = heap.top();
+      heap.pop();
+      s = put(readers[i]->key(), readers[i]->val());
+      if (!s.ok()) {
+        return s;
+      }
+      auto more = readers[i]->next();
+      if (!more.ok()) {
+        return more.status();
+      }
+      if (more.value()) {
+        heap.push(i);
+      }
+    }
+    readers.clear();
+    for (const auto& run : sb->runs) {
+      std::error_code ec;
+      filesystem::remove(run, ec);
+    }
+    sb->runs.clear();
+  }
+
+  if (sb->dataWriter) {
+    auto s = sb->dataWriter->Finish();
+    sb->dataWriter.reset();
+    if (!s.ok()) {
+      return {ErrorCodes::ERR_INTERNAL, s.ToString()};
+    }
+  }
+  LOG(INFO) << "rdb import store:" << sb->storeId
+            << " built, data files:" << sb->dataFiles.size()
+            << ",binlog files:" << sb->binlogFiles.size()
+            << ",binlogs:" << sb->binlogCnt;
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+Status RdbSstImporter::ingest(uint32_t storeId) {
+  if (storeId >= _builds.size()) {
+    return {ErrorCodes::ERR_INTERNAL, "invalid storeId"};
+  }
+  auto& sb = _builds[storeId];
+  if (sb->dataFiles.empty() && sb->binlogFiles.empty()) {
+    return {ErrorCodes::ERR_OK, ""};
+  }
+  auto s = sb->store->ingestFiles(
+    sb->dataFiles, sb->binlogFiles, sb->firstBinlogId, sb->binlogCnt);
+  if (!s.ok()) {
+    return s;
+  }
+  // the files are moved into rocksdb
+  sb->dataFiles.clear();
+  sb->binlogFiles.clear();
+  return {ErrorCodes::ERR_OK, ""};
+}
+
+void RdbSstImporter::cleanup() {
+  for (auto& sb : _builds) {
+    sb->dataWriter.reset();
+    sb->binlogWriter.reset();
+    if (!sb->dir.empty()) {
+      std::error_code ec;
+      filesystem::remove_all(sb->dir, ec);
+    }
+  }
+}
+
+std::string RdbSstImporter::getStatInfo() const {
+  std::stringstream ss;
+  ss << "keys:" << _keys.load() << ",expired_keys:" << _expiredKeys.load()
+     << ",skipped_keys:" << _skippedKeys.load()
+     << ",records:" << _records.load() << ",binlogs:" << _binlogs.load()
+     << ",read_bytes:" << _readBytes.load();
+  return ss.str();
+}
+
+}  // namespace tendisplus
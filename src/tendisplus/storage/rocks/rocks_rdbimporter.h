@@ -0,0 +1,113 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_RDBIMPORTER_H_
+#define SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_RDBIMPORTER_H_
+
+#include <atomic>
+#include <bitset>
+#include <condition_variable>  // NOLINT
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <utility>
+#include <vector>
+#include "rocksdb/sst_file_writer.h"
+#include "tendisplus/storage/kvstore.h"
+#include "tendisplus/storage/rdb_reader.h"
+
+namespace tendisplus {
+
+#define CLUSTER_SLOTS 16384
+
+struct RdbImportOptions {
+  // the files are parsed in parallel, one thread for each
+  std::vector<std::string> files;
+  // the keys of the slots not set are skipped, all slots by default
+  std::bitset<CLUSTER_SLOTS> slots = std::bitset<CLUSTER_SLOTS>().set();
+  uint32_t dbNum = 16;
+  // write a binlog for each key, or the slaves need a full sync
+  bool genBinlog = false;
+  // the sst files are built under tmpDir/<storeId>/ before ingested
+  std::string tmpDir;
+  // the stores are built by so many threads
+  uint32_t threads = 4;
+  // the records of a store sorted in memory before spilled into a run
+  uint64_t bufferBytes = 64 * 1024 * 1024;
+  uint64_t sstFileBytes = 256 * 1024 * 1024;
+};
+
+// RdbSstImporter imports redis rdb files into empty stores, bypassing the
+// write path. build() parses the files, converts the keys to the tendis
+// records of their stores (by the slot of the key), and writes them into
+// sorted sst files. The records more than bufferBytes are sorted and
+// spilled into runs, which are merged into the sst files at the end.
+// ingest() moves the files of a store into rocksdb at once.
+// With genBinlog, each key has a binlog of all its records, the binlog ids
+// follow getNextBinlogSeq() of the store when build() starts, so nothing
+// should be written into the store before ingest().
+// The expired keys are skipped. A key appears twice fails the build.
+class RdbSstImporter {
+ public:
+  RdbSstImporter(const std::vector<PStore>& stores,
+                 const RdbImportOptions& opts);
+  ~RdbSstImporter();
+  Status build();
+  Status ingest(uint32_t storeId);
+  // remove the files left in tmpDir
+  void cleanup();
+  std::string getStatInfo() const;
+
+ private:
+  struct StoreBuild;
+  struct Task {
+    uint32_t storeId;
+    uint32_t chunkId;
+    RdbObject obj;
+  };
+  struct Worker {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Task> tasks;
+    bool closed = false;
+  };
+
+  void readRoutine(const std::string& file);
+  void workRoutine(uint32_t workerId);
+  void setError(const Status& s);
+  bool hasError() const {
+    return _hasError.load(std::memory_order_relaxed);
+  }
+  Status initStore(StoreBuild* sb);
+  Status addObject(StoreBuild* sb, uint32_t chunkId, const RdbObject& obj);
+  Status addBinlog(StoreBuild* sb,
+                   uint32_t chunkId,
+                   const std::map<std::string, std::string>& records);
+  Status spill(StoreBuild* sb);
+  Status finishStore(StoreBuild* sb);
+
+  static constexpr size_t WORKER_QUEUE_MAX = 1024;
+
+  std::vector<PStore> _stores;
+  const RdbImportOptions _opts;
+  std::vector<std::unique_ptr<StoreBuild>> _builds;
+  std::vector<std::unique_ptr<Worker>> _workers;
+
+  mutable std::mutex _mutex;
+  Status _status;
+  std::atomic<bool> _hasError;
+
+  std::atomic<uint64_t> _keys;
+  std::atomic<uint64_t> _expiredKeys;
+  std::atomic<uint64_t> _skippedKeys;
+  std::atomic<uint64_t> _records;
+  std::atomic<uint64_t> _binlogs;
+  std::atomic<uint64_t> _readBytes;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_STORAGE_ROCKS_ROCKS_RDBIMPORTER_H_
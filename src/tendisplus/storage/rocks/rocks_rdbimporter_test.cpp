@@ -0,0 +1,408 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+#include "tendisplus/utils/status.h"
+#include "tendisplus/utils/scopeguard.h"
+#include "tendisplus/utils/portable.h"
+#include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/time.h"
+#include "tendisplus/storage/rdb_reader.h"
+#include "tendisplus/storage/rocks/rocks_kvstore.h"
+#include "tendisplus/storage/rocks/rocks_rdbimporter.h"
+#include "tendisplus/server/server_params.h"
+
+namespace tendisplus {
+
+std::shared_ptr<ServerParams> genParams() {
+  const auto guard = MakeGuard([] { remove("a.cfg"); });
+  std::ofstream myfile;
+  myfile.open("a.cfg");
+  myfile << "bind 127.0.0.1\n";
+  myfile << "port 8903\n";
+  myfile << "loglevel debug\n";
+  myfile << "logdir ./log\n";
+  myfile << "storage rocks\n";
+  myfile << "dir ./db\n";
+  myfile << "rocks.blockcachemb 64\n";
+  myfile.close();
+  auto cfg = std::make_shared<ServerParams>();
+  auto s = cfg->parseFile("a.cfg");
+  EXPECT_EQ(s.ok(), true) << s.toString();
+  return cfg;
+}
+
+// a tiny rdb writer, the encoded values are built by the helpers below
+class RdbBuilder {
+ public:
+  explicit RdbBuilder(const std::string& version) {
+    _buf = "REDIS" + version;
+  }
+  void op(uint8_t c) {
+    _buf.push_back(static_cast<char>(c));
+  }
+  // the lengths less than 16384 only
+  void str(const std::string& s) {
+    INVARIANT(s.size() < 16384);
+    if (s.size() < 64) {
+      op(static_cast<uint8_t>(s.size()));
+    } else {
+      op(static_cast<uint8_t>(0x40 | (s.size() >> 8)));
+      op(static_cast<uint8_t>(s.size() & 0xff));
+    }
+    _buf.append(s);
+  }
+  void expireMs(uint64_t ms) {
+    op(0xFC);
+    for (int i = 0; i < 8; ++i) {
+      op(static_cast<uint8_t>(ms >> (8 * i)));
+    }
+  }
+  std::string finish() {
+    op(0xFF);
+    _buf.append(8, '\0');
+    return _buf;
+  }
+
+ private:
+  std::string _buf;
+};
+
+std::string intset16(const std::vector<int16_t>& vals) {
+  std::string is;
+  auto put = [&is](uint64_t v, int len) {
+    for (int i = 0; i < len; ++i) {
+      is.push_back(static_cast<char>(v >> (8 * i)));
+    }
+  };
+  put(2, 4);
+  put(vals.size(), 4);
+  for (auto v : vals) {
+    put(static_cast<uint16_t>(v), 2);
+  }
+  return is;
+}
+
+static void putLE(std::string* buf, uint64_t v, int len) {
+  for (int i = 0; i < len; ++i) {
+    buf->push_back(static_cast<char>(v >> (8 * i)));
+  }
+}
+
+// the strings shorter than 64 bytes, and the integers in int16
+std::string ziplist(const std::vector<std::string>& entries) {
+  std::string body;
+  size_t prevlen = 0;
+  size_t tail = 10;
+  for (const auto& e : entries) {
+    std::string entry;
+    entry.push_back(static_cast<char>(prevlen));
+    auto ival = ::tendisplus::stoll(e);
+    if (ival.ok() && ival.value() >= 0 && ival.value() <= 12) {
+      entry.push_back(static_cast<char>(0xf1 + ival.value()));
+    } else if (ival.ok() && std::to_string(ival.value()) == e) {
+      entry.push_back(static_cast<char>(0xc0));
+      putLE(&entry, static_cast<uint16_t>(ival.value()), 2);
+    } else {
+      INVARIANT(e.size() < 64);
+      entry.push_back(static_cast<char>(e.size()));
+      entry.append(e);
+    }
+    INVARIANT(entry.size() < 254);
+    tail = 10 + body.size();
+    prevlen = entry.size();
+    body.append(entry);
+  }
+  std::string zl;
+  putLE(&zl, 10 + body.size() + 1, 4);
+  putLE(&zl, tail, 4);
+  putLE(&zl, entries.size(), 2);
+  zl.append(body);
+  zl.push_back(static_cast<char>(0xff));
+  return zl;
+}
+
+// the strings shorter than 64 bytes, and the integers in 13 bits
+std::string listpack(const std::vector<std::string>& entries) {
+  std::string body;
+  for (const auto& e : entries) {
+    std::string entry;
+    auto ival = ::tendisplus::stoll(e);
+    if (ival.ok() && ival.value() >= 0 && ival.value() <= 127) {
+      entry.push_back(static_cast<char>(ival.value()));
+    } else if (ival.ok() && std::to_string(ival.value()) == e) {
+      INVARIANT(ival.value() >= -4096 && ival.value() < 4096);
+      uint64_t v = static_cast<uint64_t>(ival.value()) & 0x1fff;
+      entry.push_back(static_cast<char>(0xc0 | (v >> 8)));
+      entry.push_back(static_cast<char>(v & 0xff));
+    } else {
+      INVARIANT(e.size() < 64);
+      entry.push_back(static_cast<char>(0x80 | e.size()));
+      entry.append(e);
+    }
+    // backlen
+    entry.push_back(static_cast<char>(entry.size()));
+    body.append(entry);
+  }
+  std::string lp;
+  putLE(&lp, 6 + body.size() + 1, 4);
+  putLE(&lp, entries.size(), 2);
+  lp.append(body);
+  lp.push_back(static_cast<char>(0xff));
+  return lp;
+}
+
+Expected<RecordValue> getMeta(PStore store, const std::string& key) {
+  auto eTxn = store->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn.ok());
+  uint32_t chunkId = redis_port::keyHashSlot(key.c_str(), key.size());
+  RecordKey mk(chunkId, 0, RecordType::RT_DATA_META, key, "");
+  return store->getKV(mk, eTxn.value().get());
+}
+
+void writeTestRdb(const std::string& path) {
+  RdbBuilder b("0006");
+  b.op(0xFE);
+  b.op(0);
+  // string
+  b.op(0);
+  b.str("str");
+  b.str("value");
+  // expired string
+  b.expireMs(1000);
+  b.op(0);
+  b.str("expired");
+  b.str("value");
+  // plain list
+  b.op(1);
+  b.str("list");
+  b.op(3);
+  b.str("a");
+  b.str("b");
+  b.str("c");
+  // plain set
+  b.op(2);
+  b.str("set");
+  b.op(2);
+  b.str("m1");
+  b.str("m2");
+  // zset with string scores
+  b.op(3);
+  b.str("zset");
+  b.op(2);
+  b.str("z1");
+  b.str("1.5");
+  b.str("z2");
+  b.str("-3");
+  // plain hash with ttl
+  b.expireMs(msSinceEpoch() + 3600 * 1000);
+  b.op(4);
+  b.str("hash");
+  b.op(1);
+  b.str("f");
+  b.str("v");
+  // intset
+  b.op(11);
+  b.str("intset");
+  b.str(intset16({1, -2, 300}));
+  std::ofstream out(path, std::ios::binary);
+  auto buf = b.finish();
+  out.write(buf.data(), buf.size());
+}
+
+TEST(RdbReader, Plain) {
+  const auto guard = MakeGuard([] { remove("test.rdb"); });
+  writeTestRdb("test.rdb");
+
+  RdbReader reader("test.rdb");
+  EXPECT_TRUE(reader.open().ok());
+  EXPECT_EQ(reader.getVersion(), 6U);
+  std::vector<RdbObject> objs;
+  while (true) {
+    auto obj = reader.next();
+    if (obj.status().code() == ErrorCodes::ERR_EXHAUST) {
+      break;
+    }
+    EXPECT_TRUE(obj.ok()) << obj.status().toString();
+    objs.push_back(obj.value());
+  }
+  EXPECT_EQ(objs.size(), 7U);
+  EXPECT_EQ(objs[0].value, "value");
+  EXPECT_EQ(objs[1].expireMs, 1000U);
+  EXPECT_EQ(objs[2].elements, std::vector<std::string>({"a", "b", "c"}));
+  EXPECT_EQ(objs[3].type, RdbObjectType::RDB_OBJ_SET);
+  EXPECT_EQ(objs[4].scores[0].second, 1.5);
+  EXPECT_EQ(objs[4].scores[1].second, -3);
+  EXPECT_EQ(objs[5].fields[0].second, "v");
+  EXPECT_EQ(objs[6].elements,
+            std::vector<std::string>({"1", "-2", "300"}));
+}
+
+// the compact encodings of redis 2.6 to 7.x
+void writeEncodedRdb(const std::string& path) {
+  RdbBuilder b("0011");
+  b.op(0xFE);
+  b.op(0);
+  // list ziplist
+  b.op(10);
+  b.str("zllist");
+  b.str(ziplist({"a", "12", "-300", "bcd"}));
+  // zset ziplist
+  b.op(12);
+  b.str("zlzset");
+  b.str(ziplist({"z1", "1.5", "z2", "3"}));
+  // hash ziplist
+  b.op(13);
+  b.str("zlhash");
+  b.str(ziplist({"f1", "v1", "f2", "7"}));
+  // quicklist of ziplists
+  b.op(14);
+  b.str("qlist");
+  b.op(2);
+  b.str(ziplist({"a", "b"}));
+  b.str(ziplist({"1000"}));
+  // hash listpack
+  b.op(16);
+  b.str("lphash");
+  b.str(listpack({"f", "v", "n", "100"}));
+  // zset listpack
+  b.op(17);
+  b.str("lpzset");
+  b.str(listpack({"m", "-2.5", "k", "5"}));
+  // quicklist of a listpack and a plain node
+  b.op(18);
+  b.str("qlist2");
+  b.op(2);
+  b.op(2);
+  b.str(listpack({"x", "-100", "4000"}));
+  b.op(1);
+  b.str("plain");
+  // set listpack
+  b.op(20);
+  b.str("lpset");
+  b.str(listpack({"s1", "2"}));
+  std::ofstream out(path, std::ios::binary);
+  auto buf = b.finish();
+  out.write(buf.data(), buf.size());
+}
+
+TEST(RdbReader, Encodings) {
+  const auto guard = MakeGuard([] { remove("test.rdb"); });
+  writeEncodedRdb("test.rdb");
+
+  RdbReader reader("test.rdb");
+  EXPECT_TRUE(reader.open().ok());
+  EXPECT_EQ(reader.getVersion(), 11U);
+  std::vector<RdbObject> objs;
+  while (true) {
+    auto obj = reader.next();
+    if (obj.status().code() == ErrorCodes::ERR_EXHAUST) {
+      break;
+    }
+    EXPECT_TRUE(obj.ok()) << obj.status().toString();
+    if (!obj.ok()) {
+      return;
+    }
+    objs.push_back(obj.value());
+  }
+  ASSERT_EQ(objs.size(), 8U);
+  typedef std::vector<std::string> Strs;
+  typedef std::vector<std::pair<std::string, std::string>> Fields;
+  typedef std::vector<std::pair<std::string, double>> Scores;
+
+  EXPECT_EQ(objs[0].type, RdbObjectType::RDB_OBJ_LIST);
+  EXPECT_EQ(objs[0].elements, Strs({"a", "12", "-300", "bcd"}));
+  EXPECT_EQ(objs[1].type, RdbObjectType::RDB_OBJ_ZSET);
+  EXPECT_EQ(objs[1].scores, Scores({{"z1", 1.5}, {"z2", 3}}));
+  EXPECT_EQ(objs[2].type, RdbObjectType::RDB_OBJ_HASH);
+  EXPECT_EQ(objs[2].fields, Fields({{"f1", "v1"}, {"f2", "7"}}));
+  EXPECT_EQ(objs[3].key, "qlist");
+  EXPECT_EQ(objs[3].elements, Strs({"a", "b", "1000"}));
+  EXPECT_EQ(objs[4].type, RdbObjectType::RDB_OBJ_HASH);
+  EXPECT_EQ(objs[4].fields, Fields({{"f", "v"}, {"n", "100"}}));
+  EXPECT_EQ(objs[5].type, RdbObjectType::RDB_OBJ_ZSET);
+  EXPECT_EQ(objs[5].scores, Scores({{"m", -2.5}, {"k", 5}}));
+  EXPECT_EQ(objs[6].type, RdbObjectType::RDB_OBJ_LIST);
+  EXPECT_EQ(objs[6].elements, Strs({"x", "-100", "4000", "plain"}));
+  EXPECT_EQ(objs[7].type, RdbObjectType::RDB_OBJ_SET);
+  EXPECT_EQ(objs[7].elements, Strs({"s1", "2"}));
+
+  // a ziplist cut in the middle
+  auto zl = ziplist({"abc", "def"});
+  EXPECT_FALSE(rdb_util::decodeZiplist(zl.substr(0, zl.size() - 3)).ok());
+  auto lp = listpack({"abc", "def"});
+  EXPECT_FALSE(rdb_util::decodeListpack(lp.substr(0, lp.size() - 3)).ok());
+}
+
+void testImport(bool genBinlog) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  const auto guard = MakeGuard([] {
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+    filesystem::remove_all("./rdbimport");
+    remove("test.rdb");
+  });
+  writeTestRdb("test.rdb");
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto store = std::shared_ptr<KVStore>(new RocksKVStore("0", cfg, blockCache));
+
+  RdbImportOptions opts;
+  opts.files = {"test.rdb"};
+  opts.tmpDir = "./rdbimport";
+  opts.genBinlog = genBinlog;
+  opts.threads = 2;
+  uint64_t firstBinlogId = store->getNextBinlogSeq();
+  {
+    RdbSstImporter importer({store}, opts);
+    auto s = importer.build();
+    EXPECT_TRUE(s.ok()) << s.toString();
+    s = importer.ingest(0);
+    EXPECT_TRUE(s.ok()) << s.toString();
+  }
+  EXPECT_FALSE(filesystem::exists("./rdbimport/0"));
+
+  auto str = getMeta(store, "str");
+  EXPECT_TRUE(str.ok());
+  EXPECT_EQ(str.value().getValue(), "value");
+  EXPECT_EQ(getMeta(store, "expired").status().code(),
+            ErrorCodes::ERR_NOTFOUND);
+  EXPECT_EQ(getMeta(store, "list").value().getRecordType(),
+            RecordType::RT_LIST_META);
+  EXPECT_EQ(getMeta(store, "set").value().getRecordType(),
+            RecordType::RT_SET_META);
+  EXPECT_EQ(getMeta(store, "intset").value().getRecordType(),
+            RecordType::RT_SET_META);
+  EXPECT_EQ(getMeta(store, "zset").value().getRecordType(),
+            RecordType::RT_ZSET_META);
+  auto hash = getMeta(store, "hash");
+  EXPECT_EQ(hash.value().getRecordType(), RecordType::RT_HASH_META);
+  EXPECT_GT(hash.value().getTtl(), msSinceEpoch());
+
+  // one binlog for each key imported
+  uint64_t binlogs = genBinlog ? 6 : 0;
+  EXPECT_EQ(store->getNextBinlogSeq(), firstBinlogId + binlogs);
+  EXPECT_EQ(store->getHighestBinlogId() + 1, firstBinlogId + binlogs);
+
+  // the store is not empty any more
+  RdbSstImporter again({store}, opts);
+  EXPECT_FALSE(again.build().ok());
+}
+
+TEST(RdbSstImporter, FullSync) {
+  testImport(false);
+}
+
+TEST(RdbSstImporter, Binlog) {
+  testImport(true);
+}
+
+}  // namespace tendisplus
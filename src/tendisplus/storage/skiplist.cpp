@@ -12,6 +12,257 @@
 
 namespace tendisplus {
 
+SkipListCache::SkipListCache()
+  : _maxNodes(0), _minCount(0), _nodes(0), _entries(0), _nextGen(1) {}
+
+SkipListCache& SkipListCache::getInstance() {
+  static SkipListCache cache;
+  return cache;
+}
+
+void SkipListCache::setLimit(uint64_t maxNodes, uint32_t minCount) {
+  _maxNodes = maxNodes;
+  _minCount = minCount;
+  if (maxNodes == 0) {
+    for (auto& shard : _shards) {
+      std::lock_guard<std::mutex> lk(shard.mutex);
+      while (!shard.lru.empty()) {
+        dropInLock(&shard, shard.lru.back());
+      }
+    }
+  }
+}
+
+bool SkipListCache::enabled(uint32_t count) const {
+  return _maxNodes.load(std::memory_order_relaxed) > 0 &&
+    count >= _minCount.load(std::memory_order_relaxed);
+}
+
+bool SkipListCache::empty() const {
+  return _entries.load(std::memory_order_relaxed) == 0;
+}
+
+std::string SkipListCache::makeKey(const std::string& storeId,
+                                   uint32_t chunkId,
+                                   uint32_t dbId,
+                                   const std::string& pk) {
+  RecordKey rk(chunkId, dbId, RecordType::RT_ZSET_META, pk, "");
+  return storeId + ":" + rk.prefixPk();
+}
+
+bool SkipListCache::isUpperNode(uint64_t pointer, const ZSlEleValue& val) {
+  return pointer == ZSlMetaValue::HEAD_ID || val.getForward(2) != 0 ||
+    val.getSpan(2) != 0;
+}
+
+std::string SkipListCache::makeSig(const ZSlMetaValue& meta) {
+  // NOTE(tendis): posAlloc grows on every insert and count changes on every
+  // remove, so a modified skiplist never has the same signature.
+  ZSlMetaValue mv(
+    meta.getLevel(), meta.getCount(), meta.getTail(), meta.getPosAlloc());
+  return mv.encode();
+}
+
+SkipListCacheShard& SkipListCache::getShard(const std::string& key) {
+  return _shards[std::hash<std::string>()(key) % SHARD_NUM];
+}
+
+void SkipListCache::dropInLock(SkipListCacheShard* shard,
+                               const std::string& key) {
+  auto it = shard->map.find(key);
+  if (it == shard->map.end()) {
+    return;
+  }
+  auto entry = it->second.first;
+  shard->lru.erase(it->second.second);
+  shard->map.erase(it);
+  --_entries;
+
+  std::lock_guard<std::mutex> lk(entry->mutex);
+  _nodes -= entry->nodes.size();
+  entry->nodes.clear();
+  entry->gen = 0;
+}
+
+void SkipListCache::evictInLock(SkipListCacheShard* shard,
+                                const std::string& except) {
+  while (_nodes.load(std::memory_order_relaxed) >= _maxNodes &&
+         !shard->lru.empty() && shard->lru.back() != except) {
+    dropInLock(shard, shard->lru.back());
+    ++shard->evictions;
+  }
+}
+
+PSkipListCacheEntry SkipListCache::attach(const std::string& key,
+                                          const ZSlMetaValue& meta,
+                                          uint64_t* gen) {
+  auto sig = makeSig(meta);
+  auto& shard = getShard(key);
+  std::lock_guard<std::mutex> lk(shard.mutex);
+  auto it = shard.map.find(key);
+  if (it != shard.map.end()) {
+    auto entry = it->second.first;
+    {
+      std::lock_guard<std::mutex> elk(entry->mutex);
+      if (entry->sig == sig) {
+        *gen = entry->gen;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.second);
+        return entry;
+      }
+    }
+    dropInLock(&shard, key);
+  }
+
+  evictInLock(&shard, key);
+  auto entry = std::make_shared<SkipListCacheEntry>();
+  entry->gen = _nextGen.fetch_add(1);
+  entry->sig = std::move(sig);
+  shard.lru.push_front(key);
+  shard.map[key] = {entry, shard.lru.begin()};
+  ++_entries;
+  *gen = entry->gen;
+  return entry;
+}
+
+bool SkipListCache::getNode(const PSkipListCacheEntry& entry,
+                            uint64_t gen,
+                            uint64_t pointer,
+                            ZSlEleValue* val) {
+  std::lock_guard<std::mutex> lk(entry->mutex);
+  auto it = entry->nodes.find(pointer);
+  bool found = entry->gen == gen && it != entry->nodes.end();
+  if (found) {
+    *val = it->second;
+  }
+  auto& shard = _shards[pointer % SHARD_NUM];
+  if (found) {
+    shard.hits.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    shard.misses.fetch_add(1, std::memory_order_relaxed);
+  }
+  return found;
+}
+
+void SkipListCache::putNode(const PSkipListCacheEntry& entry,
+                            uint64_t gen,
+                            uint64_t pointer,
+                            const ZSlEleValue& val) {
+  if (_nodes.load(std::memory_order_relaxed) >= _maxNodes) {
+    return;
+  }
+  std::lock_guard<std::mutex> lk(entry->mutex);
+  if (entry->gen != gen) {
+    return;
+  }
+  if (entry->nodes.emplace(pointer, val).second) {
+    ++_nodes;
+  }
+}
+
+PSkipListCacheEntry SkipListCache::publish(
+  const std::string& key,
+  const PSkipListCacheEntry& entry,
+  const ZSlMetaValue& meta,
+  const std::vector<std::pair<uint64_t, const ZSlEleValue*>>& nodes,
+  const std::vector<uint64_t>& deleted,
+  uint64_t* gen) {
+  auto& shard = getShard(key);
+  std::lock_guard<std::mutex> lk(shard.mutex);
+  auto it = shard.map.find(key);
+  bool reuse = entry && it != shard.map.end() && it->second.first == entry;
+  if (!reuse || !enabled(meta.getCount())) {
+    dropInLock(&shard, key);
+    if (!enabled(meta.getCount())) {
+      *gen = 0;
+      return nullptr;
+    }
+    evictInLock(&shard, key);
+    auto newEntry = std::make_shared<SkipListCacheEntry>();
+    newEntry->gen = 0;
+    shard.lru.push_front(key);
+    shard.map[key] = {newEntry, shard.lru.begin()};
+    ++_entries;
+    it = shard.map.find(key);
+  }
+
+  auto target = it->second.first;
+  std::lock_guard<std::mutex> elk(target->mutex);
+  for (auto pointer : deleted) {
+    _nodes -= target->nodes.erase(pointer);
+  }
+  for (auto& v : nodes) {
+    auto nit = target->nodes.find(v.first);
+    if (nit != target->nodes.end()) {
+      nit->second = *v.second;
+    } else if (isUpperNode(v.first, *v.second) &&
+               _nodes.load(std::memory_order_relaxed) < _maxNodes) {
+      target->nodes.emplace(v.first, *v.second);
+      ++_nodes;
+    }
+  }
+  // NOTE(tendis): readers that attached to the old meta may still be
+  // loading nodes from their snapshot, a new generation rejects them.
+  target->gen = _nextGen.fetch_add(1);
+  target->sig = makeSig(meta);
+  *gen = target->gen;
+  return target;
+}
+
+void SkipListCache::invalidate(const std::string& key) {
+  auto& shard = getShard(key);
+  std::lock_guard<std::mutex> lk(shard.mutex);
+  dropInLock(&shard, key);
+}
+
+void SkipListCache::invalidateStore(const std::string& storeId) {
+  const std::string prefix = storeId + ":";
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> lk(shard.mutex);
+    std::vector<std::string> keys;
+    for (auto& key : shard.lru) {
+      if (key.compare(0, prefix.size(), prefix) == 0) {
+        keys.push_back(key);
+      }
+    }
+    for (auto& key : keys) {
+      dropInLock(&shard, key);
+    }
+  }
+}
+
+uint64_t SkipListCache::getHits() {
+  uint64_t hits = 0;
+  for (auto& shard : _shards) {
+    hits += shard.hits.load(std::memory_order_relaxed);
+  }
+  return hits;
+}
+
+uint64_t SkipListCache::getMisses() {
+  uint64_t misses = 0;
+  for (auto& shard : _shards) {
+    misses += shard.misses.load(std::memory_order_relaxed);
+  }
+  return misses;
+}
+
+uint64_t SkipListCache::getEvictions() {
+  uint64_t evictions = 0;
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> lk(shard.mutex);
+    evictions += shard.evictions;
+  }
+  return evictions;
+}
+
+uint64_t SkipListCache::getNodeCount() const {
+  return _nodes.load(std::memory_order_relaxed);
+}
+
+uint64_t SkipListCache::getEntryCount() const {
+  return _entries.load(std::memory_order_relaxed);
+}
+
 int compareStringObjectsForLexRange(const std::string& a,
                                     const std::string& b) {
   if (a == b) {
@@ -79,7 +330,15 @@ SkipList::SkipList(uint32_t chunkId,
     _chunkId(chunkId),
     _dbId(dbId),
     _pk(pk),
-    _store(store) {}
+    _store(store),
+    _sharedGen(0) {
+  auto& shared = SkipListCache::getInstance();
+  if (!shared.enabled(meta.getCount())) {
+    return;
+  }
+  _sharedKey = SkipListCache::makeKey(_store->dbId(), chunkId, dbId, pk);
+  _shared = shared.attach(_sharedKey, meta, &_sharedGen);
+}
 
 uint8_t SkipList::randomLevel() {
   static thread_local std::mt19937 generator(
@@ -150,6 +409,16 @@ Expected<ZSlEleValue*> SkipList::getNode(uint64_t pointer, Transaction* txn) {
     ++nGetFromCache;
     return it->second.get();
   }
+  if (_shared) {
+    auto ptr = std::make_unique<ZSlEleValue>();
+    if (SkipListCache::getInstance().getNode(
+          _shared, _sharedGen, pointer, ptr.get())) {
+      ZSlEleValue* toReturn = ptr.get();
+      cache[pointer] = std::move(ptr);
+      ++nGetFromCache;
+      return toReturn;
+    }
+  }
   std::string pointerStr = std::to_string(pointer);
   RecordKey rk(_chunkId, _dbId, RecordType::RT_ZSET_S_ELE, _pk, pointerStr);
   Expected<RecordValue> rv = _store->getKV(rk, txn);
@@ -162,6 +431,9 @@ Expected<ZSlEleValue*> SkipList::getNode(uint64_t pointer, Transaction* txn) {
     return result.status();
   }
   auto ptr = std::make_unique<ZSlEleValue>(std::move(result.value()));
+  if (_shared && SkipListCache::isUpperNode(pointer, *ptr)) {
+    SkipListCache::getInstance().putNode(_shared, _sharedGen, pointer, *ptr);
+  }
   ZSlEleValue* toReturn = ptr.get();
   cache[pointer] = std::move(ptr);
   ++nGetFromStore;
@@ -171,6 +443,9 @@ Expected<ZSlEleValue*> SkipList::getNode(uint64_t pointer, Transaction* txn) {
 Status SkipList::delNode(uint64_t pointer, Transaction* txn) {
   // TODO(vinchen)
   cache.erase(pointer);
+  if (_shared) {
+    _sharedDeleted.push_back(pointer);
+  }
   ++nDeleted;
   RecordKey rk(
     _chunkId, _dbId, RecordType::RT_ZSET_S_ELE, _pk, std::to_string(pointer));
@@ -210,7 +485,36 @@ Status SkipList::save(Transaction* txn,
   uint64_t ttl = oldValue.ok() ? oldValue.value().getTtl() : 0;
   RecordValue rv(
     mv.encode(), RecordType::RT_ZSET_META, versionEP, ttl, oldValue);
-  return _store->setKV(rk, rv, txn);
+  auto s = _store->setKV(rk, rv, txn);
+  if (!s.ok()) {
+    return s;
+  }
+  publishToSharedCache();
+  return s;
+}
+
+void SkipList::publishToSharedCache() {
+  auto& shared = SkipListCache::getInstance();
+  if (_sharedKey.empty()) {
+    if (shared.empty()) {
+      return;
+    }
+    // NOTE(tendis): a small zset never attaches, but an entry of the same
+    // key may be left by a deleted zset, drop it before it can be reused.
+    _sharedKey = SkipListCache::makeKey(_store->dbId(), _chunkId, _dbId, _pk);
+  }
+
+  // NOTE(tendis): the nodes in the local cache are all up to date after
+  // save(), publish them even if the transaction is rolled back later. The
+  // entry is bound to the new meta, and a rolled back meta never matches.
+  std::vector<std::pair<uint64_t, const ZSlEleValue*>> nodes;
+  for (auto& v : cache) {
+    nodes.emplace_back(v.first, v.second.get());
+  }
+  ZSlMetaValue mv(_level, _count, _tail, _posAlloc);
+  _shared =
+    shared.publish(_sharedKey, _shared, mv, nodes, _sharedDeleted, &_sharedGen);
+  _sharedDeleted.clear();
 }
 
 Status SkipList::removeInternal(uint64_t pos,
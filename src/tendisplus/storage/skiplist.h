@@ -13,6 +13,8 @@
 #include <vector>
 #include <atomic>
 #include <utility>
+#include <mutex>  // NOLINT
+#include <unordered_map>
 #include "tendisplus/storage/record.h"
 #include "tendisplus/storage/kvstore.h"
 #include "tendisplus/utils/redis_port.h"
@@ -22,6 +24,100 @@ namespace tendisplus {
 using Zrangespec = redis_port::Zrangespec;
 using Zlexrangespec = redis_port::Zlexrangespec;
 const uint64_t SKIPLIST_INVALID_POS = (uint64_t)-1;
+
+// SkipListCache keeps the decoded head and upper-level nodes of big zsets
+// across commands, so that ZADD/ZRANK on a hot key don't reload the top of
+// the same skiplist from rocksdb every time.
+// An entry is only valid for the exact ZSlMetaValue it is built from, and
+// a generation number protects it from readers holding an older snapshot.
+// SkipList::save() publishes what it writes, replication apply and
+// deleteRange drop what they touch.
+struct SkipListCacheEntry {
+  std::mutex mutex;
+  // 0 means the entry has been dropped from the cache
+  uint64_t gen;
+  std::string sig;
+  std::unordered_map<uint64_t, ZSlEleValue> nodes;
+};
+using PSkipListCacheEntry = std::shared_ptr<SkipListCacheEntry>;
+
+// not thread safe, protected by SkipListCacheShard's mutex
+struct alignas(128) SkipListCacheShard {
+  std::mutex mutex;
+  // most recently attached key at the front
+  std::list<std::string> lru;
+  std::unordered_map<
+    std::string,
+    std::pair<PSkipListCacheEntry, std::list<std::string>::iterator>>
+    map;
+  uint64_t evictions = 0;
+  // updated without holding the mutex
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+};
+
+class SkipListCache {
+ public:
+  SkipListCache();
+  static SkipListCache& getInstance();
+  // maxNodes == 0 disables the cache, zsets with less than minCount
+  // elements are never cached
+  void setLimit(uint64_t maxNodes, uint32_t minCount);
+  // whether a zset with count elements should be cached
+  bool enabled(uint32_t count) const;
+  bool empty() const;
+  static std::string makeKey(const std::string& storeId,
+                             uint32_t chunkId,
+                             uint32_t dbId,
+                             const std::string& pk);
+  // the head and nodes above level 1, they are visited by every lookup
+  static bool isUpperNode(uint64_t pointer, const ZSlEleValue& val);
+
+  PSkipListCacheEntry attach(const std::string& key,
+                             const ZSlMetaValue& meta,
+                             uint64_t* gen);
+  bool getNode(const PSkipListCacheEntry& entry,
+               uint64_t gen,
+               uint64_t pointer,
+               ZSlEleValue* val);
+  void putNode(const PSkipListCacheEntry& entry,
+               uint64_t gen,
+               uint64_t pointer,
+               const ZSlEleValue& val);
+  // called after the skiplist nodes and meta have been written,
+  // return the entry matching the new meta, or nullptr
+  PSkipListCacheEntry publish(
+    const std::string& key,
+    const PSkipListCacheEntry& entry,
+    const ZSlMetaValue& meta,
+    const std::vector<std::pair<uint64_t, const ZSlEleValue*>>& nodes,
+    const std::vector<uint64_t>& deleted,
+    uint64_t* gen);
+  void invalidate(const std::string& key);
+  void invalidateStore(const std::string& storeId);
+
+  uint64_t getHits();
+  uint64_t getMisses();
+  uint64_t getEvictions();
+  uint64_t getNodeCount() const;
+  uint64_t getEntryCount() const;
+
+ private:
+  static std::string makeSig(const ZSlMetaValue& meta);
+  SkipListCacheShard& getShard(const std::string& key);
+  // should hold the shard's mutex
+  void dropInLock(SkipListCacheShard* shard, const std::string& key);
+  void evictInLock(SkipListCacheShard* shard, const std::string& except);
+
+  static constexpr size_t SHARD_NUM = 32;
+  SkipListCacheShard _shards[SHARD_NUM];
+  std::atomic<uint64_t> _maxNodes;
+  std::atomic<uint32_t> _minCount;
+  std::atomic<uint64_t> _nodes;
+  std::atomic<uint64_t> _entries;
+  std::atomic<uint64_t> _nextGen;
+};
+
 class SkipList {
  public:
   using PSE = std::unique_ptr<ZSlEleValue>;
@@ -101,6 +197,7 @@ class SkipList {
   Expected<ZSlEleValue*> getEleByRank(uint32_t rank, Transaction* txn);
   Expected<ZSlEleValue*> getNode(uint64_t pointer, Transaction* txn);
   std::pair<uint64_t, PSE> makeNode(double score, const std::string& subkey);
+  void publishToSharedCache();
   const uint8_t _maxLevel;
   uint8_t _level;
   uint32_t _count;
@@ -111,6 +208,11 @@ class SkipList {
   std::string _pk;
   PStore _store;
   PSE_MAP cache;
+  // server-wide cache of upper-level nodes, nullptr if not cached
+  std::string _sharedKey;
+  PSkipListCacheEntry _shared;
+  uint64_t _sharedGen;
+  std::vector<uint64_t> _sharedDeleted;
 };
 
 }  // namespace tendisplus
@@ -318,6 +318,120 @@ TEST(SkipList, InsertDelSameKeys) {
   }
 }
 
+TEST(SkipList, SharedCache) {
+  auto cfg = genParams();
+  EXPECT_TRUE(filesystem::create_directory("db"));
+  EXPECT_TRUE(filesystem::create_directory("log"));
+  auto& shared = SkipListCache::getInstance();
+  shared.setLimit(1024 * 1024, 1);
+  const auto guard = MakeGuard([&shared] {
+    shared.setLimit(0, 0);
+    filesystem::remove_all("./log");
+    filesystem::remove_all("./db");
+  });
+  auto blockCache =
+    rocksdb::NewLRUCache(cfg->rocksBlockcacheMB * 1024 * 1024LL, 4);
+  auto store = std::shared_ptr<KVStore>(new RocksKVStore("0", cfg, blockCache));
+  auto eTxn1 = store->createTransaction(nullptr);
+  EXPECT_TRUE(eTxn1.ok());
+
+  ZSlMetaValue meta(1, 1, 0);
+  RecordValue rv(meta.encode(), RecordType::RT_ZSET_META, -1);
+  RecordKey mk(0, 0, RecordType::RT_ZSET_META, "test", "");
+  Status s = store->setKV(mk, rv, eTxn1.value().get());
+  EXPECT_TRUE(s.ok());
+
+  RecordKey head(0,
+                 0,
+                 RecordType::RT_ZSET_S_ELE,
+                 "test",
+                 std::to_string(ZSlMetaValue::HEAD_ID));
+  ZSlEleValue headVal;
+  RecordValue subRv(headVal.encode(), RecordType::RT_ZSET_S_ELE, -1);
+  s = store->setKV(head, subRv, eTxn1.value().get());
+  EXPECT_TRUE(s.ok());
+
+  constexpr uint32_t CNT = 1000;
+  std::vector<uint32_t> keys;
+  for (uint32_t i = 1; i <= CNT; ++i) {
+    keys.push_back(i);
+  }
+  std::random_shuffle(keys.begin(), keys.end());
+  SkipList sl(0, 0, "test", meta, store);
+  for (auto& i : keys) {
+    s = sl.insert(i, std::to_string(i), eTxn1.value().get());
+    EXPECT_TRUE(s.ok());
+  }
+  s = sl.save(eTxn1.value().get(), {ErrorCodes::ERR_NOTFOUND, ""}, -1);
+  EXPECT_TRUE(s.ok());
+  Expected<uint64_t> commitStatus = eTxn1.value()->commit();
+  EXPECT_TRUE(commitStatus.ok());
+  EXPECT_EQ(shared.getEntryCount(), 1U);
+
+  auto loadMeta = [&store, &mk](Transaction* txn) {
+    Expected<RecordValue> eMeta = store->getKV(mk, txn);
+    EXPECT_TRUE(eMeta.ok());
+    auto eMetaContent = ZSlMetaValue::decode(eMeta.value().getValue());
+    EXPECT_TRUE(eMetaContent.ok());
+    return eMetaContent.value();
+  };
+
+  // every command builds a new skiplist, the upper-level nodes
+  // should come from the shared cache
+  uint64_t hits = shared.getHits();
+  for (uint32_t i = 1; i <= CNT; i += 7) {
+    auto eTxn = store->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    SkipList sl2(0, 0, "test", loadMeta(eTxn.value().get()), store);
+    auto expRank = sl2.rank(i, std::to_string(i), eTxn.value().get());
+    EXPECT_TRUE(expRank.ok());
+    EXPECT_EQ(expRank.value(), i);
+  }
+  EXPECT_GT(shared.getHits(), hits);
+  EXPECT_GT(shared.getNodeCount(), 0U);
+
+  // remove the odd ones, the cache must follow the new layout
+  for (uint32_t i = 1; i <= CNT; i += 2) {
+    auto eTxn = store->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    auto meta2 = loadMeta(eTxn.value().get());
+    SkipList sl2(0, 0, "test", meta2, store);
+    s = sl2.remove(i, std::to_string(i), eTxn.value().get());
+    EXPECT_TRUE(s.ok());
+    s = sl2.save(eTxn.value().get(), {ErrorCodes::ERR_NOTFOUND, ""}, -1);
+    EXPECT_TRUE(s.ok());
+    commitStatus = eTxn.value()->commit();
+    EXPECT_TRUE(commitStatus.ok());
+  }
+
+  // a rolled back write must not be visible
+  {
+    auto eTxn = store->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    SkipList sl2(0, 0, "test", loadMeta(eTxn.value().get()), store);
+    s = sl2.remove(2, std::to_string(2), eTxn.value().get());
+    EXPECT_TRUE(s.ok());
+    s = sl2.save(eTxn.value().get(), {ErrorCodes::ERR_NOTFOUND, ""}, -1);
+    EXPECT_TRUE(s.ok());
+    s = eTxn.value()->rollback();
+    EXPECT_TRUE(s.ok());
+  }
+
+  for (uint32_t i = 2; i <= CNT; i += 2) {
+    auto eTxn = store->createTransaction(nullptr);
+    EXPECT_TRUE(eTxn.ok());
+    SkipList sl2(0, 0, "test", loadMeta(eTxn.value().get()), store);
+    EXPECT_EQ(sl2.getCount(), CNT / 2 + 1);
+    auto expRank = sl2.rank(i, std::to_string(i), eTxn.value().get());
+    EXPECT_TRUE(expRank.ok());
+    EXPECT_EQ(expRank.value(), i / 2);
+  }
+
+  shared.invalidateStore(store->dbId());
+  EXPECT_EQ(shared.getEntryCount(), 0U);
+  EXPECT_EQ(shared.getNodeCount(), 0U);
+}
+
 TEST(SkipList, Common) {
   auto cfg = genParams();
   EXPECT_TRUE(filesystem::create_directory("db"));
@@ -0,0 +1,218 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <string.h>
+#include "tendisplus/utils/bitops.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define TENDIS_BITOPS_AVX2
+#include <immintrin.h>
+#endif
+
+namespace tendisplus {
+namespace bitops {
+
+namespace {
+
+inline uint64_t load64(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline void store64(unsigned char* p, uint64_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+inline uint64_t popCount64(uint64_t v) {
+#ifdef __GNUC__
+  return __builtin_popcountll(v);
+#else
+  v = v - ((v >> 1) & 0x5555555555555555ULL);
+  v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+  v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (v * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+uint64_t popCountScalar(const unsigned char* p, size_t count) {
+  uint64_t bits = 0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    bits += popCount64(load64(p + i));
+  }
+  for (; i < count; i++) {
+    bits += popCount64(p[i]);
+  }
+  return bits;
+}
+
+enum class Op {
+  AND,
+  OR,
+  XOR,
+};
+
+template <Op op>
+inline uint64_t apply64(uint64_t a, uint64_t b) {
+  switch (op) {
+    case Op::AND:
+      return a & b;
+    case Op::OR:
+      return a | b;
+    default:
+      return a ^ b;
+  }
+}
+
+template <Op op>
+void binaryScalar(unsigned char* dst, const unsigned char* src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    store64(dst + i, apply64<op>(load64(dst + i), load64(src + i)));
+  }
+  for (; i < count; i++) {
+    dst[i] = static_cast<unsigned char>(apply64<op>(dst[i], src[i]));
+  }
+}
+
+void notScalar(unsigned char* dst, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    store64(dst + i, ~load64(dst + i));
+  }
+  for (; i < count; i++) {
+    dst[i] = ~dst[i];
+  }
+}
+
+#ifdef TENDIS_BITOPS_AVX2
+// popcount of 32 bytes by nibble lookup (vpshufb), the per-byte counts
+// are summed into 4 x 64-bit lanes by vpsadbw.
+__attribute__((target("avx2"))) uint64_t popCountAvx2(const unsigned char* p,
+                                                      size_t count) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                          1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3,
+                                          1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low4 = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  while (i + 32 <= count) {
+    // per-byte counts are at most 8, so 31 rounds fit in a byte
+    __m256i acc = _mm256_setzero_si256();
+    for (int round = 0; round < 31 && i + 32 <= count; round++, i += 32) {
+      __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+      __m256i lo = _mm256_and_si256(v, low4);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low4);
+      acc = _mm256_add_epi8(acc, _mm256_shuffle_epi8(lookup, lo));
+      acc = _mm256_add_epi8(acc, _mm256_shuffle_epi8(lookup, hi));
+    }
+    total = _mm256_add_epi64(total,
+                             _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    popCountScalar(p + i, count - i);
+}
+
+template <Op op>
+__attribute__((target("avx2"))) void binaryAvx2(unsigned char* dst,
+                                                const unsigned char* src,
+                                                size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i r;
+    switch (op) {
+      case Op::AND:
+        r = _mm256_and_si256(a, b);
+        break;
+      case Op::OR:
+        r = _mm256_or_si256(a, b);
+        break;
+      default:
+        r = _mm256_xor_si256(a, b);
+        break;
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), r);
+  }
+  binaryScalar<op>(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2"))) void notAvx2(unsigned char* dst,
+                                             size_t count) {
+  const __m256i ones = _mm256_set1_epi8(static_cast<char>(0xff));
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                        _mm256_xor_si256(a, ones));
+  }
+  notScalar(dst + i, count - i);
+}
+#endif  // TENDIS_BITOPS_AVX2
+
+// the kernels are not worth for very small inputs
+constexpr size_t AVX2_MIN_SIZE = 64;
+
+template <Op op>
+void binary(unsigned char* dst, const unsigned char* src, size_t count) {
+#ifdef TENDIS_BITOPS_AVX2
+  if (count >= AVX2_MIN_SIZE && useAvx2()) {
+    binaryAvx2<op>(dst, src, count);
+    return;
+  }
+#endif
+  binaryScalar<op>(dst, src, count);
+}
+
+}  // namespace
+
+bool useAvx2() {
+#ifdef TENDIS_BITOPS_AVX2
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+uint64_t popCount(const void* s, size_t count) {
+  const unsigned char* p = static_cast<const unsigned char*>(s);
+#ifdef TENDIS_BITOPS_AVX2
+  if (count >= AVX2_MIN_SIZE && useAvx2()) {
+    return popCountAvx2(p, count);
+  }
+#endif
+  return popCountScalar(p, count);
+}
+
+void bitAnd(unsigned char* dst, const unsigned char* src, size_t count) {
+  binary<Op::AND>(dst, src, count);
+}
+
+void bitOr(unsigned char* dst, const unsigned char* src, size_t count) {
+  binary<Op::OR>(dst, src, count);
+}
+
+void bitXor(unsigned char* dst, const unsigned char* src, size_t count) {
+  binary<Op::XOR>(dst, src, count);
+}
+
+void bitNot(unsigned char* dst, size_t count) {
+#ifdef TENDIS_BITOPS_AVX2
+  if (count >= AVX2_MIN_SIZE && useAvx2()) {
+    notAvx2(dst, count);
+    return;
+  }
+#endif
+  notScalar(dst, count);
+}
+
+}  // namespace bitops
+}  // namespace tendisplus
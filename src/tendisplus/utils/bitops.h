@@ -0,0 +1,35 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_UTILS_BITOPS_H_
+#define SRC_TENDISPLUS_UTILS_BITOPS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace tendisplus {
+
+// Bitmap kernels used by BITCOUNT/BITPOS/BITOP and the pieced strings.
+// They use AVX2 if the cpu supports it, otherwise a scalar version
+// working on 64-bit words. The result is always the same.
+namespace bitops {
+
+bool useAvx2();
+
+// number of bits set in [s, s + count)
+uint64_t popCount(const void* s, size_t count);
+
+// dst[i] = dst[i] & src[i] for i in [0, count)
+void bitAnd(unsigned char* dst, const unsigned char* src, size_t count);
+// dst[i] = dst[i] | src[i] for i in [0, count)
+void bitOr(unsigned char* dst, const unsigned char* src, size_t count);
+// dst[i] = dst[i] ^ src[i] for i in [0, count)
+void bitXor(unsigned char* dst, const unsigned char* src, size_t count);
+// dst[i] = ~dst[i] for i in [0, count)
+void bitNot(unsigned char* dst, size_t count);
+
+}  // namespace bitops
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_UTILS_BITOPS_H_
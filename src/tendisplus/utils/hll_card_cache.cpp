@@ -0,0 +1,94 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#include <functional>
+#include "tendisplus/utils/hll_card_cache.h"
+
+namespace tendisplus {
+
+HllCardCache::HllCardCache() : _maxKeys(0), _hits(0), _misses(0) {}
+
+HllCardCache& HllCardCache::getInstance() {
+  static HllCardCache cache;
+  return cache;
+}
+
+void HllCardCache::setLimit(uint32_t maxKeys) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  _maxKeys = maxKeys;
+  while (_entries.size() > maxKeys) {
+    _entries.erase(_lru.back());
+    _lru.pop_back();
+  }
+}
+
+bool HllCardCache::enabled() const {
+  return _maxKeys.load(std::memory_order_relaxed) > 0;
+}
+
+std::string HllCardCache::makeKey(uint32_t dbId, const std::string& key) {
+  return std::to_string(dbId) + "_" + key;
+}
+
+uint64_t HllCardCache::fingerprint(const std::string& value) {
+  return std::hash<std::string>()(value) ^ value.size();
+}
+
+bool HllCardCache::get(const std::string& key, uint64_t fp, uint64_t* card) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  auto it = _entries.find(key);
+  if (it == _entries.end() || it->second.fp != fp) {
+    _misses++;
+    return false;
+  }
+  _lru.splice(_lru.begin(), _lru, it->second.lru);
+  *card = it->second.card;
+  _hits++;
+  return true;
+}
+
+void HllCardCache::put(const std::string& key, uint64_t fp, uint64_t card) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  if (_maxKeys == 0) {
+    return;
+  }
+  auto it = _entries.find(key);
+  if (it != _entries.end()) {
+    it->second.fp = fp;
+    it->second.card = card;
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+    return;
+  }
+  while (_entries.size() >= _maxKeys) {
+    _entries.erase(_lru.back());
+    _lru.pop_back();
+  }
+  _lru.push_front(key);
+  _entries.emplace(key, Entry{fp, card, _lru.begin()});
+}
+
+void HllCardCache::invalidate(const std::string& key) {
+  std::lock_guard<std::mutex> lk(_mutex);
+  auto it = _entries.find(key);
+  if (it == _entries.end()) {
+    return;
+  }
+  _lru.erase(it->second.lru);
+  _entries.erase(it);
+}
+
+uint64_t HllCardCache::getHits() const {
+  return _hits.load(std::memory_order_relaxed);
+}
+
+uint64_t HllCardCache::getMisses() const {
+  return _misses.load(std::memory_order_relaxed);
+}
+
+uint64_t HllCardCache::getKeyCount() const {
+  std::lock_guard<std::mutex> lk(_mutex);
+  return _entries.size();
+}
+
+}  // namespace tendisplus
@@ -0,0 +1,57 @@
+// Copyright (C) 2020 THL A29 Limited, a Tencent company.  All rights reserved.
+// Please refer to the license text that comes with this tendis open source
+// project for additional information.
+
+#ifndef SRC_TENDISPLUS_UTILS_HLL_CARD_CACHE_H_
+#define SRC_TENDISPLUS_UTILS_HLL_CARD_CACHE_H_
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace tendisplus {
+
+// PFCOUNT is a read only command, so it can't update the cardinality cached
+// in the hll header as redis does. HllCardCache remembers the cardinality of
+// the recently counted hlls in memory. An entry is bound to the fingerprint
+// of the hll value it was computed from, so it is never used after the value
+// is changed by anything (PFADD drops it directly).
+class HllCardCache {
+ public:
+  HllCardCache();
+  static HllCardCache& getInstance();
+  // max number of cached keys, 0 disables the cache
+  void setLimit(uint32_t maxKeys);
+  bool enabled() const;
+  static std::string makeKey(uint32_t dbId, const std::string& key);
+  static uint64_t fingerprint(const std::string& value);
+
+  bool get(const std::string& key, uint64_t fp, uint64_t* card);
+  void put(const std::string& key, uint64_t fp, uint64_t card);
+  void invalidate(const std::string& key);
+
+  uint64_t getHits() const;
+  uint64_t getMisses() const;
+  uint64_t getKeyCount() const;
+
+ private:
+  struct Entry {
+    uint64_t fp;
+    uint64_t card;
+    std::list<std::string>::iterator lru;
+  };
+
+  mutable std::mutex _mutex;
+  // the most recently used key is at the front
+  std::list<std::string> _lru;
+  std::unordered_map<std::string, Entry> _entries;
+  std::atomic<uint32_t> _maxKeys;
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+};
+
+}  // namespace tendisplus
+
+#endif  // SRC_TENDISPLUS_UTILS_HLL_CARD_CACHE_H_
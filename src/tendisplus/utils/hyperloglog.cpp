@@ -45,11 +45,20 @@
 #include "glog/logging.h"
 #include "tendisplus/utils/invariant.h"
 #include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/bitops.h"
 #include "tendisplus/utils/time.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define TENDIS_HLL_AVX2
+#include <immintrin.h>
+#endif
+
 namespace tendisplus {
 namespace redis_port {
 
+/* HLL_REGISTERS * 2^HLL_SUM_SHIFT should fit in uint64_t. */
+#define HLL_SUM_SHIFT 49
+
 struct PEObject {
   PEObject() {
     /* We precompute 2^(-reg[j]) in a small table in order to
@@ -60,9 +69,18 @@ struct PEObject {
       /* 2^(-reg[j]) is the same as 1/2^reg[j]. */
       PE[j] = 1.0 / (1ULL << j);
     }
+    /* 2^(-reg[j]) in fixed point, see hllRawRegSum(). The low 16 bits
+     * of PECount count the zero registers, the high 16 bits count the
+     * registers which can't be represented in fixed point. */
+    for (int j = 0; j < 64; j++) {
+      PEFixed[j] = j > HLL_SUM_SHIFT ? 0 : 1ULL << (HLL_SUM_SHIFT - j);
+      PECount[j] = (j == 0) | ((j > HLL_SUM_SHIFT) << 16);
+    }
   }
 
   double PE[64];
+  uint64_t PEFixed[64];
+  uint32_t PECount[64];
 };
 
 static struct PEObject peo;
@@ -946,49 +964,11 @@ int hllSparseAdd(hllhdr* hdr,
   return hllSparseSet(hdr, hdrSize, hdrMaxSize, index, count);
 }
 
-/* Compute SUM(2^-reg) in the sparse representation.
- * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
- * As a side effect the integer pointed by 'ezp' is set to the number
- * of zero registers. */
-double hllSparseSum(
-  uint8_t* sparse, int sparselen, double* PE, int* ezp, int* invalid) {
-  double E = 0;
-  int ez = 0, idx = 0, runlen, regval;
-  uint8_t *end = sparse + sparselen, *p = sparse;
-
-  while (p < end) {
-    if (HLL_SPARSE_IS_ZERO(p)) {
-      runlen = HLL_SPARSE_ZERO_LEN(p);
-      idx += runlen;
-      ez += runlen;
-      /* Increment E at the end of the loop. */
-      p++;
-    } else if (HLL_SPARSE_IS_XZERO(p)) {
-      runlen = HLL_SPARSE_XZERO_LEN(p);
-      idx += runlen;
-      ez += runlen;
-      /* Increment E at the end of the loop. */
-      p += 2;
-    } else {
-      runlen = HLL_SPARSE_VAL_LEN(p);
-      regval = HLL_SPARSE_VAL_VALUE(p);
-      idx += runlen;
-      E += PE[regval] * runlen;
-      p++;
-    }
-  }
-  if (idx != HLL_REGISTERS && invalid)
-    *invalid = 1;
-  E += ez; /* Add 2^0 'ez' times. */
-  *ezp = ez;
-  return E;
-}
-
 /* ========================= HyperLogLog Count ==============================
  * This is the core of the algorithm where the approximated count is computed.
- * The function uses the lower level hllDenseSum() and hllSparseSum() functions
- * as helpers to compute the SUM(2^-reg) part of the computation, which is
- * representation-specific, while all the rest is common. */
+ * The function uses the lower level hllDenseRegSum() and hllSparseRegSum()
+ * functions as helpers to compute the SUM(2^-reg) part of the computation,
+ * which is representation-specific, while all the rest is common. */
 
 /* Implements the SUM operation for uint8_t data type which is only used
  * internally as speedup for PFCOUNT with multiple keys. */
@@ -1046,6 +1026,327 @@ double hllRawSum(uint8_t* registers, double* PE, int* ezp) {
   return E;
 }
 
+/* ========================= HyperLogLog kernels ============================
+ * NOTE(tendis): hllCount() and hllMerge() work on the registers unpacked into
+ * bytes, the unpacking, max-merge and sum kernels use AVX2 if the cpu
+ * supports it. SUM(2^-reg) is computed in fixed point (2^-reg is stored as
+ * 2^(HLL_SUM_SHIFT - reg)), so it is exact whatever the order of the
+ * registers, and all the encodings give the same result for the same
+ * registers. hllDenseSum()/hllRawSum() are kept as the scalar reference. */
+
+#define HLL_DENSE_BYTES ((HLL_REGISTERS * HLL_BITS + 7) / 8)
+
+/* Unpack 'groups' * 4 registers of 6 bits, 3 bytes for 4 registers. */
+static void hllDenseUnpackScalar(const uint8_t* r, uint8_t* out, int groups) {
+  for (int j = 0; j < groups; j++) {
+    uint32_t x = r[0] | (r[1] << 8) | (r[2] << 16);
+    out[0] = x & 63;
+    out[1] = (x >> 6) & 63;
+    out[2] = (x >> 12) & 63;
+    out[3] = (x >> 18) & 63;
+    r += 3;
+    out += 4;
+  }
+}
+
+static void hllRawMaxScalar(uint8_t* max, const uint8_t* regs, int count) {
+  for (int j = 0; j < count; j++) {
+    if (regs[j] > max[j])
+      max[j] = regs[j];
+  }
+}
+
+/* Return false if some register is bigger than HLL_SUM_SHIFT. */
+static bool hllRawSumScalar(const uint8_t* regs,
+                            int count,
+                            uint64_t* sum,
+                            int* ezp) {
+  /* Four sums, so the adjacent additions don't depend on each other. */
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  uint32_t c = 0;
+  int j = 0;
+  for (; j + 4 <= count; j += 4) {
+    uint8_t r0 = regs[j] & 63, r1 = regs[j + 1] & 63;
+    uint8_t r2 = regs[j + 2] & 63, r3 = regs[j + 3] & 63;
+    s0 += peo.PEFixed[r0];
+    s1 += peo.PEFixed[r1];
+    s2 += peo.PEFixed[r2];
+    s3 += peo.PEFixed[r3];
+    c += peo.PECount[r0] + peo.PECount[r1] + peo.PECount[r2] +
+      peo.PECount[r3];
+  }
+  for (; j < count; j++) {
+    uint8_t r = regs[j] & 63;
+    s0 += peo.PEFixed[r];
+    c += peo.PECount[r];
+  }
+  if (c >> 16)
+    return false;
+  *sum += s0 + s1 + s2 + s3;
+  *ezp += c & 0xffff;
+  return true;
+}
+
+/* Same as hllRawSumScalar(), but reads the 6-bit dense registers directly,
+ * it is used when the registers are not unpacked by the vector kernel. */
+static bool hllDenseSumScalar(const uint8_t* r, uint64_t* sum, int* ezp) {
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  uint32_t c = 0;
+  for (int j = 0; j < HLL_REGISTERS / 4; j++) {
+    uint32_t x = r[0] | (r[1] << 8) | (r[2] << 16);
+    uint32_t r0 = x & 63, r1 = (x >> 6) & 63;
+    uint32_t r2 = (x >> 12) & 63, r3 = (x >> 18) & 63;
+    s0 += peo.PEFixed[r0];
+    s1 += peo.PEFixed[r1];
+    s2 += peo.PEFixed[r2];
+    s3 += peo.PEFixed[r3];
+    c += peo.PECount[r0] + peo.PECount[r1] + peo.PECount[r2] +
+      peo.PECount[r3];
+    r += 3;
+  }
+  if (c >> 16)
+    return false;
+  *sum += s0 + s1 + s2 + s3;
+  *ezp += c & 0xffff;
+  return true;
+}
+
+#ifdef TENDIS_HLL_AVX2
+/* Every 128-bit lane unpacks 12 bytes into 16 registers: the 3 bytes of a
+ * group are shuffled into a 32-bit word, then each register is shifted into
+ * its own byte. */
+__attribute__((target("avx2"))) static void hllDenseUnpackAvx2(
+  const uint8_t* r, uint8_t* out) {
+  const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                        6, 7, 8, -1, 9, 10, 11, -1,
+                                        0, 1, 2, -1, 3, 4, 5, -1,
+                                        6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i m0 = _mm256_set1_epi32(0x3f);
+  const __m256i m1 = _mm256_set1_epi32(0x3f00);
+  const __m256i m2 = _mm256_set1_epi32(0x3f0000);
+  const __m256i m3 = _mm256_set1_epi32(0x3f000000);
+  int i = 0, j = 0;
+  /* Each step loads 16 bytes at i + 12, stop before reading out of range. */
+  for (; i + 28 <= HLL_DENSE_BYTES; i += 24, j += 32) {
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + i));
+    __m128i hi =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + i + 12));
+    __m256i v =
+      _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    v = _mm256_shuffle_epi8(v, shuf);
+    __m256i o = _mm256_and_si256(v, m0);
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_slli_epi32(v, 2), m1));
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_slli_epi32(v, 4), m2));
+    o = _mm256_or_si256(o, _mm256_and_si256(_mm256_slli_epi32(v, 6), m3));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + j), o);
+  }
+  hllDenseUnpackScalar(r + i, out + j, (HLL_DENSE_BYTES - i) / 3);
+}
+
+__attribute__((target("avx2"))) static void hllRawMaxAvx2(uint8_t* max,
+                                                          const uint8_t* regs) {
+  int j = 0;
+  for (; j + 32 <= HLL_REGISTERS; j += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(max + j));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(regs + j));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(max + j),
+                        _mm256_max_epu8(a, b));
+  }
+  hllRawMaxScalar(max + j, regs + j, HLL_REGISTERS - j);
+}
+
+/* 16 registers per step, widened to 4 x 4 64-bit lanes and summed as
+ * 1 << (HLL_SUM_SHIFT - reg). The zero registers are counted by bytes and
+ * flushed by vpsadbw before the byte counters can overflow. */
+__attribute__((target("avx2"))) static bool hllRawSumAvx2(const uint8_t* regs,
+                                                          uint64_t* sum,
+                                                          int* ezp) {
+  const __m256i shift = _mm256_set1_epi64x(HLL_SUM_SHIFT);
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m128i zero = _mm_setzero_si128();
+  __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+  __m128i maxv = zero, zeros = zero;
+  int j = 0;
+  while (j < HLL_REGISTERS) {
+    __m128i z = zero;
+    for (int round = 0; round < 255 && j < HLL_REGISTERS; round++, j += 16) {
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(regs + j));
+      maxv = _mm_max_epu8(maxv, b);
+      z = _mm_sub_epi8(z, _mm_cmpeq_epi8(b, zero));
+      __m256i v0 = _mm256_cvtepu8_epi64(b);
+      __m256i v1 = _mm256_cvtepu8_epi64(_mm_srli_si128(b, 4));
+      __m256i v2 = _mm256_cvtepu8_epi64(_mm_srli_si128(b, 8));
+      __m256i v3 = _mm256_cvtepu8_epi64(_mm_srli_si128(b, 12));
+      a0 = _mm256_add_epi64(
+        a0, _mm256_sllv_epi64(one, _mm256_sub_epi64(shift, v0)));
+      a1 = _mm256_add_epi64(
+        a1, _mm256_sllv_epi64(one, _mm256_sub_epi64(shift, v1)));
+      a2 = _mm256_add_epi64(
+        a2, _mm256_sllv_epi64(one, _mm256_sub_epi64(shift, v2)));
+      a3 = _mm256_add_epi64(
+        a3, _mm256_sllv_epi64(one, _mm256_sub_epi64(shift, v3)));
+    }
+    zeros = _mm_add_epi64(zeros, _mm_sad_epu8(z, zero));
+  }
+  /* The shift of a register bigger than HLL_SUM_SHIFT is negative, vpsllvq
+   * gives 0 for it, let the caller fall back to the histogram. */
+  uint8_t maxBytes[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(maxBytes), maxv);
+  for (int i = 0; i < 16; i++) {
+    if (maxBytes[i] > HLL_SUM_SHIFT)
+      return false;
+  }
+  uint64_t lanes[4];
+  __m256i a = _mm256_add_epi64(_mm256_add_epi64(a0, a1),
+                               _mm256_add_epi64(a2, a3));
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), a);
+  *sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  *ezp += _mm_cvtsi128_si64(zeros) + _mm_extract_epi64(zeros, 1);
+  return true;
+}
+#endif  // TENDIS_HLL_AVX2
+
+/* Unpack the dense registers into HLL_REGISTERS bytes. */
+void hllDenseUnpack(const uint8_t* registers, uint8_t* out) {
+  if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
+#ifdef TENDIS_HLL_AVX2
+    if (bitops::useAvx2()) {
+      hllDenseUnpackAvx2(registers, out);
+      return;
+    }
+#endif
+    hllDenseUnpackScalar(registers, out, HLL_REGISTERS / 4);
+  } else {
+    for (int j = 0; j < HLL_REGISTERS; j++) {
+      uint8_t reg;
+      HLL_DENSE_GET_REGISTER(reg, registers, j);
+      out[j] = reg;
+    }
+  }
+}
+
+/* max[i] = MAX(max[i], regs[i]) for the HLL_REGISTERS registers. */
+void hllRawMax(uint8_t* max, const uint8_t* regs) {
+#ifdef TENDIS_HLL_AVX2
+  if (bitops::useAvx2()) {
+    hllRawMaxAvx2(max, regs);
+    return;
+  }
+#endif
+  hllRawMaxScalar(max, regs, HLL_REGISTERS);
+}
+
+/* Add the histogram of the HLL_REGISTERS raw registers to 'reghisto',
+ * which is an array of 64 counters. */
+void hllRawRegHisto(const uint8_t* registers, int* reghisto) {
+  /* Four histograms, so the adjacent increments don't depend on each other. */
+  int h[4][64];
+  memset(h, 0, sizeof(h));
+  for (int j = 0; j < HLL_REGISTERS; j += 4) {
+    h[0][registers[j] & 63]++;
+    h[1][registers[j + 1] & 63]++;
+    h[2][registers[j + 2] & 63]++;
+    h[3][registers[j + 3] & 63]++;
+  }
+  for (int j = 0; j < 64; j++) {
+    reghisto[j] += h[0][j] + h[1][j] + h[2][j] + h[3][j];
+  }
+}
+
+/* SUM(2^-reg) of the registers in the histogram. */
+static double hllHistoSum(const int* reghisto) {
+  uint64_t s = 0;
+  double tail = 0;
+  for (int j = 63; j >= 0; j--) {
+    if (j > HLL_SUM_SHIFT) {
+      tail += reghisto[j] * peo.PE[j];
+    } else {
+      s += static_cast<uint64_t>(reghisto[j]) << (HLL_SUM_SHIFT - j);
+    }
+  }
+  return ldexp(static_cast<double>(s), -HLL_SUM_SHIFT) + tail;
+}
+
+/* SUM(2^-reg) of the HLL_REGISTERS raw registers, the number of zero
+ * registers is set to 'ezp'. */
+double hllRawRegSum(const uint8_t* registers, int* ezp) {
+  uint64_t s = 0;
+  int ez = 0;
+  bool ok;
+#ifdef TENDIS_HLL_AVX2
+  if (bitops::useAvx2()) {
+    ok = hllRawSumAvx2(registers, &s, &ez);
+  } else {
+    ok = hllRawSumScalar(registers, HLL_REGISTERS, &s, &ez);
+  }
+#else
+  ok = hllRawSumScalar(registers, HLL_REGISTERS, &s, &ez);
+#endif
+  if (ok) {
+    *ezp = ez;
+    return ldexp(static_cast<double>(s), -HLL_SUM_SHIFT);
+  }
+
+  int reghisto[64] = {0};
+  hllRawRegHisto(registers, reghisto);
+  *ezp = reghisto[0];
+  return hllHistoSum(reghisto);
+}
+
+static double hllSparseRegSum(const uint8_t* sparse,
+                              int sparselen,
+                              int* ezp,
+                              int* invalid) {
+  int reghisto[64] = {0};
+  int idx = 0, runlen, regval;
+  const uint8_t *end = sparse + sparselen, *p = sparse;
+
+  while (p < end) {
+    if (HLL_SPARSE_IS_ZERO(p)) {
+      runlen = HLL_SPARSE_ZERO_LEN(p);
+      idx += runlen;
+      reghisto[0] += runlen;
+      p++;
+    } else if (HLL_SPARSE_IS_XZERO(p)) {
+      runlen = HLL_SPARSE_XZERO_LEN(p);
+      idx += runlen;
+      reghisto[0] += runlen;
+      p += 2;
+    } else {
+      runlen = HLL_SPARSE_VAL_LEN(p);
+      regval = HLL_SPARSE_VAL_VALUE(p);
+      idx += runlen;
+      reghisto[regval] += runlen;
+      p++;
+    }
+  }
+  if (idx != HLL_REGISTERS && invalid)
+    *invalid = 1;
+  *ezp = reghisto[0];
+  return hllHistoSum(reghisto);
+}
+
+/* SUM(2^-reg) of the dense registers, see hllRawRegSum(). */
+double hllDenseRegSum(const uint8_t* registers, int* ezp) {
+  uint8_t raw[HLL_REGISTERS];
+  if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
+#ifdef TENDIS_HLL_AVX2
+    if (bitops::useAvx2()) {
+      hllDenseUnpackAvx2(registers, raw);
+      return hllRawRegSum(raw, ezp);
+    }
+#endif
+    uint64_t s = 0;
+    int ez = 0;
+    if (hllDenseSumScalar(registers, &s, &ez)) {
+      *ezp = ez;
+      return ldexp(static_cast<double>(s), -HLL_SUM_SHIFT);
+    }
+  }
+  hllDenseUnpack(registers, raw);
+  return hllRawRegSum(raw, ezp);
+}
+
 /* Return the approximated cardinality of the set based on the harmonic
  * mean of the registers values. 'hdr' points to the start of the SDS
  * representing the String object holding the HLL representation.
@@ -1078,12 +1379,12 @@ uint64_t hllCount(struct hllhdr* hdr, size_t hdrSize, int* invalid) {
 
   /* Compute SUM(2^-register[0..i]). */
   if (hdr->encoding == HLL_DENSE) {
-    E = hllDenseSum(hdr->registers, peo.PE, &ez);
+    E = hllDenseRegSum(hdr->registers, &ez);
   } else if (hdr->encoding == HLL_SPARSE) {
-    E = hllSparseSum(
-      hdr->registers, hdrSize - HLL_HDR_SIZE, peo.PE, &ez, invalid);
+    E = hllSparseRegSum(
+      hdr->registers, hdrSize - HLL_HDR_SIZE, &ez, invalid);
   } else if (hdr->encoding == HLL_RAW) {
-    E = hllRawSum(hdr->registers, peo.PE, &ez);
+    E = hllRawRegSum(hdr->registers, &ez);
   } else {
     // serverPanic("Unknown HyperLogLog encoding in hllCount()");
     serverAssert(0);
@@ -1131,13 +1432,9 @@ int hllMerge(uint8_t* max, struct hllhdr* hdr, size_t hdrSize) {
   int i;
 
   if (hdr->encoding == HLL_DENSE) {
-    uint8_t val;
-
-    for (i = 0; i < HLL_REGISTERS; i++) {
-      HLL_DENSE_GET_REGISTER(val, hdr->registers, i);
-      if (val > max[i])
-        max[i] = val;
-    }
+    uint8_t raw[HLL_REGISTERS];
+    hllDenseUnpack(hdr->registers, raw);
+    hllRawMax(max, raw);
   } else {
     uint8_t *p = reinterpret_cast<uint8_t*>(hdr), *end = p + hdrSize;
     int64_t runlen, regval;
@@ -323,6 +323,14 @@ int hllAdd(hllhdr* hdr,
 uint64_t hllCount(struct hllhdr* hdr, size_t hdrSize, int* invalid);
 uint64_t hllCountFast(struct hllhdr* hdr, size_t hdrSize, int* invalid);
 int hllMerge(uint8_t* max, struct hllhdr* hdr, size_t hdrSize);
+void hllDenseUnpack(const uint8_t* registers, uint8_t* out);
+void hllRawMax(uint8_t* max, const uint8_t* regs);
+void hllRawRegHisto(const uint8_t* registers, int* reghisto);
+double hllRawRegSum(const uint8_t* registers, int* ezp);
+double hllDenseRegSum(const uint8_t* registers, int* ezp);
+// scalar SUM(2^-reg), the reference of the kernels used by hllCount()
+double hllDenseSum(uint8_t* registers, double* PE, int* ezp);
+double hllRawSum(uint8_t* registers, double* PE, int* ezp);
 int hllSparseToDense(struct hllhdr* oldhdr,
                      size_t oldSize,
                      struct hllhdr* hdr,
@@ -112,6 +112,10 @@ std::string Status::getErrStr(ErrorCodes code) {
       return "-CLUSTERDOWN The cluster is down\r\n";
     case ErrorCodes::ERR_CLUSTER_REDIR_DOWN_UNBOUND:
       return "-CLUSTERDOWN Hash slot not served\r\n";
+    case ErrorCodes::ERR_WRITE_STALL:
+      return "-TRYAGAIN Writes of the store are stalled by compaction\r\n";
+    case ErrorCodes::ERR_LAZYFREE_BUSY:
+      return "-TRYAGAIN The key is being freed in background\r\n";
 
     default:
       break;
@@ -61,6 +61,8 @@ enum class ErrorCodes {
   ERR_CLUSTER_REDIR_CROSS_SLOT,
   ERR_CLUSTER_REDIR_DOWN_STATE,
   ERR_CLUSTER_REDIR_DOWN_UNBOUND,
+  ERR_WRITE_STALL,
+  ERR_LAZYFREE_BUSY,
 };
 
 class Status {
@@ -19,6 +19,9 @@
 #include "tendisplus/utils/test_util.h"
 #include "tendisplus/cluster/cluster_manager.h"
 #include "tendisplus/utils/base64.h"
+#include "tendisplus/utils/bitops.h"
+#include "tendisplus/utils/redis_port.h"
+#include "tendisplus/utils/hll_card_cache.h"
 #include "gtest/gtest.h"
 #include "glog/logging.h"
 
@@ -198,6 +201,199 @@ TEST(bitsetEncode, common) {
   }
 }
 
+TEST(Bitops, common) {
+  std::mt19937 gen(nsSinceEpoch());
+  for (int i = 0; i < 1000; i++) {
+    size_t n = gen() % 4096;
+    std::string a(n, 0), b(n, 0);
+    for (size_t j = 0; j < n; j++) {
+      a[j] = static_cast<char>(gen());
+      b[j] = static_cast<char>(gen());
+    }
+    size_t off = n ? gen() % n : 0;
+    EXPECT_EQ(bitops::popCount(a.data() + off, n - off),
+              redis_port::popCount(a.data() + off, n - off));
+
+    auto dst = reinterpret_cast<unsigned char*>(&a[0]);
+    auto src = reinterpret_cast<const unsigned char*>(b.data());
+    std::string c = a;
+    bitops::bitAnd(reinterpret_cast<unsigned char*>(&c[0]), src, n);
+    for (size_t j = 0; j < n; j++) {
+      EXPECT_EQ(c[j], static_cast<char>(dst[j] & src[j]));
+    }
+    c = a;
+    bitops::bitOr(reinterpret_cast<unsigned char*>(&c[0]), src, n);
+    for (size_t j = 0; j < n; j++) {
+      EXPECT_EQ(c[j], static_cast<char>(dst[j] | src[j]));
+    }
+    c = a;
+    bitops::bitXor(reinterpret_cast<unsigned char*>(&c[0]), src, n);
+    for (size_t j = 0; j < n; j++) {
+      EXPECT_EQ(c[j], static_cast<char>(dst[j] ^ src[j]));
+    }
+    c = a;
+    bitops::bitNot(reinterpret_cast<unsigned char*>(&c[0]), n);
+    for (size_t j = 0; j < n; j++) {
+      EXPECT_EQ(c[j], static_cast<char>(~dst[j]));
+    }
+  }
+}
+
+// a dense hll with the registers in [0, maxReg]
+std::string genDenseHll(std::mt19937* gen, uint32_t maxReg) {
+  std::string s(HLL_DENSE_SIZE, 0);
+  auto hdr = reinterpret_cast<redis_port::hllhdr*>(&s[0]);
+  memcpy(hdr->magic, "HYLL", 4);
+  hdr->encoding = HLL_DENSE;
+  HLL_INVALIDATE_CACHE(hdr);
+  for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+    // leave some zero registers, as a small set does
+    uint8_t reg = (*gen)() % 3 ? (*gen)() % (maxReg + 1) : 0;
+    HLL_DENSE_SET_REGISTER(hdr->registers, i, reg);
+  }
+  return s;
+}
+
+TEST(HyperLogLog, kernels) {
+  std::mt19937 gen(nsSinceEpoch());
+  double PE[64];
+  for (int j = 0; j < 64; j++) {
+    PE[j] = 1.0 / (1ULL << j);
+  }
+  for (uint32_t maxReg : {0, 1, 20, 49, 63}) {
+    std::string dense = genDenseHll(&gen, maxReg);
+    auto hdr = reinterpret_cast<redis_port::hllhdr*>(&dense[0]);
+    std::vector<uint8_t> regs(HLL_REGISTERS);
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+      HLL_DENSE_GET_REGISTER(regs[i], hdr->registers, i);
+    }
+
+    std::vector<uint8_t> raw(HLL_REGISTERS);
+    redis_port::hllDenseUnpack(hdr->registers, raw.data());
+    EXPECT_EQ(raw, regs);
+
+    int ez1 = 0, ez2 = 0, ez3 = 0;
+    double e1 = redis_port::hllRawRegSum(raw.data(), &ez1);
+    double e2 = redis_port::hllDenseRegSum(hdr->registers, &ez2);
+    double e3 = redis_port::hllRawSum(raw.data(), PE, &ez3);
+    // the fixed point sum is exact, it doesn't depend on the encoding
+    EXPECT_EQ(e1, e2);
+    EXPECT_NEAR(e1, e3, e3 * 1e-12);
+    EXPECT_EQ(ez1, ez3);
+    EXPECT_EQ(ez2, ez3);
+
+    std::vector<uint8_t> max(HLL_REGISTERS), expect(HLL_REGISTERS);
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+      max[i] = gen() % 64;
+      expect[i] = std::max(max[i], regs[i]);
+    }
+    EXPECT_EQ(redis_port::hllMerge(max.data(), hdr, dense.size()), C_OK);
+    EXPECT_EQ(max, expect);
+
+    // the dense and the raw encoding give the same count
+    std::string rawHll(HLL_HDR_SIZE + HLL_REGISTERS, 0);
+    auto rawHdr = reinterpret_cast<redis_port::hllhdr*>(&rawHll[0]);
+    rawHdr->encoding = HLL_RAW;
+    memcpy(rawHdr->registers, regs.data(), HLL_REGISTERS);
+    int invalid = 0;
+    EXPECT_EQ(redis_port::hllCount(hdr, dense.size(), &invalid),
+              redis_port::hllCount(rawHdr, rawHll.size(), &invalid));
+    EXPECT_EQ(invalid, 0);
+  }
+}
+
+// compare the kernels with the scalar reference, the timing is only logged
+TEST(HyperLogLog, bench) {
+  std::mt19937 gen(nsSinceEpoch());
+  std::string dense = genDenseHll(&gen, 20);
+  auto hdr = reinterpret_cast<redis_port::hllhdr*>(&dense[0]);
+  double PE[64];
+  for (int j = 0; j < 64; j++) {
+    PE[j] = 1.0 / (1ULL << j);
+  }
+  const int rounds = 2000;
+  std::vector<uint8_t> max1(HLL_REGISTERS), max2(HLL_REGISTERS);
+
+  uint64_t start = nsSinceEpoch();
+  double sum1 = 0;
+  for (int i = 0; i < rounds; i++) {
+    int ez;
+    sum1 += redis_port::hllDenseSum(hdr->registers, PE, &ez);
+  }
+  uint64_t oldSum = nsSinceEpoch() - start;
+
+  start = nsSinceEpoch();
+  double sum2 = 0;
+  for (int i = 0; i < rounds; i++) {
+    int ez;
+    sum2 += redis_port::hllDenseRegSum(hdr->registers, &ez);
+  }
+  uint64_t newSum = nsSinceEpoch() - start;
+  EXPECT_NEAR(sum1, sum2, sum1 * 1e-9);
+
+  start = nsSinceEpoch();
+  for (int i = 0; i < rounds; i++) {
+    for (uint32_t j = 0; j < HLL_REGISTERS; j++) {
+      uint8_t val;
+      HLL_DENSE_GET_REGISTER(val, hdr->registers, j);
+      if (val > max1[j])
+        max1[j] = val;
+    }
+  }
+  uint64_t oldMerge = nsSinceEpoch() - start;
+
+  start = nsSinceEpoch();
+  for (int i = 0; i < rounds; i++) {
+    redis_port::hllMerge(max2.data(), hdr, dense.size());
+  }
+  uint64_t newMerge = nsSinceEpoch() - start;
+  EXPECT_EQ(max1, max2);
+
+  LOG(INFO) << "hll kernels avx2:" << bitops::useAvx2()
+            << " sum(ns) scalar:" << oldSum / rounds
+            << " kernel:" << newSum / rounds
+            << " merge(ns) scalar:" << oldMerge / rounds
+            << " kernel:" << newMerge / rounds;
+}
+
+TEST(HllCardCache, common) {
+  HllCardCache cache;
+  uint64_t card = 0;
+  std::string v1 = "hll1", v2 = "hll2";
+  auto k1 = HllCardCache::makeKey(0, "a");
+  auto k2 = HllCardCache::makeKey(1, "a");
+  EXPECT_NE(k1, k2);
+
+  // disabled by default
+  EXPECT_FALSE(cache.enabled());
+  cache.put(k1, HllCardCache::fingerprint(v1), 10);
+  EXPECT_FALSE(cache.get(k1, HllCardCache::fingerprint(v1), &card));
+
+  cache.setLimit(2);
+  cache.put(k1, HllCardCache::fingerprint(v1), 10);
+  EXPECT_TRUE(cache.get(k1, HllCardCache::fingerprint(v1), &card));
+  EXPECT_EQ(card, 10U);
+  // the value is changed
+  EXPECT_FALSE(cache.get(k1, HllCardCache::fingerprint(v2), &card));
+  cache.put(k1, HllCardCache::fingerprint(v2), 11);
+  EXPECT_TRUE(cache.get(k1, HllCardCache::fingerprint(v2), &card));
+  EXPECT_EQ(card, 11U);
+
+  // the least recently used key is evicted
+  cache.put(k2, HllCardCache::fingerprint(v1), 20);
+  EXPECT_TRUE(cache.get(k1, HllCardCache::fingerprint(v2), &card));
+  cache.put(HllCardCache::makeKey(0, "b"), HllCardCache::fingerprint(v1), 30);
+  EXPECT_EQ(cache.getKeyCount(), 2U);
+  EXPECT_FALSE(cache.get(k2, HllCardCache::fingerprint(v1), &card));
+  EXPECT_TRUE(cache.get(k1, HllCardCache::fingerprint(v2), &card));
+
+  cache.invalidate(k1);
+  EXPECT_FALSE(cache.get(k1, HllCardCache::fingerprint(v2), &card));
+  EXPECT_EQ(cache.getKeyCount(), 1U);
+  EXPECT_EQ(cache.getHits(), 4U);
+  EXPECT_EQ(cache.getMisses(), 4U);
+}
+
 TEST(ParamManager, common) {
   ParamManager pm;
   const char* argv[] = {"--skey1=value", "--ikey1=123"};
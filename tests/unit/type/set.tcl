@@ -285,6 +285,38 @@ start_server {
         assert_equal 0 [r exists setres]
     }
 
+    test "SINTERSTORE/SUNIONSTORE/SDIFFSTORE with dstkey as a source" {
+        r del set1 set2
+        r sadd set1 a b c d
+        r sadd set2 c d e
+        assert_equal 2 [r sinterstore set1 set1 set2]
+        assert_equal {c d} [lsort [r smembers set1]]
+        assert_equal 3 [r sunionstore set1 set2 set1]
+        assert_equal {c d e} [lsort [r smembers set1]]
+        r sadd set1 f
+        assert_equal 1 [r sdiffstore set1 set1 set2]
+        assert_equal {f} [r smembers set1]
+    }
+
+    test "SINTERSTORE/SUNIONSTORE/SDIFFSTORE with big sets" {
+        r del set1 set2 setres
+        for {set i 0} {$i < 3000} {incr i} {
+            r sadd set1 $i
+            if {$i % 3 == 0} {
+                r sadd set2 $i
+            }
+        }
+        r sadd set2 foo
+        assert_equal 1000 [r sinterstore setres set1 set2]
+        assert_equal 1000 [r scard setres]
+        assert_equal 3001 [r sunionstore setres set1 set2]
+        assert_equal 3001 [r scard setres]
+        assert_equal 2000 [r sdiffstore setres set1 set2]
+        assert_equal 2000 [r scard setres]
+        assert_equal 0 [r sismember setres 3]
+        assert_equal 1 [r sismember setres 4]
+    }
+
     foreach {type contents} {hashtable {a b c} intset {1 2 3}} {
         test "SPOP basics - $type" {
             create_set myset $contents
@@ -37,6 +37,7 @@ runOne "./$dir/index_mgr_test"
 runOne "./$dir/stacktrace_unittest"
 runOne "./$dir/status_test"
 runOne "./$dir/skiplist_test"
+runOne "./$dir/pieced_kv_test"
 runOne "./$dir/varint_test"
 runOne "./$dir/server_params_test"
 runOne "./$dir/command_test"
@@ -44,3 +45,4 @@ runOne "./$dir/demangle_unittest"
 runOne "./$dir/stl_logging_unittest"
 runOne "./$dir/network_test"
 runOne "./$dir/rocks_kvstore_test"
+runOne "./$dir/rocks_rdbimporter_test"